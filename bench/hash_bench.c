@@ -0,0 +1,81 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <openssl/sha.h>
+#include "hash.h"
+
+/*
+ * Throughput of note hashing at typical note sizes: the old one-shot
+ * SHA256() with a sprintf per byte, against sha256_hex().
+ *
+ *     ninja -C build hash-bench && ./build/hash-bench
+ */
+#define BENCH_BYTES (256 << 20)
+
+static void
+old_sha256_string(const char *s, size_t len, char output_buffer[65])
+{
+        unsigned char hash[SHA256_DIGEST_LENGTH];
+        SHA256((const unsigned char *)s, len, hash);
+        for (int i = 0; i < SHA256_DIGEST_LENGTH; i++)
+                sprintf(output_buffer + (i * 2), "%02x", hash[i]);
+        output_buffer[64] = '\0';
+}
+
+static double
+now(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int
+main(void)
+{
+        size_t sizes[] = { 64, 512, 4096, 65536, 1 << 20 };
+        size_t max = sizes[sizeof(sizes) / sizeof(sizes[0]) - 1];
+        char old_hex[65], new_hex[SHA256_HEX_LENGTH + 1];
+
+        char *buffer = malloc(max);
+        if (!buffer) {
+                fprintf(stderr, "Out of memory\n");
+                return 1;
+        }
+
+        srand(1);
+        for (size_t i = 0; i < max; i++)
+                buffer[i] = ' ' + rand() % 95;
+
+        printf("%10s %12s %12s %8s\n", "bytes", "old MB/s", "new MB/s", "speedup");
+
+        for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+                size_t len = sizes[s];
+                long rounds = BENCH_BYTES / len;
+
+                old_sha256_string(buffer, len, old_hex);
+                if (sha256_hex(buffer, len, new_hex) != 0 || strcmp(old_hex, new_hex)) {
+                        fprintf(stderr, "Digests differ at %zu bytes\n", len);
+                        free(buffer);
+                        return 1;
+                }
+
+                double start = now();
+                for (long r = 0; r < rounds; r++)
+                        old_sha256_string(buffer, len, old_hex);
+                double old_time = now() - start;
+
+                start = now();
+                for (long r = 0; r < rounds; r++)
+                        sha256_hex(buffer, len, new_hex);
+                double new_time = now() - start;
+
+                double mb = (double)rounds * len / 1e6;
+                printf("%10zu %12.1f %12.1f %7.2fx\n", len, mb / old_time, mb / new_time,
+                       old_time / new_time);
+        }
+
+        free(buffer);
+        return 0;
+}
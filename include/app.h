@@ -1,18 +1,45 @@
 #ifndef APP_H
 #define APP_H
 
+// Open the vault at path, or at $ZKC_DB if path is NULL, or else at
+// $HOME/.local/zkc/zkc.db.
 int
-open_db(sqlite3 **db);
+open_db(sqlite3 **db, const char *path);
+
+char *
+read_file(FILE *f, size_t *length);
+
+int
+uuid_v4_gen(char *buffer);
 
 int
 sql_exec(sqlite3 *db, const char *sql);
 
+// Set *exists to whether the vault has a table or index called name.
+int
+table_exists(sqlite3 *db, const char *name, int *exists);
+
+int
+cache_path(sqlite3 *db, const char *suffix, char *buffer, size_t len);
+
+sqlite3_int64
+counter_value(sqlite3 *db, const char *name);
+
 int
 create_tables(sqlite3 *db);
 
+int
+compressed_schema(sqlite3 *db);
+
 void
 help(void);
 
+void
+print_summary(const char *uuid, const char *date, const char *body);
+
+int
+resolve_note_id(sqlite3 *db, const char *uuid, sqlite3_int64 *id);
+
 int
 new(sqlite3 *db);
 
@@ -31,21 +58,42 @@ slurp(sqlite3 *db, const char *path);
 int
 spit(sqlite3 *db, const char *uuid, const char *path);
 
+const char *
+search_where(sqlite3 *db, const char *search_type);
+
+int
+search(sqlite3 *db, const char *search_type, const char *search_word, int ranked);
+
 int
-search(sqlite3 *db, const char *search_type, const char *search_word);
+complete(sqlite3 *db, const char *prefix, int limit);
 
 int
 link_notes(sqlite3 *db, const char *uuid_a, const char *uuid_b);
 
+int
+link_many(sqlite3 *db, const char *search_type, const char *search_word, const char *uuid);
+
 int
 links(sqlite3 *db, const char *uuid);
 
 int
 tag(sqlite3 *db, const char *uuid, const char *tag_body);
 
+int
+tag_many(sqlite3 *db, const char *search_type, const char *search_word, const char *tag_body);
+
 int
 tags(sqlite3 *db, const char *uuid);
 
+int
+tag_tree(sqlite3 *db);
+
+int
+tag_counts(sqlite3 *db, int sorted);
+
+int
+tag_cooccurrence(sqlite3 *db, int top);
+
 int
 delete_note(sqlite3 *db, const char *uuid);
 
@@ -65,6 +113,16 @@ int
 diff(sqlite3 *db, const char *path);
 
 int
-merge(sqlite3 *db, const char *path);
+merge(sqlite3 *db, const char *path, double near_threshold);
+
+int
+replace_body(sqlite3 *db, sqlite3_int64 id, const char *body, size_t len, const char *hash,
+             const char *date);
+
+int
+add_conflict(sqlite3 *db, sqlite3_int64 id, int hunks, const char *other);
+
+int
+conflicts(sqlite3 *db);
 
 #endif
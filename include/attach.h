@@ -0,0 +1,30 @@
+#ifndef ATTACH_H
+#define ATTACH_H
+
+// Attach the file at path to a note under its file name, replacing an
+// attachment of the same name. The contents are stored once per hash.
+int
+attach(sqlite3 *db, const char *uuid, const char *path);
+
+// List the attachments of a note.
+int
+attachments(sqlite3 *db, const char *uuid);
+
+// Write the attachment called name of a note to path.
+int
+save_attachment(sqlite3 *db, const char *uuid, const char *name, const char *path);
+
+int
+delete_attachment(sqlite3 *db, const char *uuid, const char *name);
+
+// Print the attachments in db2 that db lacks and the size of the blobs
+// that merging would copy.
+int
+diff_attachments(sqlite3 *db, sqlite3 *db2);
+
+// Add the attachments in db2 that db lacks or has an older file for,
+// copying only blobs whose hash db does not have.
+int
+merge_attachments(sqlite3 *db, sqlite3 *db2);
+
+#endif
@@ -0,0 +1,20 @@
+#ifndef BUNDLE_H
+#define BUNDLE_H
+
+// Write the notes, tags, note tags, links and inbox of the vault to a
+// bundle at path, or to stdout if path is "-".
+int
+bundle_create(sqlite3 *db, const char *path);
+
+// Check each section of a bundle against its checksum, then add what the
+// vault lacks from it in one transaction, as import --jsonl does. Reads
+// the bundle front to back, so path may be "-" for stdin.
+int
+bundle_apply(sqlite3 *db, const char *path);
+
+// Check the footer index and every section of the bundle at path against
+// their checksums and print what it holds.
+int
+bundle_verify(const char *path);
+
+#endif
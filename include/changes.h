@@ -0,0 +1,48 @@
+#ifndef CHANGES_H
+#define CHANGES_H
+
+// The journal of changesets recorded from commands, kept in the vault
+// until pushed and in the files changes push writes. Rows of a changeset
+// name notes and tags by id, so each changeset carries the uuid or body
+// of every note and tag its changes refer to.
+#define CHANGES_SCHEMA "CREATE TABLE IF NOT EXISTS changesets(" \
+        "id INTEGER PRIMARY KEY, " \
+        "date DATETIME NOT NULL DEFAULT CURRENT_TIMESTAMP, " \
+        "command TEXT NOT NULL, " \
+        "changeset BLOB NOT NULL" \
+        ");" \
+        "CREATE TABLE IF NOT EXISTS changeset_keys(" \
+        "changeset_id INTEGER NOT NULL, " \
+        "kind TEXT NOT NULL, " \
+        "row_id INTEGER NOT NULL, " \
+        "key TEXT NOT NULL, " \
+        "PRIMARY KEY(changeset_id, kind, row_id), " \
+        "FOREIGN KEY(changeset_id) REFERENCES changesets(id) ON DELETE CASCADE" \
+        ") WITHOUT ROWID;"
+
+struct changes;
+
+// Start recording the changes the command in argv makes to notes, tags,
+// note tags, links and the inbox, if it is one whose edits are worth
+// replaying elsewhere. *changes is left NULL otherwise.
+int
+changes_begin(sqlite3 *db, int argc, char **argv, struct changes **changes);
+
+// Add what was recorded to the journal as one changeset.
+int
+changes_record(sqlite3 *db, struct changes *changes);
+
+void
+changes_free(struct changes *changes);
+
+// Move the journal into a file at path for changes apply.
+int
+changes_push(sqlite3 *db, const char *path);
+
+// Replay the changesets in a file written by changes push. Notes are
+// matched by uuid and tags by body. A note edited here since the
+// changeset's edit keeps whichever edit is newer, as merge does.
+int
+changes_apply(sqlite3 *db, const char *path);
+
+#endif
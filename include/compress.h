@@ -0,0 +1,19 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+// Register note_text(body) on db. It returns a note body as text whether
+// it is stored as text or as a zstd blob.
+int
+register_note_text(sqlite3 *db);
+
+// Bind a note body, compressed when the vault has a dictionary and that
+// makes it smaller.
+int
+bind_note_body(sqlite3 *db, sqlite3_stmt *stmt, int index, const char *body, size_t len);
+
+// Train a dictionary if the vault has none, compress every note stored as
+// text, and print the compression ratio and decompression speed.
+int
+compress_notes(sqlite3 *db);
+
+#endif
@@ -0,0 +1,19 @@
+#ifndef DUPES_H
+#define DUPES_H
+
+// Compute the MinHash sketches and band buckets of notes added or edited
+// since their sketch was last computed.
+int
+sketch_refresh(sqlite3 *db);
+
+// Print the pairs of notes whose estimated word shingle similarity is at
+// least threshold, most similar first.
+int
+near_dupes(sqlite3 *db, double threshold);
+
+// Print the notes, other than uuid itself, that body is a near duplicate
+// of. The sketches must be fresh.
+int
+near_dupes_of(sqlite3 *db, const char *uuid, const char *body, double threshold);
+
+#endif
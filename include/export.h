@@ -0,0 +1,35 @@
+#ifndef EXPORT_H
+#define EXPORT_H
+
+// Notes rendered as files, front matter holding the uuid, date, tags and
+// links followed by the body, one at a time in notes.id order.
+struct note_files {
+        sqlite3_stmt *notes;    // id, uuid, date, body, hash of the note
+        sqlite3_stmt *tags;
+        sqlite3_stmt *links;
+        int tags_rc, links_rc;
+        char *data;             // the file of the current note
+        size_t len, cap;
+};
+
+// Start on the notes matching where, a condition from search_where()
+// with search_word bound to ?1, or on every note if where is NULL.
+int
+note_files_open(sqlite3 *db, const char *where, const char *search_word, struct note_files *nf);
+
+// Render the next note into nf->data. Returns SQLITE_ROW, SQLITE_DONE
+// after the last note, or an error.
+int
+note_files_next(struct note_files *nf);
+
+void
+note_files_close(struct note_files *nf);
+
+// Write every note, or those matched by --tag or --where, to a file of
+// its own in a directory, named by uuid or by title, with its tags and
+// links as front matter. Files whose contents are unchanged since the
+// last export to that directory are not rewritten.
+int
+export_dir(sqlite3 *db, int argc, char **argv);
+
+#endif
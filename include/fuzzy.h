@@ -0,0 +1,9 @@
+#ifndef FUZZY_H
+#define FUZZY_H
+
+// Print the notes sharing enough trigrams with term to be within one typo
+// of containing it, best matches first, each with its similarity score.
+int
+fuzzy_search(sqlite3 *db, const char *term);
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef GRAPH_H
+#define GRAPH_H
+
+// Link graph in compressed sparse row form. Nodes are notes renumbered
+// densely in notes.id order, edges are rows of the links table. When map
+// is set the arrays point into a read-only mapping of the cache file.
+struct graph {
+        int n;                  // number of nodes
+        int m;                  // number of edges
+        sqlite3_int64 *ids;     // node -> notes.id, ascending
+        int *fwd_off;           // n + 1 offsets into fwd
+        int *fwd;               // targets of a_id -> b_id edges
+        int *rev_off;           // n + 1 offsets into rev
+        int *rev;               // sources of a_id -> b_id edges
+        void *map;
+        size_t map_len;
+};
+
+int
+graph_load(sqlite3 *db, struct graph *g);
+
+void
+graph_free(struct graph *g);
+
+int
+graph_node(const struct graph *g, sqlite3_int64 id);
+
+int
+note_path(sqlite3 *db, const char *uuid_a, const char *uuid_b);
+
+int
+rank(sqlite3 *db);
+
+int
+components(sqlite3 *db);
+
+int
+orphans(sqlite3 *db);
+
+int
+export_graph(sqlite3 *db, int argc, char **argv);
+
+#endif
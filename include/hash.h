@@ -0,0 +1,27 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stddef.h>
+
+#define SHA256_HEX_LENGTH 64
+
+// Write the lower-case hex SHA-256 digest of len bytes at data to out,
+// NUL terminated. Returns 0, or -1 if OpenSSL fails.
+int
+sha256_hex(const void *data, size_t len, char out[SHA256_HEX_LENGTH + 1]);
+
+// The same digest of data fed in pieces: sha256_begin, sha256_update for
+// each piece, then sha256_end, which writes the digest and frees the
+// stream. sha256_begin returns NULL if OpenSSL fails.
+struct sha256_stream;
+
+struct sha256_stream *
+sha256_begin(void);
+
+int
+sha256_update(struct sha256_stream *s, const void *data, size_t len);
+
+int
+sha256_end(struct sha256_stream *s, char out[SHA256_HEX_LENGTH + 1]);
+
+#endif
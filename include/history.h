@@ -0,0 +1,36 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+// Earlier bodies of each note, version 1 the oldest. Most are stored as a
+// delta from the version after them.
+#define NOTE_VERSIONS_SCHEMA "CREATE TABLE IF NOT EXISTS note_versions(" \
+        "note_id INTEGER NOT NULL, " \
+        "version INTEGER NOT NULL, " \
+        "hash TEXT NOT NULL, " \
+        "date DATETIME NOT NULL, " \
+        "delta INTEGER NOT NULL, " \
+        "body BLOB NOT NULL, " \
+        "PRIMARY KEY(note_id, version), " \
+        "FOREIGN KEY(note_id) REFERENCES notes(id) ON DELETE CASCADE" \
+        ") WITHOUT ROWID;"
+
+// Save the body note id has now as its newest version, before it is
+// replaced by body. Nothing is saved if body is unchanged.
+int
+save_version(sqlite3 *db, sqlite3_int64 id, const char *body, size_t len);
+
+// Rebuild version n of note id, 0 meaning the current body, into *text
+// and check it against the hash it was saved with. Free *text after use.
+int
+read_version(sqlite3 *db, sqlite3_int64 id, int n, char **text, size_t *len);
+
+// List the versions of a note, newest first, as uuid@n.
+int
+history(sqlite3 *db, const char *uuid);
+
+// Print version n of a note given as uuid@n. The highest n is the
+// current body.
+int
+show_version(sqlite3 *db, const char *spec);
+
+#endif
@@ -0,0 +1,17 @@
+#ifndef JSONL_H
+#define JSONL_H
+
+// Write the vault to path, or to stdout if path is NULL, as JSON Lines: a
+// header, then one record per note, tag, note tag, link and inbox entry,
+// in that order.
+int
+export_jsonl(sqlite3 *db, const char *path);
+
+// Read records written by export_jsonl from path, or from stdin if path
+// is NULL, and add what the vault lacks. A note already here is replaced
+// only by a newer one. Records are committed in batches, so an
+// interrupted import can be run again.
+int
+import_jsonl(sqlite3 *db, const char *path);
+
+#endif
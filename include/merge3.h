@@ -0,0 +1,13 @@
+#ifndef MERGE3_H
+#define MERGE3_H
+
+// Merge the changes from base to local and from base to remote line by
+// line. Hunks both sides changed differently are kept between conflict
+// markers and counted in *conflicts. Returns the NUL terminated result,
+// or NULL if out of memory.
+char *
+merge3(const char *base, size_t base_len, const char *local, size_t local_len,
+       const char *remote, size_t remote_len, const char *remote_name,
+       size_t *out_len, int *conflicts);
+
+#endif
@@ -0,0 +1,10 @@
+#ifndef REGSEARCH_H
+#define REGSEARCH_H
+
+// Print the notes whose body matches the POSIX extended regular expression
+// pattern. Literal runs every match must contain are looked up in the
+// trigram index first, and the remaining bodies are scanned in parallel.
+int
+regex_search(sqlite3 *db, const char *pattern);
+
+#endif
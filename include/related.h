@@ -0,0 +1,9 @@
+#ifndef RELATED_H
+#define RELATED_H
+
+// Print the top notes most similar to uuid by cosine similarity of their
+// TF-IDF term vectors, refreshing the vectors of any changed notes first.
+int
+related(sqlite3 *db, const char *uuid, int top);
+
+#endif
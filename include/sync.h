@@ -0,0 +1,11 @@
+#ifndef SYNC_H
+#define SYNC_H
+
+// Bring a directory of note files and the notes table into step. Files
+// edited since the last sync are imported, notes changed since are
+// written out, and a note edited on both sides is merged. With watch
+// set, keep running and apply changes as they happen.
+int
+sync_dir(sqlite3 *db, const char *dir, int watch);
+
+#endif
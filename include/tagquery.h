@@ -0,0 +1,10 @@
+#ifndef TAGQUERY_H
+#define TAGQUERY_H
+
+// Evaluate a boolean tag expression such as "db AND (sql OR proj*) NOT draft"
+// and print the matching notes. Terms ending in '*' match tag prefixes,
+// adjacent terms are ANDed, NOT binds tighter than AND, AND tighter than OR.
+int
+tag_query(sqlite3 *db, const char *query);
+
+#endif
@@ -0,0 +1,11 @@
+#ifndef VAULTS_H
+#define VAULTS_H
+
+// Search several vaults at once: argv is a comma separated list of vault
+// files, then [--rank] [search_type] search_word as for search. Each
+// vault is searched on a thread of its own and the results are merged
+// newest first, or best ranked first with --rank.
+int
+search_vaults(int argc, char **argv);
+
+#endif
@@ -7,22 +7,46 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <openssl/rand.h>
-#include <openssl/sha.h>
 #include "app.h"
-
-static void
-sha256_string(const char *s, char output_buffer[65])
+#include "hash.h"
+#include "tagquery.h"
+#include "fuzzy.h"
+#include "regsearch.h"
+#include "dupes.h"
+#include "compress.h"
+#include "history.h"
+#include "merge3.h"
+#include "attach.h"
+#include "changes.h"
+
+// Read all of f into a NUL terminated buffer, its length in *length.
+// Returns NULL if the file cannot be read.
+char *
+read_file(FILE *f, size_t *length)
 {
-        unsigned char hash[SHA256_DIGEST_LENGTH];
-        SHA256((unsigned char *)s, strlen(s), hash);
-        for(int i = 0; i < SHA256_DIGEST_LENGTH; i++) {
-                sprintf(output_buffer + (i * 2), "%02x", hash[i]);
+        if (fseek(f, 0, SEEK_END) != 0)
+                return NULL;
+
+        long size = ftell(f);
+        if (size < 0 || fseek(f, 0, SEEK_SET) != 0)
+                return NULL;
+
+        char *buffer = malloc(size + 1);
+        if (!buffer)
+                return NULL;
+
+        *length = fread(buffer, 1, size, f);
+        if (ferror(f)) {
+                free(buffer);
+                return NULL;
         }
-        output_buffer[64] = '\0';
+
+        buffer[*length] = '\0';
+        return buffer;
 }
 
 // Taken from: https://gist.github.com/kvelakur/9069c9896577c3040030
-static int
+int
 uuid_v4_gen(char *buffer)
 {
         union
@@ -59,6 +83,7 @@ void
 help(void)
 {
         printf("zkc usage:\n"
+               "--db      - [path] [command] - run command on the vault at path, or set ZKC_DB.\n"
                "default   - help.\n"
                "help      - display commands and usage.\n"
                "init      - create tables.\n"
@@ -70,16 +95,58 @@ help(void)
                "edit      - [uuid] - edit zettel by uuid.\n"
                "slurp     - [path] - load file into new note.\n"
                "spit      - [uuid] [path] - write note to file.\n"
-               "search    - [search_type] [search_word] - search notes by search type\n"
-               "            (text|tag) and search word. search_type defaults to text.\n"
+               "search    - [--rank] [search_type] [search_word] - search notes by search type\n"
+               "            (text|tag|tree|query|fuzzy|regex) and search word. search_type defaults to text.\n"
+               "            fuzzy also finds words with a typo and scores each match.\n"
+               "            regex takes a POSIX extended regular expression.\n"
+               "            tree matches a tag and every tag nested under it with '/'.\n"
+               "            query takes a tag expression: AND, OR, NOT, ( ), prefix*.\n"
+               "            --rank orders results by note rank.\n"
+               "            --vaults a.db,b.db searches each listed vault in parallel\n"
+               "            (text|tag|tree) and merges the results.\n"
+               "complete  - [prefix] [n] - list up to n (default 10) tags and note first lines\n"
+               "            starting with prefix, one per line, tab separated.\n"
                "link      - [uuid] [uuid] - link note to other note.\n"
+               "link-many - [--where [search_type] search_word] [uuid] - link note to every note\n"
+               "            matched by a search, or to each uuid read from stdin.\n"
                "links     - [uuid] - display forward and backward links for note.\n"
-               "tag       - [uuid] [tag] - tag note\n"
-               "tags      - [uuid] - list tags for note. list all tags by default.\n"
-               "delete    - [delete_type|uuid] [uuid|tag_name] [uuid|tag_name] - delete note, tag, note_tag, or link.\n"
+               "path      - [uuid] [uuid] - show shortest chain of links between two notes.\n"
+               "related   - [uuid] [n] - list the n (default 10) notes with the most similar words.\n"
+               "rank      - compute note rank and link degrees, list top notes.\n"
+               "orphans   - list notes with no tags and no links.\n"
+               "components - count notes in each group of linked notes.\n"
+               "export-graph - [--format dot|graphml|edges] [--tag tag] [--root uuid [--hops k]]\n"
+               "            - write notes and links as a graph to stdout.\n"
+               "export-dir - [--tag tag|--where [search_type] search_word] [--name uuid|title] [dir]\n"
+               "            - write each note to a file in dir with its tags and links.\n"
+               "sync-dir  - [--watch] [dir] - import note files edited in dir and write out notes\n"
+               "            changed in the database. --watch keeps applying changes as they happen.\n"
+               "export    - --jsonl [file] - write the whole vault as JSON Lines to file or stdout.\n"
+               "import    - --jsonl [file] - add notes, tags, links and inbox entries from JSON Lines.\n"
+               "changes   - push|apply [file] - move the edits recorded since the last push to file,\n"
+               "            or replay edits pushed from another vault.\n"
+               "bundle    - create|apply|verify [file] - write the vault to a compressed bundle, add\n"
+               "            what the vault lacks from one, or check one's checksums.\n"
+               "tag       - [uuid|--stdin|--where [search_type] search_word] [tag] - tag note,\n"
+               "            each uuid read from stdin, or every note matched by a search.\n"
+               "tags      - [uuid|--tree|--counts [--sort]|--cooccur n] - list tags for note.\n"
+               "            list all tags by default. --tree shows nested tags with note counts.\n"
+               "            --counts shows notes per tag, --sort orders by count.\n"
+               "            --cooccur shows how often the n most used tags share a note.\n"
+               "delete    - [delete_type|uuid] [uuid|tag_name] [uuid|tag_name] - delete note, tag, note_tag, link,\n"
+               "            or attachment.\n"
                "archive   - [uuid] - move note out of inbox.\n"
+               "history   - [uuid] - list earlier versions of note.\n"
+               "show      - [uuid@n] - view version n of note.\n"
+               "attach    - [uuid] [path] - attach file to note.\n"
+               "attachments - [uuid] - list files attached to note.\n"
+               "attachment - [uuid] [name] [path] - write file attached to note to path.\n"
                "diff      - [path] - display differences with database at path.\n"
-               "merge     - [path] - merge differences from database at path.\n"
+               "compress  - compress note bodies with zstd, training a dictionary on the vault.\n"
+               "merge     - [--near-dupes [--threshold t]] [path] - merge differences from database\n"
+               "            at path. --near-dupes reports new notes similar to existing ones.\n"
+               "conflicts - list notes merged with conflicting edits.\n"
+               "near-dupes - [--threshold t] - list pairs of notes at least t (default 0.9) alike.\n"
                 );
 }
 
@@ -98,9 +165,70 @@ sql_exec(sqlite3 *db, const char *sql)
 }
 
 int
-open_db(sqlite3 **db)
+cache_path(sqlite3 *db, const char *suffix, char *buffer, size_t len)
+{
+        const char *file = sqlite3_db_filename(db, "main");
+        if (!file || !*file)
+                return 1;
+
+        if ((size_t)snprintf(buffer, len, "%s%s", file, suffix) >= len)
+                return 1;
+
+        return 0;
+}
+
+// Returns a generation counter, or -1 if the database predates the
+// counters table (run zkc init to add it).
+sqlite3_int64
+counter_value(sqlite3 *db, const char *name)
+{
+        char *sql = "SELECT value FROM counters WHERE name = ?;";
+        sqlite3_stmt *stmt;
+        sqlite3_int64 value = -1;
+
+        if (sqlite3_prepare_v2(db, sql, -1, &stmt, 0) != SQLITE_OK)
+                return -1;
+
+        sqlite3_bind_text(stmt, 1, name, strlen(name), SQLITE_STATIC);
+
+        if (sqlite3_step(stmt) == SQLITE_ROW)
+                value = sqlite3_column_int64(stmt, 0);
+
+        sqlite3_finalize(stmt);
+        return value;
+}
+
+// Add what zkc needs to write to a vault that predates it, so editing
+// doesn't have to wait for zkc init. Nothing happens to a vault that
+// was never initialized or is read only.
+static int
+upgrade_schema(sqlite3 *db)
+{
+        int have_notes, have_versions;
+
+        if (sqlite3_db_readonly(db, "main") == 1)
+                return SQLITE_OK;
+
+        int rc = table_exists(db, "notes", &have_notes);
+        if (rc != SQLITE_OK)
+                return rc;
+
+        rc = table_exists(db, "note_versions", &have_versions);
+        if (rc != SQLITE_OK)
+                return rc;
+
+        if (have_notes && !have_versions)
+                return sql_exec(db, NOTE_VERSIONS_SCHEMA);
+
+        return SQLITE_OK;
+}
+
+// Put the path of $HOME/.local/zkc/ in zdir, creating it if need be. It
+// holds the default vault and the scratch files of new and edit, whichever
+// vault is open.
+static int
+zkc_dir(char *zdir)
 {
-        char zdir[200];
         char* homedir = getenv("HOME");
         if (homedir == NULL) {
                 homedir = getpwuid(getuid())->pw_dir;
@@ -135,18 +263,98 @@ open_db(sqlite3 **db)
                 closedir(zdr);
         }
 
-        strcat(zdir, "zkc.db");
-        int rc = sqlite3_open(zdir, db);
+        return 0;
+}
+
+int
+open_db(sqlite3 **db, const char *path)
+{
+        char zdir[200];
+        int rc;
+
+        if (!path)
+                path = getenv("ZKC_DB");
+        if (path && *path) {
+                rc = sqlite3_open(path, db);
+        } else {
+                if (zkc_dir(zdir) != 0)
+                        return 1;
+                strcat(zdir, "zkc.db");
+                rc = sqlite3_open(zdir, db);
+        }
 
         if (rc != SQLITE_OK) {
                 fprintf(stderr, "Cannot open zkc database: %s\n", sqlite3_errmsg(*db));
+                return rc;
         }
 
         rc = sql_exec(*db, "PRAGMA foreign_keys=ON");
+        if (rc != SQLITE_OK)
+                return rc;
 
-        return rc;
+        rc = upgrade_schema(*db);
+        if (rc != SQLITE_OK)
+                return rc;
+
+        return register_note_text(*db);
+}
+
+int
+table_exists(sqlite3 *db, const char *name, int *exists)
+{
+        sqlite3_stmt *stmt;
+        int rc = sqlite3_prepare_v2(db, "SELECT 1 FROM sqlite_master WHERE name = ?;", -1, &stmt, 0);
+
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                return rc;
+        }
+
+        sqlite3_bind_text(stmt, 1, name, strlen(name), SQLITE_STATIC);
+
+        rc = sqlite3_step(stmt);
+        *exists = rc == SQLITE_ROW;
+        sqlite3_finalize(stmt);
+
+        if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+                fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+                return rc;
+        }
+
+        return SQLITE_OK;
 }
 
+// Completion key for a note: its first line, trimmed and lower-cased
+#define NOTE_TITLE(body) "lower(substr(trim(substr(" body ", 1, " \
+        "instr(" body " || char(10), char(10)) - 1), ' ' || char(9) || char(13)), 1, 80))"
+
+#define NOTE_TRIGRAMS(content) "CREATE VIRTUAL TABLE IF NOT EXISTS note_trigrams " \
+        "USING fts5(body, content='" content "', content_rowid='id', tokenize='trigram');"
+
+// Triggers feeding note text to the trigram index and completions, given
+// how to read the text of new.body and old.body and when an update counts
+#define NOTE_TEXT_TRIGGERS(new_body, old_body, changed) \
+        "CREATE TRIGGER IF NOT EXISTS notes_insert_trigrams AFTER INSERT ON notes BEGIN " \
+        "INSERT INTO note_trigrams(rowid, body) VALUES(new.id, " new_body "); END;" \
+        "CREATE TRIGGER IF NOT EXISTS notes_delete_trigrams AFTER DELETE ON notes BEGIN " \
+        "INSERT INTO note_trigrams(note_trigrams, rowid, body) " \
+        "VALUES('delete', old.id, " old_body "); END;" \
+        "CREATE TRIGGER IF NOT EXISTS notes_update_trigrams AFTER UPDATE OF id, body ON notes " \
+        changed "BEGIN " \
+        "INSERT INTO note_trigrams(note_trigrams, rowid, body) " \
+        "VALUES('delete', old.id, " old_body "); " \
+        "INSERT INTO note_trigrams(rowid, body) VALUES(new.id, " new_body "); END;" \
+        "CREATE TRIGGER IF NOT EXISTS notes_insert_completions AFTER INSERT ON notes BEGIN " \
+        "INSERT OR IGNORE INTO completions VALUES(" NOTE_TITLE(new_body) ", 1, new.id); END;" \
+        "CREATE TRIGGER IF NOT EXISTS notes_delete_completions AFTER DELETE ON notes BEGIN " \
+        "DELETE FROM completions WHERE term = " NOTE_TITLE(old_body) " " \
+        "AND kind = 1 AND ref = old.id; END;" \
+        "CREATE TRIGGER IF NOT EXISTS notes_update_completions AFTER UPDATE OF id, body ON notes " \
+        changed "BEGIN " \
+        "DELETE FROM completions WHERE term = " NOTE_TITLE(old_body) " " \
+        "AND kind = 1 AND ref = old.id; " \
+        "INSERT OR IGNORE INTO completions VALUES(" NOTE_TITLE(new_body) ", 1, new.id); END;"
+
 int
 create_tables(sqlite3 *db)
 {
@@ -209,9 +417,441 @@ create_tables(sqlite3 *db)
                 return rc;
         }
 
+        const char *create_notes_uuid = "CREATE INDEX IF NOT EXISTS notes_uuid "
+                "ON notes(uuid);";
+
+        rc = sql_exec(db, create_notes_uuid);
+        if (rc != SQLITE_OK) {
+                return rc;
+        }
+
+        // note_tags_pair replaces the older note_id only index so checks for
+        // an existing tagging are a single index probe.
+        const char *create_note_tags_indexes = "DROP INDEX IF EXISTS note_tags_note;"
+                "CREATE INDEX IF NOT EXISTS note_tags_pair "
+                "ON note_tags(note_id, tag_id);"
+                "CREATE INDEX IF NOT EXISTS note_tags_tag "
+                "ON note_tags(tag_id);";
+
+        rc = sql_exec(db, create_note_tags_indexes);
+        if (rc != SQLITE_OK) {
+                return rc;
+        }
+
+        // Probes for an existing link or inbox entry, which import --jsonl
+        // makes once per record.
+        const char *create_link_inbox_indexes = "CREATE INDEX IF NOT EXISTS links_pair "
+                "ON links(a_id, b_id);"
+                "CREATE INDEX IF NOT EXISTS inbox_note "
+                "ON inbox(note_id);";
+
+        rc = sql_exec(db, create_link_inbox_indexes);
+        if (rc != SQLITE_OK) {
+                return rc;
+        }
+
+        // Generation counters let on-disk caches detect stale data. They
+        // start at a random value so a replaced database never matches.
+        const char *create_counters = "CREATE TABLE IF NOT EXISTS counters("
+                "name TEXT PRIMARY KEY, "
+                "value INTEGER NOT NULL"
+                ");"
+                "INSERT OR IGNORE INTO counters(name, value) VALUES('graph', abs(random() / 2));"
+                "INSERT OR IGNORE INTO counters(name, value) VALUES('tags', abs(random() / 2));";
+
+        rc = sql_exec(db, create_counters);
+        if (rc != SQLITE_OK) {
+                return rc;
+        }
+
+        const char *create_graph_triggers =
+                "CREATE TRIGGER IF NOT EXISTS links_insert_graph AFTER INSERT ON links BEGIN "
+                "UPDATE counters SET value = value + 1 WHERE name = 'graph'; END;"
+                "CREATE TRIGGER IF NOT EXISTS links_delete_graph AFTER DELETE ON links BEGIN "
+                "UPDATE counters SET value = value + 1 WHERE name = 'graph'; END;"
+                "CREATE TRIGGER IF NOT EXISTS links_update_graph AFTER UPDATE ON links BEGIN "
+                "UPDATE counters SET value = value + 1 WHERE name = 'graph'; END;"
+                "CREATE TRIGGER IF NOT EXISTS notes_insert_graph AFTER INSERT ON notes BEGIN "
+                "UPDATE counters SET value = value + 1 WHERE name = 'graph'; END;"
+                "CREATE TRIGGER IF NOT EXISTS notes_delete_graph AFTER DELETE ON notes BEGIN "
+                "UPDATE counters SET value = value + 1 WHERE name = 'graph'; END;";
+
+        rc = sql_exec(db, create_graph_triggers);
+        if (rc != SQLITE_OK) {
+                return rc;
+        }
+
+        const char *create_tags_triggers =
+                "CREATE TRIGGER IF NOT EXISTS note_tags_insert_tags AFTER INSERT ON note_tags BEGIN "
+                "UPDATE counters SET value = value + 1 WHERE name = 'tags'; END;"
+                "CREATE TRIGGER IF NOT EXISTS note_tags_delete_tags AFTER DELETE ON note_tags BEGIN "
+                "UPDATE counters SET value = value + 1 WHERE name = 'tags'; END;"
+                "CREATE TRIGGER IF NOT EXISTS note_tags_update_tags AFTER UPDATE ON note_tags BEGIN "
+                "UPDATE counters SET value = value + 1 WHERE name = 'tags'; END;"
+                "CREATE TRIGGER IF NOT EXISTS tags_insert_tags AFTER INSERT ON tags BEGIN "
+                "UPDATE counters SET value = value + 1 WHERE name = 'tags'; END;"
+                "CREATE TRIGGER IF NOT EXISTS tags_delete_tags AFTER DELETE ON tags BEGIN "
+                "UPDATE counters SET value = value + 1 WHERE name = 'tags'; END;"
+                "CREATE TRIGGER IF NOT EXISTS tags_update_tags AFTER UPDATE ON tags BEGIN "
+                "UPDATE counters SET value = value + 1 WHERE name = 'tags'; END;"
+                "CREATE TRIGGER IF NOT EXISTS notes_insert_tags AFTER INSERT ON notes BEGIN "
+                "UPDATE counters SET value = value + 1 WHERE name = 'tags'; END;"
+                "CREATE TRIGGER IF NOT EXISTS notes_delete_tags AFTER DELETE ON notes BEGIN "
+                "UPDATE counters SET value = value + 1 WHERE name = 'tags'; END;";
+
+        rc = sql_exec(db, create_tags_triggers);
+        if (rc != SQLITE_OK) {
+                return rc;
+        }
+
+        // Distinct notes per tag, kept current by triggers on note_tags so
+        // tag statistics never need a GROUP BY over every tagging. The
+        // NOT EXISTS checks keep a note tagged twice from counting twice.
+        const char *create_tag_counts = "CREATE TABLE IF NOT EXISTS tag_counts("
+                "tag_id INTEGER PRIMARY KEY, "
+                "notes INTEGER NOT NULL, "
+                "FOREIGN KEY(tag_id) REFERENCES tags(id) ON DELETE CASCADE"
+                ");"
+                "CREATE TRIGGER IF NOT EXISTS note_tags_insert_counts AFTER INSERT ON note_tags "
+                "WHEN NOT EXISTS (SELECT 1 FROM note_tags WHERE note_id = new.note_id "
+                "AND tag_id = new.tag_id AND id != new.id) BEGIN "
+                "INSERT INTO tag_counts(tag_id, notes) VALUES(new.tag_id, 1) "
+                "ON CONFLICT(tag_id) DO UPDATE SET notes = notes + 1; END;"
+                "CREATE TRIGGER IF NOT EXISTS note_tags_delete_counts AFTER DELETE ON note_tags "
+                "WHEN NOT EXISTS (SELECT 1 FROM note_tags WHERE note_id = old.note_id "
+                "AND tag_id = old.tag_id) BEGIN "
+                "UPDATE tag_counts SET notes = notes - 1 WHERE tag_id = old.tag_id; END;"
+                "CREATE TRIGGER IF NOT EXISTS note_tags_update_counts AFTER UPDATE OF note_id, tag_id "
+                "ON note_tags BEGIN "
+                "UPDATE tag_counts SET notes = notes - 1 WHERE tag_id = old.tag_id "
+                "AND NOT EXISTS (SELECT 1 FROM note_tags WHERE note_id = old.note_id "
+                "AND tag_id = old.tag_id); "
+                "INSERT INTO tag_counts(tag_id, notes) SELECT new.tag_id, 1 "
+                "WHERE NOT EXISTS (SELECT 1 FROM note_tags WHERE note_id = new.note_id "
+                "AND tag_id = new.tag_id AND id != new.id) "
+                "ON CONFLICT(tag_id) DO UPDATE SET notes = notes + 1; END;"
+                "DELETE FROM tag_counts;"
+                "INSERT INTO tag_counts(tag_id, notes) "
+                "SELECT tag_id, count(DISTINCT note_id) FROM note_tags GROUP BY tag_id;";
+
+        rc = sql_exec(db, create_tag_counts);
+        if (rc != SQLITE_OK) {
+                return rc;
+        }
+
+        // Trigram index over note bodies for substring and fuzzy search. It
+        // stores no copy of the text; notes is its content table (the
+        // note_texts view once the vault is compressed).
+        int have_trigrams;
+        rc = table_exists(db, "note_trigrams", &have_trigrams);
+        if (rc != SQLITE_OK) {
+                return rc;
+        }
+
+        const char *create_note_trigrams = NOTE_TRIGRAMS("notes");
+
+        rc = sql_exec(db, create_note_trigrams);
+        if (rc != SQLITE_OK) {
+                return rc;
+        }
+
+        if (!have_trigrams) {
+                rc = sql_exec(db, "INSERT INTO note_trigrams(note_trigrams) VALUES('rebuild');");
+                if (rc != SQLITE_OK) {
+                        return rc;
+                }
+        }
+
+        // Sorted keys for search-as-you-type. Being WITHOUT ROWID the table is
+        // a single b-tree ordered by term, so a prefix lookup reads the first
+        // few matching entries and stops.
+        int have_completions;
+        rc = table_exists(db, "completions", &have_completions);
+        if (rc != SQLITE_OK) {
+                return rc;
+        }
+
+        const char *create_completions = "CREATE TABLE IF NOT EXISTS completions("
+                "term TEXT NOT NULL, "
+                "kind INTEGER NOT NULL, "
+                "ref INTEGER NOT NULL, "
+                "PRIMARY KEY(term, kind, ref)"
+                ") WITHOUT ROWID;"
+                "CREATE TRIGGER IF NOT EXISTS tags_insert_completions AFTER INSERT ON tags BEGIN "
+                "INSERT OR IGNORE INTO completions VALUES(lower(new.body), 0, new.id); END;"
+                "CREATE TRIGGER IF NOT EXISTS tags_delete_completions AFTER DELETE ON tags BEGIN "
+                "DELETE FROM completions WHERE term = lower(old.body) AND kind = 0 AND ref = old.id; END;"
+                "CREATE TRIGGER IF NOT EXISTS tags_update_completions AFTER UPDATE OF id, body ON tags BEGIN "
+                "DELETE FROM completions WHERE term = lower(old.body) AND kind = 0 AND ref = old.id; "
+                "INSERT OR IGNORE INTO completions VALUES(lower(new.body), 0, new.id); END;";
+
+        rc = sql_exec(db, create_completions);
+        if (rc != SQLITE_OK) {
+                return rc;
+        }
+
+        if (!have_completions) {
+                rc = sql_exec(db, "INSERT OR IGNORE INTO completions "
+                              "SELECT lower(body), 0, id FROM tags;"
+                              "INSERT OR IGNORE INTO completions "
+                              "SELECT " NOTE_TITLE("note_text(body)") ", 1, id FROM notes;");
+                if (rc != SQLITE_OK) {
+                        return rc;
+                }
+        }
+
+        // A compressed vault already has its own versions of these
+        rc = sql_exec(db, NOTE_TEXT_TRIGGERS("new.body", "old.body", ""));
+        if (rc != SQLITE_OK) {
+                return rc;
+        }
+
+        // Term vectors for related notes, refreshed lazily by zkc related
+        // for notes whose hash differs from the one they were indexed at.
+        // note_terms is keyed by term first so it doubles as the inverted
+        // index. counters.vectors tells when terms.df and the norms need
+        // recomputing.
+        const char *create_note_terms = "CREATE TABLE IF NOT EXISTS terms("
+                "id INTEGER PRIMARY KEY, "
+                "body TEXT UNIQUE NOT NULL, "
+                "df INTEGER NOT NULL DEFAULT 0"
+                ");"
+                "CREATE TABLE IF NOT EXISTS note_terms("
+                "term_id INTEGER NOT NULL, "
+                "note_id INTEGER NOT NULL, "
+                "tf INTEGER NOT NULL, "
+                "PRIMARY KEY(term_id, note_id), "
+                "FOREIGN KEY(note_id) REFERENCES notes(id) ON DELETE CASCADE"
+                ") WITHOUT ROWID;"
+                "CREATE INDEX IF NOT EXISTS note_terms_note ON note_terms(note_id);"
+                "CREATE TABLE IF NOT EXISTS note_vectors("
+                "note_id INTEGER PRIMARY KEY, "
+                "hash TEXT NOT NULL, "
+                "norm REAL NOT NULL, "
+                "FOREIGN KEY(note_id) REFERENCES notes(id) ON DELETE CASCADE"
+                ");"
+                "INSERT OR IGNORE INTO counters(name, value) VALUES('vectors', abs(random() / 2));"
+                "CREATE TRIGGER IF NOT EXISTS note_vectors_insert_vectors AFTER INSERT ON note_vectors BEGIN "
+                "UPDATE counters SET value = value + 1 WHERE name = 'vectors'; END;"
+                "CREATE TRIGGER IF NOT EXISTS note_vectors_delete_vectors AFTER DELETE ON note_vectors BEGIN "
+                "UPDATE counters SET value = value + 1 WHERE name = 'vectors'; END;"
+                "CREATE TRIGGER IF NOT EXISTS note_vectors_update_vectors AFTER UPDATE OF note_id, hash "
+                "ON note_vectors BEGIN "
+                "UPDATE counters SET value = value + 1 WHERE name = 'vectors'; END;";
+
+        rc = sql_exec(db, create_note_terms);
+        if (rc != SQLITE_OK) {
+                return rc;
+        }
+
+        // MinHash sketches for near-duplicate detection, refreshed lazily
+        // like the term vectors. note_bands holds one bucket per band of each
+        // sketch; notes sharing a bucket are the candidate pairs.
+        const char *create_note_sketches = "CREATE TABLE IF NOT EXISTS note_sketches("
+                "note_id INTEGER PRIMARY KEY, "
+                "hash TEXT NOT NULL, "
+                "sig BLOB, "
+                "FOREIGN KEY(note_id) REFERENCES notes(id) ON DELETE CASCADE"
+                ");"
+                "CREATE TABLE IF NOT EXISTS note_bands("
+                "band INTEGER NOT NULL, "
+                "bucket INTEGER NOT NULL, "
+                "note_id INTEGER NOT NULL, "
+                "PRIMARY KEY(band, bucket, note_id), "
+                "FOREIGN KEY(note_id) REFERENCES notes(id) ON DELETE CASCADE"
+                ") WITHOUT ROWID;"
+                "CREATE INDEX IF NOT EXISTS note_bands_note ON note_bands(note_id);";
+
+        rc = sql_exec(db, create_note_sketches);
+        if (rc != SQLITE_OK) {
+                return rc;
+        }
+
+        // zstd dictionaries for compressed note bodies, by dictionary id
+        const char *create_dictionaries = "CREATE TABLE IF NOT EXISTS dictionaries("
+                "id INTEGER PRIMARY KEY, "
+                "dict BLOB NOT NULL"
+                ");";
+
+        rc = sql_exec(db, create_dictionaries);
+        if (rc != SQLITE_OK) {
+                return rc;
+        }
+
+        // Earlier bodies of each note, see history.c
+        rc = sql_exec(db, NOTE_VERSIONS_SCHEMA);
+        if (rc != SQLITE_OK) {
+                return rc;
+        }
+
+        // Which body each body of a note was made from, so merge can tell
+        // a newer copy of a note from a concurrent edit. A merged body has
+        // two parents. Existing history seeds it once.
+        int have_parents;
+        rc = table_exists(db, "note_parents", &have_parents);
+        if (rc != SQLITE_OK) {
+                return rc;
+        }
+
+        const char *create_note_parents = "CREATE TABLE IF NOT EXISTS note_parents("
+                "note_id INTEGER NOT NULL, "
+                "hash TEXT NOT NULL, "
+                "parent TEXT NOT NULL, "
+                "PRIMARY KEY(note_id, hash, parent), "
+                "FOREIGN KEY(note_id) REFERENCES notes(id) ON DELETE CASCADE"
+                ") WITHOUT ROWID;"
+                "CREATE TABLE IF NOT EXISTS conflicts("
+                "note_id INTEGER PRIMARY KEY, "
+                "hunks INTEGER NOT NULL, "
+                "other TEXT NOT NULL, "
+                "date DATETIME NOT NULL DEFAULT CURRENT_TIMESTAMP, "
+                "FOREIGN KEY(note_id) REFERENCES notes(id) ON DELETE CASCADE"
+                ");"
+                "CREATE TRIGGER IF NOT EXISTS notes_update_parents AFTER UPDATE OF hash ON notes "
+                "WHEN old.hash IS NOT new.hash BEGIN "
+                "INSERT OR IGNORE INTO note_parents(note_id, hash, parent) "
+                "VALUES(new.id, new.hash, old.hash); "
+                "DELETE FROM conflicts WHERE note_id = new.id; END;";
+
+        rc = sql_exec(db, create_note_parents);
+        if (rc != SQLITE_OK) {
+                return rc;
+        }
+
+        if (!have_parents) {
+                rc = sql_exec(db, "INSERT OR IGNORE INTO note_parents(note_id, hash, parent) "
+                              "SELECT v.note_id, ifnull(next.hash, notes.hash), v.hash "
+                              "FROM note_versions v "
+                              "INNER JOIN notes ON notes.id = v.note_id "
+                              "LEFT JOIN note_versions next "
+                              "ON next.note_id = v.note_id AND next.version = v.version + 1;");
+                if (rc != SQLITE_OK) {
+                        return rc;
+                }
+        }
+
+        // Attached files. Contents are stored once per hash in blobs and
+        // go when the last attachment using them does.
+        const char *create_attachments = "CREATE TABLE IF NOT EXISTS blobs("
+                "id INTEGER PRIMARY KEY, "
+                "hash TEXT UNIQUE NOT NULL, "
+                "size INTEGER NOT NULL, "
+                "data BLOB NOT NULL"
+                ");"
+                "CREATE TABLE IF NOT EXISTS attachments("
+                "id INTEGER PRIMARY KEY, "
+                "note_id INTEGER NOT NULL, "
+                "blob_id INTEGER NOT NULL, "
+                "name TEXT NOT NULL, "
+                "date DATETIME NOT NULL DEFAULT CURRENT_TIMESTAMP, "
+                "UNIQUE(note_id, name), "
+                "FOREIGN KEY(note_id) REFERENCES notes(id) ON DELETE CASCADE, "
+                "FOREIGN KEY(blob_id) REFERENCES blobs(id)"
+                ");"
+                "CREATE INDEX IF NOT EXISTS attachments_blob ON attachments(blob_id);"
+                "CREATE TRIGGER IF NOT EXISTS attachments_delete AFTER DELETE ON attachments "
+                "WHEN NOT EXISTS (SELECT 1 FROM attachments WHERE blob_id = old.blob_id) BEGIN "
+                "DELETE FROM blobs WHERE id = old.blob_id; END;"
+                "CREATE TRIGGER IF NOT EXISTS attachments_update AFTER UPDATE OF blob_id ON attachments "
+                "WHEN old.blob_id IS NOT new.blob_id "
+                "AND NOT EXISTS (SELECT 1 FROM attachments WHERE blob_id = old.blob_id) BEGIN "
+                "DELETE FROM blobs WHERE id = old.blob_id; END;";
+
+        rc = sql_exec(db, create_attachments);
+        if (rc != SQLITE_OK) {
+                return rc;
+        }
+
+        // Files sync-dir keeps in step with notes, as of the last sync
+        const char *create_synced_files = "CREATE TABLE IF NOT EXISTS synced_files("
+                "dir TEXT NOT NULL, "
+                "name TEXT NOT NULL, "
+                "uuid TEXT NOT NULL, "
+                "hash TEXT NOT NULL, "
+                "file_hash TEXT NOT NULL, "
+                "mtime INTEGER NOT NULL, "
+                "size INTEGER NOT NULL, "
+                "PRIMARY KEY(dir, name)"
+                ") WITHOUT ROWID;"
+                "CREATE INDEX IF NOT EXISTS synced_files_uuid ON synced_files(uuid);";
+
+        rc = sql_exec(db, create_synced_files);
+        if (rc != SQLITE_OK) {
+                return rc;
+        }
+
+        // Edits recorded for changes push, see changes.c
+        rc = sql_exec(db, CHANGES_SCHEMA);
+        if (rc != SQLITE_OK) {
+                return rc;
+        }
+
+        const char *create_note_ranks = "CREATE TABLE IF NOT EXISTS note_ranks("
+                "note_id INTEGER PRIMARY KEY, "
+                "score REAL NOT NULL, "
+                "in_degree INTEGER NOT NULL, "
+                "out_degree INTEGER NOT NULL, "
+                "FOREIGN KEY(note_id) REFERENCES notes(id) ON DELETE CASCADE"
+                ");";
+
+        rc = sql_exec(db, create_note_ranks);
+        if (rc != SQLITE_OK) {
+                return rc;
+        }
+
         return SQLITE_OK;
 }
 
+// Switch to the layout of a vault whose bodies may be zstd blobs. The
+// trigram index reads its text through the note_texts view, and the
+// triggers through note_text(). Compressing a body keeps its hash, so the
+// update triggers skip that.
+int
+compressed_schema(sqlite3 *db)
+{
+        sqlite3_stmt *stmt;
+        int rc = sqlite3_prepare_v2(db, "SELECT 1 FROM sqlite_master WHERE name = 'note_trigrams' "
+                                    "AND sql LIKE '%note_texts%';", -1, &stmt, 0);
+
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                return rc;
+        }
+
+        rc = sqlite3_step(stmt);
+        int on_view = rc == SQLITE_ROW;
+        sqlite3_finalize(stmt);
+
+        if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+                fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+                return rc;
+        }
+
+        rc = sql_exec(db, "DROP TRIGGER IF EXISTS notes_insert_trigrams;"
+                      "DROP TRIGGER IF EXISTS notes_delete_trigrams;"
+                      "DROP TRIGGER IF EXISTS notes_update_trigrams;"
+                      "DROP TRIGGER IF EXISTS notes_insert_completions;"
+                      "DROP TRIGGER IF EXISTS notes_delete_completions;"
+                      "DROP TRIGGER IF EXISTS notes_update_completions;");
+        if (rc != SQLITE_OK) {
+                return rc;
+        }
+
+        if (!on_view) {
+                rc = sql_exec(db, "DROP TABLE IF EXISTS note_trigrams;"
+                              "CREATE VIEW IF NOT EXISTS note_texts AS "
+                              "SELECT id, note_text(body) AS body FROM notes;"
+                              NOTE_TRIGRAMS("note_texts")
+                              "INSERT INTO note_trigrams(note_trigrams) VALUES('rebuild');");
+                if (rc != SQLITE_OK) {
+                        return rc;
+                }
+        }
+
+        return sql_exec(db, NOTE_TEXT_TRIGGERS("note_text(new.body)", "note_text(old.body)",
+                                               "WHEN old.id IS NOT new.id OR old.hash IS NOT new.hash "));
+}
+
 int
 new(sqlite3 *db)
 {
@@ -219,13 +859,10 @@ new(sqlite3 *db)
         uuid_v4_gen(uuid);
 
         char zdir[200];
-        char* homedir = getenv("HOME");
-        if (homedir == NULL) {
-                homedir = getpwuid(getuid())->pw_dir;
+        if (zkc_dir(zdir) != 0) {
+                return 1;
         }
 
-        strcpy(zdir, homedir);
-        strcat(zdir, "/.local/zkc/");
         strcat(zdir, uuid);
 
         char command[300];
@@ -249,22 +886,15 @@ new(sqlite3 *db)
                 return 0;
         }
 
-        // TODO: Add error check
-        fseek(f, 0, SEEK_END);
-        long length = ftell(f);
-        fseek(f, 0, SEEK_SET);
-        char *buffer = (char*)malloc(sizeof(char)*length);
-
-        if (buffer) {
-                fread(buffer, sizeof(char), length, f);
-        }
+        size_t length;
+        char *buffer = read_file(f, &length);
 
         fclose(f);
         remove(zdir);
 
         int rc = SQLITE_OK;
 
-        if (buffer) {
+        if (buffer && length > 0) {
                 char *sql = "INSERT INTO notes(uuid, body, hash) VALUES(?, ?, ?);";
                 sqlite3_stmt *stmt;
                 rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
@@ -274,12 +904,17 @@ new(sqlite3 *db)
                         goto end;
                 }
 
-                char hash[65];
-                sha256_string(buffer, hash);
+                char hash[SHA256_HEX_LENGTH + 1];
+                if (sha256_hex(buffer, length, hash) != 0) {
+                        fprintf(stderr, "Cannot hash note\n");
+                        sqlite3_finalize(stmt);
+                        rc = SQLITE_ERROR;
+                        goto end;
+                }
 
                 sqlite3_bind_text(stmt, 1, uuid, strlen(uuid), SQLITE_STATIC);
-                sqlite3_bind_text(stmt, 2, buffer, strlen(buffer), SQLITE_TRANSIENT);
-                sqlite3_bind_text(stmt, 3, hash, strlen(hash), SQLITE_STATIC);
+                bind_note_body(db, stmt, 2, buffer, length);
+                sqlite3_bind_text(stmt, 3, hash, SHA256_HEX_LENGTH, SQLITE_STATIC);
 
                 rc = sqlite3_step(stmt);
 
@@ -344,26 +979,87 @@ note_summary_callback(void *not_used, int argc, char **argv, char **col_names)
         return 0;
 }
 
+void
+print_summary(const char *uuid, const char *date, const char *body)
+{
+        char summary[17];
+        size_t i;
+
+        for (i = 0; i < 16 && body[i] != '\0'; i++)
+                summary[i] = body[i] == '\n' ? ' ' : body[i];
+        summary[i] = '\0';
+
+        printf("%s - %s - %s...\n", uuid, date, summary);
+}
+
+int
+resolve_note_id(sqlite3 *db, const char *uuid, sqlite3_int64 *id)
+{
+        char *sql;
+        if (!strcmp(uuid, "head")) {
+                sql = "SELECT notes.id FROM notes "
+                        "INNER JOIN inbox "
+                        "ON notes.id = inbox.note_id "
+                        "ORDER BY notes.date DESC "
+                        "LIMIT 1;";
+        } else if (!strcmp(uuid, "tail")) {
+                sql = "SELECT notes.id FROM notes "
+                        "INNER JOIN inbox "
+                        "ON notes.id = inbox.note_id "
+                        "ORDER BY notes.date ASC "
+                        "LIMIT 1;";
+        } else {
+                sql = "SELECT id FROM notes WHERE uuid = ? LIMIT 1;";
+        }
+
+        sqlite3_stmt *stmt;
+        int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
+
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                return rc;
+        }
+
+        if (strcmp(uuid, "head") && strcmp(uuid, "tail")) {
+                sqlite3_bind_text(stmt, 1, uuid, strlen(uuid), SQLITE_STATIC);
+        }
+
+        rc = sqlite3_step(stmt);
+
+        if (rc == SQLITE_ROW) {
+                *id = sqlite3_column_int64(stmt, 0);
+                rc = SQLITE_OK;
+        } else if (rc == SQLITE_DONE) {
+                fprintf(stderr, "No note found: %s\n", uuid);
+                rc = SQLITE_NOTFOUND;
+        } else {
+                fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+        }
+
+        sqlite3_finalize(stmt);
+        return rc;
+}
+
 int
 inbox(sqlite3 *db, int head)
 {
         char *sql;
         if (head == 1) { // head
-                sql = "SELECT notes.uuid, notes.date, notes.body "
+                sql = "SELECT notes.uuid, notes.date, note_text(notes.body) "
                         "FROM notes "
                         "INNER JOIN inbox "
                         "ON inbox.note_id = notes.id "
                         "ORDER BY date DESC "
                         "LIMIT 1;";
         } else if (head == -1) { // tail
-                sql = "SELECT notes.uuid, notes.date, notes.body "
+                sql = "SELECT notes.uuid, notes.date, note_text(notes.body) "
                         "FROM notes "
                         "INNER JOIN inbox "
                         "ON inbox.note_id = notes.id "
                         "ORDER BY date ASC "
                         "LIMIT 1;";
         } else { // whole inbox
-                sql = "SELECT notes.uuid, notes.date, notes.body "
+                sql = "SELECT notes.uuid, notes.date, note_text(notes.body) "
                         "FROM notes "
                         "INNER JOIN inbox "
                         "ON inbox.note_id = notes.id "
@@ -389,19 +1085,19 @@ view(sqlite3 *db, const char *uuid)
         char *sql;
 
         if (!strcmp(uuid, "head")) {
-                sql = "SELECT body FROM notes "
+                sql = "SELECT note_text(body) FROM notes "
                         "INNER JOIN inbox "
                         "ON notes.id = inbox.note_id "
                         "ORDER BY notes.date DESC "
                         "LIMIT 1;";
         } else if (!strcmp(uuid, "tail")) {
-                sql = "SELECT body FROM notes "
+                sql = "SELECT note_text(body) FROM notes "
                         "INNER JOIN inbox "
                         "ON notes.id = inbox.note_id "
                         "ORDER BY notes.date ASC "
                         "LIMIT 1;";
         } else {
-                sql = "SELECT body FROM notes WHERE uuid = ? LIMIT 1;";
+                sql = "SELECT note_text(body) FROM notes WHERE uuid = ? LIMIT 1;";
         }
 
         sqlite3_stmt *stmt;
@@ -432,34 +1128,20 @@ view(sqlite3 *db, const char *uuid)
 int
 edit(sqlite3 *db, const char *uuid)
 {
-        char *sql;
-        if (!strcmp(uuid, "head")) {
-                sql = "SELECT body FROM notes "
-                        "INNER JOIN inbox "
-                        "ON notes.id = inbox.note_id "
-                        "ORDER BY notes.date DESC "
-                        "LIMIT 1";
-        } else if (!strcmp(uuid, "tail")) {
-                sql = "SELECT body FROM notes "
-                        "INNER JOIN inbox "
-                        "ON notes.id = inbox.note_id "
-                        "ORDER BY notes.date ASC "
-                        "LIMIT 1";
-        } else {
-                sql = "SELECT body FROM notes WHERE uuid = ? LIMIT 1;";
-        }
+        sqlite3_int64 id;
+        int rc = resolve_note_id(db, uuid, &id);
+        if (rc != SQLITE_OK)
+                return rc;
 
         sqlite3_stmt *stmt;
-        int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
+        rc = sqlite3_prepare_v2(db, "SELECT note_text(body) FROM notes WHERE id = ?;", -1, &stmt, 0);
 
         if (rc != SQLITE_OK) {
                 fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
                 return rc;
         }
 
-        if (strcmp(uuid, "head") && strcmp(uuid, "tail")) {
-                sqlite3_bind_text(stmt, 1, uuid, strlen(uuid), SQLITE_STATIC);
-        }
+        sqlite3_bind_int64(stmt, 1, id);
 
         rc = sqlite3_step(stmt);
 
@@ -469,13 +1151,10 @@ edit(sqlite3 *db, const char *uuid)
         }
 
         char zdir[200];
-        char* homedir = getenv("HOME");
-        if (homedir == NULL) {
-                homedir = getpwuid(getuid())->pw_dir;
+        if (zkc_dir(zdir) != 0) {
+                return 1;
         }
 
-        strcpy(zdir, homedir);
-        strcat(zdir, "/.local/zkc/");
         strcat(zdir, uuid);
 
         FILE *fw = fopen(zdir, "wb");
@@ -508,15 +1187,8 @@ edit(sqlite3 *db, const char *uuid)
                 return 1;
         }
 
-        // TODO: Add error check
-        fseek(fr, 0, SEEK_END);
-        long length = ftell(fr);
-        fseek(fr, 0, SEEK_SET);
-        char *buffer = (char*)malloc(sizeof(char) * length);
-
-        if (buffer) {
-                fread(buffer, sizeof(char), length, fr);
-        }
+        size_t length;
+        char *buffer = read_file(fr, &length);
 
         fclose(fr);
         remove(zdir);
@@ -524,52 +1196,49 @@ edit(sqlite3 *db, const char *uuid)
         rc = SQLITE_OK;
 
         if (buffer) {
-                char *sql;
-                if (!strcmp(uuid, "head")) {
-                        sql = "UPDATE notes SET body = ?, hash = ?, date = datetime() WHERE id = "
-                                "(SELECT notes.id FROM notes "
-                                "INNER JOIN inbox "
-                                "ON notes.id = inbox.note_id "
-                                "ORDER BY notes.date DESC "
-                                "LIMIT 1"
-                                ")";
-                } else if (!strcmp(uuid, "tail")) {
-                        sql = "UPDATE notes SET body = ?, hash = ?, date = datetime() WHERE id = "
-                                "(SELECT notes.id FROM notes "
-                                "INNER JOIN inbox "
-                                "ON notes.id = inbox.note_id "
-                                "ORDER BY notes.date ASC "
-                                "LIMIT 1"
-                                ")";
-                } else {
-                        sql = "UPDATE notes SET body = ?, hash = ?, date = datetime() WHERE uuid = ?;";
+                char hash[SHA256_HEX_LENGTH + 1];
+                if (sha256_hex(buffer, length, hash) != 0) {
+                        fprintf(stderr, "Cannot hash note\n");
+                        rc = SQLITE_ERROR;
+                        goto end;
                 }
-                sqlite3_stmt *stmt;
-                rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
 
-                if (rc != SQLITE_OK) {
-                        fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                // The old body and its replacement are saved together
+                rc = sql_exec(db, "SAVEPOINT edit;");
+                if (rc != SQLITE_OK)
                         goto end;
-                }
 
-                char hash[65];
-                sha256_string(buffer, hash);
+                rc = save_version(db, id, buffer, length);
+                if (rc != SQLITE_OK)
+                        goto rollback;
 
-                sqlite3_bind_text(stmt, 1, buffer, strlen(buffer), SQLITE_TRANSIENT);
-                sqlite3_bind_text(stmt, 2, hash, strlen(hash), SQLITE_STATIC);
+                rc = sqlite3_prepare_v2(db, "UPDATE notes SET body = ?, hash = ?, date = datetime() "
+                                        "WHERE id = ?;", -1, &stmt, 0);
 
-                if (strcmp(uuid, "head") && strcmp(uuid, "tail")) {
-                        sqlite3_bind_text(stmt, 3, uuid, strlen(uuid), SQLITE_STATIC);
+                if (rc != SQLITE_OK) {
+                        fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                        goto rollback;
                 }
 
+                bind_note_body(db, stmt, 1, buffer, length);
+                sqlite3_bind_text(stmt, 2, hash, SHA256_HEX_LENGTH, SQLITE_STATIC);
+                sqlite3_bind_int64(stmt, 3, id);
+
                 rc = sqlite3_step(stmt);
 
                 if (rc != SQLITE_DONE) {
-                        fprintf(stderr, "execution failed: %s", sqlite3_errmsg(db));
-                        goto end;
+                        fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+                        sqlite3_finalize(stmt);
+                        goto rollback;
                 }
 
                 sqlite3_finalize(stmt);
+
+                rc = sql_exec(db, "RELEASE edit;");
+                if (rc == SQLITE_OK)
+                        goto end;
+rollback:
+                sql_exec(db, "ROLLBACK TO edit; RELEASE edit;");
         }
 
 end:
@@ -589,21 +1258,14 @@ slurp(sqlite3 *db, const char *path)
                 return 1;
         }
 
-        // TODO: Add error check
-        fseek(f, 0, SEEK_END);
-        long length = ftell(f);
-        fseek(f, 0, SEEK_SET);
-        char *buffer = (char*)malloc(sizeof(char)*length);
-
-        if (buffer) {
-                fread(buffer, sizeof(char), length, f);
-        }
+        size_t length;
+        char *buffer = read_file(f, &length);
 
         fclose(f);
 
         int rc = SQLITE_OK;
 
-        if (buffer) {
+        if (buffer && length > 0) {
                 char *sql = "INSERT INTO notes(uuid, body, hash) VALUES(?, ?, ?);";
                 sqlite3_stmt *stmt;
                 rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
@@ -616,12 +1278,17 @@ slurp(sqlite3 *db, const char *path)
                 char uuid[38];
                 uuid_v4_gen(uuid);
 
-                char hash[65];
-                sha256_string(buffer, hash);
+                char hash[SHA256_HEX_LENGTH + 1];
+                if (sha256_hex(buffer, length, hash) != 0) {
+                        fprintf(stderr, "Cannot hash note\n");
+                        sqlite3_finalize(stmt);
+                        rc = SQLITE_ERROR;
+                        goto end;
+                }
 
                 sqlite3_bind_text(stmt, 1, uuid, strlen(uuid), SQLITE_STATIC);
-                sqlite3_bind_text(stmt, 2, buffer, strlen(buffer), SQLITE_TRANSIENT);
-                sqlite3_bind_text(stmt, 3, hash, strlen(hash), SQLITE_STATIC);
+                bind_note_body(db, stmt, 2, buffer, length);
+                sqlite3_bind_text(stmt, 3, hash, SHA256_HEX_LENGTH, SQLITE_STATIC);
 
                 rc = sqlite3_step(stmt);
 
@@ -671,19 +1338,19 @@ spit(sqlite3 *db, const char *uuid, const char *path)
 {
         char *sql;
         if (!strcmp(uuid, "head")) {
-                sql = "SELECT body FROM notes "
+                sql = "SELECT note_text(body) FROM notes "
                         "INNER JOIN inbox "
                         "ON notes.id = inbox.note_id "
                         "ORDER BY notes.date DESC "
                         "LIMIT 1;";
         } else if (!strcmp(uuid, "tail")) {
-                sql = "SELECT body FROM notes "
+                sql = "SELECT note_text(body) FROM notes "
                         "INNER JOIN inbox "
                         "ON notes.id = inbox.note_id "
                         "ORDER BY notes.date ASC "
                         "LIMIT 1;";
         } else {
-                sql = "SELECT body FROM notes WHERE uuid = ? LIMIT 1";
+                sql = "SELECT note_text(body) FROM notes WHERE uuid = ? LIMIT 1";
         }
 
         sqlite3_stmt *stmt;
@@ -716,40 +1383,84 @@ spit(sqlite3 *db, const char *uuid, const char *path)
         return SQLITE_OK;
 }
 
-int
-search(sqlite3 *db, const char *search_type, const char *search_word)
+// Tags nest through '/' separated names. A tag's subtree is one range
+// scan on the unique index over tags.body, since every "name/..." tag sorts
+// between "name" and "name0". The substr() test drops siblings such as
+// "name-x" that fall in the same range.
+#define TAG_SUBTREE "tags.body >= ?1 AND tags.body < ?1 || '0' " \
+        "AND (tags.body = ?1 OR substr(tags.body, length(?1) + 1, 1) = '/')"
+
+// Condition on notes selecting the matches of a search of the given type,
+// with the search word bound to ?1. Returns NULL for an unknown type. Text
+// searches of a vault that predates the trigram index, or of a NULL db
+// when only the type is being checked, scan the note text instead.
+const char *
+search_where(sqlite3 *db, const char *search_type)
 {
-        char *sql;
-        char match_phrase[50];
-        sprintf(match_phrase, "%%%s%%", search_word);
-
         if (!strcmp(search_type, "text")) {
-                sql = "SELECT uuid, date, body "
-                        "FROM notes "
-                        "WHERE body LIKE ?;";
+                int have_trigrams = 0;
+                if (!db || table_exists(db, "note_trigrams", &have_trigrams) != SQLITE_OK || !have_trigrams)
+                        return "note_text(notes.body) LIKE '%' || ?1 || '%'";
+
+                // The trigram index answers LIKE for words of 3 or more
+                // characters, and checks candidates against the note text
+                return "notes.id IN "
+                        "(SELECT rowid FROM note_trigrams "
+                        "WHERE note_trigrams.body LIKE '%' || ?1 || '%')";
         } else if (!strcmp(search_type, "tag")) {
-                sql = "SELECT uuid, date, body "
-                        "FROM notes "
-                        "WHERE notes.id IN "
+                return "notes.id IN "
                         "(SELECT note_id "
                         "FROM note_tags "
                         "INNER JOIN tags "
                         "ON note_tags.tag_id = tags.id "
-                        "WHERE tags.body LIKE ?);";
-        } else {
+                        "WHERE tags.body LIKE '%' || ?1 || '%')";
+        } else if (!strcmp(search_type, "tree")) {
+                return "notes.id IN "
+                        "(SELECT note_id "
+                        "FROM note_tags "
+                        "INNER JOIN tags "
+                        "ON note_tags.tag_id = tags.id "
+                        "WHERE " TAG_SUBTREE ")";
+        }
+
+        return NULL;
+}
+
+int
+search(sqlite3 *db, const char *search_type, const char *search_word, int ranked)
+{
+        if (!strcmp(search_type, "query")) {
+                return tag_query(db, search_word);
+        }
+
+        if (!strcmp(search_type, "fuzzy")) {
+                return fuzzy_search(db, search_word);
+        }
+
+        if (!strcmp(search_type, "regex")) {
+                return regex_search(db, search_word);
+        }
+
+        const char *where = search_where(db, search_type);
+        if (!where) {
                 fprintf(stderr, "Invalid search type: %s\n", search_type);
                 return 1;
         }
 
+        // Notes that were never ranked sort last
+        char query[1024];
+        snprintf(query, sizeof(query), "SELECT uuid, date, note_text(body) FROM notes WHERE %s%s;", where,
+                 ranked ? " ORDER BY (SELECT score FROM note_ranks WHERE note_id = notes.id) DESC, date DESC" : "");
+
         sqlite3_stmt *stmt;
-        int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
+        int rc = sqlite3_prepare_v2(db, query, -1, &stmt, 0);
 
         if (rc != SQLITE_OK) {
                 fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
                 return rc;
         }
 
-        sqlite3_bind_text(stmt, 1, match_phrase, strlen(match_phrase), SQLITE_STATIC);
+        sqlite3_bind_text(stmt, 1, search_word, strlen(search_word), SQLITE_STATIC);
 
         while(1) {
 
@@ -788,6 +1499,82 @@ search(sqlite3 *db, const char *search_type, const char *search_word)
         return SQLITE_OK;
 }
 
+int
+complete(sqlite3 *db, const char *prefix, int limit)
+{
+        char *sql = "SELECT completions.kind, tags.body, notes.uuid, "
+                "substr(trim(substr(note_text(notes.body), 1, instr(note_text(notes.body) || char(10), char(10)) - 1), "
+                "' ' || char(9) || char(13)), 1, 80) "
+                "FROM completions "
+                "LEFT JOIN tags ON completions.kind = 0 AND tags.id = completions.ref "
+                "LEFT JOIN notes ON completions.kind = 1 AND notes.id = completions.ref "
+                "WHERE completions.term >= ?1 AND completions.term < ?2 "
+                "AND completions.term > '' "
+                "ORDER BY completions.term, completions.kind LIMIT ?3;";
+
+        // Keys are lower-cased the same way as SQLite's lower(). The upper
+        // bound is the prefix with its last byte raised by one; a prefix of
+        // only 0xff bytes has none, and a blob sorts after any text.
+        size_t len = strlen(prefix);
+        char *lower = malloc(len + 1), *upper = malloc(len + 1);
+        if (!lower || !upper) {
+                free(lower);
+                free(upper);
+                return SQLITE_NOMEM;
+        }
+
+        for (size_t i = 0; i <= len; i++)
+                lower[i] = prefix[i] >= 'A' && prefix[i] <= 'Z' ? prefix[i] + 32 : prefix[i];
+        memcpy(upper, lower, len + 1);
+
+        size_t upper_len = len;
+        while (upper_len && (unsigned char)upper[upper_len - 1] == 0xff)
+                upper_len--;
+        if (upper_len)
+                upper[upper_len - 1]++;
+
+        // Read the index pages straight from the OS page cache
+        sql_exec(db, "PRAGMA mmap_size = 268435456;");
+
+        sqlite3_stmt *stmt;
+        int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
+
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                goto end;
+        }
+
+        sqlite3_bind_text(stmt, 1, lower, len, SQLITE_STATIC);
+        if (upper_len)
+                sqlite3_bind_text(stmt, 2, upper, upper_len, SQLITE_STATIC);
+        else
+                sqlite3_bind_zeroblob(stmt, 2, 0);
+        sqlite3_bind_int(stmt, 3, limit);
+
+        // One line per completion, tab separated for editor plugins
+        while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+                if (sqlite3_column_int(stmt, 0) == 0) {
+                        printf("tag\t%s\n", (const char *)sqlite3_column_text(stmt, 1));
+                } else {
+                        printf("note\t%s\t%s\n", (const char *)sqlite3_column_text(stmt, 2),
+                               (const char *)sqlite3_column_text(stmt, 3));
+                }
+        }
+
+        if (rc != SQLITE_DONE) {
+                fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+                goto end;
+        }
+
+        rc = SQLITE_OK;
+
+end:
+        sqlite3_finalize(stmt);
+        free(lower);
+        free(upper);
+        return rc;
+}
+
 int
 link_notes(sqlite3 *db, const char *uuid_a, const char *uuid_b)
 {
@@ -873,40 +1660,193 @@ link_notes(sqlite3 *db, const char *uuid_a, const char *uuid_b)
                         ");";
         }
 
-        sqlite3_stmt *stmt;
-        int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
+        sqlite3_stmt *stmt;
+        int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
+
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                return rc;
+        }
+
+        if (!strcmp(uuid_a, "head") && !strcmp(uuid_b, "tail")) {
+                /* Leave this blank */
+        } else if (!strcmp(uuid_a, "tail") && !strcmp(uuid_b, "head")) {
+                /* Leave this blank */
+        } else if (!strcmp(uuid_a, "head")) {
+                sqlite3_bind_text(stmt, 1, uuid_b, strlen(uuid_b), SQLITE_STATIC);
+        } else if (!strcmp(uuid_b, "head")) {
+                sqlite3_bind_text(stmt, 1, uuid_a, strlen(uuid_a), SQLITE_STATIC);
+        } else if (!strcmp(uuid_a, "tail")) {
+                sqlite3_bind_text(stmt, 1, uuid_b, strlen(uuid_b), SQLITE_STATIC);
+        } else if (!strcmp(uuid_b, "tail")) {
+                sqlite3_bind_text(stmt, 1, uuid_a, strlen(uuid_a), SQLITE_STATIC);
+        } else {
+                sqlite3_bind_text(stmt, 1, uuid_a, strlen(uuid_a), SQLITE_STATIC);
+                sqlite3_bind_text(stmt, 2, uuid_b, strlen(uuid_b), SQLITE_STATIC);
+        }
+
+        rc = sqlite3_step(stmt);
+
+        if (rc != SQLITE_DONE) {
+                fprintf(stderr, "execution failed: %s", sqlite3_errmsg(db));
+                return rc;
+        }
+
+        sqlite3_finalize(stmt);
+
+        return rc;
+}
+
+// Fill temp.bulk_notes with the notes matched by a search, or with the notes
+// whose uuids start each line of stdin when search_type is NULL. Lines are
+// cut at the first space so the output of zkc search can be piped in.
+static int
+bulk_select(sqlite3 *db, const char *search_type, const char *search_word)
+{
+        sqlite3_stmt *stmt;
+        int rc = sql_exec(db, "CREATE TEMP TABLE IF NOT EXISTS bulk_notes(id INTEGER PRIMARY KEY);"
+                          "CREATE TEMP TABLE IF NOT EXISTS bulk_uuids(uuid TEXT PRIMARY KEY);"
+                          "DELETE FROM temp.bulk_notes;"
+                          "DELETE FROM temp.bulk_uuids;");
+        if (rc != SQLITE_OK)
+                return rc;
+
+        if (search_type) {
+                const char *where = search_where(db, search_type);
+                if (!where) {
+                        fprintf(stderr, "Invalid search type: %s\n", search_type);
+                        return SQLITE_MISUSE;
+                }
+
+                char sql[512];
+                snprintf(sql, sizeof(sql), "INSERT INTO temp.bulk_notes(id) "
+                         "SELECT id FROM notes WHERE %s;", where);
+
+                rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
+
+                if (rc != SQLITE_OK) {
+                        fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                        return rc;
+                }
+
+                sqlite3_bind_text(stmt, 1, search_word, strlen(search_word), SQLITE_STATIC);
+
+                rc = sqlite3_step(stmt);
+                sqlite3_finalize(stmt);
+
+                if (rc != SQLITE_DONE) {
+                        fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+                        return rc;
+                }
+
+                return SQLITE_OK;
+        }
+
+        rc = sqlite3_prepare_v2(db, "INSERT OR IGNORE INTO temp.bulk_uuids(uuid) VALUES(?);",
+                                -1, &stmt, 0);
 
         if (rc != SQLITE_OK) {
                 fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
                 return rc;
         }
 
-        if (!strcmp(uuid_a, "head") && !strcmp(uuid_b, "tail")) {
-                /* Leave this blank */
-        } else if (!strcmp(uuid_a, "tail") && !strcmp(uuid_b, "head")) {
-                /* Leave this blank */
-        } else if (!strcmp(uuid_a, "head")) {
-                sqlite3_bind_text(stmt, 1, uuid_b, strlen(uuid_b), SQLITE_STATIC);
-        } else if (!strcmp(uuid_b, "head")) {
-                sqlite3_bind_text(stmt, 1, uuid_a, strlen(uuid_a), SQLITE_STATIC);
-        } else if (!strcmp(uuid_a, "tail")) {
-                sqlite3_bind_text(stmt, 1, uuid_b, strlen(uuid_b), SQLITE_STATIC);
-        } else if (!strcmp(uuid_b, "tail")) {
-                sqlite3_bind_text(stmt, 1, uuid_a, strlen(uuid_a), SQLITE_STATIC);
-        } else {
-                sqlite3_bind_text(stmt, 1, uuid_a, strlen(uuid_a), SQLITE_STATIC);
-                sqlite3_bind_text(stmt, 2, uuid_b, strlen(uuid_b), SQLITE_STATIC);
+        char *line = NULL;
+        size_t cap = 0;
+
+        while (getline(&line, &cap, stdin) != -1) {
+                size_t len = strcspn(line, " \t\r\n");
+                if (len == 0)
+                        continue;
+
+                sqlite3_bind_text(stmt, 1, line, len, SQLITE_STATIC);
+                rc = sqlite3_step(stmt);
+                sqlite3_reset(stmt);
+
+                if (rc != SQLITE_DONE) {
+                        fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+                        free(line);
+                        sqlite3_finalize(stmt);
+                        return rc;
+                }
         }
 
-        rc = sqlite3_step(stmt);
+        free(line);
+        sqlite3_finalize(stmt);
+
+        rc = sqlite3_prepare_v2(db, "SELECT uuid FROM temp.bulk_uuids "
+                                "WHERE uuid NOT IN (SELECT uuid FROM notes);", -1, &stmt, 0);
+
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                return rc;
+        }
+
+        while ((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+                fprintf(stderr, "No note found: %s\n", (const char *)sqlite3_column_text(stmt, 0));
+
+        sqlite3_finalize(stmt);
 
         if (rc != SQLITE_DONE) {
-                fprintf(stderr, "execution failed: %s", sqlite3_errmsg(db));
+                fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+                return rc;
+        }
+
+        return sql_exec(db, "INSERT INTO temp.bulk_notes(id) "
+                        "SELECT DISTINCT notes.id FROM notes "
+                        "INNER JOIN temp.bulk_uuids ON notes.uuid = bulk_uuids.uuid;");
+}
+
+int
+link_many(sqlite3 *db, const char *search_type, const char *search_word, const char *uuid)
+{
+        sqlite3_int64 id;
+        sqlite3_stmt *stmt;
+
+        // Skip links that already exist; the subquery is evaluated once
+        char *sql = "INSERT INTO links(a_id, b_id) "
+                "SELECT ?1, id FROM temp.bulk_notes "
+                "WHERE id != ?1 AND id NOT IN (SELECT b_id FROM links WHERE a_id = ?1);";
+
+        int rc = sql_exec(db, "BEGIN;");
+        if (rc != SQLITE_OK)
                 return rc;
+
+        rc = resolve_note_id(db, uuid, &id);
+        if (rc != SQLITE_OK)
+                goto rollback;
+
+        rc = bulk_select(db, search_type, search_word);
+        if (rc != SQLITE_OK)
+                goto rollback;
+
+        rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
+
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                goto rollback;
         }
 
+        sqlite3_bind_int64(stmt, 1, id);
+
+        rc = sqlite3_step(stmt);
         sqlite3_finalize(stmt);
 
+        if (rc != SQLITE_DONE) {
+                fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+                goto rollback;
+        }
+
+        int linked = sqlite3_changes(db);
+
+        rc = sql_exec(db, "COMMIT;");
+        if (rc != SQLITE_OK)
+                goto rollback;
+
+        printf("Linked %d notes\n", linked);
+        return SQLITE_OK;
+
+rollback:
+        sql_exec(db, "ROLLBACK;");
         return rc;
 }
 
@@ -917,7 +1857,7 @@ links(sqlite3 *db, const char *uuid)
 
         char *sql;
         if (!strcmp(uuid, "head")) {
-                sql = "SELECT uuid, date, body "
+                sql = "SELECT uuid, date, note_text(body) "
                         "FROM notes "
                         "WHERE id = "
                         "(SELECT links.b_id "
@@ -931,7 +1871,7 @@ links(sqlite3 *db, const char *uuid)
                         "ORDER BY notes.date DESC "
                         "LIMIT 1));";
         } else if (!strcmp(uuid, "tail")) {
-                sql = "SELECT uuid, date, body "
+                sql = "SELECT uuid, date, note_text(body) "
                         "FROM notes "
                         "WHERE id = "
                         "(SELECT links.b_id "
@@ -945,7 +1885,7 @@ links(sqlite3 *db, const char *uuid)
                         "ORDER BY notes.date ASC "
                         "LIMIT 1));";
         } else {
-                sql = "SELECT uuid, date, body "
+                sql = "SELECT uuid, date, note_text(body) "
                         "FROM notes "
                         "WHERE id = "
                         "(SELECT links.b_id "
@@ -1007,7 +1947,7 @@ links(sqlite3 *db, const char *uuid)
         char *sql2;
 
         if (!strcmp(uuid, "head")) {
-                sql2 = "SELECT uuid, date, body "
+                sql2 = "SELECT uuid, date, note_text(body) "
                         "FROM notes "
                         "WHERE id = "
                         "(SELECT links.a_id "
@@ -1021,7 +1961,7 @@ links(sqlite3 *db, const char *uuid)
                         "ORDER BY notes.date DESC "
                         "LIMIT 1));";
         } else if (!strcmp(uuid, "tail")) {
-                sql2 = "SELECT uuid, date, body "
+                sql2 = "SELECT uuid, date, note_text(body) "
                         "FROM notes "
                         "WHERE id = "
                         "(SELECT links.a_id "
@@ -1035,7 +1975,7 @@ links(sqlite3 *db, const char *uuid)
                         "ORDER BY notes.date ASC "
                         "LIMIT 1));";
         } else {
-                sql2 = "SELECT uuid, date, body "
+                sql2 = "SELECT uuid, date, note_text(body) "
                         "FROM notes "
                         "WHERE id = "
                         "(SELECT links.a_id "
@@ -1196,6 +2136,59 @@ tag(sqlite3 *db, const char *uuid, const char *tag_body)
         return rc;
 }
 
+int
+tag_many(sqlite3 *db, const char *search_type, const char *search_word, const char *tag_body)
+{
+        sqlite3_stmt *stmt;
+        char *sql[] = {
+                "INSERT OR IGNORE INTO tags(body) VALUES(?1);",
+                "INSERT INTO note_tags(note_id, tag_id) "
+                "SELECT bulk_notes.id, tags.id FROM temp.bulk_notes, tags "
+                "WHERE tags.body = ?1 AND NOT EXISTS "
+                "(SELECT 1 FROM note_tags WHERE note_id = bulk_notes.id AND tag_id = tags.id);",
+        };
+
+        int rc = sql_exec(db, "BEGIN;");
+        if (rc != SQLITE_OK)
+                return rc;
+
+        rc = bulk_select(db, search_type, search_word);
+        if (rc != SQLITE_OK)
+                goto rollback;
+
+        for (size_t i = 0; i < sizeof(sql) / sizeof(sql[0]); i++) {
+                rc = sqlite3_prepare_v2(db, sql[i], -1, &stmt, 0);
+
+                if (rc != SQLITE_OK) {
+                        fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                        goto rollback;
+                }
+
+                sqlite3_bind_text(stmt, 1, tag_body, strlen(tag_body), SQLITE_STATIC);
+
+                rc = sqlite3_step(stmt);
+                sqlite3_finalize(stmt);
+
+                if (rc != SQLITE_DONE) {
+                        fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+                        goto rollback;
+                }
+        }
+
+        int tagged = sqlite3_changes(db);
+
+        rc = sql_exec(db, "COMMIT;");
+        if (rc != SQLITE_OK)
+                goto rollback;
+
+        printf("Tagged %d notes\n", tagged);
+        return SQLITE_OK;
+
+rollback:
+        sql_exec(db, "ROLLBACK;");
+        return rc;
+}
+
 int
 tags(sqlite3 *db, const char *uuid)
 {
@@ -1253,46 +2246,328 @@ tags(sqlite3 *db, const char *uuid)
                                 "ON notes.id = note_tags.note_id "
                                 "WHERE notes.uuid = ?;";
 
-                        rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
+                        rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
+
+                        if (rc != SQLITE_OK) {
+                                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                                return rc;
+                        }
+
+                        sqlite3_bind_text(stmt, 1, uuid, strlen(uuid), SQLITE_STATIC);
+                }
+        } else {
+                sql = "SELECT tags.body FROM tags;";
+
+                rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
+
+                if (rc != SQLITE_OK) {
+                        fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                        return rc;
+                }
+
+        }
+
+        while(1) {
+
+                rc = sqlite3_step(stmt);
+
+                if (rc == SQLITE_DONE) {
+                        break;
+                }
+
+                if (rc != SQLITE_ROW) {
+                        fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+                        return rc;
+                }
+
+                printf("%s\n", (char *)sqlite3_column_text(stmt, 0));
+
+        }
+
+        sqlite3_finalize(stmt);
+
+        return rc;
+}
+
+int
+tag_tree(sqlite3 *db)
+{
+        // Sort '/' below every other byte so children follow their parent
+        char *sql = "SELECT body FROM tags ORDER BY replace(body, '/', char(1));";
+        char *count_sql = "SELECT count(DISTINCT note_tags.note_id) FROM tags "
+                "INNER JOIN note_tags ON note_tags.tag_id = tags.id "
+                "WHERE " TAG_SUBTREE ";";
+
+        sqlite3_stmt *stmt, *count;
+        int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
+
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                return rc;
+        }
+
+        rc = sqlite3_prepare_v2(db, count_sql, -1, &count, 0);
+
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                sqlite3_finalize(stmt);
+                return rc;
+        }
+
+        char *prev = NULL;
+
+        while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+                const char *body = (const char *)sqlite3_column_text(stmt, 0);
+                size_t len = strlen(body);
+                size_t start = 0, same = 0;
+                int depth = 0;
+
+                // Skip the path components shared with the previous tag
+                if (prev) {
+                        size_t i = 0;
+                        while (body[i] && body[i] == prev[i]) {
+                                if (body[i] == '/')
+                                        same = i + 1;
+                                i++;
+                        }
+                        if (body[i] == '/' && !prev[i])
+                                same = i + 1;
+                }
+
+                for (size_t i = 0; i <= len; i++) {
+                        if (body[i] != '/' && body[i] != '\0')
+                                continue;
+
+                        if (i >= same) {
+                                sqlite3_bind_text(count, 1, body, i, SQLITE_TRANSIENT);
+                                rc = sqlite3_step(count);
+                                if (rc != SQLITE_ROW) {
+                                        fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+                                        goto end;
+                                }
+
+                                printf("%*s%.*s (%d)\n", depth * 2, "", (int)(i - start),
+                                       body + start, sqlite3_column_int(count, 0));
+                                sqlite3_reset(count);
+                        }
+
+                        start = i + 1;
+                        depth++;
+                }
+
+                free(prev);
+                prev = strdup(body);
+                if (!prev) {
+                        rc = SQLITE_NOMEM;
+                        goto end;
+                }
+        }
+
+        if (rc != SQLITE_DONE) {
+                fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+                goto end;
+        }
+
+        rc = SQLITE_OK;
+
+end:
+        free(prev);
+        sqlite3_finalize(count);
+        sqlite3_finalize(stmt);
+        return rc;
+}
+
+int
+tag_counts(sqlite3 *db, int sorted)
+{
+        char *sql = sorted ?
+                "SELECT tags.body, coalesce(tag_counts.notes, 0) AS notes FROM tags "
+                "LEFT JOIN tag_counts ON tag_counts.tag_id = tags.id "
+                "ORDER BY notes DESC, tags.body;" :
+                "SELECT tags.body, coalesce(tag_counts.notes, 0) FROM tags "
+                "LEFT JOIN tag_counts ON tag_counts.tag_id = tags.id "
+                "ORDER BY tags.body;";
+
+        sqlite3_stmt *stmt;
+        int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
+
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                return rc;
+        }
+
+        while ((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+                printf("%6d %s\n", sqlite3_column_int(stmt, 1),
+                       (const char *)sqlite3_column_text(stmt, 0));
+
+        if (rc != SQLITE_DONE) {
+                fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+                sqlite3_finalize(stmt);
+                return rc;
+        }
+
+        sqlite3_finalize(stmt);
+        return SQLITE_OK;
+}
+
+static int
+cmp_int64(const void *a, const void *b)
+{
+        sqlite3_int64 x = *(const sqlite3_int64 *)a, y = *(const sqlite3_int64 *)b;
+        return (x > y) - (x < y);
+}
+
+int
+tag_cooccurrence(sqlite3 *db, int top)
+{
+        char *top_sql = "SELECT tag_counts.tag_id, tags.body FROM tag_counts "
+                "INNER JOIN tags ON tags.id = tag_counts.tag_id "
+                "WHERE tag_counts.notes > 0 "
+                "ORDER BY tag_counts.notes DESC, tag_counts.tag_id LIMIT ?;";
+        // Every tagging of the top tags, grouped by note, read in one pass
+        char *pairs_sql = "SELECT note_id, tag_id FROM note_tags WHERE tag_id IN "
+                "(SELECT tag_id FROM tag_counts WHERE notes > 0 "
+                "ORDER BY notes DESC, tag_id LIMIT ?) "
+                "ORDER BY note_id, tag_id;";
+
+        sqlite3_stmt *stmt = NULL;
+        sqlite3_int64 *ids = NULL, *sorted = NULL;
+        char **names = NULL;
+        int *slot = NULL, *matrix = NULL, *cur = NULL;
+        int n = 0, rc;
+
+        if (top <= 0) {
+                fprintf(stderr, "Number of tags must be positive\n");
+                return SQLITE_MISUSE;
+        }
+
+        ids = malloc(top * sizeof(*ids));
+        names = calloc(top, sizeof(*names));
+        if (!ids || !names) {
+                rc = SQLITE_NOMEM;
+                goto end;
+        }
+
+        rc = sqlite3_prepare_v2(db, top_sql, -1, &stmt, 0);
+
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                goto end;
+        }
+
+        sqlite3_bind_int(stmt, 1, top);
+
+        while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+                ids[n] = sqlite3_column_int64(stmt, 0);
+                names[n] = strdup((const char *)sqlite3_column_text(stmt, 1));
+                if (!names[n]) {
+                        rc = SQLITE_NOMEM;
+                        goto end;
+                }
+                n++;
+        }
+
+        if (rc != SQLITE_DONE) {
+                fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+                goto end;
+        }
+
+        sqlite3_finalize(stmt);
+        stmt = NULL;
+        rc = SQLITE_OK;
 
-                        if (rc != SQLITE_OK) {
-                                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
-                                return rc;
-                        }
+        if (n == 0)
+                goto end;
 
-                        sqlite3_bind_text(stmt, 1, uuid, strlen(uuid), SQLITE_STATIC);
-                }
-        } else {
-                sql = "SELECT tags.body FROM tags;";
+        // Tag ids sorted for lookup, with slot[] giving each one's row
+        sorted = malloc(n * 2 * sizeof(*sorted));
+        slot = malloc(n * sizeof(*slot));
+        matrix = calloc((size_t)n * n, sizeof(*matrix));
+        cur = malloc(n * sizeof(*cur));
+        if (!sorted || !slot || !matrix || !cur) {
+                rc = SQLITE_NOMEM;
+                goto end;
+        }
 
-                rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
+        for (int i = 0; i < n; i++) {
+                sorted[2 * i] = ids[i];
+                sorted[2 * i + 1] = i;
+        }
+        qsort(sorted, n, 2 * sizeof(*sorted), cmp_int64);
+        for (int i = 0; i < n; i++) {
+                slot[i] = sorted[2 * i + 1];
+                sorted[i] = sorted[2 * i];
+        }
 
-                if (rc != SQLITE_OK) {
-                        fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
-                        return rc;
-                }
+        rc = sqlite3_prepare_v2(db, pairs_sql, -1, &stmt, 0);
 
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                goto end;
         }
 
-        while(1) {
+        sqlite3_bind_int(stmt, 1, top);
 
-                rc = sqlite3_step(stmt);
+        sqlite3_int64 note = -1, last_tag = -1;
+        int k = 0;
 
-                if (rc == SQLITE_DONE) {
-                        break;
+        while (1) {
+                rc = sqlite3_step(stmt);
+                if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+                        fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+                        goto end;
                 }
 
-                if (rc != SQLITE_ROW) {
-                        fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
-                        return rc;
+                sqlite3_int64 note_id = rc == SQLITE_ROW ? sqlite3_column_int64(stmt, 0) : -1;
+
+                // Count every pair of top tags on the finished note
+                if (note_id != note || rc == SQLITE_DONE) {
+                        for (int i = 0; i < k; i++)
+                                for (int j = 0; j < k; j++)
+                                        matrix[cur[i] * n + cur[j]]++;
+                        note = note_id;
+                        last_tag = -1;
+                        k = 0;
                 }
 
-                printf("%s\n", (char *)sqlite3_column_text(stmt, 0));
+                if (rc == SQLITE_DONE)
+                        break;
+
+                sqlite3_int64 tag_id = sqlite3_column_int64(stmt, 1);
+                if (tag_id == last_tag)
+                        continue;
+                last_tag = tag_id;
 
+                sqlite3_int64 *hit = bsearch(&tag_id, sorted, n, sizeof(*sorted), cmp_int64);
+                if (hit)
+                        cur[k++] = slot[hit - sorted];
         }
 
-        sqlite3_finalize(stmt);
+        rc = SQLITE_OK;
 
+        printf("%-24s", "");
+        for (int j = 0; j < n; j++)
+                printf(" %6d", j + 1);
+        printf("\n");
+
+        for (int i = 0; i < n; i++) {
+                printf("%3d %-20.20s", i + 1, names[i]);
+                for (int j = 0; j < n; j++)
+                        printf(" %6d", matrix[i * n + j]);
+                printf("\n");
+        }
+
+end:
+        sqlite3_finalize(stmt);
+        if (names)
+                for (int i = 0; i < n; i++)
+                        free(names[i]);
+        free(names);
+        free(ids);
+        free(sorted);
+        free(slot);
+        free(matrix);
+        free(cur);
         return rc;
 }
 
@@ -1736,15 +3011,290 @@ diff(sqlite3 *db, const char *path)
                 sqlite3_free(err_msg);
         }
 
+        printf("attachments diff:\n");
+
+        rc = diff_attachments(db, db2);
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Failed to query attachments\n");
+        }
+
 end:
         sqlite3_close(db2);
         return rc;
 }
 
+struct merge_notes {
+        sqlite3 *db;
+        const char *path;
+        double near_threshold;
+        // Parents of a note in the other database, NULL if it keeps none
+        sqlite3_stmt *parents;
+};
+
+// How the body of a note here relates to its body in the other database
+enum ancestry {
+        UNRELATED,
+        OURS_NEWER,
+        THEIRS_NEWER,
+        CONCURRENT,
+};
+
+// Copy the parents of note uuid from the other database
+static int
+import_parents(struct merge_notes *merge, sqlite3_int64 id, const char *uuid)
+{
+        sqlite3 *db = merge->db;
+
+        if (!merge->parents)
+                return SQLITE_OK;
+
+        sqlite3_stmt *insert;
+        int rc = sqlite3_prepare_v2(db, "INSERT OR IGNORE INTO note_parents(note_id, hash, parent) "
+                                    "VALUES(?, ?, ?);", -1, &insert, 0);
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                return rc;
+        }
+
+        sqlite3_bind_text(merge->parents, 1, uuid, strlen(uuid), SQLITE_STATIC);
+        sqlite3_bind_int64(insert, 1, id);
+
+        while ((rc = sqlite3_step(merge->parents)) == SQLITE_ROW) {
+                sqlite3_bind_value(insert, 2, sqlite3_column_value(merge->parents, 0));
+                sqlite3_bind_value(insert, 3, sqlite3_column_value(merge->parents, 1));
+
+                rc = sqlite3_step(insert);
+                sqlite3_reset(insert);
+                if (rc != SQLITE_DONE) {
+                        fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+                        goto end;
+                }
+        }
+
+        if (rc != SQLITE_DONE) {
+                fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(sqlite3_db_handle(merge->parents)));
+                goto end;
+        }
+
+        rc = SQLITE_OK;
+end:
+        sqlite3_reset(merge->parents);
+        sqlite3_finalize(insert);
+        return rc;
+}
+
+// Walk the parents of both bodies of note id. For concurrent edits *base
+// is the newest saved version both descend from, 0 if there is none.
+static int
+note_ancestry(sqlite3 *db, sqlite3_int64 id, const char *ours, const char *theirs,
+              enum ancestry *relation, int *base)
+{
+        const char *sql = "WITH RECURSIVE "
+                "ours(hash) AS (SELECT ?2 UNION SELECT note_parents.parent FROM note_parents, ours "
+                "WHERE note_parents.note_id = ?1 AND note_parents.hash = ours.hash), "
+                "theirs(hash) AS (SELECT ?3 UNION SELECT note_parents.parent FROM note_parents, theirs "
+                "WHERE note_parents.note_id = ?1 AND note_parents.hash = theirs.hash) "
+                "SELECT ?3 IN (SELECT hash FROM ours), ?2 IN (SELECT hash FROM theirs), "
+                "EXISTS (SELECT hash FROM ours INTERSECT SELECT hash FROM theirs), "
+                "(SELECT ifnull(max(version), 0) FROM note_versions WHERE note_id = ?1 "
+                "AND hash IN (SELECT hash FROM ours) AND hash IN (SELECT hash FROM theirs));";
+
+        sqlite3_stmt *stmt;
+        int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                return rc;
+        }
+
+        sqlite3_bind_int64(stmt, 1, id);
+        sqlite3_bind_text(stmt, 2, ours, strlen(ours), SQLITE_STATIC);
+        sqlite3_bind_text(stmt, 3, theirs, strlen(theirs), SQLITE_STATIC);
+
+        rc = sqlite3_step(stmt);
+        if (rc != SQLITE_ROW) {
+                fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+                sqlite3_finalize(stmt);
+                return rc;
+        }
+
+        if (sqlite3_column_int(stmt, 0))
+                *relation = OURS_NEWER;
+        else if (sqlite3_column_int(stmt, 1))
+                *relation = THEIRS_NEWER;
+        else if (sqlite3_column_int(stmt, 2))
+                *relation = CONCURRENT;
+        else
+                *relation = UNRELATED;
+
+        *base = sqlite3_column_int(stmt, 3);
+
+        sqlite3_finalize(stmt);
+        return SQLITE_OK;
+}
+
+// Save the body of note id as a version and replace it. A NULL date
+// means now.
+int
+replace_body(sqlite3 *db, sqlite3_int64 id, const char *body, size_t len, const char *hash,
+             const char *date)
+{
+        int rc = save_version(db, id, body, len);
+        if (rc != SQLITE_OK)
+                return rc;
+
+        sqlite3_stmt *stmt;
+        rc = sqlite3_prepare_v2(db, "UPDATE notes SET body = ?, hash = ?, date = ifnull(?, datetime()) "
+                                "WHERE id = ?;", -1, &stmt, 0);
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                return rc;
+        }
+
+        bind_note_body(db, stmt, 1, body, len);
+        sqlite3_bind_text(stmt, 2, hash, strlen(hash), SQLITE_STATIC);
+        if (date)
+                sqlite3_bind_text(stmt, 3, date, strlen(date), SQLITE_STATIC);
+        sqlite3_bind_int64(stmt, 4, id);
+
+        rc = sqlite3_step(stmt);
+        if (rc != SQLITE_DONE) {
+                fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+                sqlite3_finalize(stmt);
+                return rc;
+        }
+
+        sqlite3_finalize(stmt);
+        return SQLITE_OK;
+}
+
+static int
+add_parent(sqlite3 *db, sqlite3_int64 id, const char *hash, const char *parent)
+{
+        sqlite3_stmt *stmt;
+        int rc = sqlite3_prepare_v2(db, "INSERT OR IGNORE INTO note_parents(note_id, hash, parent) "
+                                    "VALUES(?, ?, ?);", -1, &stmt, 0);
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                return rc;
+        }
+
+        sqlite3_bind_int64(stmt, 1, id);
+        sqlite3_bind_text(stmt, 2, hash, strlen(hash), SQLITE_STATIC);
+        sqlite3_bind_text(stmt, 3, parent, strlen(parent), SQLITE_STATIC);
+
+        rc = sqlite3_step(stmt);
+        sqlite3_finalize(stmt);
+        if (rc != SQLITE_DONE) {
+                fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+                return rc;
+        }
+
+        return SQLITE_OK;
+}
+
+int
+add_conflict(sqlite3 *db, sqlite3_int64 id, int hunks, const char *other)
+{
+        sqlite3_stmt *stmt;
+        int rc = sqlite3_prepare_v2(db, "INSERT OR REPLACE INTO conflicts(note_id, hunks, other) "
+                                    "VALUES(?, ?, ?);", -1, &stmt, 0);
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                return rc;
+        }
+
+        sqlite3_bind_int64(stmt, 1, id);
+        sqlite3_bind_int(stmt, 2, hunks);
+        sqlite3_bind_text(stmt, 3, other, strlen(other), SQLITE_STATIC);
+
+        rc = sqlite3_step(stmt);
+        sqlite3_finalize(stmt);
+        if (rc != SQLITE_DONE) {
+                fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+                return rc;
+        }
+
+        return SQLITE_OK;
+}
+
+// Both sides edited note id since version base: merge their changes.
+// The merged body has both bodies as parents. A base of 0 means the body
+// they both came from was not kept here, so the merge starts from an
+// empty base and whatever differs is left as a conflict.
+static int
+merge_concurrent(struct merge_notes *merge, sqlite3_int64 id, const char *uuid, int base,
+                 const char *ours, const char *theirs, const char *body)
+{
+        sqlite3 *db = merge->db;
+        char *base_body = NULL, *our_body = NULL, *merged = NULL;
+        size_t base_len, our_len, merged_len;
+        int conflicts;
+
+        int rc = SQLITE_OK;
+        if (base)
+                rc = read_version(db, id, base, &base_body, &base_len);
+        if (rc == SQLITE_OK)
+                rc = read_version(db, id, 0, &our_body, &our_len);
+        if (rc != SQLITE_OK)
+                goto end;
+
+        merged = merge3(base ? base_body : "", base ? base_len : 0, our_body, our_len, body, strlen(body),
+                        merge->path, &merged_len, &conflicts);
+        if (!merged) {
+                fprintf(stderr, "Cannot merge note: out of memory\n");
+                rc = SQLITE_NOMEM;
+                goto end;
+        }
+
+        char hash[SHA256_HEX_LENGTH + 1];
+        if (sha256_hex(merged, merged_len, hash) != 0) {
+                fprintf(stderr, "Cannot hash note\n");
+                rc = SQLITE_ERROR;
+                goto end;
+        }
+
+        // Their changes are already here
+        if (!strcmp(hash, ours)) {
+                rc = add_parent(db, id, ours, theirs);
+                goto end;
+        }
+
+        rc = sql_exec(db, "SAVEPOINT merge_note;");
+        if (rc != SQLITE_OK)
+                goto end;
+
+        rc = replace_body(db, id, merged, merged_len, hash, NULL);
+        if (rc == SQLITE_OK)
+                rc = add_parent(db, id, hash, theirs);
+        if (rc == SQLITE_OK && conflicts)
+                rc = add_conflict(db, id, conflicts, merge->path);
+
+        if (rc != SQLITE_OK) {
+                sql_exec(db, "ROLLBACK TO merge_note; RELEASE merge_note;");
+                goto end;
+        }
+
+        rc = sql_exec(db, "RELEASE merge_note;");
+        if (rc != SQLITE_OK)
+                goto end;
+
+        if (conflicts)
+                printf("Conflict: %s (%d hunks)\n", uuid, conflicts);
+        else
+                printf("Merged: %s\n", uuid);
+
+end:
+        free(base_body);
+        free(our_body);
+        free(merged);
+        return rc;
+}
+
 static int
 merge_notes_callback(void *data, int argc, char **argv, char **col_names)
 {
-        sqlite3 *db = (sqlite3 *)data;
+        struct merge_notes *merge = data;
+        sqlite3 *db = merge->db;
 
         char *uuid = argv[0];
         char *hash = argv[1];
@@ -1754,7 +3304,7 @@ merge_notes_callback(void *data, int argc, char **argv, char **col_names)
 
         int date_int = atoi(date_temp);
 
-        char *sql = "SELECT hash, unixepoch(date) FROM notes WHERE uuid = ? LIMIT 1;";
+        char *sql = "SELECT hash, unixepoch(date), id FROM notes WHERE uuid = ? LIMIT 1;";
         sqlite3_stmt *stmt;
         int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
         if (rc != SQLITE_OK) {
@@ -1767,6 +3317,14 @@ merge_notes_callback(void *data, int argc, char **argv, char **col_names)
         rc = sqlite3_step(stmt);
 
         if (rc == SQLITE_DONE) {
+                sqlite3_finalize(stmt);
+
+                if (merge->near_threshold > 0) {
+                        rc = near_dupes_of(db, uuid, body, merge->near_threshold);
+                        if (rc != SQLITE_OK)
+                                return rc;
+                }
+
                 sql = "INSERT INTO notes (uuid, hash, body, date) VALUES (?, ?, ?, ?);";
                 sqlite3_stmt *stmt2;
                 rc = sqlite3_prepare_v2(db, sql, -1, &stmt2, 0);
@@ -1777,7 +3335,7 @@ merge_notes_callback(void *data, int argc, char **argv, char **col_names)
 
                 sqlite3_bind_text(stmt2, 1, uuid, strlen(uuid), SQLITE_STATIC);
                 sqlite3_bind_text(stmt2, 2, hash, strlen(hash), SQLITE_STATIC);
-                sqlite3_bind_text(stmt2, 3, body, strlen(body), SQLITE_STATIC);
+                bind_note_body(db, stmt2, 3, body, strlen(body));
                 sqlite3_bind_text(stmt2, 4, date, strlen(date), SQLITE_STATIC);
 
                 rc = sqlite3_step(stmt2);
@@ -1787,46 +3345,54 @@ merge_notes_callback(void *data, int argc, char **argv, char **col_names)
                 }
 
                 sqlite3_finalize(stmt2);
-                return SQLITE_OK;
+                return import_parents(merge, sqlite3_last_insert_rowid(db), uuid);
 
         } else if (rc == SQLITE_ROW) {
-                char *hash2 = (char *)sqlite3_column_text(stmt, 0);
-                char *date_temp2 = (char *)sqlite3_column_text(stmt, 1);
+                char hash2[SHA256_HEX_LENGTH + 1];
+                snprintf(hash2, sizeof(hash2), "%s", (char *)sqlite3_column_text(stmt, 0));
+                int date_int2 = sqlite3_column_int(stmt, 1);
+                sqlite3_int64 id = sqlite3_column_int64(stmt, 2);
 
-                int date_int2 = atoi(date_temp2);
+                sqlite3_finalize(stmt);
 
                 // Hashes are equivalent
                 if (!strcmp(hash, hash2)) {
                         return SQLITE_OK;
-                } else if (date_int2 >= date_int) {
-                        return SQLITE_OK;
-                } else {
-
-                        sql = "UPDATE notes SET body = ?, hash = ?, date = ? WHERE uuid = ?;";
+                }
 
-                        sqlite3_stmt *stmt2;
-                        rc = sqlite3_prepare_v2(db, sql, -1, &stmt2, 0);
-                        if (rc != SQLITE_OK) {
-                                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
-                                return rc;
-                        }
+                rc = import_parents(merge, id, uuid);
+                if (rc != SQLITE_OK)
+                        return rc;
 
-                        sqlite3_bind_text(stmt2, 1, body, strlen(body), SQLITE_STATIC);
-                        sqlite3_bind_text(stmt2, 2, hash, strlen(hash), SQLITE_STATIC);
-                        sqlite3_bind_text(stmt2, 3, date, strlen(date), SQLITE_STATIC);        
-                        sqlite3_bind_text(stmt2, 4, uuid, strlen(uuid), SQLITE_STATIC);
+                enum ancestry relation = UNRELATED;
+                int base = 0;
+                rc = note_ancestry(db, id, hash2, hash, &relation, &base);
+                if (rc != SQLITE_OK)
+                        return rc;
 
-                        rc = sqlite3_step(stmt2);
-                        if (rc != SQLITE_DONE) {
-                                fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
-                                return rc;
-                        }
+                if (relation == CONCURRENT)
+                        return merge_concurrent(merge, id, uuid, base, hash2, hash, body);
 
-                        sqlite3_finalize(stmt2);
+                // Without history to go by the newer note wins
+                if (relation == OURS_NEWER || (relation != THEIRS_NEWER && date_int2 >= date_int)) {
                         return SQLITE_OK;
                 }
+
+                rc = sql_exec(db, "SAVEPOINT merge_note;");
+                if (rc != SQLITE_OK)
+                        return rc;
+
+                rc = replace_body(db, id, body, strlen(body), hash, date);
+                if (rc != SQLITE_OK) {
+                        sql_exec(db, "ROLLBACK TO merge_note; RELEASE merge_note;");
+                        return rc;
+                }
+
+                return sql_exec(db, "RELEASE merge_note;");
         }
 
+        fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+        sqlite3_finalize(stmt);
         return rc;
 }
 
@@ -2024,11 +3590,12 @@ merge_inbox_callback(void *data, int argc, char **argv, char **col_names)
 }
 
 int
-merge(sqlite3 *db, const char *path)
+merge(sqlite3 *db, const char *path, double near_threshold)
 {
         sqlite3 *db2;
         int rc = 1;
         char *err_msg = NULL;
+        struct merge_notes notes = { db, path, near_threshold, NULL };
 
         rc = sqlite3_open_v2(path, &db2, SQLITE_OPEN_READONLY, NULL);
         if (rc != SQLITE_OK) {
@@ -2036,9 +3603,25 @@ merge(sqlite3 *db, const char *path)
                 goto end;
         }
 
+        rc = register_note_text(db2);
+        if (rc != SQLITE_OK)
+                goto end;
+
+        // Databases from before note_parents have no ancestry to merge by
+        sqlite3_prepare_v2(db2, "SELECT note_parents.hash, note_parents.parent FROM note_parents "
+                           "INNER JOIN notes ON notes.id = note_parents.note_id "
+                           "WHERE notes.uuid = ?;", -1, &notes.parents, 0);
+
+        // Incoming notes are compared with the sketches of existing ones
+        if (near_threshold > 0) {
+                rc = sketch_refresh(db);
+                if (rc != SQLITE_OK)
+                        goto end;
+        }
+
         // merge notes
-        char *sql = "SELECT uuid, hash, body, date, unixepoch(date) FROM notes;";
-        rc = sqlite3_exec(db2, sql, merge_notes_callback, db, &err_msg);
+        char *sql = "SELECT uuid, hash, note_text(body), date, unixepoch(date) FROM notes;";
+        rc = sqlite3_exec(db2, sql, merge_notes_callback, &notes, &err_msg);
         if (rc != SQLITE_OK) {
                 fprintf(stderr, "Failed to merge notes\n");
                 fprintf(stderr, "SQL Error: %s\n", err_msg);
@@ -2086,7 +3669,46 @@ merge(sqlite3 *db, const char *path)
                 sqlite3_free(err_msg);
         }
 
+        // merge attachments, copying only contents missing here
+        rc = merge_attachments(db, db2);
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Failed to merge attachments\n");
+        }
+
 end:
+        sqlite3_finalize(notes.parents);
         sqlite3_close(db2);
         return rc;
 }
+
+int
+conflicts(sqlite3 *db)
+{
+        char *sql = "SELECT notes.uuid, conflicts.date, conflicts.hunks, conflicts.other "
+                "FROM conflicts "
+                "INNER JOIN notes ON notes.id = conflicts.note_id "
+                "ORDER BY conflicts.date;";
+
+        sqlite3_stmt *stmt;
+        int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
+
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                return rc;
+        }
+
+        while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+                printf("%s - %s - %d hunks from %s\n", sqlite3_column_text(stmt, 0),
+                       sqlite3_column_text(stmt, 1), sqlite3_column_int(stmt, 2),
+                       sqlite3_column_text(stmt, 3));
+        }
+
+        if (rc != SQLITE_DONE) {
+                fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+                sqlite3_finalize(stmt);
+                return rc;
+        }
+
+        sqlite3_finalize(stmt);
+        return SQLITE_OK;
+}
@@ -0,0 +1,611 @@
+#include <stdio.h>
+#include <sqlite3.h>
+#include <stdlib.h>
+#include <string.h>
+#include "app.h"
+#include "hash.h"
+#include "attach.h"
+
+/*
+ * Attachments are files kept with a note. Their contents live in blobs,
+ * one row per SHA-256, so a file attached to many notes or merged in from
+ * many databases is stored once, and merging copies only contents whose
+ * hash is missing. Contents are streamed CHUNK bytes at a time through
+ * incremental blob I/O, so a large file is never held in memory.
+ */
+#define CHUNK (64 << 10)
+
+static int
+read_file_chunk(void *src, void *buf, int n, sqlite3_int64 offset)
+{
+        return fread(buf, 1, n, src) == (size_t)n ? 0 : -1;
+}
+
+static int
+read_blob_chunk(void *src, void *buf, int n, sqlite3_int64 offset)
+{
+        return sqlite3_blob_read(src, buf, n, offset) == SQLITE_OK ? 0 : -1;
+}
+
+static int
+hash_file(FILE *f, char hash[SHA256_HEX_LENGTH + 1], sqlite3_int64 *size)
+{
+        char *buf = malloc(CHUNK);
+        struct sha256_stream *sum = sha256_begin();
+        int rc = -1;
+
+        if (!buf || !sum) {
+                if (sum)
+                        sha256_end(sum, hash);
+                free(buf);
+                return -1;
+        }
+
+        size_t n;
+        *size = 0;
+        while ((n = fread(buf, 1, CHUNK, f)) > 0) {
+                if (sha256_update(sum, buf, n))
+                        break;
+                *size += n;
+        }
+
+        if (!ferror(f) && feof(f))
+                rc = 0;
+        if (sha256_end(sum, hash))
+                rc = -1;
+
+        free(buf);
+        return rc;
+}
+
+// Look up the blob holding hash, *id 0 if there is none
+static int
+find_blob(sqlite3 *db, const char *hash, sqlite3_int64 *id)
+{
+        sqlite3_stmt *stmt;
+        int rc = sqlite3_prepare_v2(db, "SELECT id FROM blobs WHERE hash = ?;", -1, &stmt, 0);
+
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                return rc;
+        }
+
+        sqlite3_bind_text(stmt, 1, hash, strlen(hash), SQLITE_STATIC);
+
+        rc = sqlite3_step(stmt);
+        *id = rc == SQLITE_ROW ? sqlite3_column_int64(stmt, 0) : 0;
+        sqlite3_finalize(stmt);
+
+        if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+                fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+                return rc;
+        }
+
+        return SQLITE_OK;
+}
+
+// Store size bytes read in order from src as the blob for hash. The bytes
+// are hashed on the way in, so a file that changed since it was hashed
+// is refused.
+static int
+store_blob(sqlite3 *db, const char *hash, sqlite3_int64 size,
+           int (*next)(void *src, void *buf, int n, sqlite3_int64 offset), void *src,
+           sqlite3_int64 *id)
+{
+        if (size > sqlite3_limit(db, SQLITE_LIMIT_LENGTH, -1)) {
+                fprintf(stderr, "Attachment too large: %lld bytes\n", (long long)size);
+                return SQLITE_TOOBIG;
+        }
+
+        sqlite3_stmt *stmt;
+        int rc = sqlite3_prepare_v2(db, "INSERT INTO blobs(hash, size, data) VALUES(?, ?, zeroblob(?));",
+                                    -1, &stmt, 0);
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                return rc;
+        }
+
+        sqlite3_bind_text(stmt, 1, hash, strlen(hash), SQLITE_STATIC);
+        sqlite3_bind_int64(stmt, 2, size);
+        sqlite3_bind_int64(stmt, 3, size);
+
+        rc = sqlite3_step(stmt);
+        sqlite3_finalize(stmt);
+        if (rc != SQLITE_DONE) {
+                fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+                return rc;
+        }
+
+        *id = sqlite3_last_insert_rowid(db);
+
+        sqlite3_blob *blob;
+        rc = sqlite3_blob_open(db, "main", "blobs", "data", *id, 1, &blob);
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot open blob: %s\n", sqlite3_errmsg(db));
+                return rc;
+        }
+
+        char *buf = malloc(CHUNK);
+        struct sha256_stream *sum = sha256_begin();
+        char check[SHA256_HEX_LENGTH + 1];
+
+        if (!buf || !sum) {
+                fprintf(stderr, "Cannot store attachment: out of memory\n");
+                rc = SQLITE_NOMEM;
+                goto end;
+        }
+
+        for (sqlite3_int64 offset = 0; offset < size; offset += CHUNK) {
+                int n = size - offset < CHUNK ? size - offset : CHUNK;
+
+                if (next(src, buf, n, offset)) {
+                        fprintf(stderr, "Cannot read attachment\n");
+                        rc = SQLITE_IOERR;
+                        goto end;
+                }
+
+                sha256_update(sum, buf, n);
+
+                rc = sqlite3_blob_write(blob, buf, n, offset);
+                if (rc != SQLITE_OK) {
+                        fprintf(stderr, "Cannot write blob: %s\n", sqlite3_errmsg(db));
+                        goto end;
+                }
+        }
+
+        rc = sha256_end(sum, check) == 0 ? SQLITE_OK : SQLITE_ERROR;
+        sum = NULL;
+        if (rc == SQLITE_OK && strcmp(check, hash)) {
+                fprintf(stderr, "Attachment changed while it was stored\n");
+                rc = SQLITE_MISMATCH;
+        }
+
+end:
+        if (sum)
+                sha256_end(sum, check);
+        free(buf);
+        sqlite3_blob_close(blob);
+        return rc;
+}
+
+// Attach blob_id to note_id as name, replacing the file of that name. A
+// NULL date means now.
+static int
+link_attachment(sqlite3 *db, sqlite3_int64 note_id, sqlite3_int64 blob_id, const char *name,
+                const char *date)
+{
+        sqlite3_stmt *stmt;
+        int rc = sqlite3_prepare_v2(db, "INSERT INTO attachments(note_id, blob_id, name, date) "
+                                    "VALUES(?, ?, ?, ifnull(?, CURRENT_TIMESTAMP)) "
+                                    "ON CONFLICT(note_id, name) DO UPDATE SET "
+                                    "blob_id = excluded.blob_id, date = excluded.date;", -1, &stmt, 0);
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                return rc;
+        }
+
+        sqlite3_bind_int64(stmt, 1, note_id);
+        sqlite3_bind_int64(stmt, 2, blob_id);
+        sqlite3_bind_text(stmt, 3, name, strlen(name), SQLITE_STATIC);
+        if (date)
+                sqlite3_bind_text(stmt, 4, date, strlen(date), SQLITE_STATIC);
+
+        rc = sqlite3_step(stmt);
+        sqlite3_finalize(stmt);
+        if (rc != SQLITE_DONE) {
+                fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+                return rc;
+        }
+
+        return SQLITE_OK;
+}
+
+int
+attach(sqlite3 *db, const char *uuid, const char *path)
+{
+        sqlite3_int64 note_id;
+        int rc = resolve_note_id(db, uuid, &note_id);
+        if (rc != SQLITE_OK)
+                return rc;
+
+        FILE *f = fopen(path, "rb");
+        if (!f) {
+                fprintf(stderr, "No file found at: %s\n", path);
+                return 1;
+        }
+
+        char hash[SHA256_HEX_LENGTH + 1];
+        sqlite3_int64 size;
+        if (hash_file(f, hash, &size) != 0) {
+                fprintf(stderr, "Cannot read %s\n", path);
+                fclose(f);
+                return 1;
+        }
+
+        const char *name = strrchr(path, '/');
+        name = name ? name + 1 : path;
+
+        rc = sql_exec(db, "BEGIN;");
+        if (rc != SQLITE_OK) {
+                fclose(f);
+                return rc;
+        }
+
+        sqlite3_int64 blob_id;
+        rc = find_blob(db, hash, &blob_id);
+        if (rc == SQLITE_OK && !blob_id) {
+                rewind(f);
+                rc = store_blob(db, hash, size, read_file_chunk, f, &blob_id);
+        }
+        fclose(f);
+
+        if (rc == SQLITE_OK)
+                rc = link_attachment(db, note_id, blob_id, name, NULL);
+        if (rc == SQLITE_OK)
+                rc = sql_exec(db, "COMMIT;");
+        if (rc != SQLITE_OK)
+                sql_exec(db, "ROLLBACK;");
+
+        return rc;
+}
+
+int
+attachments(sqlite3 *db, const char *uuid)
+{
+        sqlite3_int64 note_id;
+        int rc = resolve_note_id(db, uuid, &note_id);
+        if (rc != SQLITE_OK)
+                return rc;
+
+        char *sql = "SELECT attachments.name, attachments.date, blobs.size, blobs.hash "
+                "FROM attachments "
+                "INNER JOIN blobs ON blobs.id = attachments.blob_id "
+                "WHERE attachments.note_id = ? "
+                "ORDER BY attachments.name;";
+
+        sqlite3_stmt *stmt;
+        rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                return rc;
+        }
+
+        sqlite3_bind_int64(stmt, 1, note_id);
+
+        while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+                printf("%s - %s - %lld bytes - %s\n", sqlite3_column_text(stmt, 0),
+                       sqlite3_column_text(stmt, 1), sqlite3_column_int64(stmt, 2),
+                       sqlite3_column_text(stmt, 3));
+        }
+
+        if (rc != SQLITE_DONE) {
+                fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+                sqlite3_finalize(stmt);
+                return rc;
+        }
+
+        sqlite3_finalize(stmt);
+        return SQLITE_OK;
+}
+
+int
+save_attachment(sqlite3 *db, const char *uuid, const char *name, const char *path)
+{
+        sqlite3_int64 note_id;
+        int rc = resolve_note_id(db, uuid, &note_id);
+        if (rc != SQLITE_OK)
+                return rc;
+
+        sqlite3_stmt *stmt;
+        rc = sqlite3_prepare_v2(db, "SELECT blobs.id, blobs.size FROM attachments "
+                                "INNER JOIN blobs ON blobs.id = attachments.blob_id "
+                                "WHERE attachments.note_id = ? AND attachments.name = ?;", -1, &stmt, 0);
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                return rc;
+        }
+
+        sqlite3_bind_int64(stmt, 1, note_id);
+        sqlite3_bind_text(stmt, 2, name, strlen(name), SQLITE_STATIC);
+
+        rc = sqlite3_step(stmt);
+        if (rc != SQLITE_ROW) {
+                if (rc == SQLITE_DONE) {
+                        fprintf(stderr, "No attachment %s on %s\n", name, uuid);
+                        rc = SQLITE_NOTFOUND;
+                } else {
+                        fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+                }
+                sqlite3_finalize(stmt);
+                return rc;
+        }
+
+        sqlite3_int64 blob_id = sqlite3_column_int64(stmt, 0);
+        sqlite3_int64 size = sqlite3_column_int64(stmt, 1);
+        sqlite3_finalize(stmt);
+
+        sqlite3_blob *blob;
+        rc = sqlite3_blob_open(db, "main", "blobs", "data", blob_id, 0, &blob);
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot open blob: %s\n", sqlite3_errmsg(db));
+                return rc;
+        }
+
+        FILE *f = fopen(path, "wb");
+        char *buf = malloc(CHUNK);
+        if (!f || !buf) {
+                fprintf(stderr, "Cannot write %s\n", path);
+                rc = 1;
+                goto end;
+        }
+
+        for (sqlite3_int64 offset = 0; offset < size; offset += CHUNK) {
+                int n = size - offset < CHUNK ? size - offset : CHUNK;
+
+                rc = sqlite3_blob_read(blob, buf, n, offset);
+                if (rc != SQLITE_OK) {
+                        fprintf(stderr, "Cannot read blob: %s\n", sqlite3_errmsg(db));
+                        goto end;
+                }
+
+                if (fwrite(buf, 1, n, f) != (size_t)n) {
+                        fprintf(stderr, "Cannot write %s\n", path);
+                        rc = 1;
+                        goto end;
+                }
+        }
+
+end:
+        if (f && fclose(f) != 0 && rc == SQLITE_OK) {
+                fprintf(stderr, "Cannot write %s\n", path);
+                rc = 1;
+        }
+        free(buf);
+        sqlite3_blob_close(blob);
+        return rc;
+}
+
+int
+delete_attachment(sqlite3 *db, const char *uuid, const char *name)
+{
+        sqlite3_int64 note_id;
+        int rc = resolve_note_id(db, uuid, &note_id);
+        if (rc != SQLITE_OK)
+                return rc;
+
+        sqlite3_stmt *stmt;
+        rc = sqlite3_prepare_v2(db, "DELETE FROM attachments WHERE note_id = ? AND name = ?;",
+                                -1, &stmt, 0);
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                return rc;
+        }
+
+        sqlite3_bind_int64(stmt, 1, note_id);
+        sqlite3_bind_text(stmt, 2, name, strlen(name), SQLITE_STATIC);
+
+        rc = sqlite3_step(stmt);
+        sqlite3_finalize(stmt);
+        if (rc != SQLITE_DONE) {
+                fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+                return rc;
+        }
+
+        if (sqlite3_changes(db) == 0) {
+                fprintf(stderr, "No attachment %s on %s\n", name, uuid);
+                return SQLITE_NOTFOUND;
+        }
+
+        return SQLITE_OK;
+}
+
+// Databases from before attachments have none to offer
+static int
+has_attachments(sqlite3 *db, int *exists)
+{
+        sqlite3_stmt *stmt;
+        int rc = sqlite3_prepare_v2(db, "SELECT 1 FROM sqlite_master "
+                                    "WHERE type = 'table' AND name = 'attachments';", -1, &stmt, 0);
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                return rc;
+        }
+
+        rc = sqlite3_step(stmt);
+        *exists = rc == SQLITE_ROW;
+        sqlite3_finalize(stmt);
+
+        if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+                fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+                return rc;
+        }
+
+        return SQLITE_OK;
+}
+
+int
+diff_attachments(sqlite3 *db, sqlite3 *db2)
+{
+        sqlite3_stmt *theirs = NULL, *ours = NULL, *blob = NULL;
+        int exists, blobs = 0;
+        sqlite3_int64 bytes = 0;
+
+        int rc = has_attachments(db2, &exists);
+        if (rc != SQLITE_OK || !exists)
+                return rc;
+
+        rc = sqlite3_prepare_v2(db2, "SELECT notes.uuid, attachments.name, blobs.hash, blobs.size "
+                                "FROM attachments "
+                                "INNER JOIN notes ON notes.id = attachments.note_id "
+                                "INNER JOIN blobs ON blobs.id = attachments.blob_id "
+                                "ORDER BY blobs.id;", -1, &theirs, 0);
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db2));
+                goto end;
+        }
+
+        rc = sqlite3_prepare_v2(db, "SELECT 1 FROM attachments "
+                                "INNER JOIN notes ON notes.id = attachments.note_id "
+                                "INNER JOIN blobs ON blobs.id = attachments.blob_id "
+                                "WHERE notes.uuid = ? AND attachments.name = ? AND blobs.hash = ?;",
+                                -1, &ours, 0);
+        if (rc == SQLITE_OK)
+                rc = sqlite3_prepare_v2(db, "SELECT 1 FROM blobs WHERE hash = ?;", -1, &blob, 0);
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                goto end;
+        }
+
+        char last[SHA256_HEX_LENGTH + 1] = "";
+        while ((rc = sqlite3_step(theirs)) == SQLITE_ROW) {
+                const char *uuid = (const char *)sqlite3_column_text(theirs, 0);
+                const char *name = (const char *)sqlite3_column_text(theirs, 1);
+                const char *hash = (const char *)sqlite3_column_text(theirs, 2);
+
+                sqlite3_bind_text(ours, 1, uuid, -1, SQLITE_STATIC);
+                sqlite3_bind_text(ours, 2, name, -1, SQLITE_STATIC);
+                sqlite3_bind_text(ours, 3, hash, -1, SQLITE_STATIC);
+                rc = sqlite3_step(ours);
+                sqlite3_reset(ours);
+                if (rc == SQLITE_ROW)
+                        continue;
+                if (rc != SQLITE_DONE)
+                        break;
+
+                printf("%s %s\n", uuid, name);
+
+                // Rows come by blob, so each missing blob is counted once
+                if (!strcmp(last, hash))
+                        continue;
+                snprintf(last, sizeof(last), "%s", hash);
+
+                sqlite3_bind_text(blob, 1, hash, -1, SQLITE_STATIC);
+                rc = sqlite3_step(blob);
+                sqlite3_reset(blob);
+                if (rc == SQLITE_DONE) {
+                        blobs++;
+                        bytes += sqlite3_column_int64(theirs, 3);
+                } else if (rc != SQLITE_ROW) {
+                        break;
+                }
+        }
+
+        if (rc != SQLITE_DONE) {
+                fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+                goto end;
+        }
+
+        printf("%d files, %lld bytes to copy\n", blobs, (long long)bytes);
+        rc = SQLITE_OK;
+
+end:
+        sqlite3_finalize(theirs);
+        sqlite3_finalize(ours);
+        sqlite3_finalize(blob);
+        return rc;
+}
+
+int
+merge_attachments(sqlite3 *db, sqlite3 *db2)
+{
+        sqlite3_stmt *theirs = NULL, *ours = NULL;
+        int exists;
+
+        int rc = has_attachments(db2, &exists);
+        if (rc != SQLITE_OK || !exists)
+                return rc;
+
+        rc = sqlite3_prepare_v2(db2, "SELECT notes.uuid, attachments.name, attachments.date, "
+                                "blobs.id, blobs.hash, blobs.size "
+                                "FROM attachments "
+                                "INNER JOIN notes ON notes.id = attachments.note_id "
+                                "INNER JOIN blobs ON blobs.id = attachments.blob_id;", -1, &theirs, 0);
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db2));
+                return rc;
+        }
+
+        rc = sqlite3_prepare_v2(db, "SELECT notes.id, blobs.hash, attachments.date FROM notes "
+                                "LEFT JOIN attachments ON attachments.note_id = notes.id "
+                                "AND attachments.name = ?2 "
+                                "LEFT JOIN blobs ON blobs.id = attachments.blob_id "
+                                "WHERE notes.uuid = ?1;", -1, &ours, 0);
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                sqlite3_finalize(theirs);
+                return rc;
+        }
+
+        rc = sql_exec(db, "BEGIN;");
+        if (rc != SQLITE_OK)
+                goto end;
+
+        while ((rc = sqlite3_step(theirs)) == SQLITE_ROW) {
+                const char *name = (const char *)sqlite3_column_text(theirs, 1);
+                const char *date = (const char *)sqlite3_column_text(theirs, 2);
+                const char *hash = (const char *)sqlite3_column_text(theirs, 4);
+
+                sqlite3_bind_value(ours, 1, sqlite3_column_value(theirs, 0));
+                sqlite3_bind_text(ours, 2, name, -1, SQLITE_STATIC);
+
+                rc = sqlite3_step(ours);
+                if (rc != SQLITE_ROW) {
+                        sqlite3_reset(ours);
+                        if (rc == SQLITE_DONE)
+                                continue;
+                        fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+                        goto rollback;
+                }
+
+                sqlite3_int64 note_id = sqlite3_column_int64(ours, 0);
+                const char *our_hash = (const char *)sqlite3_column_text(ours, 1);
+                const char *our_date = (const char *)sqlite3_column_text(ours, 2);
+
+                // Same file, or a newer one of that name here
+                int keep = our_hash && (!strcmp(our_hash, hash) || strcmp(our_date, date) >= 0);
+                sqlite3_reset(ours);
+                if (keep)
+                        continue;
+
+                sqlite3_int64 blob_id;
+                rc = find_blob(db, hash, &blob_id);
+                if (rc != SQLITE_OK)
+                        goto rollback;
+
+                if (!blob_id) {
+                        sqlite3_blob *src;
+                        rc = sqlite3_blob_open(db2, "main", "blobs", "data",
+                                               sqlite3_column_int64(theirs, 3), 0, &src);
+                        if (rc != SQLITE_OK) {
+                                fprintf(stderr, "Cannot open blob: %s\n", sqlite3_errmsg(db2));
+                                goto rollback;
+                        }
+
+                        rc = store_blob(db, hash, sqlite3_column_int64(theirs, 5), read_blob_chunk, src,
+                                        &blob_id);
+                        sqlite3_blob_close(src);
+                        if (rc != SQLITE_OK)
+                                goto rollback;
+                }
+
+                rc = link_attachment(db, note_id, blob_id, name, date);
+                if (rc != SQLITE_OK)
+                        goto rollback;
+        }
+
+        if (rc != SQLITE_DONE) {
+                fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db2));
+                goto rollback;
+        }
+
+        rc = sql_exec(db, "COMMIT;");
+        if (rc == SQLITE_OK)
+                goto end;
+
+rollback:
+        sql_exec(db, "ROLLBACK;");
+end:
+        sqlite3_finalize(theirs);
+        sqlite3_finalize(ours);
+        return rc;
+}
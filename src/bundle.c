@@ -0,0 +1,1027 @@
+#include <stdio.h>
+#include <sqlite3.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#include "app.h"
+#include "compress.h"
+#include "hash.h"
+#include "bundle.h"
+
+/*
+ * A bundle holds the logical rows of a vault and nothing else: no free
+ * pages, no indexes, no derived tables. It is
+ *
+ *   magic, section, section, ..., index section, trailer
+ *
+ * Every section starts with a header giving its type, how it is stored,
+ * its row count, raw and stored length and the SHA-256 of the header
+ * fields and stored bytes. Rows of one type are cut into sections of
+ * about SECTION_SIZE raw bytes, each compressed on its own with zstd when
+ * zkc has it, so a reader never holds more than one section.
+ *
+ * The index section lists the offset and header of every other section
+ * and the trailer gives the index's offset, so a bundle can be checked or
+ * read out of order by seeking. Apply does not need either: it reads the
+ * sections in order and stops at the index.
+ *
+ * Notes are numbered by their order in the bundle and tags likewise, and
+ * note tags, links and inbox entries refer to those numbers. Rows of
+ * those are sorted by note, which is stored as the difference from the
+ * previous row's note in the same section. Integers are little-endian or
+ * LEB128 varints and strings are a varint length followed by the bytes.
+ */
+#define BUNDLE_MAGIC "ZKCBNDL1"
+#define BUNDLE_END "ZKCBEND1"
+#define MAGIC_SIZE 8
+#define HEADER_FIELDS 24
+#define HEADER_SIZE (HEADER_FIELDS + SHA256_HEX_LENGTH)
+#define ENTRY_SIZE (8 + HEADER_SIZE)
+#define TRAILER_SIZE (8 + MAGIC_SIZE)
+#define SECTION_SIZE (1 << 20)
+#define SECTION_MAX (1 << 30)
+#define BUNDLE_LEVEL 9
+
+enum {
+        SECTION_INDEX,
+        SECTION_NOTES,
+        SECTION_TAGS,
+        SECTION_NOTE_TAGS,
+        SECTION_LINKS,
+        SECTION_INBOX,
+        SECTION_TYPES
+};
+
+static const char *section_names[SECTION_TYPES] = {
+        "index", "notes", "tags", "note tags", "links", "inbox entries"
+};
+
+enum {
+        METHOD_STORED,
+        METHOD_ZSTD
+};
+
+struct section {
+        int type;
+        int method;
+        uint32_t rows;
+        uint64_t raw_len;
+        uint64_t stored_len;
+        char sum[SHA256_HEX_LENGTH + 1];
+};
+
+struct buf {
+        unsigned char *data;
+        size_t len, cap;
+};
+
+// Database ids in bundle order, notes or tags
+struct id_map {
+        sqlite3_int64 *ids;
+        size_t n, cap;
+};
+
+static int
+buf_reserve(struct buf *b, size_t n)
+{
+        if (b->len + n <= b->cap)
+                return 0;
+
+        size_t cap = b->cap ? b->cap : 4096;
+        while (cap < b->len + n)
+                cap *= 2;
+
+        unsigned char *data = realloc(b->data, cap);
+        if (!data)
+                return -1;
+        b->data = data;
+        b->cap = cap;
+        return 0;
+}
+
+static int
+put_varint(struct buf *b, uint64_t v)
+{
+        if (buf_reserve(b, 10))
+                return -1;
+        while (v >= 0x80) {
+                b->data[b->len++] = v | 0x80;
+                v >>= 7;
+        }
+        b->data[b->len++] = v;
+        return 0;
+}
+
+static int
+put_raw(struct buf *b, const void *p, size_t n)
+{
+        if (buf_reserve(b, n))
+                return -1;
+        if (n)
+                memcpy(b->data + b->len, p, n);
+        b->len += n;
+        return 0;
+}
+
+static int
+put_bytes(struct buf *b, const void *p, size_t n)
+{
+        return put_varint(b, n) || put_raw(b, p, n) ? -1 : 0;
+}
+
+static const unsigned char *
+get_varint(const unsigned char *p, const unsigned char *end, uint64_t *v)
+{
+        *v = 0;
+        for (int shift = 0; p < end && shift < 64; shift += 7) {
+                unsigned char c = *p++;
+                *v |= (uint64_t)(c & 0x7f) << shift;
+                if (!(c & 0x80))
+                        return p;
+        }
+        return NULL;
+}
+
+static const unsigned char *
+get_bytes(const unsigned char *p, const unsigned char *end, const unsigned char **s, size_t *n)
+{
+        uint64_t len;
+        if (!(p = get_varint(p, end, &len)) || len > (uint64_t)(end - p))
+                return NULL;
+        *s = p;
+        *n = len;
+        return p + len;
+}
+
+static void
+put_le(unsigned char *p, uint64_t v, int n)
+{
+        for (int i = 0; i < n; i++)
+                p[i] = v >> (8 * i);
+}
+
+static uint64_t
+get_le(const unsigned char *p, int n)
+{
+        uint64_t v = 0;
+        for (int i = n - 1; i >= 0; i--)
+                v = v << 8 | p[i];
+        return v;
+}
+
+static int
+hex_decode(const char *hex, unsigned char *out, size_t n)
+{
+        for (size_t i = 0; i < 2 * n; i++) {
+                char c = hex[i];
+                int digit;
+                if (c >= '0' && c <= '9')
+                        digit = c - '0';
+                else if (c >= 'a' && c <= 'f')
+                        digit = c - 'a' + 10;
+                else
+                        return -1;
+                out[i / 2] = i % 2 ? out[i / 2] | digit : digit << 4;
+        }
+        return 0;
+}
+
+static int
+id_map_add(struct id_map *m, sqlite3_int64 id)
+{
+        if (m->n == m->cap) {
+                size_t cap = m->cap ? 2 * m->cap : 1024;
+                sqlite3_int64 *ids = realloc(m->ids, cap * sizeof(*ids));
+                if (!ids)
+                        return -1;
+                m->ids = ids;
+                m->cap = cap;
+        }
+        m->ids[m->n++] = id;
+        return 0;
+}
+
+static int
+compare_ids(const void *a, const void *b)
+{
+        sqlite3_int64 x = *(const sqlite3_int64 *)a, y = *(const sqlite3_int64 *)b;
+        return (x > y) - (x < y);
+}
+
+// The bundle number of id, from a map built in id order
+static int
+id_map_find(const struct id_map *m, sqlite3_int64 id, uint64_t *ordinal)
+{
+        if (!m->n)
+                return -1;
+        const sqlite3_int64 *found = bsearch(&id, m->ids, m->n, sizeof(id), compare_ids);
+        if (!found)
+                return -1;
+        *ordinal = found - m->ids;
+        return 0;
+}
+
+static void
+encode_header(unsigned char *p, const struct section *s)
+{
+        p[0] = s->type;
+        p[1] = s->method;
+        p[2] = p[3] = 0;
+        put_le(p + 4, s->rows, 4);
+        put_le(p + 8, s->raw_len, 8);
+        put_le(p + 16, s->stored_len, 8);
+        memcpy(p + HEADER_FIELDS, s->sum, SHA256_HEX_LENGTH);
+}
+
+static int
+decode_header(const unsigned char *p, struct section *s)
+{
+        s->type = p[0];
+        s->method = p[1];
+        s->rows = get_le(p + 4, 4);
+        s->raw_len = get_le(p + 8, 8);
+        s->stored_len = get_le(p + 16, 8);
+        memcpy(s->sum, p + HEADER_FIELDS, SHA256_HEX_LENGTH);
+        s->sum[SHA256_HEX_LENGTH] = '\0';
+
+        if (s->type >= SECTION_TYPES || s->method > METHOD_ZSTD)
+                return -1;
+        if (s->raw_len > SECTION_MAX || s->stored_len > SECTION_MAX)
+                return -1;
+        if (s->method == METHOD_STORED && s->raw_len != s->stored_len)
+                return -1;
+        return 0;
+}
+
+// The checksum of a section covers its header fields as well as its bytes
+static int
+section_sum(const struct section *s, const unsigned char *data, char sum[SHA256_HEX_LENGTH + 1])
+{
+        unsigned char header[HEADER_SIZE];
+        encode_header(header, s);
+
+        struct sha256_stream *stream = sha256_begin();
+        if (!stream)
+                return -1;
+
+        int rc = sha256_update(stream, header, HEADER_FIELDS);
+        if (!rc && s->stored_len)
+                rc = sha256_update(stream, data, s->stored_len);
+        if (sha256_end(stream, sum))
+                rc = -1;
+        return rc;
+}
+
+struct writer {
+        FILE *out;
+        uint64_t offset;
+        struct section section;         // the one rows are being added to
+        struct buf rows;
+        struct buf packed;
+        struct buf index;
+        uint64_t last;                  // note of the section's last row
+        uint64_t raw_total;
+        uint32_t sections;
+        int counts[SECTION_TYPES];
+#ifdef HAVE_ZSTD
+        ZSTD_CCtx *cctx;
+#endif
+};
+
+static int
+write_section(struct writer *w, struct section *s, const unsigned char *data)
+{
+        unsigned char header[HEADER_SIZE];
+
+        if (section_sum(s, data, s->sum))
+                return -1;
+        encode_header(header, s);
+
+        if (fwrite(header, 1, HEADER_SIZE, w->out) != HEADER_SIZE ||
+            fwrite(data, 1, s->stored_len, w->out) != s->stored_len)
+                return -1;
+
+        if (s->type != SECTION_INDEX) {
+                unsigned char entry[ENTRY_SIZE];
+                put_le(entry, w->offset, 8);
+                memcpy(entry + 8, header, HEADER_SIZE);
+                if (put_raw(&w->index, entry, ENTRY_SIZE))
+                        return -1;
+                w->sections++;
+        }
+
+        w->offset += HEADER_SIZE + s->stored_len;
+        w->raw_total += HEADER_SIZE + s->raw_len;
+        return 0;
+}
+
+// Compress and write the section being filled, if it has any rows
+static int
+flush_section(struct writer *w)
+{
+        struct section *s = &w->section;
+        if (s->rows == 0)
+                return 0;
+
+        const unsigned char *data = w->rows.data;
+        s->method = METHOD_STORED;
+        s->raw_len = s->stored_len = w->rows.len;
+
+#ifdef HAVE_ZSTD
+        size_t bound = ZSTD_compressBound(w->rows.len);
+        w->packed.len = 0;
+        if (buf_reserve(&w->packed, bound))
+                return -1;
+
+        size_t n = ZSTD_compressCCtx(w->cctx, w->packed.data, bound,
+                                     w->rows.data, w->rows.len, BUNDLE_LEVEL);
+        if (!ZSTD_isError(n) && n < w->rows.len) {
+                data = w->packed.data;
+                s->method = METHOD_ZSTD;
+                s->stored_len = n;
+        }
+#endif
+
+        int rc = write_section(w, s, data);
+        s->rows = 0;
+        w->rows.len = 0;
+        w->last = 0;
+        return rc;
+}
+
+// Start a row of type, in a new section if the current one holds another
+// type or is full.
+static int
+begin_row(struct writer *w, int type)
+{
+        if (w->section.type != type || w->rows.len >= SECTION_SIZE) {
+                if (flush_section(w))
+                        return -1;
+                w->section.type = type;
+        }
+        w->section.rows++;
+        w->counts[type]++;
+        return 0;
+}
+
+static int
+write_notes(sqlite3 *db, struct writer *w, struct id_map *notes)
+{
+        sqlite3_stmt *stmt;
+        int rc = sqlite3_prepare_v2(db, "SELECT id, uuid, date, hash, note_text(body) "
+                                    "FROM notes ORDER BY id;", -1, &stmt, 0);
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                return rc;
+        }
+
+        while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+                const char *hex = (const char *)sqlite3_column_text(stmt, 3);
+                unsigned char hash[SHA256_HEX_LENGTH / 2];
+
+                if (sqlite3_column_bytes(stmt, 3) != SHA256_HEX_LENGTH ||
+                    hex_decode(hex, hash, sizeof(hash))) {
+                        fprintf(stderr, "Note %s has an invalid hash\n", sqlite3_column_text(stmt, 1));
+                        rc = SQLITE_CORRUPT;
+                        break;
+                }
+
+                const unsigned char *body = sqlite3_column_text(stmt, 4);
+                if (!body) {
+                        fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+                        rc = SQLITE_ERROR;
+                        break;
+                }
+
+                if (begin_row(w, SECTION_NOTES) ||
+                    put_bytes(&w->rows, sqlite3_column_text(stmt, 1), sqlite3_column_bytes(stmt, 1)) ||
+                    put_bytes(&w->rows, sqlite3_column_text(stmt, 2), sqlite3_column_bytes(stmt, 2)) ||
+                    put_raw(&w->rows, hash, sizeof(hash)) ||
+                    put_bytes(&w->rows, body, sqlite3_column_bytes(stmt, 4)) ||
+                    id_map_add(notes, sqlite3_column_int64(stmt, 0))) {
+                        rc = SQLITE_IOERR;
+                        break;
+                }
+        }
+        sqlite3_finalize(stmt);
+
+        if (rc == SQLITE_IOERR)
+                perror("bundle");
+        else if (rc != SQLITE_DONE && rc != SQLITE_CORRUPT && rc != SQLITE_ERROR)
+                fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+        return rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
+
+static int
+write_tags(sqlite3 *db, struct writer *w, struct id_map *tags)
+{
+        sqlite3_stmt *stmt;
+        int rc = sqlite3_prepare_v2(db, "SELECT id, body FROM tags ORDER BY id;", -1, &stmt, 0);
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                return rc;
+        }
+
+        while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+                if (begin_row(w, SECTION_TAGS) ||
+                    put_bytes(&w->rows, sqlite3_column_text(stmt, 1), sqlite3_column_bytes(stmt, 1)) ||
+                    id_map_add(tags, sqlite3_column_int64(stmt, 0))) {
+                        perror("bundle");
+                        sqlite3_finalize(stmt);
+                        return SQLITE_IOERR;
+                }
+        }
+        sqlite3_finalize(stmt);
+
+        if (rc != SQLITE_DONE) {
+                fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+                return rc;
+        }
+        return SQLITE_OK;
+}
+
+// Write the rows of sql, a note id and, unless refs is NULL, the id of a
+// note or tag in refs, sorted by note. Rows naming ids missing from the
+// maps are left out.
+static int
+write_edges(sqlite3 *db, struct writer *w, int type, const char *sql,
+            const struct id_map *notes, const struct id_map *refs)
+{
+        sqlite3_stmt *stmt;
+        int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                return rc;
+        }
+
+        while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+                uint64_t note, ref = 0;
+                if (id_map_find(notes, sqlite3_column_int64(stmt, 0), &note) ||
+                    (refs && id_map_find(refs, sqlite3_column_int64(stmt, 1), &ref)))
+                        continue;
+
+                if (begin_row(w, type) ||
+                    put_varint(&w->rows, note - w->last) ||
+                    (refs && put_varint(&w->rows, ref))) {
+                        perror("bundle");
+                        sqlite3_finalize(stmt);
+                        return SQLITE_IOERR;
+                }
+                w->last = note;
+        }
+        sqlite3_finalize(stmt);
+
+        if (rc != SQLITE_DONE) {
+                fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+                return rc;
+        }
+        return SQLITE_OK;
+}
+
+static int
+write_bundle(sqlite3 *db, struct writer *w)
+{
+        struct id_map notes = { 0 }, tags = { 0 };
+
+        int rc = write_notes(db, w, &notes);
+        if (rc == SQLITE_OK)
+                rc = write_tags(db, w, &tags);
+        if (rc == SQLITE_OK)
+                rc = write_edges(db, w, SECTION_NOTE_TAGS, "SELECT note_id, tag_id FROM note_tags "
+                                 "ORDER BY note_id, tag_id;", &notes, &tags);
+        if (rc == SQLITE_OK)
+                rc = write_edges(db, w, SECTION_LINKS, "SELECT a_id, b_id FROM links "
+                                 "ORDER BY a_id, b_id;", &notes, &notes);
+        if (rc == SQLITE_OK)
+                rc = write_edges(db, w, SECTION_INBOX, "SELECT note_id FROM inbox "
+                                 "ORDER BY note_id;", &notes, NULL);
+
+        free(notes.ids);
+        free(tags.ids);
+        if (rc != SQLITE_OK)
+                return rc;
+
+        if (flush_section(w))
+                goto fail;
+
+        uint64_t index_offset = w->offset;
+        struct section index = {
+                .type = SECTION_INDEX,
+                .method = METHOD_STORED,
+                .rows = w->sections,
+                .raw_len = w->index.len,
+                .stored_len = w->index.len,
+        };
+        if (write_section(w, &index, w->index.data))
+                goto fail;
+
+        unsigned char trailer[TRAILER_SIZE];
+        put_le(trailer, index_offset, 8);
+        memcpy(trailer + 8, BUNDLE_END, MAGIC_SIZE);
+        if (fwrite(trailer, 1, TRAILER_SIZE, w->out) != TRAILER_SIZE || fflush(w->out))
+                goto fail;
+        w->offset += TRAILER_SIZE;
+        w->raw_total += TRAILER_SIZE;
+        return SQLITE_OK;
+
+fail:
+        perror("bundle");
+        return SQLITE_IOERR;
+}
+
+int
+bundle_create(sqlite3 *db, const char *path)
+{
+        int to_stdout = !strcmp(path, "-");
+        struct writer w = { .out = to_stdout ? stdout : fopen(path, "wb") };
+        if (!w.out) {
+                perror(path);
+                return 1;
+        }
+
+        int rc = SQLITE_NOMEM;
+#ifdef HAVE_ZSTD
+        if (!(w.cctx = ZSTD_createCCtx())) {
+                fprintf(stderr, "Cannot create zstd context\n");
+                goto end;
+        }
+#endif
+
+        if (fwrite(BUNDLE_MAGIC, 1, MAGIC_SIZE, w.out) != MAGIC_SIZE) {
+                perror(path);
+                rc = SQLITE_IOERR;
+                goto end;
+        }
+        w.offset = w.raw_total = MAGIC_SIZE;
+
+        // Read everything in one transaction so edges match the notes
+        rc = sql_exec(db, "BEGIN;");
+        if (rc != SQLITE_OK)
+                goto end;
+        rc = write_bundle(db, &w);
+        sql_exec(db, "COMMIT;");
+
+        if (rc == SQLITE_OK)
+                fprintf(to_stdout ? stderr : stdout,
+                        "Bundled %d notes, %d tags, %d note tags, %d links, %d inbox entries "
+                        "in %u sections, %llu bytes (%llu uncompressed)\n",
+                        w.counts[SECTION_NOTES], w.counts[SECTION_TAGS], w.counts[SECTION_NOTE_TAGS],
+                        w.counts[SECTION_LINKS], w.counts[SECTION_INBOX], w.sections,
+                        (unsigned long long)w.offset, (unsigned long long)w.raw_total);
+
+end:
+#ifdef HAVE_ZSTD
+        ZSTD_freeCCtx(w.cctx);
+#endif
+        free(w.rows.data);
+        free(w.packed.data);
+        free(w.index.data);
+        if (!to_stdout && fclose(w.out) && rc == SQLITE_OK) {
+                perror(path);
+                rc = SQLITE_IOERR;
+        }
+        return rc;
+}
+
+struct reader {
+        FILE *in;
+        const char *path;
+        unsigned char header[HEADER_SIZE];
+        struct buf stored;
+        struct buf raw;
+#ifdef HAVE_ZSTD
+        ZSTD_DCtx *dctx;
+#endif
+};
+
+static int
+reader_open(struct reader *r, const char *path)
+{
+        memset(r, 0, sizeof(*r));
+        r->path = path;
+        r->in = strcmp(path, "-") ? fopen(path, "rb") : stdin;
+        if (!r->in) {
+                perror(path);
+                return -1;
+        }
+
+#ifdef HAVE_ZSTD
+        if (!(r->dctx = ZSTD_createDCtx())) {
+                fprintf(stderr, "Cannot create zstd context\n");
+                return -1;
+        }
+#endif
+
+        char magic[MAGIC_SIZE];
+        if (fread(magic, 1, MAGIC_SIZE, r->in) != MAGIC_SIZE || memcmp(magic, BUNDLE_MAGIC, MAGIC_SIZE)) {
+                fprintf(stderr, "%s is not a zkc bundle\n", path);
+                return -1;
+        }
+        return 0;
+}
+
+static void
+reader_close(struct reader *r)
+{
+#ifdef HAVE_ZSTD
+        ZSTD_freeDCtx(r->dctx);
+#endif
+        free(r->stored.data);
+        free(r->raw.data);
+        if (r->in && r->in != stdin)
+                fclose(r->in);
+}
+
+// Read the section at the current position, check it against its
+// checksum and leave its rows in r->raw.
+static int
+read_section(struct reader *r, struct section *s)
+{
+        if (fread(r->header, 1, HEADER_SIZE, r->in) != HEADER_SIZE) {
+                fprintf(stderr, "%s is truncated\n", r->path);
+                return -1;
+        }
+        if (decode_header(r->header, s)) {
+                fprintf(stderr, "%s has a corrupt section header\n", r->path);
+                return -1;
+        }
+
+        r->stored.len = 0;
+        if (buf_reserve(&r->stored, s->stored_len)) {
+                perror(r->path);
+                return -1;
+        }
+        if (fread(r->stored.data, 1, s->stored_len, r->in) != s->stored_len) {
+                fprintf(stderr, "%s is truncated\n", r->path);
+                return -1;
+        }
+        r->stored.len = s->stored_len;
+
+        char sum[SHA256_HEX_LENGTH + 1];
+        if (section_sum(s, r->stored.data, sum) || strcmp(sum, s->sum)) {
+                fprintf(stderr, "%s: checksum mismatch in a section of %s\n", r->path, section_names[s->type]);
+                return -1;
+        }
+
+        if (s->method == METHOD_STORED) {
+                struct buf swap = r->raw;
+                r->raw = r->stored;
+                r->stored = swap;
+                return 0;
+        }
+
+#ifdef HAVE_ZSTD
+        r->raw.len = 0;
+        if (buf_reserve(&r->raw, s->raw_len)) {
+                perror(r->path);
+                return -1;
+        }
+        size_t n = ZSTD_decompressDCtx(r->dctx, r->raw.data, s->raw_len, r->stored.data, s->stored_len);
+        if (ZSTD_isError(n) || n != s->raw_len) {
+                fprintf(stderr, "%s: cannot decompress a section of %s\n", r->path, section_names[s->type]);
+                return -1;
+        }
+        r->raw.len = n;
+        return 0;
+#else
+        fprintf(stderr, "%s is compressed but zkc was built without zstd\n", r->path);
+        return -1;
+#endif
+}
+
+enum {
+        FIND_NOTE,
+        INSERT_NOTE,
+        INSERT_TAG,
+        FIND_TAG,
+        INSERT_NOTE_TAG,
+        INSERT_LINK,
+        INSERT_INBOX,
+        APPLY_STMTS
+};
+
+static const char *apply_sql[APPLY_STMTS] = {
+        [FIND_NOTE] = "SELECT id, hash, date FROM notes WHERE uuid = ? LIMIT 1;",
+        [INSERT_NOTE] = "INSERT INTO notes(uuid, date, hash, body) VALUES(?, ?, ?, ?);",
+        [INSERT_TAG] = "INSERT OR IGNORE INTO tags(body) VALUES(?);",
+        [FIND_TAG] = "SELECT id FROM tags WHERE body = ?;",
+        [INSERT_NOTE_TAG] = "INSERT INTO note_tags(note_id, tag_id) SELECT ?1, ?2 "
+                "WHERE NOT EXISTS (SELECT 1 FROM note_tags WHERE note_id = ?1 AND tag_id = ?2);",
+        [INSERT_LINK] = "INSERT INTO links(a_id, b_id) SELECT ?1, ?2 "
+                "WHERE NOT EXISTS (SELECT 1 FROM links WHERE a_id = ?1 AND b_id = ?2);",
+        [INSERT_INBOX] = "INSERT INTO inbox(note_id) SELECT ?1 "
+                "WHERE NOT EXISTS (SELECT 1 FROM inbox WHERE note_id = ?1);",
+};
+
+struct applier {
+        sqlite3 *db;
+        sqlite3_stmt *stmts[APPLY_STMTS];
+        struct id_map notes;            // our id of each bundled note, 0 if skipped
+        struct id_map tags;
+        int counts[SECTION_TYPES];
+};
+
+static int
+step_done(struct applier *a, sqlite3_stmt *stmt)
+{
+        if (sqlite3_step(stmt) != SQLITE_DONE) {
+                fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(a->db));
+                return -1;
+        }
+        return 0;
+}
+
+// Add a note, or replace ours if the bundled one is newer, and return its
+// id here in *id, or 0 if it is skipped.
+static int
+apply_note(struct applier *a, const char *uuid, const char *date, const unsigned char *hash,
+           const char *body, size_t len, sqlite3_int64 *id)
+{
+        char hex[SHA256_HEX_LENGTH + 1];
+        unsigned char sum[SHA256_HEX_LENGTH / 2];
+
+        *id = 0;
+        if (sha256_hex(body, len, hex) || hex_decode(hex, sum, sizeof(sum)))
+                return -1;
+        if (memcmp(sum, hash, sizeof(sum))) {
+                fprintf(stderr, "Skipping note %s: hash does not match its body\n", uuid);
+                return 0;
+        }
+
+        sqlite3_stmt *find = a->stmts[FIND_NOTE];
+        sqlite3_reset(find);
+        sqlite3_bind_text(find, 1, uuid, -1, SQLITE_STATIC);
+        int rc = sqlite3_step(find);
+
+        if (rc == SQLITE_DONE) {
+                sqlite3_stmt *insert = a->stmts[INSERT_NOTE];
+                sqlite3_reset(insert);
+                sqlite3_bind_text(insert, 1, uuid, -1, SQLITE_STATIC);
+                sqlite3_bind_text(insert, 2, date, -1, SQLITE_STATIC);
+                sqlite3_bind_text(insert, 3, hex, -1, SQLITE_STATIC);
+                bind_note_body(a->db, insert, 4, body, len);
+                if (step_done(a, insert))
+                        return -1;
+                *id = sqlite3_last_insert_rowid(a->db);
+                a->counts[SECTION_NOTES]++;
+                return 0;
+        }
+        if (rc != SQLITE_ROW) {
+                fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(a->db));
+                return -1;
+        }
+
+        *id = sqlite3_column_int64(find, 0);
+        const char *our_hash = (const char *)sqlite3_column_text(find, 1);
+        const char *our_date = (const char *)sqlite3_column_text(find, 2);
+        if (!strcmp(our_hash, hex) || strcmp(date, our_date) <= 0)
+                return 0;
+
+        if (replace_body(a->db, *id, body, len, hex, date) != SQLITE_OK)
+                return -1;
+        a->counts[SECTION_NOTES]++;
+        return 0;
+}
+
+// Copy a string of at most n - 1 bytes out of a section, NUL terminated
+static int
+get_string(const unsigned char **p, const unsigned char *end, char *out, size_t n)
+{
+        const unsigned char *s;
+        size_t len;
+        if (!(*p = get_bytes(*p, end, &s, &len)) || len >= n)
+                return -1;
+        memcpy(out, s, len);
+        out[len] = '\0';
+        return 0;
+}
+
+static int
+apply_notes(struct applier *a, const struct section *s, const unsigned char *p, const unsigned char *end)
+{
+        for (uint32_t i = 0; i < s->rows; i++) {
+                char uuid[64], date[64];
+                const unsigned char *hash, *body;
+                size_t len;
+                sqlite3_int64 id;
+
+                if (get_string(&p, end, uuid, sizeof(uuid)) ||
+                    get_string(&p, end, date, sizeof(date)) ||
+                    end - p < SHA256_HEX_LENGTH / 2)
+                        return 1;
+                hash = p;
+                p += SHA256_HEX_LENGTH / 2;
+                if (!(p = get_bytes(p, end, &body, &len)))
+                        return 1;
+
+                if (apply_note(a, uuid, date, hash, (const char *)body, len, &id) ||
+                    id_map_add(&a->notes, id))
+                        return -1;
+        }
+        return p == end ? 0 : 1;
+}
+
+static int
+apply_tags(struct applier *a, const struct section *s, const unsigned char *p, const unsigned char *end)
+{
+        sqlite3_stmt *insert = a->stmts[INSERT_TAG], *find = a->stmts[FIND_TAG];
+
+        for (uint32_t i = 0; i < s->rows; i++) {
+                const unsigned char *body;
+                size_t len;
+                if (!(p = get_bytes(p, end, &body, &len)))
+                        return 1;
+
+                sqlite3_reset(insert);
+                sqlite3_bind_text(insert, 1, (const char *)body, len, SQLITE_STATIC);
+                if (step_done(a, insert))
+                        return -1;
+                a->counts[SECTION_TAGS] += sqlite3_changes(a->db);
+
+                sqlite3_reset(find);
+                sqlite3_bind_text(find, 1, (const char *)body, len, SQLITE_STATIC);
+                if (sqlite3_step(find) != SQLITE_ROW) {
+                        fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(a->db));
+                        return -1;
+                }
+                if (id_map_add(&a->tags, sqlite3_column_int64(find, 0)))
+                        return -1;
+        }
+        return p == end ? 0 : 1;
+}
+
+static int
+apply_edges(struct applier *a, const struct section *s, const unsigned char *p, const unsigned char *end)
+{
+        const struct id_map *refs = NULL;
+        sqlite3_stmt *insert;
+        switch (s->type) {
+        case SECTION_NOTE_TAGS:
+                refs = &a->tags;
+                insert = a->stmts[INSERT_NOTE_TAG];
+                break;
+        case SECTION_LINKS:
+                refs = &a->notes;
+                insert = a->stmts[INSERT_LINK];
+                break;
+        default:
+                insert = a->stmts[INSERT_INBOX];
+                break;
+        }
+
+        uint64_t note = 0;
+        for (uint32_t i = 0; i < s->rows; i++) {
+                uint64_t delta, ref = 0;
+                if (!(p = get_varint(p, end, &delta)) || (refs && !(p = get_varint(p, end, &ref))))
+                        return 1;
+                note += delta;
+                if (note >= a->notes.n || (refs && ref >= refs->n))
+                        return 1;
+
+                sqlite3_int64 id = a->notes.ids[note], ref_id = refs ? refs->ids[ref] : 0;
+                if (!id || (refs && !ref_id))
+                        continue;
+
+                sqlite3_reset(insert);
+                sqlite3_bind_int64(insert, 1, id);
+                if (refs)
+                        sqlite3_bind_int64(insert, 2, ref_id);
+                if (step_done(a, insert))
+                        return -1;
+                a->counts[s->type] += sqlite3_changes(a->db);
+        }
+        return p == end ? 0 : 1;
+}
+
+int
+bundle_apply(sqlite3 *db, const char *path)
+{
+        struct reader r;
+        struct applier a = { .db = db };
+        int rc = SQLITE_ERROR;
+
+        if (reader_open(&r, path))
+                goto end;
+
+        for (int i = 0; i < APPLY_STMTS; i++) {
+                if (sqlite3_prepare_v2(db, apply_sql[i], -1, &a.stmts[i], 0) != SQLITE_OK) {
+                        fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                        goto end;
+                }
+        }
+
+        // Apply all or nothing: a section failing its checksum halfway
+        // through undoes the sections before it
+        rc = sql_exec(db, "PRAGMA cache_size = -65536; BEGIN;");
+        if (rc != SQLITE_OK)
+                goto end;
+
+        struct section s;
+        int err = 0;
+        while (!err && !(err = read_section(&r, &s)) && s.type != SECTION_INDEX) {
+                const unsigned char *p = r.raw.data, *end = p + r.raw.len;
+                switch (s.type) {
+                case SECTION_NOTES:
+                        err = apply_notes(&a, &s, p, end);
+                        break;
+                case SECTION_TAGS:
+                        err = apply_tags(&a, &s, p, end);
+                        break;
+                default:
+                        err = apply_edges(&a, &s, p, end);
+                        break;
+                }
+                if (err > 0)
+                        fprintf(stderr, "%s has a corrupt section of %s\n", path, section_names[s.type]);
+        }
+
+        unsigned char trailer[TRAILER_SIZE];
+        if (!err && (fread(trailer, 1, TRAILER_SIZE, r.in) != TRAILER_SIZE ||
+                     memcmp(trailer + 8, BUNDLE_END, MAGIC_SIZE))) {
+                fprintf(stderr, "%s has no trailer\n", path);
+                err = 1;
+        }
+
+        if (err) {
+                sql_exec(db, "ROLLBACK;");
+                rc = SQLITE_ERROR;
+                goto end;
+        }
+
+        rc = sql_exec(db, "COMMIT;");
+        if (rc == SQLITE_OK)
+                printf("Applied %d notes, %d tags, %d note tags, %d links, %d inbox entries\n",
+                       a.counts[SECTION_NOTES], a.counts[SECTION_TAGS], a.counts[SECTION_NOTE_TAGS],
+                       a.counts[SECTION_LINKS], a.counts[SECTION_INBOX]);
+
+end:
+        for (int i = 0; i < APPLY_STMTS; i++)
+                sqlite3_finalize(a.stmts[i]);
+        free(a.notes.ids);
+        free(a.tags.ids);
+        reader_close(&r);
+        return rc;
+}
+
+int
+bundle_verify(const char *path)
+{
+        struct reader r;
+        struct section index, s;
+        unsigned char trailer[TRAILER_SIZE];
+        uint64_t rows[SECTION_TYPES] = { 0 }, raw = 0, stored = 0;
+        uint32_t sections[SECTION_TYPES] = { 0 };
+        int rc = 1;
+
+        if (reader_open(&r, path))
+                goto end;
+
+        if (fseek(r.in, -TRAILER_SIZE, SEEK_END) ||
+            fread(trailer, 1, TRAILER_SIZE, r.in) != TRAILER_SIZE ||
+            memcmp(trailer + 8, BUNDLE_END, MAGIC_SIZE)) {
+                fprintf(stderr, "%s has no trailer\n", path);
+                goto end;
+        }
+        if (fseek(r.in, get_le(trailer, 8), SEEK_SET) || read_section(&r, &index))
+                goto end;
+        if (index.type != SECTION_INDEX || index.raw_len != (uint64_t)index.rows * ENTRY_SIZE) {
+                fprintf(stderr, "%s has a corrupt index\n", path);
+                goto end;
+        }
+
+        // read_section reuses its buffers, so keep the index apart
+        struct buf entries = r.raw;
+        r.raw = (struct buf){ 0 };
+
+        for (uint32_t i = 0; i < index.rows; i++) {
+                const unsigned char *entry = entries.data + (size_t)i * ENTRY_SIZE;
+                if (fseek(r.in, get_le(entry, 8), SEEK_SET) || read_section(&r, &s)) {
+                        free(entries.data);
+                        goto end;
+                }
+                if (s.type == SECTION_INDEX || memcmp(r.header, entry + 8, HEADER_SIZE)) {
+                        fprintf(stderr, "%s: section %u does not match the index\n", path, i);
+                        free(entries.data);
+                        goto end;
+                }
+                sections[s.type]++;
+                rows[s.type] += s.rows;
+                raw += s.raw_len;
+                stored += s.stored_len;
+        }
+        free(entries.data);
+
+        for (int t = SECTION_NOTES; t < SECTION_TYPES; t++)
+                printf("%s: %llu in %u sections\n", section_names[t],
+                       (unsigned long long)rows[t], sections[t]);
+        printf("%u sections, %llu bytes of rows (%llu uncompressed), checksums ok\n",
+               index.rows, (unsigned long long)stored, (unsigned long long)raw);
+        rc = 0;
+
+end:
+        reader_close(&r);
+        return rc;
+}
@@ -0,0 +1,774 @@
+#ifdef HAVE_SESSION
+#define SQLITE_ENABLE_SESSION 1
+#define SQLITE_ENABLE_PREUPDATE_HOOK 1
+#endif
+#include <stdio.h>
+#include <sqlite3.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "app.h"
+#include "compress.h"
+#include "changes.h"
+
+/*
+ * Commands that edit notes run under a session, and what the session
+ * saw is added to the changesets journal when the command succeeds. Only
+ * direct changes matter: rows a trigger or a cascading delete touched are
+ * touched again when the direct change is replayed.
+ *
+ * Changesets address rows by id, and ids differ from vault to vault, so
+ * the uuid of every note and the body of every tag a changeset mentions
+ * is saved with it in changeset_keys while the ids still mean something.
+ * Replaying a changeset turns each of its changes back into one
+ * statement against the rows with those keys, so it costs what the edits
+ * cost, whatever the size of the vault.
+ */
+
+#ifdef HAVE_SESSION
+
+static const char *recorded_commands[] = {
+        "new", "edit", "slurp", "tag", "link", "link-many", "archive", "delete"
+};
+
+static const char *recorded_tables[] = {
+        "notes", "tags", "note_tags", "links", "inbox"
+};
+
+struct changes {
+        sqlite3_session *session;
+        const char *command;
+};
+
+int
+changes_begin(sqlite3 *db, int argc, char **argv, struct changes **changes)
+{
+        *changes = NULL;
+        if (argc < 2)
+                return SQLITE_OK;
+
+        size_t i, n = sizeof(recorded_commands) / sizeof(recorded_commands[0]);
+        for (i = 0; i < n && strcmp(argv[1], recorded_commands[i]); i++)
+                ;
+        if (i == n)
+                return SQLITE_OK;
+
+        // Vaults from before the journal record nothing until zkc init
+        int exists;
+        int rc = table_exists(db, "changesets", &exists);
+        if (rc != SQLITE_OK || !exists)
+                return rc;
+
+        struct changes *c = calloc(1, sizeof(*c));
+        if (!c)
+                return SQLITE_NOMEM;
+        c->command = argv[1];
+
+        rc = sqlite3session_create(db, "main", &c->session);
+        for (i = 0; rc == SQLITE_OK && i < sizeof(recorded_tables) / sizeof(recorded_tables[0]); i++)
+                rc = sqlite3session_attach(c->session, recorded_tables[i]);
+
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot record changes: %s\n", sqlite3_errstr(rc));
+                changes_free(c);
+                return rc;
+        }
+
+        *changes = c;
+        return SQLITE_OK;
+}
+
+void
+changes_free(struct changes *changes)
+{
+        if (!changes)
+                return;
+        if (changes->session)
+                sqlite3session_delete(changes->session);
+        free(changes);
+}
+
+// The value a change leaves in column col, or the one it removes
+static sqlite3_value *
+change_value(sqlite3_changeset_iter *it, int op, int col)
+{
+        sqlite3_value *value = NULL;
+        if (op != SQLITE_DELETE)
+                sqlite3changeset_new(it, col, &value);
+        if (!value && op != SQLITE_INSERT)
+                sqlite3changeset_old(it, col, &value);
+        return value;
+}
+
+enum {
+        KEY_VALUE,
+        KEY_NOTE,
+        KEY_TAG,
+        KEY_STMTS
+};
+
+static const char *key_sql[KEY_STMTS] = {
+        [KEY_VALUE] = "INSERT OR IGNORE INTO changeset_keys(changeset_id, kind, row_id, key) "
+                "VALUES(?1, ?3, ?2, ?4);",
+        [KEY_NOTE] = "INSERT OR IGNORE INTO changeset_keys(changeset_id, kind, row_id, key) "
+                "SELECT ?1, 'notes', ?2, uuid FROM notes WHERE id = ?2;",
+        [KEY_TAG] = "INSERT OR IGNORE INTO changeset_keys(changeset_id, kind, row_id, key) "
+                "SELECT ?1, 'tags', ?2, body FROM tags WHERE id = ?2;",
+};
+
+static int
+save_key(sqlite3 *db, sqlite3_stmt *stmt, sqlite3_int64 changeset_id, sqlite3_value *row_id)
+{
+        if (!row_id)
+                return SQLITE_OK;
+
+        sqlite3_reset(stmt);
+        sqlite3_bind_int64(stmt, 1, changeset_id);
+        sqlite3_bind_value(stmt, 2, row_id);
+        if (sqlite3_step(stmt) != SQLITE_DONE) {
+                fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+                return SQLITE_ERROR;
+        }
+        return SQLITE_OK;
+}
+
+// Save the key of each note and tag the direct changes in a changeset
+// refer to. A note or tag the changeset itself adds or removes has its
+// key among the changed values; any other is still in the vault.
+static int
+save_keys(sqlite3 *db, sqlite3_int64 changeset_id, int n, void *changeset)
+{
+        sqlite3_stmt *stmts[KEY_STMTS] = { 0 };
+        sqlite3_changeset_iter *it = NULL;
+        int rc = SQLITE_OK;
+
+        for (int i = 0; i < KEY_STMTS && rc == SQLITE_OK; i++) {
+                rc = sqlite3_prepare_v2(db, key_sql[i], -1, &stmts[i], 0);
+                if (rc != SQLITE_OK)
+                        fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+        }
+        if (rc == SQLITE_OK)
+                rc = sqlite3changeset_start(&it, n, changeset);
+
+        while (rc == SQLITE_OK && sqlite3changeset_next(it) == SQLITE_ROW) {
+                const char *table;
+                int columns, op, indirect;
+                sqlite3changeset_op(it, &table, &columns, &op, &indirect);
+                if (indirect)
+                        continue;
+
+                int is_notes = !strcmp(table, "notes");
+                if (is_notes || !strcmp(table, "tags")) {
+                        sqlite3_value *key = change_value(it, op, 1);
+                        if (key && sqlite3_value_type(key) == SQLITE_TEXT) {
+                                sqlite3_stmt *stmt = stmts[KEY_VALUE];
+                                sqlite3_reset(stmt);
+                                sqlite3_bind_text(stmt, 3, table, -1, SQLITE_STATIC);
+                                sqlite3_bind_value(stmt, 4, key);
+                                rc = save_key(db, stmt, changeset_id, change_value(it, op, 0));
+                        } else {
+                                rc = save_key(db, stmts[is_notes ? KEY_NOTE : KEY_TAG], changeset_id,
+                                              change_value(it, op, 0));
+                        }
+                } else if (!strcmp(table, "note_tags")) {
+                        rc = save_key(db, stmts[KEY_NOTE], changeset_id, change_value(it, op, 1));
+                        if (rc == SQLITE_OK)
+                                rc = save_key(db, stmts[KEY_TAG], changeset_id, change_value(it, op, 2));
+                } else {
+                        for (int col = 1; col < columns && rc == SQLITE_OK; col++)
+                                rc = save_key(db, stmts[KEY_NOTE], changeset_id, change_value(it, op, col));
+                }
+        }
+
+        if (it && sqlite3changeset_finalize(it) != SQLITE_OK && rc == SQLITE_OK)
+                rc = SQLITE_CORRUPT;
+        for (int i = 0; i < KEY_STMTS; i++)
+                sqlite3_finalize(stmts[i]);
+        return rc;
+}
+
+int
+changes_record(sqlite3 *db, struct changes *changes)
+{
+        if (!changes)
+                return SQLITE_OK;
+
+        int n;
+        void *changeset;
+        int rc = sqlite3session_changeset(changes->session, &n, &changeset);
+        sqlite3session_delete(changes->session);
+        changes->session = NULL;
+
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot record changes: %s\n", sqlite3_errstr(rc));
+                return rc;
+        }
+        if (n == 0) {
+                sqlite3_free(changeset);
+                return SQLITE_OK;
+        }
+
+        rc = sql_exec(db, "BEGIN;");
+        if (rc != SQLITE_OK) {
+                sqlite3_free(changeset);
+                return rc;
+        }
+
+        sqlite3_stmt *stmt;
+        rc = sqlite3_prepare_v2(db, "INSERT INTO changesets(command, changeset) VALUES(?, ?);",
+                                -1, &stmt, 0);
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                goto end;
+        }
+
+        sqlite3_bind_text(stmt, 1, changes->command, -1, SQLITE_STATIC);
+        sqlite3_bind_blob(stmt, 2, changeset, n, SQLITE_STATIC);
+        rc = sqlite3_step(stmt);
+        sqlite3_finalize(stmt);
+        if (rc != SQLITE_DONE) {
+                fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+                goto end;
+        }
+
+        rc = save_keys(db, sqlite3_last_insert_rowid(db), n, changeset);
+
+end:
+        if (rc == SQLITE_OK)
+                rc = sql_exec(db, "COMMIT;");
+        else
+                sql_exec(db, "ROLLBACK;");
+        sqlite3_free(changeset);
+        return rc;
+}
+
+// Copy the rows of one table between the journal and a push file
+static int
+copy_rows(sqlite3 *from, sqlite3 *to, const char *select, const char *insert, int columns)
+{
+        sqlite3_stmt *read, *write;
+        int rc = sqlite3_prepare_v2(from, select, -1, &read, 0);
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(from));
+                return rc;
+        }
+        rc = sqlite3_prepare_v2(to, insert, -1, &write, 0);
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(to));
+                sqlite3_finalize(read);
+                return rc;
+        }
+
+        while ((rc = sqlite3_step(read)) == SQLITE_ROW) {
+                sqlite3_reset(write);
+                for (int i = 0; i < columns; i++)
+                        sqlite3_bind_value(write, i + 1, sqlite3_column_value(read, i));
+                if (sqlite3_step(write) != SQLITE_DONE) {
+                        fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(to));
+                        rc = SQLITE_ERROR;
+                        break;
+                }
+        }
+        if (rc != SQLITE_DONE && rc != SQLITE_ERROR)
+                fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(from));
+
+        sqlite3_finalize(read);
+        sqlite3_finalize(write);
+        return rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
+
+int
+changes_push(sqlite3 *db, const char *path)
+{
+        sqlite3 *out = NULL;
+        sqlite3_stmt *stmt;
+        char tmp[PATH_MAX];
+        sqlite3_int64 last = 0;
+        int count = 0;
+
+        int rc = sqlite3_prepare_v2(db, "SELECT count(*), ifnull(max(id), 0) FROM changesets;", -1, &stmt, 0);
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                return rc;
+        }
+        if (sqlite3_step(stmt) == SQLITE_ROW) {
+                count = sqlite3_column_int(stmt, 0);
+                last = sqlite3_column_int64(stmt, 1);
+        }
+        sqlite3_finalize(stmt);
+
+        if (count == 0) {
+                printf("No changes to push\n");
+                return SQLITE_OK;
+        }
+
+        if ((size_t)snprintf(tmp, sizeof(tmp), "%s.%ld", path, (long)getpid()) >= sizeof(tmp)) {
+                fprintf(stderr, "Path too long: %s\n", path);
+                return SQLITE_ERROR;
+        }
+
+        remove(tmp);
+        rc = sqlite3_open(tmp, &out);
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot open %s: %s\n", tmp, sqlite3_errmsg(out));
+                goto end;
+        }
+
+        rc = sql_exec(out, CHANGES_SCHEMA "BEGIN;");
+        if (rc != SQLITE_OK)
+                goto end;
+
+        char select[128], insert[128];
+        snprintf(select, sizeof(select), "SELECT id, date, command, changeset FROM changesets "
+                 "WHERE id <= %lld;", (long long)last);
+        snprintf(insert, sizeof(insert), "INSERT INTO changesets VALUES(?, ?, ?, ?);");
+        rc = copy_rows(db, out, select, insert, 4);
+        if (rc == SQLITE_OK) {
+                snprintf(select, sizeof(select), "SELECT changeset_id, kind, row_id, key "
+                         "FROM changeset_keys WHERE changeset_id <= %lld;", (long long)last);
+                snprintf(insert, sizeof(insert), "INSERT INTO changeset_keys VALUES(?, ?, ?, ?);");
+                rc = copy_rows(db, out, select, insert, 4);
+        }
+
+        // Bodies in the changesets may be compressed with the vault's
+        // dictionaries, which the vault applying them does not have
+        int have_dictionaries = 0;
+        if (rc == SQLITE_OK)
+                rc = table_exists(db, "dictionaries", &have_dictionaries);
+        if (rc == SQLITE_OK && have_dictionaries) {
+                rc = sql_exec(out, "CREATE TABLE dictionaries(id INTEGER PRIMARY KEY, dict BLOB NOT NULL);");
+                if (rc == SQLITE_OK)
+                        rc = copy_rows(db, out, "SELECT id, dict FROM dictionaries;",
+                                       "INSERT INTO dictionaries VALUES(?, ?);", 2);
+        }
+        if (rc != SQLITE_OK) {
+                sql_exec(out, "ROLLBACK;");
+                goto end;
+        }
+
+        rc = sql_exec(out, "COMMIT;");
+        if (rc != SQLITE_OK)
+                goto end;
+        rc = sqlite3_close(out);
+        out = NULL;
+        if (rc != SQLITE_OK || rename(tmp, path) != 0) {
+                perror(path);
+                rc = SQLITE_IOERR;
+                goto end;
+        }
+
+        // Only once the file is in place is the journal emptied, so a
+        // failed push loses nothing and pushing again is harmless
+        snprintf(select, sizeof(select), "DELETE FROM changesets WHERE id <= %lld;", (long long)last);
+        rc = sql_exec(db, select);
+        if (rc != SQLITE_OK)
+                return rc;
+
+        printf("Pushed %d changesets to %s\n", count, path);
+        return SQLITE_OK;
+
+end:
+        sqlite3_close(out);
+        remove(tmp);
+        return rc;
+}
+
+enum {
+        FIND_KEY,
+        FIND_NOTE,
+        INSERT_NOTE,
+        DELETE_NOTE,
+        NOTE_TEXT,
+        FIND_TAG,
+        INSERT_TAG,
+        RENAME_TAG,
+        DELETE_TAG,
+        INSERT_NOTE_TAG,
+        DELETE_NOTE_TAG,
+        INSERT_LINK,
+        DELETE_LINK,
+        INSERT_INBOX,
+        DELETE_INBOX,
+        APPLY_STMTS
+};
+
+static const char *apply_sql[APPLY_STMTS] = {
+        [FIND_KEY] = "SELECT key FROM changeset_keys "
+                "WHERE changeset_id = ? AND kind = ? AND row_id = ?;",
+        [FIND_NOTE] = "SELECT id, hash, unixepoch(date), unixepoch(?2) FROM notes "
+                "WHERE uuid = ?1 LIMIT 1;",
+        [INSERT_NOTE] = "INSERT INTO notes(uuid, body, hash, date) VALUES(?, ?, ?, ?);",
+        [DELETE_NOTE] = "DELETE FROM notes WHERE id = ?;",
+        [NOTE_TEXT] = "SELECT note_text(?);",
+        [FIND_TAG] = "SELECT id FROM tags WHERE body = ?;",
+        [INSERT_TAG] = "INSERT OR IGNORE INTO tags(body) VALUES(?);",
+        [RENAME_TAG] = "UPDATE OR IGNORE tags SET body = ?2 WHERE body = ?1;",
+        [DELETE_TAG] = "DELETE FROM tags WHERE body = ?;",
+        [INSERT_NOTE_TAG] = "INSERT INTO note_tags(note_id, tag_id) SELECT ?1, ?2 "
+                "WHERE NOT EXISTS (SELECT 1 FROM note_tags WHERE note_id = ?1 AND tag_id = ?2);",
+        [DELETE_NOTE_TAG] = "DELETE FROM note_tags WHERE note_id = ?1 AND tag_id = ?2;",
+        [INSERT_LINK] = "INSERT INTO links(a_id, b_id) SELECT ?1, ?2 "
+                "WHERE NOT EXISTS (SELECT 1 FROM links WHERE a_id = ?1 AND b_id = ?2);",
+        [DELETE_LINK] = "DELETE FROM links WHERE a_id = ?1 AND b_id = ?2;",
+        [INSERT_INBOX] = "INSERT INTO inbox(note_id) SELECT ?1 "
+                "WHERE NOT EXISTS (SELECT 1 FROM inbox WHERE note_id = ?1);",
+        [DELETE_INBOX] = "DELETE FROM inbox WHERE note_id = ?1;",
+};
+
+struct replay {
+        sqlite3 *db;
+        sqlite3 *file;
+        sqlite3_stmt *stmts[APPLY_STMTS];
+        sqlite3_int64 changeset_id;
+        const char *date;               // when the changeset was recorded
+        int applied, kept, skipped;
+};
+
+static int
+run(struct replay *r, int index)
+{
+        if (sqlite3_step(r->stmts[index]) != SQLITE_DONE) {
+                fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(r->db));
+                return SQLITE_ERROR;
+        }
+        r->applied += sqlite3_changes(r->db) > 0;
+        return SQLITE_OK;
+}
+
+// Our id of the note or tag the changeset calls row_id, or 0 if this vault
+// has no such note or tag
+static sqlite3_int64
+local_id(struct replay *r, const char *kind, sqlite3_value *row_id)
+{
+        if (!row_id)
+                return 0;
+
+        sqlite3_stmt *key = r->stmts[FIND_KEY];
+        sqlite3_reset(key);
+        sqlite3_bind_int64(key, 1, r->changeset_id);
+        sqlite3_bind_text(key, 2, kind, -1, SQLITE_STATIC);
+        sqlite3_bind_value(key, 3, row_id);
+        if (sqlite3_step(key) != SQLITE_ROW)
+                return 0;
+
+        int is_notes = !strcmp(kind, "notes");
+        sqlite3_stmt *find = r->stmts[is_notes ? FIND_NOTE : FIND_TAG];
+        sqlite3_reset(find);
+        sqlite3_bind_value(find, 1, sqlite3_column_value(key, 0));
+        if (is_notes)
+                sqlite3_bind_null(find, 2);
+        return sqlite3_step(find) == SQLITE_ROW ? sqlite3_column_int64(find, 0) : 0;
+}
+
+static int
+replay_note(struct replay *r, sqlite3_changeset_iter *it, int op)
+{
+        sqlite3_value *uuid = NULL, *body = NULL, *hash = NULL, *date = NULL, *old_hash = NULL;
+
+        if (op == SQLITE_UPDATE) {
+                sqlite3_value *id;
+                sqlite3changeset_old(it, 0, &id);
+                sqlite3_stmt *key = r->stmts[FIND_KEY];
+                sqlite3_reset(key);
+                sqlite3_bind_int64(key, 1, r->changeset_id);
+                sqlite3_bind_text(key, 2, "notes", -1, SQLITE_STATIC);
+                sqlite3_bind_value(key, 3, id);
+                if (sqlite3_step(key) == SQLITE_ROW)
+                        uuid = sqlite3_column_value(key, 0);
+                sqlite3changeset_new(it, 2, &body);
+                sqlite3changeset_new(it, 3, &hash);
+                sqlite3changeset_new(it, 4, &date);
+                sqlite3changeset_old(it, 3, &old_hash);
+        } else {
+                uuid = change_value(it, op, 1);
+                body = change_value(it, op, 2);
+                hash = change_value(it, op, 3);
+                date = change_value(it, op, 4);
+        }
+
+        if (!uuid || !hash) {
+                r->skipped++;
+                return SQLITE_OK;
+        }
+
+        sqlite3_stmt *find = r->stmts[FIND_NOTE];
+        sqlite3_reset(find);
+        sqlite3_bind_value(find, 1, uuid);
+        if (op == SQLITE_DELETE || !date)
+                sqlite3_bind_text(find, 2, r->date, -1, SQLITE_STATIC);
+        else
+                sqlite3_bind_value(find, 2, date);
+
+        int rc = sqlite3_step(find);
+        if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+                fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(r->db));
+                return rc;
+        }
+
+        int found = rc == SQLITE_ROW;
+        sqlite3_int64 id = found ? sqlite3_column_int64(find, 0) : 0;
+        const char *ours = found ? (const char *)sqlite3_column_text(find, 1) : NULL;
+        const char *theirs = (const char *)sqlite3_value_text(hash);
+        int ours_newer = found && sqlite3_column_int64(find, 2) >= sqlite3_column_int64(find, 3);
+
+        // Unchanged here since the changeset's edit, or already replayed
+        int clean = found && (old_hash ? !strcmp(ours, (const char *)sqlite3_value_text(old_hash))
+                                       : !strcmp(ours, theirs));
+
+        if (op == SQLITE_DELETE) {
+                if (!found) {
+                        r->skipped++;
+                        return SQLITE_OK;
+                }
+                if (!clean && ours_newer) {
+                        r->kept++;
+                        return SQLITE_OK;
+                }
+                sqlite3_reset(r->stmts[DELETE_NOTE]);
+                sqlite3_bind_int64(r->stmts[DELETE_NOTE], 1, id);
+                return run(r, DELETE_NOTE);
+        }
+
+        if (found && !strcmp(ours, theirs))
+                return SQLITE_OK;
+        if (found && !clean && ours_newer) {
+                r->kept++;
+                return SQLITE_OK;
+        }
+        if (!body) {
+                r->skipped++;
+                return SQLITE_OK;
+        }
+
+        // Bodies may be compressed, with a dictionary the file carries
+        sqlite3_stmt *text = r->stmts[NOTE_TEXT];
+        sqlite3_reset(text);
+        sqlite3_bind_value(text, 1, body);
+        if (sqlite3_step(text) != SQLITE_ROW) {
+                fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(r->file));
+                return SQLITE_ERROR;
+        }
+        const char *body_text = (const char *)sqlite3_column_text(text, 0);
+        size_t len = sqlite3_column_bytes(text, 0);
+        const char *date_text = date ? (const char *)sqlite3_value_text(date) : NULL;
+
+        if (found) {
+                rc = replace_body(r->db, id, body_text, len, theirs, date_text);
+                r->applied += rc == SQLITE_OK;
+                return rc;
+        }
+
+        sqlite3_stmt *insert = r->stmts[INSERT_NOTE];
+        sqlite3_reset(insert);
+        sqlite3_bind_value(insert, 1, uuid);
+        bind_note_body(r->db, insert, 2, body_text, len);
+        sqlite3_bind_value(insert, 3, hash);
+        if (date_text)
+                sqlite3_bind_text(insert, 4, date_text, -1, SQLITE_STATIC);
+        else
+                sqlite3_bind_text(insert, 4, r->date, -1, SQLITE_STATIC);
+        return run(r, INSERT_NOTE);
+}
+
+static int
+replay_tag(struct replay *r, sqlite3_changeset_iter *it, int op)
+{
+        sqlite3_value *old_body = NULL, *new_body = NULL;
+        if (op != SQLITE_INSERT)
+                sqlite3changeset_old(it, 1, &old_body);
+        if (op != SQLITE_DELETE)
+                sqlite3changeset_new(it, 1, &new_body);
+
+        int index = op == SQLITE_INSERT ? INSERT_TAG : op == SQLITE_DELETE ? DELETE_TAG : RENAME_TAG;
+        if ((op != SQLITE_INSERT && !old_body) || (op != SQLITE_DELETE && !new_body)) {
+                r->skipped++;
+                return SQLITE_OK;
+        }
+
+        sqlite3_stmt *stmt = r->stmts[index];
+        sqlite3_reset(stmt);
+        if (op == SQLITE_INSERT) {
+                sqlite3_bind_value(stmt, 1, new_body);
+        } else {
+                sqlite3_bind_value(stmt, 1, old_body);
+                if (op == SQLITE_UPDATE)
+                        sqlite3_bind_value(stmt, 2, new_body);
+        }
+        return run(r, index);
+}
+
+// Note tags, links and inbox entries, rows of ids of notes and tags
+static int
+replay_edge(struct replay *r, sqlite3_changeset_iter *it, const char *table, int op, int columns)
+{
+        int insert, drop;
+        const char *second = "notes";
+        if (!strcmp(table, "note_tags")) {
+                insert = INSERT_NOTE_TAG;
+                drop = DELETE_NOTE_TAG;
+                second = "tags";
+        } else if (!strcmp(table, "links")) {
+                insert = INSERT_LINK;
+                drop = DELETE_LINK;
+        } else {
+                insert = INSERT_INBOX;
+                drop = DELETE_INBOX;
+        }
+
+        // Nothing moves an edge from one note to another
+        if (op == SQLITE_UPDATE) {
+                r->skipped++;
+                return SQLITE_OK;
+        }
+
+        sqlite3_int64 ids[2] = { 0, 0 };
+        for (int col = 1; col < columns && col < 3; col++) {
+                ids[col - 1] = local_id(r, col == 1 ? "notes" : second, change_value(it, op, col));
+                if (!ids[col - 1]) {
+                        r->skipped++;
+                        return SQLITE_OK;
+                }
+        }
+
+        int index = op == SQLITE_INSERT ? insert : drop;
+        sqlite3_stmt *stmt = r->stmts[index];
+        sqlite3_reset(stmt);
+        sqlite3_bind_int64(stmt, 1, ids[0]);
+        if (columns > 2)
+                sqlite3_bind_int64(stmt, 2, ids[1]);
+        return run(r, index);
+}
+
+static int
+replay(struct replay *r, int n, const void *changeset)
+{
+        sqlite3_changeset_iter *it;
+        int rc = sqlite3changeset_start(&it, n, (void *)changeset);
+        if (rc != SQLITE_OK)
+                return rc;
+
+        while (rc == SQLITE_OK && sqlite3changeset_next(it) == SQLITE_ROW) {
+                const char *table;
+                int columns, op, indirect;
+                sqlite3changeset_op(it, &table, &columns, &op, &indirect);
+                if (indirect)
+                        continue;
+
+                if (!strcmp(table, "notes"))
+                        rc = replay_note(r, it, op);
+                else if (!strcmp(table, "tags"))
+                        rc = replay_tag(r, it, op);
+                else
+                        rc = replay_edge(r, it, table, op, columns);
+        }
+
+        if (sqlite3changeset_finalize(it) != SQLITE_OK && rc == SQLITE_OK) {
+                fprintf(stderr, "Corrupt changeset %lld\n", (long long)r->changeset_id);
+                rc = SQLITE_CORRUPT;
+        }
+        return rc;
+}
+
+int
+changes_apply(sqlite3 *db, const char *path)
+{
+        struct replay r = { .db = db };
+        sqlite3_stmt *changesets = NULL;
+        int count = 0;
+
+        int rc = sqlite3_open_v2(path, &r.file, SQLITE_OPEN_READONLY, NULL);
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot open changes file: %s\n", path);
+                goto end;
+        }
+
+        rc = sqlite3_prepare_v2(r.file, "SELECT id, date, changeset FROM changesets ORDER BY id;",
+                                -1, &changesets, 0);
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(r.file));
+                goto end;
+        }
+        rc = register_note_text(r.file);
+        if (rc != SQLITE_OK)
+                goto end;
+
+        for (int i = 0; i < APPLY_STMTS; i++) {
+                sqlite3 *handle = i == FIND_KEY || i == NOTE_TEXT ? r.file : db;
+                rc = sqlite3_prepare_v2(handle, apply_sql[i], -1, &r.stmts[i], 0);
+                if (rc != SQLITE_OK) {
+                        fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(handle));
+                        goto end;
+                }
+        }
+
+        // All of the file or none of it
+        rc = sql_exec(db, "BEGIN;");
+        if (rc != SQLITE_OK)
+                goto end;
+
+        while ((rc = sqlite3_step(changesets)) == SQLITE_ROW) {
+                r.changeset_id = sqlite3_column_int64(changesets, 0);
+                r.date = (const char *)sqlite3_column_text(changesets, 1);
+                rc = replay(&r, sqlite3_column_bytes(changesets, 2), sqlite3_column_blob(changesets, 2));
+                if (rc != SQLITE_OK)
+                        goto rollback;
+                count++;
+        }
+
+        if (rc != SQLITE_DONE) {
+                fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(r.file));
+                goto rollback;
+        }
+
+        rc = sql_exec(db, "COMMIT;");
+        if (rc == SQLITE_OK)
+                printf("Applied %d changes from %d changesets, kept %d newer local edits, "
+                       "skipped %d\n", r.applied, count, r.kept, r.skipped);
+        goto end;
+
+rollback:
+        sql_exec(db, "ROLLBACK;");
+end:
+        for (int i = 0; i < APPLY_STMTS; i++)
+                sqlite3_finalize(r.stmts[i]);
+        sqlite3_finalize(changesets);
+        sqlite3_close(r.file);
+        return rc;
+}
+
+#else
+
+int
+changes_begin(sqlite3 *db, int argc, char **argv, struct changes **changes)
+{
+        *changes = NULL;
+        return SQLITE_OK;
+}
+
+int
+changes_record(sqlite3 *db, struct changes *changes)
+{
+        return SQLITE_OK;
+}
+
+void
+changes_free(struct changes *changes)
+{
+}
+
+int
+changes_push(sqlite3 *db, const char *path)
+{
+        fprintf(stderr, "zkc was built without the SQLite session extension\n");
+        return SQLITE_ERROR;
+}
+
+int
+changes_apply(sqlite3 *db, const char *path)
+{
+        fprintf(stderr, "zkc was built without the SQLite session extension\n");
+        return SQLITE_ERROR;
+}
+
+#endif
@@ -0,0 +1,572 @@
+#include <stdio.h>
+#include <sqlite3.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#include <zdict.h>
+#endif
+#include "app.h"
+#include "compress.h"
+
+/*
+ * Optional zstd compression of note bodies. A compressed body is stored as
+ * a blob holding one zstd frame made with a dictionary trained on the
+ * vault, which is what makes short, similar notes compress well. The
+ * dictionary lives in the dictionaries table under its zstd id, so every
+ * frame names the dictionary it needs.
+ *
+ * SQL reads bodies through note_text(), which passes text through and
+ * decompresses blobs, so a vault may mix both. Hashes are always of the
+ * text, so merging with uncompressed vaults works as before.
+ */
+#define DICT_SIZE (110 << 10)
+#define TRAIN_BYTES (16 << 20)
+#define COMPRESS_LEVEL 19
+#define MAX_DICTS 8
+
+// A zstd frame starts with the magic number 0xfd2fb528, little-endian
+static int
+is_frame(const void *blob, int len)
+{
+        const unsigned char *b = blob;
+        return len >= 4 && b[0] == 0x28 && b[1] == 0xb5 && b[2] == 0x2f && b[3] == 0xfd;
+}
+
+#ifdef HAVE_ZSTD
+
+struct decoder {
+        sqlite3 *db;
+        ZSTD_DCtx *dctx;
+        int ndicts;
+        struct {
+                unsigned id;
+                ZSTD_DDict *ddict;
+        } dicts[MAX_DICTS];
+};
+
+// Compression state for the connection being written to
+static struct {
+        sqlite3 *db;
+        ZSTD_CCtx *cctx;
+        ZSTD_CDict *cdict;
+} writer;
+
+static void
+decoder_free(void *data)
+{
+        struct decoder *dec = data;
+
+        for (int i = 0; i < dec->ndicts; i++)
+                ZSTD_freeDDict(dec->dicts[i].ddict);
+        ZSTD_freeDCtx(dec->dctx);
+        free(dec);
+}
+
+static struct decoder *
+decoder_new(sqlite3 *db)
+{
+        struct decoder *dec = calloc(1, sizeof(*dec));
+        if (!dec)
+                return NULL;
+
+        dec->db = db;
+        dec->dctx = ZSTD_createDCtx();
+        if (!dec->dctx) {
+                free(dec);
+                return NULL;
+        }
+
+        return dec;
+}
+
+static ZSTD_DDict *
+decoder_dict(struct decoder *dec, unsigned id)
+{
+        sqlite3_stmt *stmt;
+        ZSTD_DDict *ddict = NULL;
+
+        for (int i = 0; i < dec->ndicts; i++)
+                if (dec->dicts[i].id == id)
+                        return dec->dicts[i].ddict;
+
+        if (dec->ndicts == MAX_DICTS)
+                return NULL;
+
+        if (sqlite3_prepare_v2(dec->db, "SELECT dict FROM dictionaries WHERE id = ?;", -1, &stmt, 0)
+            != SQLITE_OK)
+                return NULL;
+
+        sqlite3_bind_int64(stmt, 1, id);
+        if (sqlite3_step(stmt) == SQLITE_ROW)
+                ddict = ZSTD_createDDict(sqlite3_column_blob(stmt, 0), sqlite3_column_bytes(stmt, 0));
+        sqlite3_finalize(stmt);
+
+        if (ddict) {
+                dec->dicts[dec->ndicts].id = id;
+                dec->dicts[dec->ndicts].ddict = ddict;
+                dec->ndicts++;
+        }
+
+        return ddict;
+}
+
+// Decompress one frame into a sqlite3_malloc'd, NUL terminated buffer
+static const char *
+decode(struct decoder *dec, const void *blob, int len, char **text, size_t *text_len)
+{
+        unsigned long long size = ZSTD_getFrameContentSize(blob, len);
+        if (size == ZSTD_CONTENTSIZE_UNKNOWN || size == ZSTD_CONTENTSIZE_ERROR || size >= 0x7fffffff)
+                return "corrupt compressed note";
+
+        ZSTD_DDict *ddict = NULL;
+        unsigned id = ZSTD_getDictID_fromFrame(blob, len);
+        if (id && !(ddict = decoder_dict(dec, id)))
+                return "missing dictionary for compressed note";
+
+        *text = sqlite3_malloc64(size + 1);
+        if (!*text)
+                return "out of memory";
+
+        size_t n = ZSTD_decompress_usingDDict(dec->dctx, *text, size, blob, len, ddict);
+        if (ZSTD_isError(n) || n != size) {
+                sqlite3_free(*text);
+                return "corrupt compressed note";
+        }
+
+        (*text)[n] = '\0';
+        *text_len = n;
+        return NULL;
+}
+
+#endif
+
+static void
+note_text(sqlite3_context *ctx, int argc, sqlite3_value **argv)
+{
+        if (sqlite3_value_type(argv[0]) != SQLITE_BLOB) {
+                sqlite3_result_value(ctx, argv[0]);
+                return;
+        }
+
+        const void *blob = sqlite3_value_blob(argv[0]);
+        int len = sqlite3_value_bytes(argv[0]);
+
+        if (is_frame(blob, len)) {
+#ifdef HAVE_ZSTD
+                char *text;
+                size_t text_len;
+                const char *err = decode(sqlite3_user_data(ctx), blob, len, &text, &text_len);
+
+                if (err)
+                        sqlite3_result_error(ctx, err, -1);
+                else
+                        sqlite3_result_text64(ctx, text, text_len, sqlite3_free, SQLITE_UTF8);
+#else
+                sqlite3_result_error(ctx, "note is compressed but zkc was built without zstd", -1);
+#endif
+                return;
+        }
+
+        sqlite3_result_text(ctx, blob, len, SQLITE_TRANSIENT);
+}
+
+int
+register_note_text(sqlite3 *db)
+{
+        void *data = NULL;
+        void (*destroy)(void *) = NULL;
+
+#ifdef HAVE_ZSTD
+        if (!(data = decoder_new(db))) {
+                fprintf(stderr, "Cannot create zstd decoder\n");
+                return SQLITE_NOMEM;
+        }
+        destroy = decoder_free;
+#endif
+
+        int rc = sqlite3_create_function_v2(db, "note_text", 1,
+                                            SQLITE_UTF8 | SQLITE_DETERMINISTIC | SQLITE_INNOCUOUS,
+                                            data, note_text, NULL, NULL, destroy);
+        if (rc != SQLITE_OK)
+                fprintf(stderr, "Cannot register note_text: %s\n", sqlite3_errmsg(db));
+
+        return rc;
+}
+
+#ifdef HAVE_ZSTD
+
+static void
+writer_reset(void)
+{
+        ZSTD_freeCDict(writer.cdict);
+        ZSTD_freeCCtx(writer.cctx);
+        memset(&writer, 0, sizeof(writer));
+}
+
+// Load the vault's dictionary, if it has one, for compressing into db
+static void
+writer_load(sqlite3 *db)
+{
+        sqlite3_stmt *stmt;
+
+        if (writer.db == db)
+                return;
+
+        writer_reset();
+        writer.db = db;
+
+        // A vault from before zkc init has no dictionaries table
+        if (sqlite3_prepare_v2(db, "SELECT dict FROM dictionaries LIMIT 1;", -1, &stmt, 0) != SQLITE_OK)
+                return;
+
+        if (sqlite3_step(stmt) == SQLITE_ROW) {
+                writer.cdict = ZSTD_createCDict(sqlite3_column_blob(stmt, 0), sqlite3_column_bytes(stmt, 0),
+                                                COMPRESS_LEVEL);
+                writer.cctx = ZSTD_createCCtx();
+        }
+
+        sqlite3_finalize(stmt);
+}
+
+// Compressed body in a malloc'd buffer, or NULL when the vault is not
+// compressed or compressing would not make it smaller
+static void *
+compress_body(sqlite3 *db, const char *body, size_t len, size_t *out_len)
+{
+        writer_load(db);
+        if (!writer.cdict || !writer.cctx)
+                return NULL;
+
+        size_t cap = ZSTD_compressBound(len);
+        void *out = malloc(cap);
+        if (!out)
+                return NULL;
+
+        *out_len = ZSTD_compress_usingCDict(writer.cctx, out, cap, body, len, writer.cdict);
+        if (ZSTD_isError(*out_len) || *out_len >= len) {
+                free(out);
+                return NULL;
+        }
+
+        return out;
+}
+
+#endif
+
+int
+bind_note_body(sqlite3 *db, sqlite3_stmt *stmt, int index, const char *body, size_t len)
+{
+#ifdef HAVE_ZSTD
+        size_t blob_len;
+        void *blob = compress_body(db, body, len, &blob_len);
+
+        if (blob)
+                return sqlite3_bind_blob64(stmt, index, blob, blob_len, free);
+#endif
+
+        return sqlite3_bind_text64(stmt, index, body, len, SQLITE_TRANSIENT, SQLITE_UTF8);
+}
+
+#ifdef HAVE_ZSTD
+
+static double
+now(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Train a dictionary on a random sample of notes and store it
+static int
+train_dictionary(sqlite3 *db)
+{
+        sqlite3_stmt *stmt;
+        char *samples = NULL;
+        size_t *sizes = NULL, used = 0, n = 0, cap = 0;
+        void *dict = NULL;
+
+        int rc = sqlite3_prepare_v2(db, "SELECT note_text(body) FROM notes ORDER BY random();",
+                                    -1, &stmt, 0);
+
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                return rc;
+        }
+
+        samples = malloc(TRAIN_BYTES);
+        dict = malloc(DICT_SIZE);
+        if (!samples || !dict) {
+                rc = SQLITE_NOMEM;
+                goto end;
+        }
+
+        while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+                size_t len = sqlite3_column_bytes(stmt, 0);
+                if (used + len > TRAIN_BYTES)
+                        break;
+
+                if (n == cap) {
+                        cap = cap ? cap * 2 : 1024;
+                        size_t *tmp = realloc(sizes, cap * sizeof(*sizes));
+                        if (!tmp) {
+                                rc = SQLITE_NOMEM;
+                                goto end;
+                        }
+                        sizes = tmp;
+                }
+
+                memcpy(samples + used, sqlite3_column_blob(stmt, 0), len);
+                used += len;
+                sizes[n++] = len;
+        }
+
+        if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+                fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+                goto end;
+        }
+
+        sqlite3_finalize(stmt);
+        stmt = NULL;
+
+        size_t dict_len = ZDICT_trainFromBuffer(dict, DICT_SIZE, samples, sizes, n);
+        if (ZDICT_isError(dict_len)) {
+                fprintf(stderr, "Cannot train a dictionary on %zu notes: %s\n", n,
+                        ZDICT_getErrorName(dict_len));
+                rc = SQLITE_ERROR;
+                goto end;
+        }
+
+        rc = sqlite3_prepare_v2(db, "INSERT INTO dictionaries(id, dict) VALUES(?, ?);", -1, &stmt, 0);
+
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                goto end;
+        }
+
+        sqlite3_bind_int64(stmt, 1, ZDICT_getDictID(dict, dict_len));
+        sqlite3_bind_blob(stmt, 2, dict, dict_len, SQLITE_STATIC);
+
+        rc = sqlite3_step(stmt);
+        if (rc != SQLITE_DONE) {
+                fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+                goto end;
+        }
+
+        printf("Trained a %zu byte dictionary on %zu notes\n", dict_len, n);
+        rc = SQLITE_OK;
+
+end:
+        sqlite3_finalize(stmt);
+        free(samples);
+        free(sizes);
+        free(dict);
+        return rc;
+}
+
+// Compress every note still stored as text
+static int
+compress_text_notes(sqlite3 *db, int *count)
+{
+        sqlite3_stmt *select = NULL, *update = NULL;
+        sqlite3_int64 *ids = NULL;
+        size_t n = 0, cap = 0;
+
+        *count = 0;
+
+        int rc = sqlite3_prepare_v2(db, "SELECT id FROM notes WHERE typeof(body) = 'text';", -1, &select, 0);
+
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                return rc;
+        }
+
+        // Collect the ids first rather than update the table being scanned
+        while ((rc = sqlite3_step(select)) == SQLITE_ROW) {
+                if (n == cap) {
+                        cap = cap ? cap * 2 : 1024;
+                        sqlite3_int64 *tmp = realloc(ids, cap * sizeof(*ids));
+                        if (!tmp) {
+                                rc = SQLITE_NOMEM;
+                                goto end;
+                        }
+                        ids = tmp;
+                }
+                ids[n++] = sqlite3_column_int64(select, 0);
+        }
+
+        if (rc != SQLITE_DONE) {
+                fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+                goto end;
+        }
+
+        sqlite3_finalize(select);
+        select = NULL;
+
+        if ((rc = sqlite3_prepare_v2(db, "SELECT body FROM notes WHERE id = ?;", -1, &select, 0))
+            != SQLITE_OK ||
+            (rc = sqlite3_prepare_v2(db, "UPDATE notes SET body = ? WHERE id = ?;", -1, &update, 0))
+            != SQLITE_OK) {
+                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                goto end;
+        }
+
+        for (size_t i = 0; i < n; i++) {
+                sqlite3_bind_int64(select, 1, ids[i]);
+
+                rc = sqlite3_step(select);
+                if (rc != SQLITE_ROW) {
+                        fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+                        goto end;
+                }
+
+                size_t blob_len;
+                void *blob = compress_body(db, (const char *)sqlite3_column_text(select, 0),
+                                           sqlite3_column_bytes(select, 0), &blob_len);
+                sqlite3_reset(select);
+
+                if (!blob)
+                        continue;
+
+                sqlite3_bind_blob64(update, 1, blob, blob_len, free);
+                sqlite3_bind_int64(update, 2, ids[i]);
+
+                rc = sqlite3_step(update);
+                sqlite3_reset(update);
+                if (rc != SQLITE_DONE) {
+                        fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+                        goto end;
+                }
+
+                (*count)++;
+        }
+
+        rc = SQLITE_OK;
+
+end:
+        sqlite3_finalize(select);
+        sqlite3_finalize(update);
+        free(ids);
+        return rc;
+}
+
+// Print the compression ratio of the vault and how fast it decompresses
+static int
+report(sqlite3 *db)
+{
+        sqlite3_stmt *stmt;
+        sqlite3_int64 notes = 0, stored = 0, text = 0;
+        double elapsed = 0;
+
+        struct decoder *dec = decoder_new(db);
+        if (!dec)
+                return SQLITE_NOMEM;
+
+        int rc = sqlite3_prepare_v2(db, "SELECT body FROM notes WHERE typeof(body) = 'blob';", -1, &stmt, 0);
+
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                decoder_free(dec);
+                return rc;
+        }
+
+        while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+                const void *blob = sqlite3_column_blob(stmt, 0);
+                int len = sqlite3_column_bytes(stmt, 0);
+                char *body;
+                size_t body_len;
+
+                if (!is_frame(blob, len))
+                        continue;
+
+                double start = now();
+                const char *err = decode(dec, blob, len, &body, &body_len);
+                elapsed += now() - start;
+
+                if (err) {
+                        fprintf(stderr, "Cannot decompress note: %s\n", err);
+                        continue;
+                }
+
+                sqlite3_free(body);
+                notes++;
+                stored += len;
+                text += body_len;
+        }
+
+        sqlite3_finalize(stmt);
+        decoder_free(dec);
+
+        if (rc != SQLITE_DONE) {
+                fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+                return rc;
+        }
+
+        printf("%lld compressed notes: %.1f MB of text in %.1f MB (%.2fx)\n", notes, text / 1e6,
+               stored / 1e6, stored ? (double)text / stored : 0);
+        printf("Decompressed at %.1f MB/s\n", elapsed > 0 ? text / 1e6 / elapsed : 0);
+        return SQLITE_OK;
+}
+
+#endif
+
+int
+compress_notes(sqlite3 *db)
+{
+#ifdef HAVE_ZSTD
+        sqlite3_stmt *stmt;
+        int count, have_dict;
+
+        int rc = sql_exec(db, "BEGIN;");
+        if (rc != SQLITE_OK)
+                return rc;
+
+        rc = sqlite3_prepare_v2(db, "SELECT 1 FROM dictionaries LIMIT 1;", -1, &stmt, 0);
+
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                goto rollback;
+        }
+
+        have_dict = sqlite3_step(stmt) == SQLITE_ROW;
+        sqlite3_finalize(stmt);
+
+        if (!have_dict) {
+                rc = train_dictionary(db);
+                if (rc != SQLITE_OK)
+                        goto rollback;
+        }
+
+        rc = compressed_schema(db);
+        if (rc != SQLITE_OK)
+                goto rollback;
+
+        writer_reset();
+        rc = compress_text_notes(db, &count);
+        if (rc != SQLITE_OK)
+                goto rollback;
+
+        rc = sql_exec(db, "COMMIT;");
+        if (rc != SQLITE_OK)
+                goto rollback;
+
+        printf("Compressed %d notes\n", count);
+
+        // Give the space back so the file itself shrinks
+        rc = sql_exec(db, "VACUUM;");
+        if (rc != SQLITE_OK)
+                return rc;
+
+        return report(db);
+
+rollback:
+        sql_exec(db, "ROLLBACK;");
+        writer_reset();
+        return rc;
+#else
+        fprintf(stderr, "zkc was built without zstd support\n");
+        return SQLITE_ERROR;
+#endif
+}
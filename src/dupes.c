@@ -0,0 +1,594 @@
+#include <stdio.h>
+#include <sqlite3.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "app.h"
+#include "dupes.h"
+
+/*
+ * Near-duplicate notes by MinHash. A note is the set of its three word
+ * shingles over lower-cased words, so whitespace and punctuation changes
+ * do not matter, and its sketch is the minimum of SKETCH_HASHES different
+ * hashes over that set. The fraction of equal minimums between two
+ * sketches estimates the Jaccard similarity of the notes.
+ *
+ * Sketches are cut into BANDS bands of ROWS hashes and each band is
+ * hashed into a bucket in note_bands. Notes with similarity s share at
+ * least one bucket with probability 1 - (1 - s^ROWS)^BANDS, which is over
+ * 99.9% at s = 0.9 and about 12% at s = 0.3, so only notes sharing a
+ * bucket are compared. Sketches are refreshed for notes whose hash has
+ * changed since they were computed.
+ */
+#define SKETCH_HASHES 64
+#define BANDS 16
+#define ROWS (SKETCH_HASHES / BANDS)
+#define SHINGLE 3
+
+struct sketcher {
+        uint64_t mul[SKETCH_HASHES];
+        uint64_t add[SKETCH_HASHES];
+};
+
+struct pair {
+        sqlite3_int64 a, b;
+        int same;
+};
+
+static uint64_t
+splitmix64(uint64_t *state)
+{
+        uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return z ^ (z >> 31);
+}
+
+// The hash functions must be the same in every run, so the seed is fixed
+static void
+sketcher_init(struct sketcher *sk)
+{
+        uint64_t state = 0x7a6b63;
+
+        for (int i = 0; i < SKETCH_HASHES; i++) {
+                sk->mul[i] = splitmix64(&state) | 1;
+                sk->add[i] = splitmix64(&state);
+        }
+}
+
+static int
+is_word(unsigned char c)
+{
+        return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c >= 0x80;
+}
+
+static uint64_t
+word_hash(const char *s, size_t len)
+{
+        uint64_t h = 14695981039346656037ULL;
+        for (size_t i = 0; i < len; i++) {
+                unsigned char c = s[i] >= 'A' && s[i] <= 'Z' ? s[i] + 32 : s[i];
+                h = (h ^ c) * 1099511628211ULL;
+        }
+        return h;
+}
+
+static void
+add_shingle(const struct sketcher *sk, uint32_t *sig, uint64_t shingle)
+{
+        // Finish mixing so the multiply-shift hashes see well spread input
+        uint64_t state = shingle;
+        shingle = splitmix64(&state);
+
+        for (int i = 0; i < SKETCH_HASHES; i++) {
+                uint32_t h = (sk->mul[i] * shingle + sk->add[i]) >> 32;
+                if (h < sig[i])
+                        sig[i] = h;
+        }
+}
+
+// MinHash sketch of body into sig. Returns 0 for a note without words.
+static int
+sketch(const struct sketcher *sk, const char *body, uint32_t *sig)
+{
+        uint64_t window[SHINGLE];
+        size_t words = 0;
+
+        for (int i = 0; i < SKETCH_HASHES; i++)
+                sig[i] = UINT32_MAX;
+
+        for (size_t i = 0; body[i];) {
+                if (!is_word(body[i])) {
+                        i++;
+                        continue;
+                }
+
+                size_t start = i;
+                while (body[i] && is_word(body[i]))
+                        i++;
+
+                window[words % SHINGLE] = word_hash(body + start, i - start);
+                words++;
+
+                if (words >= SHINGLE) {
+                        uint64_t shingle = 0;
+                        for (size_t k = words - SHINGLE; k < words; k++)
+                                shingle = shingle * 1099511628211ULL + window[k % SHINGLE];
+                        add_shingle(sk, sig, shingle);
+                }
+        }
+
+        // Too short for a whole shingle, so all of its words are one
+        if (words > 0 && words < SHINGLE) {
+                uint64_t shingle = 0;
+                for (size_t k = 0; k < words; k++)
+                        shingle = shingle * 1099511628211ULL + window[k];
+                add_shingle(sk, sig, shingle);
+        }
+
+        return words > 0;
+}
+
+static sqlite3_int64
+band_bucket(const uint32_t *sig, int band)
+{
+        uint64_t h = 14695981039346656037ULL ^ band;
+        for (int i = band * ROWS; i < (band + 1) * ROWS; i++)
+                h = (h ^ sig[i]) * 1099511628211ULL;
+        return (sqlite3_int64)h;
+}
+
+// Sketches are stored big-endian so a database reads the same anywhere
+static void
+sig_encode(const uint32_t *sig, unsigned char *out)
+{
+        for (int i = 0; i < SKETCH_HASHES; i++) {
+                out[4 * i] = sig[i] >> 24;
+                out[4 * i + 1] = sig[i] >> 16;
+                out[4 * i + 2] = sig[i] >> 8;
+                out[4 * i + 3] = sig[i];
+        }
+}
+
+static void
+sig_decode(const unsigned char *in, uint32_t *sig)
+{
+        for (int i = 0; i < SKETCH_HASHES; i++)
+                sig[i] = (uint32_t)in[4 * i] << 24 | (uint32_t)in[4 * i + 1] << 16 |
+                        (uint32_t)in[4 * i + 2] << 8 | in[4 * i + 3];
+}
+
+static int
+sig_same(const uint32_t *x, const uint32_t *y)
+{
+        int same = 0;
+        for (int i = 0; i < SKETCH_HASHES; i++)
+                same += x[i] == y[i];
+        return same;
+}
+
+static int
+step_done(sqlite3 *db, sqlite3_stmt *stmt)
+{
+        int rc = sqlite3_step(stmt);
+        sqlite3_reset(stmt);
+
+        if (rc != SQLITE_DONE) {
+                fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+                return rc;
+        }
+
+        return SQLITE_OK;
+}
+
+int
+sketch_refresh(sqlite3 *db)
+{
+        struct sketcher sk;
+        sqlite3_stmt *stale = NULL, *clear = NULL, *set_sketch = NULL, *add_band = NULL;
+        int rc;
+
+        struct {
+                sqlite3_stmt **stmt;
+                const char *sql;
+        } prepare[] = {
+                { &stale, "SELECT notes.id, notes.hash, note_text(notes.body) FROM notes "
+                  "LEFT JOIN note_sketches ON note_sketches.note_id = notes.id "
+                  "WHERE note_sketches.hash IS NOT notes.hash;" },
+                { &clear, "DELETE FROM note_bands WHERE note_id = ?;" },
+                { &set_sketch, "INSERT OR REPLACE INTO note_sketches(note_id, hash, sig) VALUES(?, ?, ?);" },
+                { &add_band, "INSERT OR IGNORE INTO note_bands(band, bucket, note_id) VALUES(?, ?, ?);" },
+        };
+
+        sketcher_init(&sk);
+
+        rc = sql_exec(db, "BEGIN;");
+        if (rc != SQLITE_OK)
+                return rc;
+
+        for (size_t i = 0; i < sizeof(prepare) / sizeof(prepare[0]); i++) {
+                rc = sqlite3_prepare_v2(db, prepare[i].sql, -1, prepare[i].stmt, 0);
+
+                if (rc != SQLITE_OK) {
+                        fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                        goto rollback;
+                }
+        }
+
+        while ((rc = sqlite3_step(stale)) == SQLITE_ROW) {
+                sqlite3_int64 id = sqlite3_column_int64(stale, 0);
+                const char *body = (const char *)sqlite3_column_text(stale, 2);
+                uint32_t sig[SKETCH_HASHES];
+                unsigned char blob[4 * SKETCH_HASHES];
+
+                sqlite3_bind_int64(clear, 1, id);
+                rc = step_done(db, clear);
+                if (rc != SQLITE_OK)
+                        goto rollback;
+
+                int has_words = sketch(&sk, body ? body : "", sig);
+
+                sqlite3_bind_int64(set_sketch, 1, id);
+                sqlite3_bind_value(set_sketch, 2, sqlite3_column_value(stale, 1));
+                if (has_words) {
+                        sig_encode(sig, blob);
+                        sqlite3_bind_blob(set_sketch, 3, blob, sizeof(blob), SQLITE_STATIC);
+                } else {
+                        sqlite3_bind_null(set_sketch, 3);
+                }
+                rc = step_done(db, set_sketch);
+                if (rc != SQLITE_OK)
+                        goto rollback;
+
+                for (int band = 0; has_words && band < BANDS; band++) {
+                        sqlite3_bind_int(add_band, 1, band);
+                        sqlite3_bind_int64(add_band, 2, band_bucket(sig, band));
+                        sqlite3_bind_int64(add_band, 3, id);
+                        rc = step_done(db, add_band);
+                        if (rc != SQLITE_OK)
+                                goto rollback;
+                }
+        }
+
+        if (rc != SQLITE_DONE) {
+                fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+                goto rollback;
+        }
+
+        sqlite3_finalize(stale);
+        stale = NULL;
+
+        rc = sql_exec(db, "COMMIT;");
+        if (rc == SQLITE_OK)
+                goto end;
+
+rollback:
+        sqlite3_finalize(stale);
+        stale = NULL;
+        sql_exec(db, "ROLLBACK;");
+end:
+        sqlite3_finalize(clear);
+        sqlite3_finalize(set_sketch);
+        sqlite3_finalize(add_band);
+        return rc;
+}
+
+static int
+cmp_pair(const void *a, const void *b)
+{
+        const struct pair *x = a, *y = b;
+        if (x->a != y->a)
+                return (x->a > y->a) - (x->a < y->a);
+        return (x->b > y->b) - (x->b < y->b);
+}
+
+// Most similar first, then in note order
+static int
+cmp_score(const void *a, const void *b)
+{
+        const struct pair *x = a, *y = b;
+        if (x->same != y->same)
+                return y->same - x->same;
+        return cmp_pair(a, b);
+}
+
+static int
+cmp_int64(const void *a, const void *b)
+{
+        sqlite3_int64 x = *(const sqlite3_int64 *)a, y = *(const sqlite3_int64 *)b;
+        return (x > y) - (x < y);
+}
+
+static int
+add_pair(struct pair **pairs, size_t *count, size_t *cap, sqlite3_int64 a, sqlite3_int64 b)
+{
+        if (*count == *cap) {
+                *cap = *cap ? *cap * 2 : 1024;
+                struct pair *tmp = realloc(*pairs, *cap * sizeof(**pairs));
+                if (!tmp)
+                        return SQLITE_NOMEM;
+                *pairs = tmp;
+        }
+
+        (*pairs)[*count].a = a < b ? a : b;
+        (*pairs)[*count].b = a < b ? b : a;
+        (*count)++;
+        return SQLITE_OK;
+}
+
+// Sketches of every note that has one, sorted by note id for bsearch
+static int
+load_sketches(sqlite3 *db, sqlite3_int64 **ids, uint32_t **sigs, size_t *count)
+{
+        sqlite3_stmt *stmt;
+        size_t cap = 0;
+        int rc = sqlite3_prepare_v2(db, "SELECT note_id, sig FROM note_sketches "
+                                    "WHERE sig IS NOT NULL ORDER BY note_id;", -1, &stmt, 0);
+
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                return rc;
+        }
+
+        *ids = NULL;
+        *sigs = NULL;
+        *count = 0;
+
+        while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+                if (sqlite3_column_bytes(stmt, 1) != 4 * SKETCH_HASHES)
+                        continue;
+
+                if (*count == cap) {
+                        cap = cap ? cap * 2 : 1024;
+                        sqlite3_int64 *i = realloc(*ids, cap * sizeof(**ids));
+                        uint32_t *s = i ? realloc(*sigs, cap * SKETCH_HASHES * sizeof(**sigs)) : NULL;
+                        if (i)
+                                *ids = i;
+                        if (s)
+                                *sigs = s;
+                        if (!i || !s) {
+                                sqlite3_finalize(stmt);
+                                return SQLITE_NOMEM;
+                        }
+                }
+
+                (*ids)[*count] = sqlite3_column_int64(stmt, 0);
+                sig_decode(sqlite3_column_blob(stmt, 1), *sigs + *count * SKETCH_HASHES);
+                (*count)++;
+        }
+
+        sqlite3_finalize(stmt);
+
+        if (rc != SQLITE_DONE) {
+                fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+                return rc;
+        }
+
+        return SQLITE_OK;
+}
+
+static const uint32_t *
+find_sketch(const sqlite3_int64 *ids, const uint32_t *sigs, size_t count, sqlite3_int64 id)
+{
+        const sqlite3_int64 *found = bsearch(&id, ids, count, sizeof(*ids), cmp_int64);
+        return found ? sigs + (found - ids) * SKETCH_HASHES : NULL;
+}
+
+int
+near_dupes(sqlite3 *db, double threshold)
+{
+        sqlite3_stmt *bands = NULL, *note = NULL;
+        sqlite3_int64 *ids = NULL, *bucket = NULL;
+        uint32_t *sigs = NULL;
+        struct pair *pairs = NULL;
+        size_t nsketches, npairs = 0, pairs_cap = 0, nbucket = 0, bucket_cap = 0;
+        int rc;
+
+        if (threshold <= 0 || threshold > 1) {
+                fprintf(stderr, "Threshold must be between 0 and 1\n");
+                return SQLITE_MISUSE;
+        }
+
+        rc = sketch_refresh(db);
+        if (rc != SQLITE_OK)
+                return rc;
+
+        rc = load_sketches(db, &ids, &sigs, &nsketches);
+        if (rc != SQLITE_OK)
+                goto end;
+
+        // Rows come in key order, so each bucket is one run of notes
+        rc = sqlite3_prepare_v2(db, "SELECT band, bucket, note_id FROM note_bands "
+                                "ORDER BY band, bucket;", -1, &bands, 0);
+
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                goto end;
+        }
+
+        int band = -1;
+        sqlite3_int64 key = 0;
+
+        for (;;) {
+                rc = sqlite3_step(bands);
+                int more = rc == SQLITE_ROW;
+
+                if (!more || sqlite3_column_int(bands, 0) != band || sqlite3_column_int64(bands, 1) != key) {
+                        for (size_t i = 0; i < nbucket; i++)
+                                for (size_t j = i + 1; j < nbucket; j++)
+                                        if ((rc = add_pair(&pairs, &npairs, &pairs_cap,
+                                                           bucket[i], bucket[j])) != SQLITE_OK)
+                                                goto end;
+                        nbucket = 0;
+                }
+
+                if (!more)
+                        break;
+
+                band = sqlite3_column_int(bands, 0);
+                key = sqlite3_column_int64(bands, 1);
+
+                if (nbucket == bucket_cap) {
+                        bucket_cap = bucket_cap ? bucket_cap * 2 : 16;
+                        sqlite3_int64 *tmp = realloc(bucket, bucket_cap * sizeof(*bucket));
+                        if (!tmp) {
+                                rc = SQLITE_NOMEM;
+                                goto end;
+                        }
+                        bucket = tmp;
+                }
+                bucket[nbucket++] = sqlite3_column_int64(bands, 2);
+        }
+
+        if (rc != SQLITE_DONE) {
+                fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+                goto end;
+        }
+
+        // Pairs sharing several buckets are checked once, on whole sketches
+        qsort(pairs, npairs, sizeof(*pairs), cmp_pair);
+
+        int need = (int)(threshold * SKETCH_HASHES + 0.999);
+        size_t kept = 0;
+
+        for (size_t i = 0; i < npairs; i++) {
+                if (kept && !cmp_pair(&pairs[kept - 1], &pairs[i]))
+                        continue;
+
+                const uint32_t *x = find_sketch(ids, sigs, nsketches, pairs[i].a);
+                const uint32_t *y = find_sketch(ids, sigs, nsketches, pairs[i].b);
+                if (!x || !y)
+                        continue;
+
+                pairs[i].same = sig_same(x, y);
+                if (pairs[i].same >= need)
+                        pairs[kept++] = pairs[i];
+        }
+
+        qsort(pairs, kept, sizeof(*pairs), cmp_score);
+
+        rc = sqlite3_prepare_v2(db, "SELECT uuid, date, note_text(body) FROM notes WHERE id = ?;", -1, &note, 0);
+
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                goto end;
+        }
+
+        for (size_t i = 0; i < kept; i++) {
+                printf("%.2f ", (double)pairs[i].same / SKETCH_HASHES);
+
+                for (int k = 0; k < 2; k++) {
+                        sqlite3_bind_int64(note, 1, k ? pairs[i].b : pairs[i].a);
+
+                        rc = sqlite3_step(note);
+                        if (rc == SQLITE_ROW) {
+                                if (k)
+                                        printf("     ");
+                                print_summary((const char *)sqlite3_column_text(note, 0),
+                                              (const char *)sqlite3_column_text(note, 1),
+                                              (const char *)sqlite3_column_text(note, 2));
+                        } else {
+                                fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+                                goto end;
+                        }
+
+                        sqlite3_reset(note);
+                }
+        }
+
+        rc = SQLITE_OK;
+
+end:
+        sqlite3_finalize(bands);
+        sqlite3_finalize(note);
+        free(ids);
+        free(sigs);
+        free(bucket);
+        free(pairs);
+        return rc;
+}
+
+int
+near_dupes_of(sqlite3 *db, const char *uuid, const char *body, double threshold)
+{
+        struct sketcher sk;
+        uint32_t sig[SKETCH_HASHES], other[SKETCH_HASHES];
+        sqlite3_int64 *found = NULL;
+        size_t nfound = 0, found_cap = 0;
+        sqlite3_stmt *candidates = NULL, *stored = NULL;
+        int rc;
+
+        sketcher_init(&sk);
+        if (!sketch(&sk, body, sig))
+                return SQLITE_OK;
+
+        char *candidates_sql = "SELECT note_bands.note_id FROM note_bands "
+                "INNER JOIN notes ON notes.id = note_bands.note_id "
+                "WHERE note_bands.band = ? AND note_bands.bucket = ? AND notes.uuid != ?;";
+        char *stored_sql = "SELECT note_sketches.sig, notes.uuid FROM note_sketches "
+                "INNER JOIN notes ON notes.id = note_sketches.note_id "
+                "WHERE note_sketches.note_id = ?;";
+
+        if ((rc = sqlite3_prepare_v2(db, candidates_sql, -1, &candidates, 0)) != SQLITE_OK ||
+            (rc = sqlite3_prepare_v2(db, stored_sql, -1, &stored, 0)) != SQLITE_OK) {
+                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                goto end;
+        }
+
+        for (int band = 0; band < BANDS; band++) {
+                sqlite3_bind_int(candidates, 1, band);
+                sqlite3_bind_int64(candidates, 2, band_bucket(sig, band));
+                sqlite3_bind_text(candidates, 3, uuid, -1, SQLITE_STATIC);
+
+                while ((rc = sqlite3_step(candidates)) == SQLITE_ROW) {
+                        if (nfound == found_cap) {
+                                found_cap = found_cap ? found_cap * 2 : 64;
+                                sqlite3_int64 *tmp = realloc(found, found_cap * sizeof(*found));
+                                if (!tmp) {
+                                        rc = SQLITE_NOMEM;
+                                        goto end;
+                                }
+                                found = tmp;
+                        }
+                        found[nfound++] = sqlite3_column_int64(candidates, 0);
+                }
+
+                sqlite3_reset(candidates);
+
+                if (rc != SQLITE_DONE) {
+                        fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+                        goto end;
+                }
+        }
+
+        qsort(found, nfound, sizeof(*found), cmp_int64);
+
+        for (size_t i = 0; i < nfound; i++) {
+                if (i && found[i] == found[i - 1])
+                        continue;
+
+                sqlite3_bind_int64(stored, 1, found[i]);
+
+                rc = sqlite3_step(stored);
+                if (rc == SQLITE_ROW && sqlite3_column_bytes(stored, 0) == 4 * SKETCH_HASHES) {
+                        sig_decode(sqlite3_column_blob(stored, 0), other);
+                        double score = (double)sig_same(sig, other) / SKETCH_HASHES;
+                        if (score >= threshold)
+                                printf("Near duplicate: %s ~ %s (%.2f)\n", uuid,
+                                       (const char *)sqlite3_column_text(stored, 1), score);
+                } else if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+                        fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+                        goto end;
+                }
+
+                sqlite3_reset(stored);
+        }
+
+        rc = SQLITE_OK;
+
+end:
+        sqlite3_finalize(candidates);
+        sqlite3_finalize(stored);
+        free(found);
+        return rc;
+}
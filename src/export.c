@@ -0,0 +1,742 @@
+#include <stdio.h>
+#include <sqlite3.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "app.h"
+#include "hash.h"
+#include "export.h"
+
+/*
+ * The database is read on this thread, which renders each note with its
+ * front matter and queues it for a pool of writer threads. A writer
+ * hashes the file and leaves it alone when the manifest of the last
+ * export says it already has that hash and size, so exporting again
+ * after a few edits only writes what changed. Tags and links are read
+ * in note order alongside the notes, not looked up per note.
+ */
+#define EXPORT_MANIFEST ".zkc-export"
+#define EXPORT_QUEUE 256
+#define EXPORT_MAX_THREADS 8
+#define TITLE_MAX 64
+
+struct export_file {
+        char *name;
+        char *data;
+        size_t len;
+        char hash[SHA256_HEX_LENGTH + 1];
+        int state;              // 1 written, 0 unchanged, -1 failed or not written
+};
+
+struct file_slot {
+        char *name;
+        char hash[SHA256_HEX_LENGTH + 1];
+        long long size;
+};
+
+// Open addressing map from file name to the hash and size it was
+// exported with
+struct file_map {
+        size_t cap, n;
+        struct file_slot *slot;
+};
+
+struct export_queue {
+        pthread_mutex_t lock;
+        pthread_cond_t ready, room;
+        struct export_file *slot[EXPORT_QUEUE];
+        int head, count, closed;
+        const char *dir;
+        const struct file_map *manifest;
+};
+
+struct export_writer {
+        pthread_t thread;
+        struct export_queue *q;
+        int written, unchanged, failed;
+};
+
+static int
+put(struct note_files *b, const char *s, size_t len)
+{
+        if (b->len + len + 1 > b->cap) {
+                size_t cap = b->cap ? b->cap : 1024;
+                while (cap < b->len + len + 1)
+                        cap *= 2;
+
+                char *data = realloc(b->data, cap);
+                if (!data)
+                        return -1;
+                b->data = data;
+                b->cap = cap;
+        }
+
+        memcpy(b->data + b->len, s, len);
+        b->len += len;
+        b->data[b->len] = '\0';
+        return 0;
+}
+
+static int
+puts_buf(struct note_files *b, const char *s)
+{
+        return put(b, s, strlen(s));
+}
+
+// Tags are quoted, since they may hold anything
+static int
+put_quoted(struct note_files *b, const char *s)
+{
+        if (put(b, "\"", 1))
+                return -1;
+
+        for (; *s; s++) {
+                if ((*s == '"' || *s == '\\') && put(b, "\\", 1))
+                        return -1;
+                if (put(b, s, 1))
+                        return -1;
+        }
+
+        return put(b, "\"", 1);
+}
+
+static size_t
+name_hash(const char *s)
+{
+        size_t h = 14695981039346656037ULL;
+        for (; *s; s++)
+                h = (h ^ (unsigned char)*s) * 1099511628211ULL;
+        return h;
+}
+
+static struct file_slot *
+file_find(const struct file_map *map, const char *name)
+{
+        if (!map->cap)
+                return NULL;
+
+        size_t i = name_hash(name) & (map->cap - 1);
+
+        while (map->slot[i].name && strcmp(map->slot[i].name, name))
+                i = (i + 1) & (map->cap - 1);
+
+        return &map->slot[i];
+}
+
+static int
+file_put(struct file_map *map, const char *name, const char *hash, long long size)
+{
+        if ((map->n + 1) * 2 > map->cap) {
+                struct file_map bigger = { .cap = map->cap ? map->cap * 2 : 1024 };
+                bigger.slot = calloc(bigger.cap, sizeof(*bigger.slot));
+                if (!bigger.slot)
+                        return SQLITE_NOMEM;
+
+                for (size_t i = 0; i < map->cap; i++)
+                        if (map->slot[i].name)
+                                *file_find(&bigger, map->slot[i].name) = map->slot[i];
+
+                bigger.n = map->n;
+                free(map->slot);
+                *map = bigger;
+        }
+
+        struct file_slot *slot = file_find(map, name);
+        if (!slot->name) {
+                slot->name = strdup(name);
+                if (!slot->name)
+                        return SQLITE_NOMEM;
+                map->n++;
+        }
+        snprintf(slot->hash, sizeof(slot->hash), "%s", hash);
+        slot->size = size;
+        return SQLITE_OK;
+}
+
+static void
+file_map_free(struct file_map *map)
+{
+        for (size_t i = 0; i < map->cap; i++)
+                free(map->slot[i].name);
+        free(map->slot);
+}
+
+// The manifest has a "hash size name" line per file of the last export.
+// A missing or unreadable manifest just means every file is written.
+static int
+read_manifest(const char *dir, struct file_map *map)
+{
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/" EXPORT_MANIFEST, dir);
+
+        FILE *f = fopen(path, "r");
+        if (!f)
+                return SQLITE_OK;
+
+        char *line = NULL;
+        size_t cap = 0;
+        ssize_t n;
+        int rc = SQLITE_OK;
+
+        while (rc == SQLITE_OK && (n = getline(&line, &cap, f)) != -1) {
+                char hash[SHA256_HEX_LENGTH + 1];
+                long long size;
+                int name;
+
+                if (n && line[n - 1] == '\n')
+                        line[n - 1] = '\0';
+
+                if (sscanf(line, "%64s %lld %n", hash, &size, &name) == 2 && line[name])
+                        rc = file_put(map, line + name, hash, size);
+        }
+
+        free(line);
+        fclose(f);
+        return rc;
+}
+
+static int
+write_manifest(const char *dir, struct export_file **files, int n)
+{
+        char path[PATH_MAX], tmp[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/" EXPORT_MANIFEST, dir);
+
+        FILE *f = NULL;
+        if ((size_t)snprintf(tmp, sizeof(tmp), "%s.%ld", path, (long)getpid()) < sizeof(tmp))
+                f = fopen(tmp, "w");
+        if (!f) {
+                fprintf(stderr, "Cannot write %s\n", path);
+                return 1;
+        }
+
+        int ok = 1;
+        for (int i = 0; i < n && ok; i++) {
+                // Failed files are left out so the next export retries them
+                if (files[i]->state >= 0)
+                        ok = fprintf(f, "%s %zu %s\n", files[i]->hash, files[i]->len, files[i]->name) > 0;
+        }
+
+        if (fclose(f) != 0)
+                ok = 0;
+
+        if (!ok || rename(tmp, path) != 0) {
+                fprintf(stderr, "Cannot write %s\n", path);
+                remove(tmp);
+                return 1;
+        }
+
+        return SQLITE_OK;
+}
+
+// Remove the files the last export wrote that this one did not, so the
+// files of deleted and renamed notes don't linger. A file whose size no
+// longer matches the manifest was edited since and is left alone.
+static int
+remove_stale(const char *dir, const struct file_map *manifest, const struct file_map *used)
+{
+        int removed = 0;
+
+        for (size_t i = 0; i < manifest->cap; i++) {
+                const struct file_slot *old = &manifest->slot[i];
+                char path[PATH_MAX];
+                struct stat st;
+
+                if (!old->name || old->name[0] == '.' || strchr(old->name, '/'))
+                        continue;
+
+                const struct file_slot *now = file_find(used, old->name);
+                if (now && now->name)
+                        continue;
+
+                if ((size_t)snprintf(path, sizeof(path), "%s/%s", dir, old->name) >= sizeof(path))
+                        continue;
+
+                if (stat(path, &st) != 0 || st.st_size != (off_t)old->size)
+                        continue;
+
+                if (remove(path) == 0)
+                        removed++;
+                else
+                        fprintf(stderr, "Cannot remove %s\n", path);
+        }
+
+        return removed;
+}
+
+// Write a file unless the last export left it with the same contents.
+// Files are written under a temporary name and renamed into place.
+static void
+write_file(struct export_queue *q, struct export_file *file)
+{
+        char path[PATH_MAX], tmp[PATH_MAX];
+        struct stat st;
+
+        if ((size_t)snprintf(path, sizeof(path), "%s/%s", q->dir, file->name) >= sizeof(path)
+            || (size_t)snprintf(tmp, sizeof(tmp), "%s/.%s.tmp", q->dir, file->name) >= sizeof(tmp)) {
+                fprintf(stderr, "Path too long: %s/%s\n", q->dir, file->name);
+                file->state = -1;
+                return;
+        }
+
+        if (sha256_hex(file->data, file->len, file->hash)) {
+                fprintf(stderr, "Cannot hash %s\n", path);
+                file->state = -1;
+                return;
+        }
+
+        const struct file_slot *old = file_find(q->manifest, file->name);
+        if (old && old->name && !strcmp(old->hash, file->hash)
+            && stat(path, &st) == 0 && st.st_size == (off_t)file->len) {
+                file->state = 0;
+                return;
+        }
+
+        FILE *f = fopen(tmp, "wb");
+        int ok = f && fwrite(file->data, 1, file->len, f) == file->len;
+
+        if (f && fclose(f) != 0)
+                ok = 0;
+
+        if (!ok || rename(tmp, path) != 0) {
+                fprintf(stderr, "Cannot write %s\n", path);
+                remove(tmp);
+                file->state = -1;
+                return;
+        }
+
+        file->state = 1;
+}
+
+static void *
+export_worker(void *arg)
+{
+        struct export_writer *w = arg;
+        struct export_queue *q = w->q;
+
+        for (;;) {
+                pthread_mutex_lock(&q->lock);
+                while (!q->count && !q->closed)
+                        pthread_cond_wait(&q->ready, &q->lock);
+
+                if (!q->count) {
+                        pthread_mutex_unlock(&q->lock);
+                        break;
+                }
+
+                struct export_file *file = q->slot[q->head];
+                q->head = (q->head + 1) % EXPORT_QUEUE;
+                q->count--;
+                pthread_cond_signal(&q->room);
+                pthread_mutex_unlock(&q->lock);
+
+                write_file(q, file);
+                free(file->data);
+                file->data = NULL;
+
+                if (file->state > 0)
+                        w->written++;
+                else if (file->state == 0)
+                        w->unchanged++;
+                else
+                        w->failed++;
+        }
+
+        return NULL;
+}
+
+static void
+queue_push(struct export_queue *q, struct export_file *file)
+{
+        pthread_mutex_lock(&q->lock);
+        while (q->count == EXPORT_QUEUE)
+                pthread_cond_wait(&q->room, &q->lock);
+
+        q->slot[(q->head + q->count) % EXPORT_QUEUE] = file;
+        q->count++;
+        pthread_cond_signal(&q->ready);
+        pthread_mutex_unlock(&q->lock);
+}
+
+static void
+queue_close(struct export_queue *q)
+{
+        pthread_mutex_lock(&q->lock);
+        q->closed = 1;
+        pthread_cond_broadcast(&q->ready);
+        pthread_mutex_unlock(&q->lock);
+}
+
+static int
+export_threads(void)
+{
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+        if (cpus < 1)
+                cpus = 1;
+        if (cpus > EXPORT_MAX_THREADS)
+                cpus = EXPORT_MAX_THREADS;
+
+        return cpus;
+}
+
+// File name from the first line of body: letters and digits lower-cased,
+// everything else collapsed to '-'. Empty if there is nothing to use.
+static void
+title_name(const char *body, char *out, size_t len)
+{
+        size_t n = 0;
+        int dash = 0;
+
+        while (*body == '\n' || *body == '\r' || *body == ' ' || *body == '\t' || *body == '#')
+                body++;
+
+        for (; *body && *body != '\n' && n + 1 < len && n < TITLE_MAX; body++) {
+                unsigned char c = *body;
+
+                if ((c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c >= 0x80) {
+                        if (dash && n)
+                                out[n++] = '-';
+                        if (n + 1 < len)
+                                out[n++] = c;
+                        dash = 0;
+                } else if (c >= 'A' && c <= 'Z') {
+                        if (dash && n)
+                                out[n++] = '-';
+                        if (n + 1 < len)
+                                out[n++] = c - 'A' + 'a';
+                        dash = 0;
+                } else {
+                        dash = 1;
+                }
+        }
+
+        // Drop a UTF-8 character the length limit cut short
+        size_t start = n;
+        while (start > 0 && ((unsigned char)out[start - 1] & 0xc0) == 0x80)
+                start--;
+        if (start > 0 && (unsigned char)out[start - 1] >= 0xc0) {
+                unsigned char lead = out[start - 1];
+                size_t need = lead >= 0xf0 ? 4 : lead >= 0xe0 ? 3 : 2;
+                if (n - (start - 1) < need)
+                        n = start - 1;
+        }
+
+        while (n && out[n - 1] == '-')
+                n--;
+
+        out[n] = '\0';
+}
+
+// Pick the file name of a note. Notes whose titles clash after the first
+// get the start of their uuid added.
+static int
+file_name(struct file_map *used, int by_title, const char *uuid, const char *body,
+          char *out, size_t len)
+{
+        char title[TITLE_MAX + 1] = "";
+
+        if (by_title)
+                title_name(body, title, sizeof(title));
+
+        if (!title[0]) {
+                snprintf(out, len, "%s.md", uuid);
+        } else {
+                snprintf(out, len, "%s.md", title);
+                const struct file_slot *slot = file_find(used, out);
+                if (slot && slot->name)
+                        snprintf(out, len, "%s-%.8s.md", title, uuid);
+        }
+
+        const struct file_slot *slot = file_find(used, out);
+        if (slot && slot->name)
+                snprintf(out, len, "%s.md", uuid);
+
+        return file_put(used, out, "", 0);
+}
+
+// Step a cursor over rows keyed by note id in column 0 up to id
+static int
+seek(sqlite3_stmt *stmt, int *rc, sqlite3_int64 id)
+{
+        while (*rc == SQLITE_ROW && sqlite3_column_int64(stmt, 0) < id)
+                *rc = sqlite3_step(stmt);
+
+        return *rc == SQLITE_ROW && sqlite3_column_int64(stmt, 0) == id;
+}
+
+int
+note_files_open(sqlite3 *db, const char *where, const char *search_word, struct note_files *nf)
+{
+        char notes[1024], tags[1024], links[1024];
+        char filter[768] = "";
+
+        memset(nf, 0, sizeof(*nf));
+
+        // Tags and links are kept to the same notes and read in note order
+        if (where)
+                snprintf(filter, sizeof(filter), "IN (SELECT notes.id FROM notes WHERE %s) ", where);
+
+        snprintf(notes, sizeof(notes), "SELECT id, uuid, date, note_text(body), hash FROM notes "
+                 "%s%s ORDER BY id;", where ? "WHERE " : "", where ? where : "");
+        snprintf(tags, sizeof(tags), "SELECT note_tags.note_id, tags.body FROM note_tags "
+                 "INNER JOIN tags ON tags.id = note_tags.tag_id "
+                 "%s%s ORDER BY note_tags.note_id, tags.body;",
+                 where ? "WHERE note_tags.note_id " : "", filter);
+        snprintf(links, sizeof(links), "SELECT links.a_id, targets.uuid FROM links "
+                 "INNER JOIN notes targets ON targets.id = links.b_id "
+                 "%s%s ORDER BY links.a_id, targets.uuid;",
+                 where ? "WHERE links.a_id " : "", filter);
+
+        int rc = sqlite3_prepare_v2(db, notes, -1, &nf->notes, 0);
+        if (rc == SQLITE_OK)
+                rc = sqlite3_prepare_v2(db, tags, -1, &nf->tags, 0);
+        if (rc == SQLITE_OK)
+                rc = sqlite3_prepare_v2(db, links, -1, &nf->links, 0);
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                note_files_close(nf);
+                return rc;
+        }
+
+        if (where) {
+                sqlite3_bind_text(nf->notes, 1, search_word, strlen(search_word), SQLITE_STATIC);
+                sqlite3_bind_text(nf->tags, 1, search_word, strlen(search_word), SQLITE_STATIC);
+                sqlite3_bind_text(nf->links, 1, search_word, strlen(search_word), SQLITE_STATIC);
+        }
+
+        nf->tags_rc = sqlite3_step(nf->tags);
+        nf->links_rc = sqlite3_step(nf->links);
+        return SQLITE_OK;
+}
+
+int
+note_files_next(struct note_files *nf)
+{
+        int rc = sqlite3_step(nf->notes);
+        if (rc != SQLITE_ROW) {
+                if (rc == SQLITE_DONE && nf->tags_rc != SQLITE_ROW && nf->tags_rc != SQLITE_DONE)
+                        rc = nf->tags_rc;
+                if (rc == SQLITE_DONE && nf->links_rc != SQLITE_ROW && nf->links_rc != SQLITE_DONE)
+                        rc = nf->links_rc;
+                if (rc != SQLITE_DONE)
+                        fprintf(stderr, "execution failed: %s\n",
+                                sqlite3_errmsg(sqlite3_db_handle(nf->notes)));
+                return rc;
+        }
+
+        sqlite3_stmt *note = nf->notes;
+        sqlite3_int64 id = sqlite3_column_int64(note, 0);
+        const char *body = (const char *)sqlite3_column_text(note, 3);
+        int empty;
+
+        nf->len = 0;
+        if (puts_buf(nf, "---\nuuid: ") || puts_buf(nf, (const char *)sqlite3_column_text(note, 1))
+            || puts_buf(nf, "\ndate: ") || puts_buf(nf, (const char *)sqlite3_column_text(note, 2))
+            || puts_buf(nf, "\ntags:"))
+                goto nomem;
+
+        for (empty = 1; seek(nf->tags, &nf->tags_rc, id); nf->tags_rc = sqlite3_step(nf->tags), empty = 0) {
+                if (puts_buf(nf, "\n  - ") || put_quoted(nf, (const char *)sqlite3_column_text(nf->tags, 1)))
+                        goto nomem;
+        }
+
+        if ((empty && puts_buf(nf, " []")) || puts_buf(nf, "\nlinks:"))
+                goto nomem;
+
+        for (empty = 1; seek(nf->links, &nf->links_rc, id); nf->links_rc = sqlite3_step(nf->links), empty = 0) {
+                if (puts_buf(nf, "\n  - ") || puts_buf(nf, (const char *)sqlite3_column_text(nf->links, 1)))
+                        goto nomem;
+        }
+
+        if ((empty && puts_buf(nf, " []")) || puts_buf(nf, "\n---\n") || puts_buf(nf, body ? body : ""))
+                goto nomem;
+
+        return SQLITE_ROW;
+
+nomem:
+        return SQLITE_NOMEM;
+}
+
+void
+note_files_close(struct note_files *nf)
+{
+        sqlite3_finalize(nf->notes);
+        sqlite3_finalize(nf->tags);
+        sqlite3_finalize(nf->links);
+        free(nf->data);
+        memset(nf, 0, sizeof(*nf));
+}
+
+int
+export_dir(sqlite3 *db, int argc, char **argv)
+{
+        const char *dir = NULL, *search_type = NULL, *search_word = NULL;
+        int by_title = 0;
+
+        for (int i = 0; i < argc; i++) {
+                if (!strcmp(argv[i], "--tag") && i + 1 < argc) {
+                        search_type = "tree";
+                        search_word = argv[++i];
+                } else if (!strcmp(argv[i], "--where") && i + 2 < argc) {
+                        search_type = argv[++i];
+                        search_word = argv[++i];
+                } else if (!strcmp(argv[i], "--name") && i + 1 < argc) {
+                        i++;
+                        if (!strcmp(argv[i], "title")) {
+                                by_title = 1;
+                        } else if (strcmp(argv[i], "uuid")) {
+                                fprintf(stderr, "Invalid export-dir name: %s\n", argv[i]);
+                                return 1;
+                        }
+                } else if (argv[i][0] != '-' && !dir) {
+                        dir = argv[i];
+                } else {
+                        fprintf(stderr, "Invalid export-dir option: %s\n", argv[i]);
+                        return 1;
+                }
+        }
+
+        if (!dir) {
+                fprintf(stderr, "No export directory given\n");
+                return 1;
+        }
+
+        const char *where = NULL;
+        if (search_type) {
+                where = search_where(db, search_type);
+                if (!where) {
+                        fprintf(stderr, "Invalid search type: %s\n", search_type);
+                        return 1;
+                }
+        }
+
+        if (mkdir(dir, 0777) != 0 && errno != EEXIST) {
+                fprintf(stderr, "Cannot create directory: %s\n", dir);
+                return 1;
+        }
+
+        struct note_files nf;
+        struct file_map manifest = { 0 }, used = { 0 };
+        struct export_file **files = NULL;
+        struct export_writer writers[EXPORT_MAX_THREADS] = { 0 };
+        struct export_queue q = { .dir = dir, .manifest = &manifest };
+        int nfiles = 0, cap = 0, started = 0;
+
+        int rc = note_files_open(db, where, search_word, &nf);
+        if (rc != SQLITE_OK)
+                return rc;
+
+        rc = read_manifest(dir, &manifest);
+        if (rc != SQLITE_OK)
+                goto end;
+
+        pthread_mutex_init(&q.lock, NULL);
+        pthread_cond_init(&q.ready, NULL);
+        pthread_cond_init(&q.room, NULL);
+
+        int nthreads = export_threads();
+        for (; started < nthreads; started++) {
+                writers[started].q = &q;
+                if (pthread_create(&writers[started].thread, NULL, export_worker, &writers[started]) != 0)
+                        break;
+        }
+
+        while ((rc = note_files_next(&nf)) == SQLITE_ROW) {
+                const char *uuid = (const char *)sqlite3_column_text(nf.notes, 1);
+                const char *body = (const char *)sqlite3_column_text(nf.notes, 3);
+                char name[TITLE_MAX + 64];
+
+                if (nfiles == cap) {
+                        cap = cap ? cap * 2 : 1024;
+                        struct export_file **grown = realloc(files, cap * sizeof(*files));
+                        if (!grown) {
+                                rc = SQLITE_NOMEM;
+                                break;
+                        }
+                        files = grown;
+                }
+
+                struct export_file *file = calloc(1, sizeof(*file));
+                if (!file) {
+                        rc = SQLITE_NOMEM;
+                        break;
+                }
+                file->state = -1;
+                files[nfiles++] = file;
+
+                rc = file_name(&used, by_title, uuid, body ? body : "", name, sizeof(name));
+                if (rc != SQLITE_OK)
+                        break;
+
+                file->name = strdup(name);
+                file->data = malloc(nf.len + 1);
+                if (!file->name || !file->data) {
+                        rc = SQLITE_NOMEM;
+                        break;
+                }
+                memcpy(file->data, nf.data, nf.len);
+                file->len = nf.len;
+
+                // With no writer thread running the file is written here
+                if (started) {
+                        queue_push(&q, file);
+                } else {
+                        write_file(&q, file);
+                        free(file->data);
+                        file->data = NULL;
+                        writers[0].written += file->state > 0;
+                        writers[0].unchanged += file->state == 0;
+                        writers[0].failed += file->state < 0;
+                }
+        }
+
+        queue_close(&q);
+        for (int t = 0; t < started; t++)
+                pthread_join(writers[t].thread, NULL);
+
+        if (rc == SQLITE_NOMEM)
+                fprintf(stderr, "Cannot export notes: out of memory\n");
+        else if (rc == SQLITE_DONE)
+                rc = SQLITE_OK;
+
+        int written = 0, unchanged = 0, failed = 0, removed = 0;
+        for (int t = 0; t < EXPORT_MAX_THREADS; t++) {
+                written += writers[t].written;
+                unchanged += writers[t].unchanged;
+                failed += writers[t].failed;
+        }
+
+        // Only a complete export knows every file that is still wanted
+        if (rc == SQLITE_OK)
+                removed = remove_stale(dir, &manifest, &used);
+
+        if (write_manifest(dir, files, nfiles) != SQLITE_OK && rc == SQLITE_OK)
+                rc = 1;
+
+        printf("Exported %d notes to %s: %d written, %d unchanged, %d removed\n",
+               written + unchanged, dir, written, unchanged, removed);
+        if (failed && rc == SQLITE_OK) {
+                fprintf(stderr, "Failed to write %d notes\n", failed);
+                rc = 1;
+        }
+
+        pthread_cond_destroy(&q.room);
+        pthread_cond_destroy(&q.ready);
+        pthread_mutex_destroy(&q.lock);
+
+end:
+        for (int i = 0; i < nfiles; i++) {
+                free(files[i]->name);
+                free(files[i]->data);
+                free(files[i]);
+        }
+        free(files);
+        file_map_free(&manifest);
+        file_map_free(&used);
+        note_files_close(&nf);
+        return rc;
+}
@@ -0,0 +1,280 @@
+#include <stdio.h>
+#include <sqlite3.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "app.h"
+#include "fuzzy.h"
+
+/*
+ * Fuzzy matching on the note_trigrams index, or on a scan of every note in
+ * a vault that predates it. The term is cut into its distinct trigrams and
+ * each one's posting list is read from the index; a note's score is the fraction of the term's trigrams it contains. A single
+ * typo destroys at most three trigrams, so notes missing more than that
+ * (or more than half of a short term's) are dropped.
+ */
+#define MAX_TRIGRAMS 64
+
+struct hit {
+        sqlite3_int64 id;
+        int shared;
+};
+
+static int
+cmp_id(const void *a, const void *b)
+{
+        sqlite3_int64 x = *(const sqlite3_int64 *)a, y = *(const sqlite3_int64 *)b;
+        return (x > y) - (x < y);
+}
+
+// Best score first, newest note first among equals
+static int
+cmp_hit(const void *a, const void *b)
+{
+        const struct hit *x = a, *y = b;
+        if (x->shared != y->shared)
+                return y->shared - x->shared;
+        return (y->id > x->id) - (y->id < x->id);
+}
+
+// Split term into distinct trigrams of characters, as the trigram tokenizer
+// does, returning each as a quoted FTS5 phrase.
+static int
+split_trigrams(const char *term, char **grams)
+{
+        size_t off[MAX_TRIGRAMS + 3], i;
+        int chars = 0, n = 0;
+
+        // Offsets of the first characters, ignoring UTF-8 continuation bytes
+        for (i = 0; term[i]; i++) {
+                if (((unsigned char)term[i] & 0xc0) == 0x80)
+                        continue;
+                if (chars == MAX_TRIGRAMS + 2)
+                        break;
+                off[chars++] = i;
+        }
+        off[chars] = i;
+
+        for (int i = 0; i + 3 <= chars; i++) {
+                const char *gram = term + off[i];
+                size_t len = off[i + 3] - off[i];
+                int seen = 0;
+
+                for (int j = 0; j < n && !seen; j++)
+                        seen = strlen(grams[j]) == len + 2 && !strncasecmp(grams[j] + 1, gram, len);
+                if (seen)
+                        continue;
+
+                // Quote the trigram, doubling any quote inside it
+                char *q = malloc(2 * len + 3), *p = q;
+                if (!q)
+                        return -1;
+                *p++ = '"';
+                for (size_t k = 0; k < len; k++) {
+                        if (gram[k] == '"')
+                                *p++ = '"';
+                        *p++ = gram[k];
+                }
+                *p++ = '"';
+                *p = '\0';
+                grams[n++] = q;
+        }
+
+        return n;
+}
+
+static int
+add_id(sqlite3_int64 **ids, size_t *nids, size_t *cap, sqlite3_int64 id)
+{
+        if (*nids == *cap) {
+                size_t grown = *cap ? *cap * 2 : 1024;
+                sqlite3_int64 *tmp = realloc(*ids, grown * sizeof(**ids));
+                if (!tmp)
+                        return SQLITE_NOMEM;
+                *ids = tmp;
+                *cap = grown;
+        }
+
+        (*ids)[(*nids)++] = id;
+        return SQLITE_OK;
+}
+
+// Without the index, read every note once and look for each trigram in
+// its lower-cased text, adding the note's id once per trigram found.
+static int
+scan_postings(sqlite3 *db, char **grams, int n, sqlite3_int64 **ids, size_t *nids, size_t *cap)
+{
+        char *scan_sql = "SELECT id, lower(note_text(body)) FROM notes;";
+        char *plain[MAX_TRIGRAMS];
+        sqlite3_stmt *stmt = NULL;
+        int rc = SQLITE_OK, i;
+
+        // Undo the FTS5 quoting and fold ASCII case as lower() does
+        for (i = 0; i < n; i++) {
+                const char *q = grams[i] + 1;
+                char *p = plain[i] = malloc(strlen(q) + 1);
+                if (!p) {
+                        rc = SQLITE_NOMEM;
+                        goto end;
+                }
+                for (; q[1]; q++) {
+                        if (*q == '"')
+                                q++;
+                        *p++ = *q >= 'A' && *q <= 'Z' ? *q - 'A' + 'a' : *q;
+                }
+                *p = '\0';
+        }
+
+        rc = sqlite3_prepare_v2(db, scan_sql, -1, &stmt, 0);
+
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                goto end;
+        }
+
+        while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+                const char *text = (const char *)sqlite3_column_text(stmt, 1);
+                if (!text)
+                        continue;
+
+                for (int j = 0; j < n; j++) {
+                        if (strstr(text, plain[j]) && add_id(ids, nids, cap, sqlite3_column_int64(stmt, 0))) {
+                                rc = SQLITE_NOMEM;
+                                goto end;
+                        }
+                }
+        }
+
+        if (rc != SQLITE_DONE) {
+                fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+                goto end;
+        }
+
+        rc = SQLITE_OK;
+
+end:
+        sqlite3_finalize(stmt);
+        while (i-- > 0)
+                free(plain[i]);
+        return rc;
+}
+
+int
+fuzzy_search(sqlite3 *db, const char *term)
+{
+        char *match_sql = "SELECT rowid FROM note_trigrams WHERE note_trigrams MATCH ?;";
+        char *note_sql = "SELECT uuid, date, note_text(body) FROM notes WHERE id = ?;";
+
+        char *grams[MAX_TRIGRAMS];
+        sqlite3_int64 *ids = NULL;
+        struct hit *hits = NULL;
+        sqlite3_stmt *stmt = NULL;
+        size_t nids = 0, cap = 0;
+        int rc;
+
+        int n = split_trigrams(term, grams);
+        if (n < 0)
+                return SQLITE_NOMEM;
+
+        // Too short to have trigrams, so only an exact substring can match
+        if (n == 0)
+                return search(db, "text", term, 0);
+
+        // Vaults from before the index are scanned instead
+        int have_trigrams;
+        rc = table_exists(db, "note_trigrams", &have_trigrams);
+        if (rc != SQLITE_OK)
+                goto end;
+
+        if (!have_trigrams) {
+                rc = scan_postings(db, grams, n, &ids, &nids, &cap);
+                if (rc != SQLITE_OK)
+                        goto end;
+        } else {
+                rc = sqlite3_prepare_v2(db, match_sql, -1, &stmt, 0);
+
+                if (rc != SQLITE_OK) {
+                        fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                        goto end;
+                }
+
+                for (int i = 0; i < n; i++) {
+                        sqlite3_bind_text(stmt, 1, grams[i], -1, SQLITE_STATIC);
+
+                        while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+                                if (add_id(&ids, &nids, &cap, sqlite3_column_int64(stmt, 0))) {
+                                        rc = SQLITE_NOMEM;
+                                        goto end;
+                                }
+                        }
+
+                        if (rc != SQLITE_DONE) {
+                                fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+                                goto end;
+                        }
+
+                        sqlite3_reset(stmt);
+                }
+
+                sqlite3_finalize(stmt);
+                stmt = NULL;
+        }
+
+        // Each note appears once per shared trigram; count the runs
+        qsort(ids, nids, sizeof(*ids), cmp_id);
+
+        int need = n - 3 > (n + 1) / 2 ? n - 3 : (n + 1) / 2;
+        size_t nhits = 0;
+
+        hits = malloc((nids ? nids : 1) * sizeof(*hits));
+        if (!hits) {
+                rc = SQLITE_NOMEM;
+                goto end;
+        }
+
+        for (size_t i = 0, j; i < nids; i = j) {
+                for (j = i + 1; j < nids && ids[j] == ids[i]; j++)
+                        ;
+                if ((int)(j - i) >= need) {
+                        hits[nhits].id = ids[i];
+                        hits[nhits].shared = j - i;
+                        nhits++;
+                }
+        }
+
+        qsort(hits, nhits, sizeof(*hits), cmp_hit);
+
+        rc = sqlite3_prepare_v2(db, note_sql, -1, &stmt, 0);
+
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                goto end;
+        }
+
+        for (size_t i = 0; i < nhits; i++) {
+                sqlite3_bind_int64(stmt, 1, hits[i].id);
+
+                rc = sqlite3_step(stmt);
+                if (rc == SQLITE_ROW) {
+                        printf("%.2f ", (double)hits[i].shared / n);
+                        print_summary((const char *)sqlite3_column_text(stmt, 0),
+                                      (const char *)sqlite3_column_text(stmt, 1),
+                                      (const char *)sqlite3_column_text(stmt, 2));
+                } else if (rc != SQLITE_DONE) {
+                        fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+                        goto end;
+                }
+
+                sqlite3_reset(stmt);
+        }
+
+        rc = SQLITE_OK;
+
+end:
+        sqlite3_finalize(stmt);
+        for (int i = 0; i < n; i++)
+                free(grams[i]);
+        free(ids);
+        free(hits);
+        return rc;
+}
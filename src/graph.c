@@ -0,0 +1,1407 @@
+#include <stdio.h>
+#include <sqlite3.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "app.h"
+#include "graph.h"
+
+static int
+load_ids(sqlite3 *db, struct graph *g)
+{
+        char *sql = "SELECT id FROM notes ORDER BY id;";
+        sqlite3_stmt *stmt;
+        int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
+
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                return rc;
+        }
+
+        int cap = 1024;
+        g->ids = malloc(sizeof(*g->ids) * cap);
+
+        while (g->ids) {
+                rc = sqlite3_step(stmt);
+
+                if (rc == SQLITE_DONE) {
+                        rc = SQLITE_OK;
+                        break;
+                }
+
+                if (rc != SQLITE_ROW) {
+                        fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+                        break;
+                }
+
+                if (g->n == cap) {
+                        cap *= 2;
+                        sqlite3_int64 *ids = realloc(g->ids, sizeof(*ids) * cap);
+                        if (!ids) {
+                                free(g->ids);
+                                g->ids = NULL;
+                                break;
+                        }
+                        g->ids = ids;
+                }
+
+                g->ids[g->n++] = sqlite3_column_int64(stmt, 0);
+        }
+
+        if (!g->ids)
+                rc = SQLITE_NOMEM;
+
+        sqlite3_finalize(stmt);
+        return rc;
+}
+
+// Bucket (src, dst) pairs by src into a CSR offset/target array pair.
+static int
+build_csr(int n, int m, const int *src, const int *dst, int **off_out, int **adj_out)
+{
+        int *off = calloc(n + 1, sizeof(*off));
+        int *adj = malloc(sizeof(*adj) * (m ? m : 1));
+
+        if (!off || !adj) {
+                free(off);
+                free(adj);
+                return SQLITE_NOMEM;
+        }
+
+        for (int i = 0; i < m; i++)
+                off[src[i] + 1]++;
+
+        for (int i = 0; i < n; i++)
+                off[i + 1] += off[i];
+
+        // off[i] is used as a cursor while filling and restored afterwards
+        for (int i = 0; i < m; i++)
+                adj[off[src[i]]++] = dst[i];
+
+        for (int i = n; i > 0; i--)
+                off[i] = off[i - 1];
+        off[0] = 0;
+
+        *off_out = off;
+        *adj_out = adj;
+        return SQLITE_OK;
+}
+
+int
+graph_node(const struct graph *g, sqlite3_int64 id)
+{
+        int lo = 0, hi = g->n - 1;
+
+        while (lo <= hi) {
+                int mid = lo + (hi - lo) / 2;
+                if (g->ids[mid] == id)
+                        return mid;
+                if (g->ids[mid] < id)
+                        lo = mid + 1;
+                else
+                        hi = mid - 1;
+        }
+
+        return -1;
+}
+
+static int
+graph_build(sqlite3 *db, struct graph *g)
+{
+        memset(g, 0, sizeof(*g));
+
+        int rc = load_ids(db, g);
+        if (rc != SQLITE_OK)
+                return rc;
+
+        char *sql = "SELECT a_id, b_id FROM links;";
+        sqlite3_stmt *stmt;
+        rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
+
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                graph_free(g);
+                return rc;
+        }
+
+        int cap = 1024, m = 0;
+        int *src = malloc(sizeof(*src) * cap);
+        int *dst = malloc(sizeof(*dst) * cap);
+
+        while (src && dst) {
+                rc = sqlite3_step(stmt);
+
+                if (rc == SQLITE_DONE) {
+                        rc = SQLITE_OK;
+                        break;
+                }
+
+                if (rc != SQLITE_ROW) {
+                        fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+                        break;
+                }
+
+                int a = graph_node(g, sqlite3_column_int64(stmt, 0));
+                int b = graph_node(g, sqlite3_column_int64(stmt, 1));
+                if (a < 0 || b < 0)
+                        continue;
+
+                if (m == cap) {
+                        cap *= 2;
+                        int *s = realloc(src, sizeof(*s) * cap);
+                        if (s)
+                                src = s;
+                        int *d = realloc(dst, sizeof(*d) * cap);
+                        if (d)
+                                dst = d;
+                        if (!s || !d) {
+                                rc = SQLITE_NOMEM;
+                                break;
+                        }
+                }
+
+                src[m] = a;
+                dst[m] = b;
+                m++;
+        }
+
+        sqlite3_finalize(stmt);
+
+        if (!src || !dst)
+                rc = SQLITE_NOMEM;
+
+        if (rc == SQLITE_OK) {
+                g->m = m;
+                rc = build_csr(g->n, m, src, dst, &g->fwd_off, &g->fwd);
+        }
+
+        if (rc == SQLITE_OK)
+                rc = build_csr(g->n, m, dst, src, &g->rev_off, &g->rev);
+
+        free(src);
+        free(dst);
+
+        if (rc != SQLITE_OK) {
+                if (rc == SQLITE_NOMEM)
+                        fprintf(stderr, "Out of memory loading link graph\n");
+                graph_free(g);
+        }
+
+        return rc;
+}
+
+void
+graph_free(struct graph *g)
+{
+        if (g->map) {
+                munmap(g->map, g->map_len);
+        } else {
+                free(g->ids);
+                free(g->fwd_off);
+                free(g->fwd);
+                free(g->rev_off);
+                free(g->rev);
+        }
+        memset(g, 0, sizeof(*g));
+}
+
+/*
+ * Cache file layout, native endian, next to the database as <db>-graph:
+ *
+ *   struct graph_header
+ *   sqlite3_int64 ids[n]
+ *   int fwd_off[n + 1], fwd[m], rev_off[n + 1], rev[m]
+ *
+ * The file is only valid while its generation matches counters.graph,
+ * which triggers on notes and links bump on every change.
+ */
+#define GRAPH_MAGIC "ZKCGRPH1"
+
+struct graph_header {
+        char magic[8];
+        sqlite3_int64 generation;
+        sqlite3_int64 n;
+        sqlite3_int64 m;
+};
+
+static size_t
+cache_size(sqlite3_int64 n, sqlite3_int64 m)
+{
+        return sizeof(struct graph_header) + sizeof(sqlite3_int64) * n
+                + sizeof(int) * (2 * (n + 1) + 2 * m);
+}
+
+static int
+cache_map(const char *path, sqlite3_int64 generation, struct graph *g)
+{
+        int fd = open(path, O_RDONLY);
+        if (fd < 0)
+                return 1;
+
+        struct stat st;
+        struct graph_header header;
+
+        if (fstat(fd, &st) != 0
+            || (size_t)st.st_size < sizeof(header)
+            || read(fd, &header, sizeof(header)) != sizeof(header)
+            || memcmp(header.magic, GRAPH_MAGIC, sizeof(header.magic))
+            || header.generation != generation
+            || header.n < 0 || header.n >= INT_MAX
+            || header.m < 0 || header.m >= INT_MAX
+            || (size_t)st.st_size != cache_size(header.n, header.m)) {
+                close(fd);
+                return 1;
+        }
+
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+
+        if (map == MAP_FAILED)
+                return 1;
+
+        char *p = (char *)map + sizeof(header);
+
+        memset(g, 0, sizeof(*g));
+        g->map = map;
+        g->map_len = st.st_size;
+        g->n = header.n;
+        g->m = header.m;
+        g->ids = (sqlite3_int64 *)p;
+        p += sizeof(sqlite3_int64) * g->n;
+        g->fwd_off = (int *)p;
+        p += sizeof(int) * (g->n + 1);
+        g->fwd = (int *)p;
+        p += sizeof(int) * g->m;
+        g->rev_off = (int *)p;
+        p += sizeof(int) * (g->n + 1);
+        g->rev = (int *)p;
+
+        return 0;
+}
+
+// Write to a temporary file and rename it into place so concurrent
+// readers only ever map a complete cache.
+static void
+cache_write(const char *path, sqlite3_int64 generation, const struct graph *g)
+{
+        char tmp[PATH_MAX];
+        if ((size_t)snprintf(tmp, sizeof(tmp), "%s.%ld", path, (long)getpid()) >= sizeof(tmp))
+                return;
+
+        FILE *f = fopen(tmp, "wb");
+        if (!f)
+                return;
+
+        struct graph_header header = { .generation = generation, .n = g->n, .m = g->m };
+        memcpy(header.magic, GRAPH_MAGIC, sizeof(header.magic));
+
+        int ok = fwrite(&header, sizeof(header), 1, f) == 1
+                && fwrite(g->ids, sizeof(*g->ids), g->n, f) == (size_t)g->n
+                && fwrite(g->fwd_off, sizeof(int), g->n + 1, f) == (size_t)g->n + 1
+                && fwrite(g->fwd, sizeof(int), g->m, f) == (size_t)g->m
+                && fwrite(g->rev_off, sizeof(int), g->n + 1, f) == (size_t)g->n + 1
+                && fwrite(g->rev, sizeof(int), g->m, f) == (size_t)g->m;
+
+        if (fclose(f) != 0)
+                ok = 0;
+
+        if (!ok || rename(tmp, path) != 0)
+                remove(tmp);
+}
+
+int
+graph_load(sqlite3 *db, struct graph *g)
+{
+        char path[PATH_MAX];
+        sqlite3_int64 generation = counter_value(db, "graph");
+        int cached = generation >= 0 && !cache_path(db, "-graph", path, sizeof(path));
+
+        if (cached && !cache_map(path, generation, g))
+                return SQLITE_OK;
+
+        int rc = graph_build(db, g);
+
+        if (rc == SQLITE_OK && cached)
+                cache_write(path, generation, g);
+
+        return rc;
+}
+
+// Expand one BFS level from queue[*head, *tail) over links in both
+// directions. Returns the node where the two searches met, or -1.
+static int
+expand_level(const struct graph *g, int *queue, int *head, int *tail,
+             int *parent, const int *other)
+{
+        int end = *tail;
+
+        for (; *head < end; (*head)++) {
+                int u = queue[*head];
+
+                for (int dir = 0; dir < 2; dir++) {
+                        const int *off = dir ? g->rev_off : g->fwd_off;
+                        const int *adj = dir ? g->rev : g->fwd;
+
+                        for (int i = off[u]; i < off[u + 1]; i++) {
+                                int v = adj[i];
+                                if (parent[v] != -1)
+                                        continue;
+                                parent[v] = u;
+                                if (other[v] != -1)
+                                        return v;
+                                queue[(*tail)++] = v;
+                        }
+                }
+        }
+
+        return -1;
+}
+
+// Bidirectional BFS treating links as undirected. Fills path with node
+// indices from a to b and returns its length, 0 if unreachable, -1 on OOM.
+static int
+shortest_path(const struct graph *g, int a, int b, int **path_out)
+{
+        int *pa = malloc(sizeof(*pa) * g->n);
+        int *pb = malloc(sizeof(*pb) * g->n);
+        int *qa = malloc(sizeof(*qa) * g->n);
+        int *qb = malloc(sizeof(*qb) * g->n);
+        int len = -1;
+
+        *path_out = NULL;
+
+        if (!pa || !pb || !qa || !qb)
+                goto end;
+
+        for (int i = 0; i < g->n; i++)
+                pa[i] = pb[i] = -1;
+
+        int ha = 0, ta = 0, hb = 0, tb = 0, meet = -1;
+        pa[a] = a;
+        pb[b] = b;
+        qa[ta++] = a;
+        qb[tb++] = b;
+
+        if (a == b)
+                meet = a;
+
+        while (meet == -1 && ha < ta && hb < tb) {
+                // Grow whichever frontier is smaller
+                if (ta - ha <= tb - hb)
+                        meet = expand_level(g, qa, &ha, &ta, pa, pb);
+                else
+                        meet = expand_level(g, qb, &hb, &tb, pb, pa);
+        }
+
+        len = 0;
+        if (meet == -1)
+                goto end;
+
+        int na = 0, nb = 0;
+        for (int v = meet; v != a; v = pa[v])
+                na++;
+        for (int v = meet; v != b; v = pb[v])
+                nb++;
+
+        int *path = malloc(sizeof(*path) * (na + nb + 1));
+        if (!path) {
+                len = -1;
+                goto end;
+        }
+
+        int i = na;
+        for (int v = meet; ; v = pa[v]) {
+                path[i--] = v;
+                if (v == a)
+                        break;
+        }
+        i = na;
+        for (int v = meet; v != b; ) {
+                v = pb[v];
+                path[++i] = v;
+        }
+
+        *path_out = path;
+        len = na + nb + 1;
+
+end:
+        free(pa);
+        free(pb);
+        free(qa);
+        free(qb);
+        return len;
+}
+
+static int
+has_edge(const struct graph *g, int u, int v)
+{
+        for (int i = g->fwd_off[u]; i < g->fwd_off[u + 1]; i++)
+                if (g->fwd[i] == v)
+                        return 1;
+        return 0;
+}
+
+int
+note_path(sqlite3 *db, const char *uuid_a, const char *uuid_b)
+{
+        sqlite3_int64 id_a, id_b;
+
+        int rc = resolve_note_id(db, uuid_a, &id_a);
+        if (rc != SQLITE_OK)
+                return rc;
+
+        rc = resolve_note_id(db, uuid_b, &id_b);
+        if (rc != SQLITE_OK)
+                return rc;
+
+        struct graph g;
+        rc = graph_load(db, &g);
+        if (rc != SQLITE_OK)
+                return rc;
+
+        int *path = NULL;
+        int len = shortest_path(&g, graph_node(&g, id_a), graph_node(&g, id_b), &path);
+
+        if (len < 0) {
+                fprintf(stderr, "Out of memory searching link graph\n");
+                rc = SQLITE_NOMEM;
+                goto end;
+        }
+
+        if (len == 0) {
+                printf("No path between %s and %s\n", uuid_a, uuid_b);
+                goto end;
+        }
+
+        char *sql = "SELECT uuid, date, substr(note_text(body), 1, 16) FROM notes WHERE id = ?;";
+        sqlite3_stmt *stmt;
+        rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
+
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                goto end;
+        }
+
+        for (int i = 0; i < len; i++) {
+                if (i > 0)
+                        printf("%s\n", has_edge(&g, path[i - 1], path[i]) ? "  ->" : "  <-");
+
+                sqlite3_bind_int64(stmt, 1, g.ids[path[i]]);
+
+                rc = sqlite3_step(stmt);
+                if (rc != SQLITE_ROW) {
+                        fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+                        break;
+                }
+
+                print_summary((char *)sqlite3_column_text(stmt, 0),
+                              (char *)sqlite3_column_text(stmt, 1),
+                              (char *)sqlite3_column_text(stmt, 2));
+
+                sqlite3_reset(stmt);
+                rc = SQLITE_OK;
+        }
+
+        sqlite3_finalize(stmt);
+
+end:
+        free(path);
+        graph_free(&g);
+        return rc;
+}
+
+#define RANK_DAMPING 0.85
+#define RANK_TOLERANCE 1e-9
+#define RANK_MAX_ITERATIONS 200
+#define RANK_MAX_THREADS 16
+
+// The power iteration state shared by the rank workers. The workers are
+// started once and step through every iteration together, meeting at a
+// barrier after each of the two passes. Every worker sums the per-slice
+// results itself, in the same order, so all of them agree on the base
+// score and on when to stop without another round of synchronization.
+struct rank_shared {
+        const struct graph *g;
+        double *x, *next, *contrib;
+        struct rank_job *jobs;
+        int nthreads;
+        int iterations;         // set by the first worker when it stops
+        pthread_barrier_t barrier;
+        pthread_mutex_t start;
+};
+
+// One slice of the node range. The first pass spreads each node's score
+// over its out links and sums dangling mass, the second pulls along
+// reverse links.
+struct rank_job {
+        struct rank_shared *shared;
+        int lo, hi;
+        double dangling;
+        double delta;
+};
+
+static void
+rank_iterate(struct rank_job *job)
+{
+        struct rank_shared *sh = job->shared;
+        const struct graph *g = sh->g;
+        double *x = sh->x, *next = sh->next, *contrib = sh->contrib;
+        double delta = 1;
+        int iterations = 0;
+
+        while (iterations < RANK_MAX_ITERATIONS && delta > RANK_TOLERANCE) {
+                job->dangling = 0;
+                for (int u = job->lo; u < job->hi; u++) {
+                        int out = g->fwd_off[u + 1] - g->fwd_off[u];
+                        if (out) {
+                                contrib[u] = x[u] / out;
+                        } else {
+                                contrib[u] = 0;
+                                job->dangling += x[u];
+                        }
+                }
+
+                pthread_barrier_wait(&sh->barrier);
+
+                double dangling = 0;
+                for (int t = 0; t < sh->nthreads; t++)
+                        dangling += sh->jobs[t].dangling;
+
+                // Teleport plus dangling mass spread evenly over all notes
+                double base = (1 - RANK_DAMPING + RANK_DAMPING * dangling) / g->n;
+
+                job->delta = 0;
+                for (int v = job->lo; v < job->hi; v++) {
+                        double sum = 0;
+                        for (int i = g->rev_off[v]; i < g->rev_off[v + 1]; i++)
+                                sum += contrib[g->rev[i]];
+
+                        double score = base + RANK_DAMPING * sum;
+                        double diff = score - x[v];
+                        next[v] = score;
+                        job->delta += diff < 0 ? -diff : diff;
+                }
+
+                // Nobody starts the next first pass, which overwrites
+                // contrib, until every slice has finished reading it
+                pthread_barrier_wait(&sh->barrier);
+
+                delta = 0;
+                for (int t = 0; t < sh->nthreads; t++)
+                        delta += sh->jobs[t].delta;
+
+                double *tmp = x;
+                x = next;
+                next = tmp;
+                iterations++;
+        }
+
+        if (job == &sh->jobs[0]) {
+                sh->x = x;
+                sh->next = next;
+                sh->iterations = iterations;
+        }
+}
+
+static void *
+rank_worker(void *arg)
+{
+        struct rank_job *job = arg;
+
+        // Wait until the slices are handed out and the barrier is set up
+        pthread_mutex_lock(&job->shared->start);
+        pthread_mutex_unlock(&job->shared->start);
+
+        rank_iterate(job);
+        return NULL;
+}
+
+static int
+rank_threads(int n)
+{
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        int nthreads = n / 16384 + 1;
+
+        if (cpus < 1)
+                cpus = 1;
+        if (nthreads > cpus)
+                nthreads = cpus;
+        if (nthreads > RANK_MAX_THREADS)
+                nthreads = RANK_MAX_THREADS;
+
+        return nthreads;
+}
+
+// Seed x with the stored scores so a lightly changed graph converges in a
+// few iterations. This is only a warm start: every run still iterates over
+// the whole graph until it converges, it just needs fewer iterations.
+// Notes without a score start at the uniform value.
+static int
+rank_warm_start(sqlite3 *db, const struct graph *g, double *x)
+{
+        for (int i = 0; i < g->n; i++)
+                x[i] = -1;
+
+        char *sql = "SELECT note_id, score FROM note_ranks;";
+        sqlite3_stmt *stmt;
+        int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
+
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                return rc;
+        }
+
+        while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+                int u = graph_node(g, sqlite3_column_int64(stmt, 0));
+                if (u >= 0)
+                        x[u] = sqlite3_column_double(stmt, 1);
+        }
+
+        sqlite3_finalize(stmt);
+
+        if (rc != SQLITE_DONE) {
+                fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+                return rc;
+        }
+
+        double total = 0;
+        for (int i = 0; i < g->n; i++) {
+                if (x[i] < 0)
+                        x[i] = 1.0 / g->n;
+                total += x[i];
+        }
+
+        for (int i = 0; i < g->n; i++)
+                x[i] /= total;
+
+        return SQLITE_OK;
+}
+
+static int
+rank_store(sqlite3 *db, const struct graph *g, const double *x, sqlite3_int64 generation)
+{
+        int rc = sql_exec(db, "BEGIN;");
+        if (rc != SQLITE_OK)
+                return rc;
+
+        rc = sql_exec(db, "DELETE FROM note_ranks;");
+        if (rc != SQLITE_OK)
+                goto end;
+
+        char *sql = "INSERT INTO note_ranks(note_id, score, in_degree, out_degree) "
+                "VALUES(?, ?, ?, ?);";
+        sqlite3_stmt *stmt;
+        rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
+
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                goto end;
+        }
+
+        for (int u = 0; u < g->n; u++) {
+                sqlite3_bind_int64(stmt, 1, g->ids[u]);
+                sqlite3_bind_double(stmt, 2, x[u]);
+                sqlite3_bind_int(stmt, 3, g->rev_off[u + 1] - g->rev_off[u]);
+                sqlite3_bind_int(stmt, 4, g->fwd_off[u + 1] - g->fwd_off[u]);
+
+                rc = sqlite3_step(stmt);
+                if (rc != SQLITE_DONE) {
+                        fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+                        break;
+                }
+
+                sqlite3_reset(stmt);
+                rc = SQLITE_OK;
+        }
+
+        sqlite3_finalize(stmt);
+
+        if (rc != SQLITE_OK)
+                goto end;
+
+        sql = "INSERT OR REPLACE INTO counters(name, value) VALUES('rank', ?);";
+        rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
+
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                goto end;
+        }
+
+        sqlite3_bind_int64(stmt, 1, generation);
+        rc = sqlite3_step(stmt);
+        sqlite3_finalize(stmt);
+
+        if (rc != SQLITE_DONE) {
+                fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+                goto end;
+        }
+
+        return sql_exec(db, "COMMIT;");
+
+end:
+        sql_exec(db, "ROLLBACK;");
+        return rc;
+}
+
+static int
+rank_top(sqlite3 *db, int limit)
+{
+        char *sql = "SELECT note_ranks.score, note_ranks.in_degree, note_ranks.out_degree, "
+                "notes.uuid, notes.date, substr(note_text(notes.body), 1, 16) "
+                "FROM note_ranks "
+                "INNER JOIN notes ON notes.id = note_ranks.note_id "
+                "ORDER BY note_ranks.score DESC "
+                "LIMIT ?;";
+        sqlite3_stmt *stmt;
+        int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
+
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                return rc;
+        }
+
+        sqlite3_bind_int(stmt, 1, limit);
+
+        while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+                printf("%.6f %4d %4d ", sqlite3_column_double(stmt, 0),
+                       sqlite3_column_int(stmt, 1), sqlite3_column_int(stmt, 2));
+                print_summary((char *)sqlite3_column_text(stmt, 3),
+                              (char *)sqlite3_column_text(stmt, 4),
+                              (char *)sqlite3_column_text(stmt, 5));
+        }
+
+        sqlite3_finalize(stmt);
+
+        if (rc != SQLITE_DONE) {
+                fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+                return rc;
+        }
+
+        return SQLITE_OK;
+}
+
+int
+rank(sqlite3 *db)
+{
+        sqlite3_int64 generation = counter_value(db, "graph");
+        if (generation < 0) {
+                fprintf(stderr, "Missing counters table, run zkc init first\n");
+                return 1;
+        }
+
+        // Nothing changed since the last run
+        char *sql = "SELECT 1 FROM counters WHERE name = 'rank' AND value = ?;";
+        sqlite3_stmt *stmt;
+        int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
+
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                return rc;
+        }
+
+        sqlite3_bind_int64(stmt, 1, generation);
+        rc = sqlite3_step(stmt);
+        sqlite3_finalize(stmt);
+
+        if (rc == SQLITE_ROW) {
+                printf("Ranks are up to date\n");
+                return rank_top(db, 10);
+        }
+
+        struct graph g;
+        rc = graph_load(db, &g);
+        if (rc != SQLITE_OK)
+                return rc;
+
+        if (g.n == 0) {
+                graph_free(&g);
+                return SQLITE_OK;
+        }
+
+        int nthreads = rank_threads(g.n);
+        double *x = malloc(sizeof(*x) * g.n);
+        double *next = malloc(sizeof(*next) * g.n);
+        double *contrib = malloc(sizeof(*contrib) * g.n);
+        struct rank_job jobs[RANK_MAX_THREADS];
+        pthread_t threads[RANK_MAX_THREADS];
+
+        if (!x || !next || !contrib) {
+                fprintf(stderr, "Out of memory ranking notes\n");
+                rc = SQLITE_NOMEM;
+                goto end;
+        }
+
+        rc = rank_warm_start(db, &g, x);
+        if (rc != SQLITE_OK)
+                goto end;
+
+        struct rank_shared shared = {
+                .g = &g,
+                .x = x,
+                .next = next,
+                .contrib = contrib,
+                .jobs = jobs,
+                .start = PTHREAD_MUTEX_INITIALIZER,
+        };
+
+        for (int t = 0; t < nthreads; t++)
+                jobs[t].shared = &shared;
+
+        // Workers hold on the start lock until they know how many of them
+        // there are, so a thread that fails to start just shrinks the pool
+        pthread_mutex_lock(&shared.start);
+
+        int started = 1;
+        for (; started < nthreads; started++) {
+                if (pthread_create(&threads[started], NULL, rank_worker, &jobs[started]) != 0)
+                        break;
+        }
+
+        shared.nthreads = started;
+        for (int t = 0; t < started; t++) {
+                jobs[t].lo = (int)((long long)g.n * t / started);
+                jobs[t].hi = (int)((long long)g.n * (t + 1) / started);
+        }
+
+        pthread_barrier_init(&shared.barrier, NULL, started);
+        pthread_mutex_unlock(&shared.start);
+
+        rank_iterate(&jobs[0]);
+
+        for (int t = 1; t < started; t++)
+                pthread_join(threads[t], NULL);
+
+        pthread_barrier_destroy(&shared.barrier);
+
+        // The result may have ended up in either buffer
+        x = shared.x;
+        next = shared.next;
+        int iterations = shared.iterations;
+
+        rc = rank_store(db, &g, x, generation);
+        if (rc != SQLITE_OK)
+                goto end;
+
+        printf("Ranked %d notes in %d iterations\n", g.n, iterations);
+        rc = rank_top(db, 10);
+
+end:
+        free(x);
+        free(next);
+        free(contrib);
+        graph_free(&g);
+        return rc;
+}
+
+static int
+uf_find(int *parent, int u)
+{
+        while (parent[u] != u) {
+                parent[u] = parent[parent[u]];
+                u = parent[u];
+        }
+        return u;
+}
+
+static void
+uf_union(int *parent, int *size, int u, int v)
+{
+        u = uf_find(parent, u);
+        v = uf_find(parent, v);
+        if (u == v)
+                return;
+
+        if (size[u] < size[v]) {
+                int tmp = u;
+                u = v;
+                v = tmp;
+        }
+
+        parent[v] = u;
+        size[u] += size[v];
+}
+
+static int
+compare_int_desc(const void *a, const void *b)
+{
+        int x = *(const int *)a, y = *(const int *)b;
+        return (x < y) - (x > y);
+}
+
+int
+components(sqlite3 *db)
+{
+        struct graph g;
+        int rc = graph_load(db, &g);
+        if (rc != SQLITE_OK)
+                return rc;
+
+        int *parent = malloc(sizeof(*parent) * (g.n ? g.n : 1));
+        int *size = malloc(sizeof(*size) * (g.n ? g.n : 1));
+
+        if (!parent || !size) {
+                fprintf(stderr, "Out of memory finding components\n");
+                rc = SQLITE_NOMEM;
+                goto end;
+        }
+
+        for (int u = 0; u < g.n; u++) {
+                parent[u] = u;
+                size[u] = 1;
+        }
+
+        for (int u = 0; u < g.n; u++)
+                for (int i = g.fwd_off[u]; i < g.fwd_off[u + 1]; i++)
+                        uf_union(parent, size, u, g.fwd[i]);
+
+        // Compact root sizes to the front of size[] and sort them
+        int count = 0;
+        for (int u = 0; u < g.n; u++)
+                if (parent[u] == u)
+                        size[count++] = size[u];
+
+        qsort(size, count, sizeof(*size), compare_int_desc);
+
+        printf("%d notes in %d components\n", g.n, count);
+        printf("size - components\n");
+
+        for (int i = 0; i < count; ) {
+                int j = i;
+                while (j < count && size[j] == size[i])
+                        j++;
+                printf("%d - %d\n", size[i], j - i);
+                i = j;
+        }
+
+end:
+        free(parent);
+        free(size);
+        graph_free(&g);
+        return rc;
+}
+
+int
+orphans(sqlite3 *db)
+{
+        struct graph g;
+        int rc = graph_load(db, &g);
+        if (rc != SQLITE_OK)
+                return rc;
+
+        char *tagged = calloc(g.n ? g.n : 1, 1);
+        sqlite3_stmt *stmt = NULL;
+
+        if (!tagged) {
+                fprintf(stderr, "Out of memory finding orphans\n");
+                rc = SQLITE_NOMEM;
+                goto end;
+        }
+
+        char *sql = "SELECT note_id FROM note_tags;";
+        rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
+
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                goto end;
+        }
+
+        while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+                int u = graph_node(&g, sqlite3_column_int64(stmt, 0));
+                if (u >= 0)
+                        tagged[u] = 1;
+        }
+
+        if (rc != SQLITE_DONE) {
+                fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+                goto end;
+        }
+
+        sqlite3_finalize(stmt);
+
+        sql = "SELECT uuid, date, substr(note_text(body), 1, 16) FROM notes WHERE id = ?;";
+        rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
+
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                stmt = NULL;
+                goto end;
+        }
+
+        for (int u = 0; u < g.n; u++) {
+                if (tagged[u]
+                    || g.fwd_off[u + 1] != g.fwd_off[u]
+                    || g.rev_off[u + 1] != g.rev_off[u])
+                        continue;
+
+                sqlite3_bind_int64(stmt, 1, g.ids[u]);
+
+                rc = sqlite3_step(stmt);
+                if (rc == SQLITE_ROW) {
+                        print_summary((char *)sqlite3_column_text(stmt, 0),
+                                      (char *)sqlite3_column_text(stmt, 1),
+                                      (char *)sqlite3_column_text(stmt, 2));
+                } else if (rc != SQLITE_DONE) {
+                        fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+                        goto end;
+                }
+
+                sqlite3_reset(stmt);
+        }
+
+        rc = SQLITE_OK;
+
+end:
+        sqlite3_finalize(stmt);
+        free(tagged);
+        graph_free(&g);
+        return rc;
+}
+
+enum graph_format {
+        FORMAT_DOT,
+        FORMAT_GRAPHML,
+        FORMAT_EDGES,
+};
+
+// Mark notes within hops links of root, in either direction, in the
+// temp export_nodes table.
+static int
+select_neighbourhood(sqlite3 *db, const char *uuid, int hops)
+{
+        sqlite3_int64 id;
+        int rc = resolve_note_id(db, uuid, &id);
+        if (rc != SQLITE_OK)
+                return rc;
+
+        struct graph g;
+        rc = graph_load(db, &g);
+        if (rc != SQLITE_OK)
+                return rc;
+
+        int root = graph_node(&g, id);
+        int *depth = malloc(sizeof(*depth) * (g.n ? g.n : 1));
+        int *queue = malloc(sizeof(*queue) * (g.n ? g.n : 1));
+        sqlite3_stmt *stmt = NULL;
+
+        if (!depth || !queue) {
+                fprintf(stderr, "Out of memory exporting graph\n");
+                rc = SQLITE_NOMEM;
+                goto end;
+        }
+
+        for (int u = 0; u < g.n; u++)
+                depth[u] = -1;
+
+        int head = 0, tail = 0;
+        if (root >= 0) {
+                depth[root] = 0;
+                queue[tail++] = root;
+        }
+
+        while (head < tail) {
+                int u = queue[head++];
+                if (depth[u] == hops)
+                        continue;
+
+                for (int dir = 0; dir < 2; dir++) {
+                        const int *off = dir ? g.rev_off : g.fwd_off;
+                        const int *adj = dir ? g.rev : g.fwd;
+
+                        for (int i = off[u]; i < off[u + 1]; i++) {
+                                int v = adj[i];
+                                if (depth[v] != -1)
+                                        continue;
+                                depth[v] = depth[u] + 1;
+                                queue[tail++] = v;
+                        }
+                }
+        }
+
+        char *sql = "INSERT INTO temp.export_nodes(id) VALUES(?);";
+        rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
+
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                goto end;
+        }
+
+        for (int i = 0; i < tail; i++) {
+                sqlite3_bind_int64(stmt, 1, g.ids[queue[i]]);
+
+                rc = sqlite3_step(stmt);
+                if (rc != SQLITE_DONE) {
+                        fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+                        goto end;
+                }
+
+                sqlite3_reset(stmt);
+        }
+
+        rc = SQLITE_OK;
+
+end:
+        sqlite3_finalize(stmt);
+        free(depth);
+        free(queue);
+        graph_free(&g);
+        return rc;
+}
+
+static int
+select_tagged(sqlite3 *db, const char *tag_body)
+{
+        char *sql = "INSERT OR IGNORE INTO temp.export_nodes(id) "
+                "SELECT note_tags.note_id FROM note_tags "
+                "INNER JOIN tags ON tags.id = note_tags.tag_id "
+                "WHERE tags.body = ?;";
+        sqlite3_stmt *stmt;
+        int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
+
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                return rc;
+        }
+
+        sqlite3_bind_text(stmt, 1, tag_body, strlen(tag_body), SQLITE_STATIC);
+
+        rc = sqlite3_step(stmt);
+        sqlite3_finalize(stmt);
+
+        if (rc != SQLITE_DONE) {
+                fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+                return rc;
+        }
+
+        return SQLITE_OK;
+}
+
+static int
+keep_tagged(sqlite3 *db, const char *tag_body)
+{
+        char *sql = "DELETE FROM temp.export_nodes WHERE id NOT IN "
+                "(SELECT note_tags.note_id FROM note_tags "
+                "INNER JOIN tags ON tags.id = note_tags.tag_id "
+                "WHERE tags.body = ?);";
+        sqlite3_stmt *stmt;
+        int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
+
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                return rc;
+        }
+
+        sqlite3_bind_text(stmt, 1, tag_body, strlen(tag_body), SQLITE_STATIC);
+
+        rc = sqlite3_step(stmt);
+        sqlite3_finalize(stmt);
+
+        if (rc != SQLITE_DONE) {
+                fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+                return rc;
+        }
+
+        return SQLITE_OK;
+}
+
+static void
+put_escaped(const char *s, enum graph_format format)
+{
+        for (; *s; s++) {
+                if (format == FORMAT_GRAPHML) {
+                        // XML 1.0 has no way to write other control
+                        // characters, not even as references
+                        if ((unsigned char)*s < 0x20 && *s != '\t' && *s != '\n' && *s != '\r')
+                                continue;
+
+                        switch (*s) {
+                        case '&': fputs("&amp;", stdout); break;
+                        case '<': fputs("&lt;", stdout); break;
+                        case '>': fputs("&gt;", stdout); break;
+                        case '"': fputs("&quot;", stdout); break;
+                        default: putchar(*s);
+                        }
+                } else {
+                        if (*s == '"' || *s == '\\')
+                                putchar('\\');
+                        putchar(*s);
+                }
+        }
+}
+
+static void
+put_node(enum graph_format format, const char *uuid, const char *body, const char *tags)
+{
+        // Label with the first line of the note
+        char summary[41];
+        size_t i;
+        for (i = 0; i < sizeof(summary) - 1 && body[i] && body[i] != '\n'; i++)
+                summary[i] = body[i];
+
+        // Don't cut a UTF-8 character in half
+        if (body[i] && body[i] != '\n') {
+                while (i > 0 && ((unsigned char)body[i] & 0xc0) == 0x80)
+                        i--;
+        }
+        summary[i] = '\0';
+
+        if (format == FORMAT_DOT) {
+                printf("  \"%s\" [label=\"", uuid);
+                put_escaped(summary, format);
+                if (*tags) {
+                        fputs("\\n[", stdout);
+                        put_escaped(tags, format);
+                        putchar(']');
+                }
+                fputs("\"];\n", stdout);
+        } else if (format == FORMAT_GRAPHML) {
+                printf("    <node id=\"%s\">\n      <data key=\"summary\">", uuid);
+                put_escaped(summary, format);
+                fputs("</data>\n      <data key=\"tags\">", stdout);
+                put_escaped(tags, format);
+                fputs("</data>\n    </node>\n", stdout);
+        }
+}
+
+static void
+put_edge(enum graph_format format, const char *uuid_a, const char *uuid_b)
+{
+        if (format == FORMAT_DOT)
+                printf("  \"%s\" -> \"%s\";\n", uuid_a, uuid_b);
+        else if (format == FORMAT_GRAPHML)
+                printf("    <edge source=\"%s\" target=\"%s\"/>\n", uuid_a, uuid_b);
+        else
+                printf("%s %s\n", uuid_a, uuid_b);
+}
+
+static int
+stream_rows(sqlite3 *db, const char *sql, enum graph_format format, int nodes)
+{
+        sqlite3_stmt *stmt;
+        int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
+
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                return rc;
+        }
+
+        while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+                const char *a = (const char *)sqlite3_column_text(stmt, 0);
+                const char *b = (const char *)sqlite3_column_text(stmt, 1);
+
+                if (nodes) {
+                        const char *tags = (const char *)sqlite3_column_text(stmt, 2);
+                        put_node(format, a, b, tags ? tags : "");
+                } else {
+                        put_edge(format, a, b);
+                }
+        }
+
+        sqlite3_finalize(stmt);
+
+        if (rc != SQLITE_DONE) {
+                fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+                return rc;
+        }
+
+        return SQLITE_OK;
+}
+
+int
+export_graph(sqlite3 *db, int argc, char **argv)
+{
+        enum graph_format format = FORMAT_DOT;
+        const char *tag_body = NULL, *root = NULL;
+        int hops = 1;
+
+        for (int i = 0; i < argc; i++) {
+                if (!strcmp(argv[i], "--format") && i + 1 < argc) {
+                        i++;
+                        if (!strcmp(argv[i], "dot")) {
+                                format = FORMAT_DOT;
+                        } else if (!strcmp(argv[i], "graphml")) {
+                                format = FORMAT_GRAPHML;
+                        } else if (!strcmp(argv[i], "edges")) {
+                                format = FORMAT_EDGES;
+                        } else {
+                                fprintf(stderr, "Invalid graph format: %s\n", argv[i]);
+                                return 1;
+                        }
+                } else if (!strcmp(argv[i], "--tag") && i + 1 < argc) {
+                        tag_body = argv[++i];
+                } else if (!strcmp(argv[i], "--root") && i + 1 < argc) {
+                        root = argv[++i];
+                } else if (!strcmp(argv[i], "--hops") && i + 1 < argc) {
+                        hops = atoi(argv[++i]);
+                } else {
+                        fprintf(stderr, "Invalid export-graph option: %s\n", argv[i]);
+                        return 1;
+                }
+        }
+
+        int filtered = tag_body || root;
+        int rc;
+
+        if (filtered) {
+                rc = sql_exec(db, "CREATE TEMP TABLE export_nodes(id INTEGER PRIMARY KEY);");
+                if (rc != SQLITE_OK)
+                        return rc;
+
+                rc = root ? select_neighbourhood(db, root, hops) : select_tagged(db, tag_body);
+                if (rc != SQLITE_OK)
+                        return rc;
+
+                // A root and a tag together keep the tagged part of the neighbourhood
+                if (root && tag_body) {
+                        rc = keep_tagged(db, tag_body);
+                        if (rc != SQLITE_OK)
+                                return rc;
+                }
+        }
+
+        char nodes_sql[512], edges_sql[512];
+        snprintf(nodes_sql, sizeof(nodes_sql),
+                 "SELECT notes.uuid, substr(note_text(notes.body), 1, 64), "
+                 "(SELECT group_concat(tags.body, ' ') FROM note_tags "
+                 "INNER JOIN tags ON tags.id = note_tags.tag_id "
+                 "WHERE note_tags.note_id = notes.id) "
+                 "FROM notes%s;",
+                 filtered ? " WHERE notes.id IN temp.export_nodes" : "");
+        snprintf(edges_sql, sizeof(edges_sql),
+                 "SELECT notes_a.uuid, notes_b.uuid FROM links "
+                 "INNER JOIN notes notes_a ON links.a_id = notes_a.id "
+                 "INNER JOIN notes notes_b ON links.b_id = notes_b.id%s;",
+                 filtered ? " WHERE links.a_id IN temp.export_nodes "
+                 "AND links.b_id IN temp.export_nodes" : "");
+
+        if (format == FORMAT_DOT) {
+                printf("digraph zkc {\n");
+        } else if (format == FORMAT_GRAPHML) {
+                printf("<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                       "<graphml xmlns=\"http://graphml.graphdrawing.org/xmlns\">\n"
+                       "  <key id=\"summary\" for=\"node\" attr.name=\"summary\" attr.type=\"string\"/>\n"
+                       "  <key id=\"tags\" for=\"node\" attr.name=\"tags\" attr.type=\"string\"/>\n"
+                       "  <graph id=\"zkc\" edgedefault=\"directed\">\n");
+        }
+
+        if (format != FORMAT_EDGES) {
+                rc = stream_rows(db, nodes_sql, format, 1);
+                if (rc != SQLITE_OK)
+                        return rc;
+        }
+
+        rc = stream_rows(db, edges_sql, format, 0);
+        if (rc != SQLITE_OK)
+                return rc;
+
+        if (format == FORMAT_DOT)
+                printf("}\n");
+        else if (format == FORMAT_GRAPHML)
+                printf("  </graph>\n</graphml>\n");
+
+        return SQLITE_OK;
+}
@@ -0,0 +1,100 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <openssl/evp.h>
+#include "hash.h"
+
+/*
+ * Note hashes go through EVP so OpenSSL can pick its fastest SHA-256 for
+ * the CPU. OpenSSL 3 looks the algorithm up on every EVP_sha256() digest,
+ * which costs more than hashing a short note, so it is fetched once.
+ */
+static const EVP_MD *sha256_md;
+static pthread_once_t sha256_once = PTHREAD_ONCE_INIT;
+
+static void
+sha256_fetch(void)
+{
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+        sha256_md = EVP_MD_fetch(NULL, "SHA256", NULL);
+#endif
+        if (!sha256_md)
+                sha256_md = EVP_sha256();
+}
+
+struct sha256_stream {
+        EVP_MD_CTX *ctx;
+};
+
+static void
+to_hex(const unsigned char *digest, unsigned int digest_len, char out[SHA256_HEX_LENGTH + 1])
+{
+        static const char digits[] = "0123456789abcdef";
+
+        for (unsigned int i = 0; i < digest_len; i++) {
+                out[2 * i] = digits[digest[i] >> 4];
+                out[2 * i + 1] = digits[digest[i] & 0x0f];
+        }
+        out[SHA256_HEX_LENGTH] = '\0';
+}
+
+int
+sha256_hex(const void *data, size_t len, char out[SHA256_HEX_LENGTH + 1])
+{
+        unsigned char digest[EVP_MAX_MD_SIZE];
+        unsigned int digest_len;
+
+        pthread_once(&sha256_once, sha256_fetch);
+
+        if (!EVP_Digest(data, len, digest, &digest_len, sha256_md, NULL) ||
+            digest_len * 2 != SHA256_HEX_LENGTH) {
+                out[0] = '\0';
+                return -1;
+        }
+
+        to_hex(digest, digest_len, out);
+        return 0;
+}
+
+struct sha256_stream *
+sha256_begin(void)
+{
+        struct sha256_stream *s = malloc(sizeof(*s));
+        if (!s)
+                return NULL;
+
+        pthread_once(&sha256_once, sha256_fetch);
+
+        s->ctx = EVP_MD_CTX_new();
+        if (!s->ctx || !EVP_DigestInit_ex(s->ctx, sha256_md, NULL)) {
+                EVP_MD_CTX_free(s->ctx);
+                free(s);
+                return NULL;
+        }
+
+        return s;
+}
+
+int
+sha256_update(struct sha256_stream *s, const void *data, size_t len)
+{
+        return EVP_DigestUpdate(s->ctx, data, len) ? 0 : -1;
+}
+
+int
+sha256_end(struct sha256_stream *s, char out[SHA256_HEX_LENGTH + 1])
+{
+        unsigned char digest[EVP_MAX_MD_SIZE];
+        unsigned int digest_len;
+        int rc = -1;
+
+        if (EVP_DigestFinal_ex(s->ctx, digest, &digest_len) && digest_len * 2 == SHA256_HEX_LENGTH) {
+                to_hex(digest, digest_len, out);
+                rc = 0;
+        } else {
+                out[0] = '\0';
+        }
+
+        EVP_MD_CTX_free(s->ctx);
+        free(s);
+        return rc;
+}
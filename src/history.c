@@ -0,0 +1,610 @@
+#include <stdio.h>
+#include <sqlite3.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "app.h"
+#include "hash.h"
+#include "compress.h"
+#include "history.h"
+
+/*
+ * Note history as reverse deltas. When a note is edited or merged over,
+ * its old body becomes version n, stored as a delta that rebuilds it from
+ * version n + 1, the body that replaced it. The current body is the last
+ * version and stays whole in notes, so reading it costs nothing and
+ * saving a version never rewrites older ones.
+ *
+ * Every SNAPSHOT_EVERY-th version is stored whole, as is any version
+ * whose delta would be no smaller, so rebuilding a version starts from
+ * the first whole body at or after it and applies fewer than
+ * SNAPSHOT_EVERY deltas however long the history gets.
+ *
+ * A delta is the base and target lengths followed by copy and insert
+ * instructions, every number a LEB128 varint:
+ *
+ *     (len << 1) | 1, offset   copy len bytes of the base from offset
+ *     len << 1, bytes          insert the len bytes that follow
+ *
+ * Copies are found as in git packs: the base is indexed in BLOCK byte
+ * blocks and a rolling hash of each BLOCK bytes of the target is looked
+ * up, then matches are extended both ways.
+ */
+#define SNAPSHOT_EVERY 16
+#define BLOCK 16
+#define MAX_CHAIN 32
+#define ROLL_BASE 257u
+#define MAX_TEXT 0x7fffffff
+
+struct buffer {
+        unsigned char *data;
+        size_t len, cap;
+};
+
+struct version {
+        int delta;
+        unsigned char *data;
+        size_t len;
+};
+
+static int
+step_done(sqlite3 *db, sqlite3_stmt *stmt)
+{
+        int rc = sqlite3_step(stmt);
+        sqlite3_reset(stmt);
+
+        if (rc != SQLITE_DONE) {
+                fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+                return rc;
+        }
+
+        return SQLITE_OK;
+}
+
+static int
+buffer_grow(struct buffer *b, size_t n)
+{
+        if (b->len + n <= b->cap)
+                return 0;
+
+        size_t cap = b->cap ? b->cap : 256;
+        while (cap < b->len + n)
+                cap *= 2;
+
+        unsigned char *data = realloc(b->data, cap);
+        if (!data)
+                return -1;
+
+        b->data = data;
+        b->cap = cap;
+        return 0;
+}
+
+static int
+put_varint(struct buffer *b, uint64_t v)
+{
+        if (buffer_grow(b, 10))
+                return -1;
+
+        do {
+                unsigned char c = v & 0x7f;
+                v >>= 7;
+                b->data[b->len++] = c | (v ? 0x80 : 0);
+        } while (v);
+
+        return 0;
+}
+
+static int
+get_varint(const unsigned char **p, const unsigned char *end, uint64_t *v)
+{
+        *v = 0;
+        for (int shift = 0; shift < 64 && *p < end; shift += 7) {
+                unsigned char c = *(*p)++;
+                *v |= (uint64_t)(c & 0x7f) << shift;
+                if (!(c & 0x80))
+                        return 0;
+        }
+
+        return -1;
+}
+
+static int
+put_insert(struct buffer *b, const unsigned char *bytes, size_t len)
+{
+        if (!len)
+                return 0;
+
+        if (put_varint(b, (uint64_t)len << 1) || buffer_grow(b, len))
+                return -1;
+
+        memcpy(b->data + b->len, bytes, len);
+        b->len += len;
+        return 0;
+}
+
+static int
+put_copy(struct buffer *b, size_t offset, size_t len)
+{
+        return put_varint(b, (uint64_t)len << 1 | 1) || put_varint(b, offset) ? -1 : 0;
+}
+
+static uint32_t
+block_hash(const unsigned char *p)
+{
+        uint32_t h = 0;
+
+        for (int i = 0; i < BLOCK; i++)
+                h = h * ROLL_BASE + p[i];
+        return h;
+}
+
+static uint32_t
+bucket_of(uint32_t h, int bits)
+{
+        return (h * 2654435761u) >> (32 - bits);
+}
+
+// Append to out a delta that turns base into target
+static int
+make_delta(const unsigned char *base, size_t base_len,
+           const unsigned char *target, size_t target_len, struct buffer *out)
+{
+        size_t blocks = base_len / BLOCK;
+        int bits = 4;
+        while (bits < 30 && ((size_t)1 << bits) < blocks * 2)
+                bits++;
+
+        int rc = -1;
+        int32_t *head = calloc((size_t)1 << bits, sizeof(*head));
+        int32_t *next = malloc((blocks ? blocks : 1) * sizeof(*next));
+        if (!head || !next)
+                goto end;
+
+        // Chains hold block number + 1, so 0 ends them
+        for (size_t i = 0; i < blocks; i++) {
+                uint32_t bucket = bucket_of(block_hash(base + i * BLOCK), bits);
+                next[i] = head[bucket];
+                head[bucket] = i + 1;
+        }
+
+        if (put_varint(out, base_len) || put_varint(out, target_len))
+                goto end;
+
+        uint32_t pow = 1;
+        for (int i = 1; i < BLOCK; i++)
+                pow *= ROLL_BASE;
+
+        size_t literal = 0, i = 0;
+        uint32_t h = target_len >= BLOCK ? block_hash(target) : 0;
+
+        while (i + BLOCK <= target_len) {
+                size_t best_len = 0, best_offset = 0, best_back = 0;
+                int chain = 0;
+
+                for (int32_t c = head[bucket_of(h, bits)]; c && chain < MAX_CHAIN; c = next[c - 1], chain++) {
+                        size_t offset = (size_t)(c - 1) * BLOCK;
+                        size_t len = 0;
+
+                        while (offset + len < base_len && i + len < target_len
+                               && base[offset + len] == target[i + len])
+                                len++;
+                        if (len < BLOCK)
+                                continue;
+
+                        // Take back bytes that would otherwise be inserted
+                        size_t back = 0;
+                        while (back < offset && back < i - literal
+                               && base[offset - back - 1] == target[i - back - 1])
+                                back++;
+
+                        if (len + back > best_len + best_back) {
+                                best_len = len;
+                                best_offset = offset;
+                                best_back = back;
+                        }
+                }
+
+                if (best_len) {
+                        if (put_insert(out, target + literal, i - best_back - literal)
+                            || put_copy(out, best_offset - best_back, best_len + best_back))
+                                goto end;
+
+                        i += best_len;
+                        literal = i;
+                        if (i + BLOCK <= target_len)
+                                h = block_hash(target + i);
+                } else {
+                        if (i + BLOCK < target_len)
+                                h = (h - target[i] * pow) * ROLL_BASE + target[i + BLOCK];
+                        i++;
+                }
+        }
+
+        if (put_insert(out, target + literal, target_len - literal))
+                goto end;
+
+        rc = 0;
+end:
+        free(head);
+        free(next);
+        return rc;
+}
+
+// Apply delta to base. Returns the NUL terminated result, or NULL if the
+// delta does not fit base or is damaged.
+static char *
+apply_delta(const unsigned char *base, size_t base_len,
+            const unsigned char *delta, size_t delta_len, size_t *out_len)
+{
+        const unsigned char *p = delta, *end = delta + delta_len;
+        uint64_t want_base, target_len;
+
+        if (get_varint(&p, end, &want_base) || get_varint(&p, end, &target_len)
+            || want_base != base_len || target_len > MAX_TEXT)
+                return NULL;
+
+        char *out = malloc(target_len + 1);
+        if (!out)
+                return NULL;
+
+        size_t n = 0;
+        while (p < end) {
+                uint64_t op, offset;
+
+                if (get_varint(&p, end, &op))
+                        goto corrupt;
+
+                uint64_t len = op >> 1;
+                if (len > target_len - n)
+                        goto corrupt;
+
+                if (op & 1) {
+                        if (get_varint(&p, end, &offset) || offset > base_len || len > base_len - offset)
+                                goto corrupt;
+                        memcpy(out + n, base + offset, len);
+                } else {
+                        if (len > (uint64_t)(end - p))
+                                goto corrupt;
+                        memcpy(out + n, p, len);
+                        p += len;
+                }
+                n += len;
+        }
+
+        if (n != target_len)
+                goto corrupt;
+
+        out[n] = '\0';
+        *out_len = n;
+        return out;
+
+corrupt:
+        free(out);
+        return NULL;
+}
+
+int
+save_version(sqlite3 *db, sqlite3_int64 id, const char *body, size_t len)
+{
+        sqlite3_stmt *old = NULL, *insert = NULL;
+        struct buffer delta = { 0 };
+
+        int rc = sqlite3_prepare_v2(db, "SELECT note_text(body), hash, date, "
+                                    "(SELECT ifnull(max(version), 0) + 1 FROM note_versions "
+                                    "WHERE note_id = notes.id) "
+                                    "FROM notes WHERE id = ?;", -1, &old, 0);
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                return rc;
+        }
+
+        sqlite3_bind_int64(old, 1, id);
+
+        rc = sqlite3_step(old);
+        if (rc != SQLITE_ROW) {
+                if (rc == SQLITE_DONE) {
+                        rc = SQLITE_OK;
+                } else {
+                        fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+                }
+                goto end;
+        }
+
+        const unsigned char *text = sqlite3_column_text(old, 0);
+        size_t text_len = sqlite3_column_bytes(old, 0);
+        int version = sqlite3_column_int(old, 3);
+
+        if (!text) {
+                rc = sqlite3_errcode(db) == SQLITE_NOMEM ? SQLITE_NOMEM : SQLITE_OK;
+                goto end;
+        }
+
+        if (text_len == len && !memcmp(text, body, len)) {
+                rc = SQLITE_OK;
+                goto end;
+        }
+
+        int whole = version % SNAPSHOT_EVERY == 0;
+        if (!whole) {
+                if (make_delta((const unsigned char *)body, len, text, text_len, &delta)) {
+                        fprintf(stderr, "Cannot make delta: out of memory\n");
+                        rc = SQLITE_NOMEM;
+                        goto end;
+                }
+                whole = delta.len >= text_len;
+        }
+
+        rc = sqlite3_prepare_v2(db, "INSERT INTO note_versions(note_id, version, hash, date, delta, body) "
+                                "VALUES(?, ?, ?, ?, ?, ?);", -1, &insert, 0);
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                goto end;
+        }
+
+        sqlite3_bind_int64(insert, 1, id);
+        sqlite3_bind_int(insert, 2, version);
+        sqlite3_bind_value(insert, 3, sqlite3_column_value(old, 1));
+        sqlite3_bind_value(insert, 4, sqlite3_column_value(old, 2));
+        sqlite3_bind_int(insert, 5, !whole);
+        if (whole) {
+                bind_note_body(db, insert, 6, (const char *)text, text_len);
+        } else {
+                sqlite3_bind_blob64(insert, 6, delta.data, delta.len, SQLITE_STATIC);
+        }
+
+        rc = step_done(db, insert);
+
+end:
+        sqlite3_finalize(old);
+        sqlite3_finalize(insert);
+        free(delta.data);
+        return rc;
+}
+
+int
+read_version(sqlite3 *db, sqlite3_int64 id, int n, char **text, size_t *len)
+{
+        sqlite3_stmt *stmt;
+        struct version *versions = NULL;
+        int count = 0;
+        char *hash = NULL;
+        char *base = NULL;
+        size_t base_len = 0;
+
+        int rc = sqlite3_prepare_v2(db, "SELECT note_text(body), "
+                                    "(SELECT ifnull(max(version), 0) FROM note_versions "
+                                    "WHERE note_id = notes.id) "
+                                    "FROM notes WHERE id = ?;", -1, &stmt, 0);
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                return rc;
+        }
+
+        sqlite3_bind_int64(stmt, 1, id);
+
+        rc = sqlite3_step(stmt);
+        if (rc != SQLITE_ROW) {
+                fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+                sqlite3_finalize(stmt);
+                return rc;
+        }
+
+        int last = sqlite3_column_int(stmt, 1);
+        base_len = sqlite3_column_bytes(stmt, 0);
+        base = malloc(base_len + 1);
+        if (base) {
+                memcpy(base, sqlite3_column_blob(stmt, 0), base_len);
+                base[base_len] = '\0';
+        }
+        sqlite3_finalize(stmt);
+
+        if (!base) {
+                fprintf(stderr, "Cannot read note: out of memory\n");
+                return SQLITE_NOMEM;
+        }
+
+        if (n == 0 || n == last + 1) {
+                *text = base;
+                *len = base_len;
+                return SQLITE_OK;
+        }
+
+        if (n < 1 || n > last) {
+                fprintf(stderr, "No version %d, the note has %d\n", n, last + 1);
+                free(base);
+                return SQLITE_NOTFOUND;
+        }
+
+        // Versions from n up to the first one stored whole
+        rc = sqlite3_prepare_v2(db, "SELECT delta, CASE WHEN delta THEN body ELSE note_text(body) END, hash "
+                                "FROM note_versions WHERE note_id = ? AND version >= ? "
+                                "ORDER BY version;", -1, &stmt, 0);
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                free(base);
+                return rc;
+        }
+
+        sqlite3_bind_int64(stmt, 1, id);
+        sqlite3_bind_int(stmt, 2, n);
+
+        while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+                if (count % SNAPSHOT_EVERY == 0) {
+                        struct version *grown = realloc(versions, (count + SNAPSHOT_EVERY) * sizeof(*versions));
+                        if (!grown) {
+                                rc = SQLITE_NOMEM;
+                                break;
+                        }
+                        versions = grown;
+                }
+
+                struct version *v = &versions[count];
+                v->delta = sqlite3_column_int(stmt, 0);
+                v->len = sqlite3_column_bytes(stmt, 1);
+                v->data = malloc(v->len + 1);
+                if (!v->data) {
+                        rc = SQLITE_NOMEM;
+                        break;
+                }
+                memcpy(v->data, sqlite3_column_blob(stmt, 1), v->len);
+                v->data[v->len] = '\0';
+                count++;
+
+                if (count == 1)
+                        hash = sqlite3_mprintf("%s", sqlite3_column_text(stmt, 2));
+                if (!v->delta)
+                        break;
+        }
+
+        if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+                if (rc == SQLITE_NOMEM)
+                        fprintf(stderr, "Cannot read versions: out of memory\n");
+                else
+                        fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+                goto end;
+        }
+
+        // Start from the whole version if there is one, else the current body
+        int i = count - 1;
+        if (count && !versions[i].delta) {
+                free(base);
+                base = (char *)versions[i].data;
+                base_len = versions[i].len;
+                versions[i].data = NULL;
+                i--;
+        }
+
+        for (; i >= 0; i--) {
+                size_t out_len;
+                char *out = apply_delta((unsigned char *)base, base_len,
+                                        versions[i].data, versions[i].len, &out_len);
+                if (!out) {
+                        fprintf(stderr, "Version %d is damaged\n", n + i);
+                        rc = SQLITE_CORRUPT;
+                        goto end;
+                }
+
+                free(base);
+                base = out;
+                base_len = out_len;
+        }
+
+        char sum[SHA256_HEX_LENGTH + 1];
+        if (!hash || sha256_hex(base, base_len, sum) != 0) {
+                fprintf(stderr, "Cannot hash note\n");
+                rc = SQLITE_ERROR;
+                goto end;
+        }
+
+        if (strcmp(sum, hash)) {
+                fprintf(stderr, "Version %d does not match its hash\n", n);
+                rc = SQLITE_CORRUPT;
+                goto end;
+        }
+
+        *text = base;
+        *len = base_len;
+        base = NULL;
+        rc = SQLITE_OK;
+
+end:
+        sqlite3_finalize(stmt);
+        for (int j = 0; j < count; j++)
+                free(versions[j].data);
+        free(versions);
+        sqlite3_free(hash);
+        free(base);
+        return rc;
+}
+
+int
+history(sqlite3 *db, const char *uuid)
+{
+        sqlite3_int64 id;
+        int rc = resolve_note_id(db, uuid, &id);
+        if (rc != SQLITE_OK)
+                return rc;
+
+        sqlite3_stmt *stmt;
+        rc = sqlite3_prepare_v2(db, "SELECT uuid, (SELECT ifnull(max(version), 0) + 1 FROM note_versions "
+                                "WHERE note_id = notes.id), date, NULL, NULL FROM notes WHERE id = ?1 "
+                                "UNION ALL "
+                                "SELECT notes.uuid, version, note_versions.date, delta, length(note_versions.body) "
+                                "FROM note_versions INNER JOIN notes ON notes.id = note_versions.note_id "
+                                "WHERE note_id = ?1 "
+                                "ORDER BY 2 DESC;", -1, &stmt, 0);
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                return rc;
+        }
+
+        sqlite3_bind_int64(stmt, 1, id);
+
+        while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+                const char *kind;
+                if (sqlite3_column_type(stmt, 3) == SQLITE_NULL)
+                        kind = "current";
+                else if (sqlite3_column_int(stmt, 3))
+                        kind = "delta";
+                else
+                        kind = "whole";
+
+                printf("%s@%d - %s - %s", sqlite3_column_text(stmt, 0), sqlite3_column_int(stmt, 1),
+                       sqlite3_column_text(stmt, 2), kind);
+                if (sqlite3_column_type(stmt, 4) != SQLITE_NULL)
+                        printf(", %d bytes", sqlite3_column_int(stmt, 4));
+                printf("\n");
+        }
+
+        if (rc != SQLITE_DONE) {
+                fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+                sqlite3_finalize(stmt);
+                return rc;
+        }
+
+        sqlite3_finalize(stmt);
+        return SQLITE_OK;
+}
+
+int
+show_version(sqlite3 *db, const char *spec)
+{
+        char uuid[64];
+        const char *at = strrchr(spec, '@');
+        size_t uuid_len = at ? (size_t)(at - spec) : strlen(spec);
+        int n = 0;
+
+        if (uuid_len >= sizeof(uuid)) {
+                fprintf(stderr, "No note found: %s\n", spec);
+                return SQLITE_NOTFOUND;
+        }
+
+        memcpy(uuid, spec, uuid_len);
+        uuid[uuid_len] = '\0';
+
+        if (at) {
+                char *end;
+                long v = strtol(at + 1, &end, 10);
+                if (end == at + 1 || *end || v < 1 || v > MAX_TEXT) {
+                        fprintf(stderr, "Invalid version: %s\n", at + 1);
+                        return SQLITE_MISUSE;
+                }
+                n = v;
+        }
+
+        sqlite3_int64 id;
+        int rc = resolve_note_id(db, uuid, &id);
+        if (rc != SQLITE_OK)
+                return rc;
+
+        char *text = NULL;
+        size_t len;
+        rc = read_version(db, id, n, &text, &len);
+        if (rc != SQLITE_OK)
+                return rc;
+
+        printf("%s\n", text);
+        free(text);
+        return SQLITE_OK;
+}
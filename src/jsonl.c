@@ -0,0 +1,609 @@
+#include <stdio.h>
+#include <sqlite3.h>
+#include <stdlib.h>
+#include <string.h>
+#include "app.h"
+#include "compress.h"
+#include "hash.h"
+#include "jsonl.h"
+
+/*
+ * One JSON object per line. The first line is a header,
+ *
+ *   {"type":"zkc","version":1}
+ *
+ * and after it come the records, each table in id order:
+ *
+ *   {"type":"note","uuid":...,"date":...,"hash":...,"body":...}
+ *   {"type":"tag","body":...}
+ *   {"type":"note_tag","uuid":...,"tag":...}
+ *   {"type":"link","from":...,"to":...}
+ *   {"type":"inbox","uuid":...}
+ *
+ * Notes are referred to by uuid and tags by body, never by id, so a dump
+ * can be loaded into any vault. Import takes keys in any order, skips
+ * keys and record types it does not know, and holds one line at a time.
+ */
+
+#define JSONL_VERSION 1
+#define JSONL_BUFFER (1 << 20)
+#define IMPORT_BATCH 10000
+
+static const struct {
+        const char *type;
+        const char *sql;
+        const char *keys[4];
+} exports[] = {
+        { "note", "SELECT uuid, date, hash, note_text(body) FROM notes ORDER BY id;",
+          { "uuid", "date", "hash", "body" } },
+        { "tag", "SELECT body FROM tags ORDER BY id;",
+          { "body" } },
+        { "note_tag", "SELECT notes.uuid, tags.body FROM note_tags "
+                "INNER JOIN notes ON notes.id = note_tags.note_id "
+                "INNER JOIN tags ON tags.id = note_tags.tag_id "
+                "ORDER BY note_tags.id;",
+          { "uuid", "tag" } },
+        { "link", "SELECT a.uuid, b.uuid FROM links "
+                "INNER JOIN notes a ON a.id = links.a_id "
+                "INNER JOIN notes b ON b.id = links.b_id "
+                "ORDER BY links.id;",
+          { "from", "to" } },
+        { "inbox", "SELECT notes.uuid FROM inbox "
+                "INNER JOIN notes ON notes.id = inbox.note_id "
+                "ORDER BY inbox.id;",
+          { "uuid" } },
+};
+
+// Write s as a JSON string, copying the runs between characters that
+// need escaping in one go.
+static void
+put_string(FILE *out, const unsigned char *s, size_t len)
+{
+        static const char hex[] = "0123456789abcdef";
+
+        putc('"', out);
+        size_t start = 0;
+        for (size_t i = 0; i < len; i++) {
+                unsigned char c = s[i];
+                if (c >= 0x20 && c != '"' && c != '\\')
+                        continue;
+
+                fwrite(s + start, 1, i - start, out);
+                start = i + 1;
+
+                char esc[7] = { '\\', 0 };
+                size_t n = 2;
+                switch (c) {
+                case '"': esc[1] = '"'; break;
+                case '\\': esc[1] = '\\'; break;
+                case '\n': esc[1] = 'n'; break;
+                case '\t': esc[1] = 't'; break;
+                case '\r': esc[1] = 'r'; break;
+                case '\b': esc[1] = 'b'; break;
+                case '\f': esc[1] = 'f'; break;
+                default:
+                        memcpy(esc + 1, "u00", 3);
+                        esc[4] = hex[c >> 4];
+                        esc[5] = hex[c & 0xf];
+                        n = 6;
+                        break;
+                }
+                fwrite(esc, 1, n, out);
+        }
+        fwrite(s + start, 1, len - start, out);
+        putc('"', out);
+}
+
+int
+export_jsonl(sqlite3 *db, const char *path)
+{
+        FILE *out = stdout;
+        if (path) {
+                out = fopen(path, "wb");
+                if (!out) {
+                        perror(path);
+                        return 1;
+                }
+        }
+        setvbuf(out, NULL, _IOFBF, JSONL_BUFFER);
+
+        // One read transaction, so the records agree with each other even
+        // if the vault is written to while they stream out.
+        int rc = sql_exec(db, "BEGIN;");
+        if (rc != SQLITE_OK)
+                goto out;
+
+        fprintf(out, "{\"type\":\"zkc\",\"version\":%d}\n", JSONL_VERSION);
+
+        for (size_t t = 0; t < sizeof(exports) / sizeof(exports[0]); t++) {
+                sqlite3_stmt *stmt;
+                rc = sqlite3_prepare_v2(db, exports[t].sql, -1, &stmt, 0);
+                if (rc != SQLITE_OK) {
+                        fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                        break;
+                }
+
+                int columns = sqlite3_column_count(stmt);
+                while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+                        fprintf(out, "{\"type\":\"%s\"", exports[t].type);
+                        for (int i = 0; i < columns; i++) {
+                                fprintf(out, ",\"%s\":", exports[t].keys[i]);
+                                const unsigned char *value = sqlite3_column_text(stmt, i);
+                                if (value)
+                                        put_string(out, value, sqlite3_column_bytes(stmt, i));
+                                else
+                                        fputs("null", out);
+                        }
+                        fputs("}\n", out);
+                }
+                sqlite3_finalize(stmt);
+
+                if (rc != SQLITE_DONE) {
+                        fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+                        break;
+                }
+                rc = SQLITE_OK;
+        }
+
+        sql_exec(db, "COMMIT;");
+
+out:
+        if (fflush(out) != 0 || ferror(out)) {
+                perror(path ? path : "stdout");
+                if (rc == SQLITE_OK)
+                        rc = 1;
+        }
+        if (path)
+                fclose(out);
+        return rc;
+}
+
+struct record {
+        char *type;
+        char *uuid;
+        char *date;
+        char *hash;
+        char *body;
+        char *tag;
+        char *from;
+        char *to;
+        size_t body_len;
+        long version;
+};
+
+static char *
+skip_space(char *p)
+{
+        while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')
+                p++;
+        return p;
+}
+
+static int
+parse_hex4(const char *p, unsigned *value)
+{
+        *value = 0;
+        for (int i = 0; i < 4; i++) {
+                char c = p[i];
+                unsigned digit;
+                if (c >= '0' && c <= '9')
+                        digit = c - '0';
+                else if (c >= 'a' && c <= 'f')
+                        digit = c - 'a' + 10;
+                else if (c >= 'A' && c <= 'F')
+                        digit = c - 'A' + 10;
+                else
+                        return -1;
+                *value = *value << 4 | digit;
+        }
+        return 0;
+}
+
+static char *
+put_utf8(char *w, unsigned cp)
+{
+        if (cp < 0x80) {
+                *w++ = cp;
+        } else if (cp < 0x800) {
+                *w++ = 0xc0 | cp >> 6;
+                *w++ = 0x80 | (cp & 0x3f);
+        } else if (cp < 0x10000) {
+                *w++ = 0xe0 | cp >> 12;
+                *w++ = 0x80 | (cp >> 6 & 0x3f);
+                *w++ = 0x80 | (cp & 0x3f);
+        } else {
+                *w++ = 0xf0 | cp >> 18;
+                *w++ = 0x80 | (cp >> 12 & 0x3f);
+                *w++ = 0x80 | (cp >> 6 & 0x3f);
+                *w++ = 0x80 | (cp & 0x3f);
+        }
+        return w;
+}
+
+// Decode in place the string whose opening quote is just before p. The
+// decoded string is never longer, so it is written over the input and
+// NUL terminated. Returns the character after the closing quote, or NULL
+// if the string is malformed.
+static char *
+parse_string(char *p, char **value, size_t *len)
+{
+        char *w = p;
+        *value = p;
+        for (;;) {
+                size_t run = strcspn(p, "\"\\");
+                memmove(w, p, run);
+                w += run;
+                p += run;
+
+                if (*p == '"')
+                        break;
+                if (*p == '\0')
+                        return NULL;
+
+                p++;
+                switch (*p++) {
+                case '"': *w++ = '"'; break;
+                case '\\': *w++ = '\\'; break;
+                case '/': *w++ = '/'; break;
+                case 'n': *w++ = '\n'; break;
+                case 't': *w++ = '\t'; break;
+                case 'r': *w++ = '\r'; break;
+                case 'b': *w++ = '\b'; break;
+                case 'f': *w++ = '\f'; break;
+                case 'u': {
+                        unsigned cp, low;
+                        if (parse_hex4(p, &cp) != 0)
+                                return NULL;
+                        p += 4;
+                        if (cp >= 0xd800 && cp < 0xdc00 && p[0] == '\\' && p[1] == 'u' &&
+                            parse_hex4(p + 2, &low) == 0 && low >= 0xdc00 && low < 0xe000) {
+                                cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+                                p += 6;
+                        }
+                        w = put_utf8(w, cp);
+                        break;
+                }
+                default:
+                        return NULL;
+                }
+        }
+        *len = w - *value;
+        *w = '\0';
+        return p + 1;
+}
+
+// Step over a value of no interest, objects and arrays included.
+static char *
+skip_value(char *p)
+{
+        int depth = 0;
+        do {
+                char *s;
+                size_t len;
+
+                p = skip_space(p);
+                switch (*p) {
+                case '"':
+                        p = parse_string(p + 1, &s, &len);
+                        if (!p)
+                                return NULL;
+                        break;
+                case '{':
+                case '[':
+                        depth++;
+                        p++;
+                        break;
+                case '}':
+                case ']':
+                case ',':
+                case ':':
+                        if (depth == 0)
+                                return NULL;
+                        if (*p == '}' || *p == ']')
+                                depth--;
+                        p++;
+                        break;
+                case '\0':
+                        return NULL;
+                default:
+                        while (*p && !strchr(",:{}[]\" \t\r\n", *p))
+                                p++;
+                        break;
+                }
+        } while (depth > 0);
+        return p;
+}
+
+static char **
+record_field(struct record *r, const char *key)
+{
+        if (!strcmp(key, "type"))
+                return &r->type;
+        if (!strcmp(key, "uuid"))
+                return &r->uuid;
+        if (!strcmp(key, "date"))
+                return &r->date;
+        if (!strcmp(key, "hash"))
+                return &r->hash;
+        if (!strcmp(key, "body"))
+                return &r->body;
+        if (!strcmp(key, "tag"))
+                return &r->tag;
+        if (!strcmp(key, "from"))
+                return &r->from;
+        if (!strcmp(key, "to"))
+                return &r->to;
+        return NULL;
+}
+
+// Parse one line into r, its strings pointing into line. Returns 0, or -1
+// if the line is not a JSON object.
+static int
+parse_record(char *line, struct record *r)
+{
+        memset(r, 0, sizeof(*r));
+
+        char *p = skip_space(line);
+        if (*p != '{')
+                return -1;
+        p = skip_space(p + 1);
+
+        while (*p != '}') {
+                char *key, *end;
+                size_t len;
+
+                if (*p != '"' || !(p = parse_string(p + 1, &key, &len)))
+                        return -1;
+                p = skip_space(p);
+                if (*p != ':')
+                        return -1;
+                p = skip_space(p + 1);
+
+                char **field = record_field(r, key);
+                if (field && *p == '"') {
+                        p = parse_string(p + 1, field, &len);
+                        if (!p)
+                                return -1;
+                        if (field == &r->body)
+                                r->body_len = len;
+                } else if (!strcmp(key, "version")) {
+                        r->version = strtol(p, &end, 10);
+                        if (end == p)
+                                return -1;
+                        p = end;
+                } else if (!(p = skip_value(p))) {
+                        return -1;
+                }
+
+                p = skip_space(p);
+                if (*p == ',')
+                        p = skip_space(p + 1);
+                else if (*p != '}')
+                        return -1;
+        }
+        return *skip_space(p + 1) ? -1 : 0;
+}
+
+enum {
+        FIND_NOTE,
+        INSERT_NOTE,
+        INSERT_TAG,
+        INSERT_NOTE_TAG,
+        INSERT_LINK,
+        INSERT_INBOX,
+        IMPORT_STMTS
+};
+
+static const char *import_sql[IMPORT_STMTS] = {
+        [FIND_NOTE] = "SELECT id, hash, date FROM notes WHERE uuid = ? LIMIT 1;",
+        [INSERT_NOTE] = "INSERT INTO notes(uuid, date, hash, body) "
+                "VALUES(?1, ifnull(?2, datetime()), ?3, ?4);",
+        [INSERT_TAG] = "INSERT OR IGNORE INTO tags(body) VALUES(?);",
+        [INSERT_NOTE_TAG] = "INSERT INTO note_tags(note_id, tag_id) "
+                "SELECT notes.id, tags.id FROM notes, tags "
+                "WHERE notes.uuid = ?1 AND tags.body = ?2 AND NOT EXISTS ("
+                "SELECT 1 FROM note_tags WHERE note_id = notes.id AND tag_id = tags.id) "
+                "LIMIT 1;",
+        [INSERT_LINK] = "INSERT INTO links(a_id, b_id) "
+                "SELECT a.id, b.id FROM notes a, notes b "
+                "WHERE a.uuid = ?1 AND b.uuid = ?2 AND NOT EXISTS ("
+                "SELECT 1 FROM links WHERE a_id = a.id AND b_id = b.id) "
+                "LIMIT 1;",
+        [INSERT_INBOX] = "INSERT INTO inbox(note_id) "
+                "SELECT id FROM notes WHERE uuid = ?1 AND NOT EXISTS ("
+                "SELECT 1 FROM inbox WHERE note_id = notes.id) "
+                "LIMIT 1;",
+};
+
+// Run stmt with its text parameters bound to a and b, either of which may
+// be NULL. Returns the number of rows it changed, or -1.
+static int
+run_insert(sqlite3 *db, sqlite3_stmt *stmt, const char *a, const char *b)
+{
+        sqlite3_reset(stmt);
+        sqlite3_bind_text(stmt, 1, a, -1, SQLITE_STATIC);
+        if (b)
+                sqlite3_bind_text(stmt, 2, b, -1, SQLITE_STATIC);
+
+        if (sqlite3_step(stmt) != SQLITE_DONE) {
+                fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+                return -1;
+        }
+        return sqlite3_changes(db);
+}
+
+// Add the note, or replace ours when the record's is newer. Returns 1 if
+// the vault changed, 0 if not, or -1 on error.
+static int
+import_note(sqlite3 *db, sqlite3_stmt **stmts, struct record *r)
+{
+        char hash[SHA256_HEX_LENGTH + 1];
+        if (sha256_hex(r->body, r->body_len, hash) != 0)
+                return -1;
+        if (r->hash && strcmp(r->hash, hash)) {
+                fprintf(stderr, "Skipping note %s: hash does not match its body\n", r->uuid);
+                return 0;
+        }
+
+        sqlite3_stmt *find = stmts[FIND_NOTE];
+        sqlite3_reset(find);
+        sqlite3_bind_text(find, 1, r->uuid, -1, SQLITE_STATIC);
+        int rc = sqlite3_step(find);
+
+        if (rc == SQLITE_DONE) {
+                sqlite3_stmt *insert = stmts[INSERT_NOTE];
+                sqlite3_reset(insert);
+                sqlite3_bind_text(insert, 1, r->uuid, -1, SQLITE_STATIC);
+                if (r->date)
+                        sqlite3_bind_text(insert, 2, r->date, -1, SQLITE_STATIC);
+                else
+                        sqlite3_bind_null(insert, 2);
+                sqlite3_bind_text(insert, 3, hash, -1, SQLITE_STATIC);
+                bind_note_body(db, insert, 4, r->body, r->body_len);
+                if (sqlite3_step(insert) != SQLITE_DONE) {
+                        fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+                        return -1;
+                }
+                return 1;
+        }
+        if (rc != SQLITE_ROW) {
+                fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+                return -1;
+        }
+
+        sqlite3_int64 id = sqlite3_column_int64(find, 0);
+        const char *our_hash = (const char *)sqlite3_column_text(find, 1);
+        const char *our_date = (const char *)sqlite3_column_text(find, 2);
+        if (!strcmp(our_hash, hash) || !r->date || strcmp(r->date, our_date) <= 0)
+                return 0;
+
+        rc = replace_body(db, id, r->body, r->body_len, hash, r->date);
+        return rc == SQLITE_OK ? 1 : -1;
+}
+
+int
+import_jsonl(sqlite3 *db, const char *path)
+{
+        FILE *in = stdin;
+        if (path) {
+                in = fopen(path, "rb");
+                if (!in) {
+                        perror(path);
+                        return 1;
+                }
+        }
+        setvbuf(in, NULL, _IOFBF, JSONL_BUFFER);
+
+        sqlite3_stmt *stmts[IMPORT_STMTS] = { 0 };
+        int rc = SQLITE_OK;
+        for (int i = 0; i < IMPORT_STMTS; i++) {
+                rc = sqlite3_prepare_v2(db, import_sql[i], -1, &stmts[i], 0);
+                if (rc != SQLITE_OK) {
+                        fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                        goto out;
+                }
+        }
+
+        // Every note lands in the trigram and completion indexes too, so
+        // give their b-trees room to stay in memory between commits
+        rc = sql_exec(db, "PRAGMA cache_size = -65536; BEGIN;");
+        if (rc != SQLITE_OK)
+                goto out;
+
+        int notes = 0, tags = 0, note_tags = 0, links = 0, inbox = 0;
+        long line_number = 0, batch = 0;
+        char *line = NULL;
+        size_t cap = 0;
+
+        while (getline(&line, &cap, in) != -1) {
+                struct record r;
+                int changed = 0;
+
+                line_number++;
+                if (*skip_space(line) == '\0')
+                        continue;
+                if (parse_record(line, &r) != 0 || !r.type)
+                        goto invalid;
+
+                if (!strcmp(r.type, "zkc")) {
+                        if (r.version > JSONL_VERSION) {
+                                fprintf(stderr, "Unsupported export version %ld\n", r.version);
+                                rc = 1;
+                                break;
+                        }
+                } else if (!strcmp(r.type, "note")) {
+                        if (!r.uuid || !r.body)
+                                goto invalid;
+                        changed = import_note(db, stmts, &r);
+                        notes += changed > 0;
+                } else if (!strcmp(r.type, "tag")) {
+                        if (!r.body)
+                                goto invalid;
+                        changed = run_insert(db, stmts[INSERT_TAG], r.body, NULL);
+                        tags += changed > 0;
+                } else if (!strcmp(r.type, "note_tag")) {
+                        if (!r.uuid || !r.tag)
+                                goto invalid;
+                        changed = run_insert(db, stmts[INSERT_TAG], r.tag, NULL);
+                        tags += changed > 0;
+                        if (changed >= 0)
+                                changed = run_insert(db, stmts[INSERT_NOTE_TAG], r.uuid, r.tag);
+                        note_tags += changed > 0;
+                } else if (!strcmp(r.type, "link")) {
+                        if (!r.from || !r.to)
+                                goto invalid;
+                        changed = run_insert(db, stmts[INSERT_LINK], r.from, r.to);
+                        links += changed > 0;
+                } else if (!strcmp(r.type, "inbox")) {
+                        if (!r.uuid)
+                                goto invalid;
+                        changed = run_insert(db, stmts[INSERT_INBOX], r.uuid, NULL);
+                        inbox += changed > 0;
+                }
+
+                if (changed < 0) {
+                        rc = 1;
+                        break;
+                }
+
+                // Commit now and then, so the journal stays small and work
+                // done survives an import that fails further on.
+                if (++batch == IMPORT_BATCH) {
+                        batch = 0;
+                        rc = sql_exec(db, "COMMIT;");
+                        if (rc == SQLITE_OK)
+                                rc = sql_exec(db, "BEGIN;");
+                        if (rc != SQLITE_OK)
+                                break;
+                }
+                continue;
+
+invalid:
+                fprintf(stderr, "Invalid record on line %ld\n", line_number);
+                rc = 1;
+                break;
+        }
+        free(line);
+
+        if (rc == SQLITE_OK && ferror(in)) {
+                perror(path ? path : "stdin");
+                rc = 1;
+        }
+
+        if (rc == SQLITE_OK)
+                rc = sql_exec(db, "COMMIT;");
+        if (rc == SQLITE_OK) {
+                printf("Imported %d notes, %d tags, %d note tags, %d links, %d inbox entries\n",
+                       notes, tags, note_tags, links, inbox);
+        } else {
+                sql_exec(db, "ROLLBACK;");
+                fprintf(stderr, "Stopped at line %ld; earlier batches were kept\n", line_number);
+        }
+
+out:
+        for (int i = 0; i < IMPORT_STMTS; i++)
+                sqlite3_finalize(stmts[i]);
+        if (path)
+                fclose(in);
+        return rc;
+}
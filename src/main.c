@@ -1,19 +1,58 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <sqlite3.h>
 #include <string.h>
 #include "app.h"
+#include "graph.h"
+#include "related.h"
+#include "dupes.h"
+#include "compress.h"
+#include "history.h"
+#include "attach.h"
+#include "export.h"
+#include "sync.h"
+#include "jsonl.h"
+#include "bundle.h"
+#include "changes.h"
+#include "vaults.h"
 
 int
 main(int argc, char **argv)
 {
 	sqlite3 *db;
+	struct changes *changes = NULL;
+	char *path = NULL;
 	int rc, err = 1;
 
-	rc = open_db(&db);
+	// --db names the vault for the rest of the command
+	if (argc >= 3 && !strcmp(argv[1], "--db")) {
+		path = argv[2];
+		argv[2] = argv[0];
+		argc -= 2;
+		argv += 2;
+	}
+
+	rc = open_db(&db, path);
+	if (rc != SQLITE_OK)
+		goto end;
+
+	rc = changes_begin(db, argc, argv, &changes);
 	if (rc != SQLITE_OK)
 		goto end;
 
-	if (argc == 2) {
+	if (argc >= 2 && !strcmp(argv[1], "export-graph")) {
+		rc = export_graph(db, argc - 2, argv + 2);
+		if (rc != SQLITE_OK)
+			goto end;
+	} else if (argc >= 4 && !strcmp(argv[1], "search") && !strcmp(argv[2], "--vaults")) {
+		rc = search_vaults(argc - 3, argv + 3);
+		if (rc != SQLITE_OK)
+			goto end;
+	} else if (argc >= 2 && !strcmp(argv[1], "export-dir")) {
+		rc = export_dir(db, argc - 2, argv + 2);
+		if (rc != SQLITE_OK)
+			goto end;
+	} else if (argc == 2) {
 		if (!strcmp(argv[1], "help")) {
 			help();
 		} else if (!strcmp(argv[1], "init")) {
@@ -21,6 +60,18 @@ main(int argc, char **argv)
 			if (rc != SQLITE_OK)
 				goto end;
 			printf("zkc initialized\n");
+		} else if (!strcmp(argv[1], "compress")) {
+			rc = compress_notes(db);
+			if (rc != SQLITE_OK)
+				goto end;
+		} else if (!strcmp(argv[1], "conflicts")) {
+			rc = conflicts(db);
+			if (rc != SQLITE_OK)
+				goto end;
+		} else if (!strcmp(argv[1], "near-dupes")) {
+			rc = near_dupes(db, 0.9);
+			if (rc != SQLITE_OK)
+				goto end;
 		} else if (!strcmp(argv[1], "inbox")) {
 			printf("Inbox:\n");
 			rc = inbox(db, 0);
@@ -42,6 +93,18 @@ main(int argc, char **argv)
 			rc = tags(db, NULL);
 			if (rc != SQLITE_OK)
 				goto end;
+		} else if (!strcmp(argv[1], "rank")) {
+			rc = rank(db);
+			if (rc != SQLITE_OK)
+				goto end;
+		} else if (!strcmp(argv[1], "orphans")) {
+			rc = orphans(db);
+			if (rc != SQLITE_OK)
+				goto end;
+		} else if (!strcmp(argv[1], "components")) {
+			rc = components(db);
+			if (rc != SQLITE_OK)
+				goto end;
 		} else {
 			printf("Invalid command or missing arguments: %s\n", argv[1]);
 		}
@@ -54,18 +117,62 @@ main(int argc, char **argv)
 			rc = edit(db, argv[2]);
 			if (rc != SQLITE_OK)
 				goto end;
+		} else if (!strcmp(argv[1], "history")) {
+			rc = history(db, argv[2]);
+			if (rc != SQLITE_OK)
+				goto end;
+		} else if (!strcmp(argv[1], "show")) {
+			rc = show_version(db, argv[2]);
+			if (rc != SQLITE_OK)
+				goto end;
+		} else if (!strcmp(argv[1], "sync-dir")) {
+			rc = sync_dir(db, argv[2], 0);
+			if (rc != SQLITE_OK)
+				goto end;
+		} else if (!strcmp(argv[1], "export") && !strcmp(argv[2], "--jsonl")) {
+			rc = export_jsonl(db, NULL);
+			if (rc != SQLITE_OK)
+				goto end;
+		} else if (!strcmp(argv[1], "import") && !strcmp(argv[2], "--jsonl")) {
+			rc = import_jsonl(db, NULL);
+			if (rc != SQLITE_OK)
+				goto end;
+		} else if (!strcmp(argv[1], "attachments")) {
+			rc = attachments(db, argv[2]);
+			if (rc != SQLITE_OK)
+				goto end;
 		} else if (!strcmp(argv[1], "slurp")) {
 			rc = slurp(db, argv[2]);
 			if (rc != SQLITE_OK)
 				goto end;
 		} else if (!strcmp(argv[1], "search")) {
-			rc = search(db, "text", argv[2]);
+			rc = search(db, "text", argv[2], 0);
+			if (rc != SQLITE_OK)
+				goto end;
+		} else if (!strcmp(argv[1], "related")) {
+			rc = related(db, argv[2], 10);
+			if (rc != SQLITE_OK)
+				goto end;
+		} else if (!strcmp(argv[1], "complete")) {
+			rc = complete(db, argv[2], 10);
+			if (rc != SQLITE_OK)
+				goto end;
+		} else if (!strcmp(argv[1], "link-many")) {
+			rc = link_many(db, NULL, NULL, argv[2]);
 			if (rc != SQLITE_OK)
 				goto end;
 		} else if (!strcmp(argv[1], "links")) {
 			rc = links(db, argv[2]);
 			if (rc != SQLITE_OK)
 				goto end;
+		} else if (!strcmp(argv[1], "tags") && !strcmp(argv[2], "--tree")) {
+			rc = tag_tree(db);
+			if (rc != SQLITE_OK)
+				goto end;
+		} else if (!strcmp(argv[1], "tags") && !strcmp(argv[2], "--counts")) {
+			rc = tag_counts(db, 0);
+			if (rc != SQLITE_OK)
+				goto end;
 		} else if (!strcmp(argv[1], "tags")) {
 			rc = tags(db, argv[2]);
 			if (rc != SQLITE_OK)
@@ -83,7 +190,7 @@ main(int argc, char **argv)
 			if (rc != SQLITE_OK)
 			  goto end;
 		} else if (!strcmp(argv[1], "merge")) {
-		  rc = merge(db, argv[2]);
+		  rc = merge(db, argv[2], 0);
 			if (rc != SQLITE_OK)
 			  goto end;
 		} else {
@@ -94,18 +201,91 @@ main(int argc, char **argv)
 			rc = spit(db, argv[2], argv[3]);
 			if (rc != SQLITE_OK)
 				goto end;
+		} else if (!strcmp(argv[1], "search") && !strcmp(argv[2], "--rank")) {
+			rc = search(db, "text", argv[3], 1);
+			if (rc != SQLITE_OK)
+				goto end;
 		} else if (!strcmp(argv[1], "search")) {
-			rc = search(db, argv[2], argv[3]);
+			rc = search(db, argv[2], argv[3], 0);
+			if (rc != SQLITE_OK)
+				goto end;
+		} else if (!strcmp(argv[1], "tags") && !strcmp(argv[2], "--counts")
+			   && !strcmp(argv[3], "--sort")) {
+			rc = tag_counts(db, 1);
+			if (rc != SQLITE_OK)
+				goto end;
+		} else if (!strcmp(argv[1], "tags") && !strcmp(argv[2], "--cooccur")) {
+			rc = tag_cooccurrence(db, atoi(argv[3]));
+			if (rc != SQLITE_OK)
+				goto end;
+		} else if (!strcmp(argv[1], "near-dupes") && !strcmp(argv[2], "--threshold")) {
+			rc = near_dupes(db, atof(argv[3]));
+			if (rc != SQLITE_OK)
+				goto end;
+		} else if (!strcmp(argv[1], "merge") && !strcmp(argv[2], "--near-dupes")) {
+			rc = merge(db, argv[3], 0.9);
+			if (rc != SQLITE_OK)
+				goto end;
+		} else if (!strcmp(argv[1], "related")) {
+			rc = related(db, argv[2], atoi(argv[3]));
+			if (rc != SQLITE_OK)
+				goto end;
+		} else if (!strcmp(argv[1], "complete")) {
+			rc = complete(db, argv[2], atoi(argv[3]));
 			if (rc != SQLITE_OK)
 				goto end;
 		} else if (!strcmp(argv[1], "link")) {
 			rc = link_notes(db, argv[2], argv[3]);
 			if (rc != SQLITE_OK)
 				goto end;
+		} else if (!strcmp(argv[1], "tag") && !strcmp(argv[2], "--stdin")) {
+			rc = tag_many(db, NULL, NULL, argv[3]);
+			if (rc != SQLITE_OK)
+				goto end;
 		} else if (!strcmp(argv[1], "tag")) {
 			rc = tag(db, argv[2], argv[3]);
 			if (rc != SQLITE_OK)
 				goto end;
+		} else if (!strcmp(argv[1], "sync-dir") && !strcmp(argv[2], "--watch")) {
+			rc = sync_dir(db, argv[3], 1);
+			if (rc != SQLITE_OK)
+				goto end;
+		} else if (!strcmp(argv[1], "export") && !strcmp(argv[2], "--jsonl")) {
+			rc = export_jsonl(db, argv[3]);
+			if (rc != SQLITE_OK)
+				goto end;
+		} else if (!strcmp(argv[1], "import") && !strcmp(argv[2], "--jsonl")) {
+			rc = import_jsonl(db, argv[3]);
+			if (rc != SQLITE_OK)
+				goto end;
+		} else if (!strcmp(argv[1], "bundle") && !strcmp(argv[2], "create")) {
+			rc = bundle_create(db, argv[3]);
+			if (rc != SQLITE_OK)
+				goto end;
+		} else if (!strcmp(argv[1], "bundle") && !strcmp(argv[2], "apply")) {
+			rc = bundle_apply(db, argv[3]);
+			if (rc != SQLITE_OK)
+				goto end;
+		} else if (!strcmp(argv[1], "bundle") && !strcmp(argv[2], "verify")) {
+			rc = bundle_verify(argv[3]);
+			if (rc != SQLITE_OK)
+				goto end;
+		} else if (!strcmp(argv[1], "changes") && !strcmp(argv[2], "push")) {
+			rc = changes_push(db, argv[3]);
+			if (rc != SQLITE_OK)
+				goto end;
+		} else if (!strcmp(argv[1], "changes") && !strcmp(argv[2], "apply")) {
+			rc = changes_apply(db, argv[3]);
+			if (rc != SQLITE_OK)
+				goto end;
+		} else if (!strcmp(argv[1], "attach")) {
+			rc = attach(db, argv[2], argv[3]);
+			if (rc != SQLITE_OK)
+				goto end;
+		} else if (!strcmp(argv[1], "path")) {
+			rc = note_path(db, argv[2], argv[3]);
+			if (rc != SQLITE_OK)
+				goto end;
 		} else if (!strcmp(argv[1], "delete")) {
 			if (!strcmp(argv[2], "note")) {
 				rc = delete_note(db, argv[3]);
@@ -122,7 +302,23 @@ main(int argc, char **argv)
 			printf("Invalid command: %s\n", argv[1]);
 		}
 	} else if (argc == 5) {
-		if (!strcmp(argv[1], "delete")) {
+		if (!strcmp(argv[1], "search") && !strcmp(argv[2], "--rank")) {
+			rc = search(db, argv[3], argv[4], 1);
+			if (rc != SQLITE_OK)
+				goto end;
+		} else if (!strcmp(argv[1], "tag") && !strcmp(argv[2], "--where")) {
+			rc = tag_many(db, "text", argv[3], argv[4]);
+			if (rc != SQLITE_OK)
+				goto end;
+		} else if (!strcmp(argv[1], "link-many") && !strcmp(argv[2], "--where")) {
+			rc = link_many(db, "text", argv[3], argv[4]);
+			if (rc != SQLITE_OK)
+				goto end;
+		} else if (!strcmp(argv[1], "attachment")) {
+			rc = save_attachment(db, argv[2], argv[3], argv[4]);
+			if (rc != SQLITE_OK)
+				goto end;
+		} else if (!strcmp(argv[1], "delete")) {
 			if (!strcmp(argv[2], "link")) {
 				rc = delete_link(db, argv[3], argv[4]);
 				if (rc != SQLITE_OK)
@@ -131,12 +327,33 @@ main(int argc, char **argv)
 				rc = delete_note_tag(db, argv[3], argv[4]);
 				if (rc != SQLITE_OK)
 					goto end;
+			} else if (!strcmp(argv[2], "attachment")) {
+				rc = delete_attachment(db, argv[3], argv[4]);
+				if (rc != SQLITE_OK)
+					goto end;
 			} else {
 				printf("Invalid delete type: %s\n", argv[2]);
 			}
 		} else {
 			printf("Invalid command: %s\n", argv[1]);			
 		}
+	} else if (argc == 6) {
+		if (!strcmp(argv[1], "tag") && !strcmp(argv[2], "--where")) {
+			rc = tag_many(db, argv[3], argv[4], argv[5]);
+			if (rc != SQLITE_OK)
+				goto end;
+		} else if (!strcmp(argv[1], "link-many") && !strcmp(argv[2], "--where")) {
+			rc = link_many(db, argv[3], argv[4], argv[5]);
+			if (rc != SQLITE_OK)
+				goto end;
+		} else if (!strcmp(argv[1], "merge") && !strcmp(argv[2], "--near-dupes")
+			   && !strcmp(argv[3], "--threshold")) {
+			rc = merge(db, argv[5], atof(argv[4]));
+			if (rc != SQLITE_OK)
+				goto end;
+		} else {
+			printf("Invalid command: %s\n", argv[1]);
+		}
 	} else {
 		help();
 	}
@@ -146,6 +363,10 @@ main(int argc, char **argv)
 
 end:
 
+	// Many commands return SQLITE_DONE when they succeed
+	if ((rc == SQLITE_OK || rc == SQLITE_DONE) && changes_record(db, changes) != SQLITE_OK)
+		err = 1;
+	changes_free(changes);
 	sqlite3_close(db);
 	return err;
 }
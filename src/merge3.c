@@ -0,0 +1,335 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "merge3.h"
+
+/*
+ * Line based three-way merge in the manner of diff3. Each side is matched
+ * against the base along a shortest edit script (Myers' O(ND) algorithm).
+ * Base lines matched on both sides are stable and split the texts into
+ * hunks. A hunk only one side changed takes that side, one both sides
+ * changed the same way takes either, and anything else is a conflict.
+ *
+ * The edit script keeps every step of the search to walk back from, so
+ * past MAX_EDITS differences the middle of a side is left unmatched,
+ * which at worst turns it into one conflict.
+ */
+#define MAX_EDITS 2000
+
+struct line {
+        const char *s;
+        size_t len;
+        uint64_t hash;
+};
+
+struct lines {
+        struct line *v;
+        int n;
+};
+
+struct text {
+        char *data;
+        size_t len, cap;
+};
+
+static int
+split_lines(const char *s, size_t len, struct lines *out)
+{
+        int n = 0;
+        for (size_t i = 0; i < len; i++)
+                if (s[i] == '\n')
+                        n++;
+        if (len && s[len - 1] != '\n')
+                n++;
+
+        out->n = 0;
+        out->v = malloc((n ? n : 1) * sizeof(*out->v));
+        if (!out->v)
+                return -1;
+
+        size_t start = 0;
+        for (size_t i = 0; i < len; i++) {
+                if (s[i] != '\n' && i + 1 < len)
+                        continue;
+
+                struct line *l = &out->v[out->n++];
+                l->s = s + start;
+                l->len = i + 1 - start;
+                l->hash = 0xcbf29ce484222325ULL;
+                for (size_t j = 0; j < l->len; j++)
+                        l->hash = (l->hash ^ (unsigned char)l->s[j]) * 0x100000001b3ULL;
+                start = i + 1;
+        }
+
+        return 0;
+}
+
+static int
+same_line(const struct line *a, const struct line *b)
+{
+        return a->hash == b->hash && a->len == b->len && !memcmp(a->s, b->s, a->len);
+}
+
+static int
+same_lines(const struct line *a, int n, const struct line *b, int m)
+{
+        if (n != m)
+                return 0;
+
+        for (int i = 0; i < n; i++)
+                if (!same_line(&a[i], &b[i]))
+                        return 0;
+        return 1;
+}
+
+// Myers' greedy search over a[0..n) and b[0..m), keeping each round of
+// furthest reaching x in trace so the script can be walked back. Round d
+// covers diagonals -d..d and starts at trace[d * d].
+static int
+myers(const struct line *a, int n, const struct line *b, int m, int *match)
+{
+        int max = n + m;
+        int *v = malloc((2 * (size_t)max + 3) * sizeof(*v));
+        int *trace = NULL;
+        size_t trace_len = 0, trace_cap = 0;
+        int found = -1;
+
+        if (!v)
+                return -1;
+
+        int offset = max + 1;
+        v[offset + 1] = 0;
+
+        for (int d = 0; d <= max && d <= MAX_EDITS && found < 0; d++) {
+                for (int k = -d; k <= d; k += 2) {
+                        int x;
+                        if (k == -d || (k != d && v[offset + k - 1] < v[offset + k + 1]))
+                                x = v[offset + k + 1];
+                        else
+                                x = v[offset + k - 1] + 1;
+
+                        int y = x - k;
+                        while (x < n && y < m && same_line(&a[x], &b[y])) {
+                                x++;
+                                y++;
+                        }
+
+                        v[offset + k] = x;
+                        if (x >= n && y >= m) {
+                                found = d;
+                                break;
+                        }
+                }
+
+                if (trace_len + 2 * d + 1 > trace_cap) {
+                        size_t cap = trace_cap ? trace_cap * 2 : 1024;
+                        while (cap < trace_len + 2 * d + 1)
+                                cap *= 2;
+
+                        int *grown = realloc(trace, cap * sizeof(*trace));
+                        if (!grown) {
+                                free(trace);
+                                free(v);
+                                return -1;
+                        }
+                        trace = grown;
+                        trace_cap = cap;
+                }
+
+                memcpy(trace + trace_len, v + offset - d, (2 * d + 1) * sizeof(*v));
+                trace_len += 2 * d + 1;
+        }
+
+        free(v);
+
+        if (found < 0) {
+                free(trace);
+                return 0;
+        }
+
+        int x = n, y = m;
+        for (int d = found; d > 0; d--) {
+                const int *prev = trace + (size_t)(d - 1) * (d - 1) + (d - 1);
+                int k = x - y;
+                int pk;
+
+                if (k == -d || (k != d && prev[k - 1] < prev[k + 1]))
+                        pk = k + 1;
+                else
+                        pk = k - 1;
+
+                int px = prev[pk];
+                int sx = pk == k + 1 ? px : px + 1;
+
+                // The diagonal run after the step holds matching lines
+                while (x > sx) {
+                        x--;
+                        y--;
+                        match[x] = y;
+                }
+
+                x = px;
+                y = px - pk;
+        }
+
+        while (x > 0) {
+                x--;
+                y--;
+                match[x] = y;
+        }
+
+        free(trace);
+        return 0;
+}
+
+// Set match[i] to the line of b matched with line i of a, or -1
+static int
+match_lines(const struct lines *a, const struct lines *b, int *match)
+{
+        int n = a->n, m = b->n;
+        int p = 0, s = 0;
+
+        for (int i = 0; i < n; i++)
+                match[i] = -1;
+
+        while (p < n && p < m && same_line(&a->v[p], &b->v[p])) {
+                match[p] = p;
+                p++;
+        }
+
+        while (s < n - p && s < m - p && same_line(&a->v[n - 1 - s], &b->v[m - 1 - s])) {
+                match[n - 1 - s] = m - 1 - s;
+                s++;
+        }
+
+        if (myers(a->v + p, n - p - s, b->v + p, m - p - s, match + p) != 0)
+                return -1;
+
+        for (int i = p; i < n - s; i++)
+                if (match[i] >= 0)
+                        match[i] += p;
+
+        return 0;
+}
+
+static int
+put(struct text *t, const char *s, size_t len)
+{
+        if (t->len + len + 1 > t->cap) {
+                size_t cap = t->cap ? t->cap : 1024;
+                while (cap < t->len + len + 1)
+                        cap *= 2;
+
+                char *data = realloc(t->data, cap);
+                if (!data)
+                        return -1;
+                t->data = data;
+                t->cap = cap;
+        }
+
+        memcpy(t->data + t->len, s, len);
+        t->len += len;
+        t->data[t->len] = '\0';
+        return 0;
+}
+
+static int
+put_lines(struct text *t, const struct line *l, int n, int terminate)
+{
+        for (int i = 0; i < n; i++)
+                if (put(t, l[i].s, l[i].len))
+                        return -1;
+
+        // Markers must start on a line of their own
+        if (terminate && n && l[n - 1].s[l[n - 1].len - 1] != '\n')
+                return put(t, "\n", 1);
+        return 0;
+}
+
+char *
+merge3(const char *base, size_t base_len, const char *local, size_t local_len,
+       const char *remote, size_t remote_len, const char *remote_name,
+       size_t *out_len, int *conflicts)
+{
+        struct lines b = { 0 }, l = { 0 }, r = { 0 };
+        struct text out = { 0 };
+        int *ml = NULL, *mr = NULL;
+        int failed = 1;
+
+        *conflicts = 0;
+
+        if (split_lines(base, base_len, &b) || split_lines(local, local_len, &l)
+            || split_lines(remote, remote_len, &r))
+                goto end;
+
+        ml = malloc((b.n ? b.n : 1) * sizeof(*ml));
+        mr = malloc((b.n ? b.n : 1) * sizeof(*mr));
+        if (!ml || !mr || match_lines(&b, &l, ml) || match_lines(&b, &r, mr))
+                goto end;
+
+        if (put(&out, "", 0))
+                goto end;
+
+        int bi = 0, li = 0, ri = 0;
+        for (;;) {
+                int i = bi;
+                while (i < b.n && (ml[i] < 0 || mr[i] < 0))
+                        i++;
+
+                int le = i < b.n ? ml[i] : l.n;
+                int re = i < b.n ? mr[i] : r.n;
+
+                if (i == bi && le == li && re == ri) {
+                        if (i == b.n)
+                                break;
+                        if (put_lines(&out, &b.v[i], 1, 0))
+                                goto end;
+                        bi++;
+                        li++;
+                        ri++;
+                        continue;
+                }
+
+                const struct line *bh = b.v + bi, *lh = l.v + li, *rh = r.v + ri;
+                int bn = i - bi, ln = le - li, rn = re - ri;
+                int rc;
+
+                if (same_lines(lh, ln, bh, bn)) {
+                        rc = put_lines(&out, rh, rn, 0);
+                } else if (same_lines(rh, rn, bh, bn) || same_lines(lh, ln, rh, rn)) {
+                        rc = put_lines(&out, lh, ln, 0);
+                } else {
+                        (*conflicts)++;
+                        rc = put(&out, "<<<<<<< local\n", 14)
+                                || put_lines(&out, lh, ln, 1)
+                                || put(&out, "=======\n", 8)
+                                || put_lines(&out, rh, rn, 1)
+                                || put(&out, ">>>>>>> ", 8)
+                                || put(&out, remote_name, strlen(remote_name))
+                                || put(&out, "\n", 1);
+                }
+
+                if (rc)
+                        goto end;
+
+                bi = i;
+                li = le;
+                ri = re;
+        }
+
+        failed = 0;
+end:
+        free(b.v);
+        free(l.v);
+        free(r.v);
+        free(ml);
+        free(mr);
+
+        if (failed) {
+                free(out.data);
+                return NULL;
+        }
+
+        *out_len = out.len;
+        return out.data;
+}
@@ -0,0 +1,528 @@
+#include <stdio.h>
+#include <sqlite3.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <locale.h>
+#include <pthread.h>
+#include <regex.h>
+#include <unistd.h>
+#include "app.h"
+#include "regsearch.h"
+#include "compress.h"
+
+/*
+ * Regex search runs in two steps. The pattern is scanned for literal runs
+ * that any match must contain, and notes holding all of them are looked up
+ * in note_trigrams. Only those candidates (or every note, when the pattern
+ * has no usable literal or the vault has no index) are read and matched, by worker threads that each
+ * have their own read-only connection and compiled regex, since glibc
+ * serializes regexec calls that share one.
+ */
+#define REGEX_MAX_THREADS 16
+#define REGEX_MAX_LITERALS 8
+#define REGEX_CHUNK 512
+
+struct regex_work {
+        const char *path;
+        const char *pattern;
+        const sqlite3_int64 *ids;       // candidates, or NULL to scan lo..hi
+        sqlite3_int64 lo, hi, count;
+        sqlite3_int64 next;
+        pthread_mutex_t lock;
+};
+
+struct regex_job {
+        struct regex_work *work;
+        sqlite3_int64 *matches;
+        size_t n, cap;
+        int rc;
+};
+
+static int
+cmp_id(const void *a, const void *b)
+{
+        sqlite3_int64 x = *(const sqlite3_int64 *)a, y = *(const sqlite3_int64 *)b;
+        return (x > y) - (x < y);
+}
+
+// Length of the bracket expression starting at p[0] == '['
+static size_t
+skip_bracket(const char *p)
+{
+        size_t i = 1;
+
+        if (p[i] == '^')
+                i++;
+        if (p[i] == ']')
+                i++;
+        while (p[i] && p[i] != ']') {
+                if (p[i] == '[' && (p[i + 1] == ':' || p[i + 1] == '.' || p[i + 1] == '=')) {
+                        char close = p[i + 1];
+                        i += 2;
+                        while (p[i] && !(p[i] == close && p[i + 1] == ']'))
+                                i++;
+                        if (p[i])
+                                i += 2;
+                } else {
+                        i++;
+                }
+        }
+
+        return p[i] ? i + 1 : i;
+}
+
+// Length of the group starting at p[0] == '('
+static size_t
+skip_group(const char *p)
+{
+        size_t i = 1;
+        int depth = 1;
+
+        while (p[i] && depth) {
+                if (p[i] == '\\' && p[i + 1]) {
+                        i += 2;
+                } else if (p[i] == '[') {
+                        i += skip_bracket(p + i);
+                } else {
+                        depth += (p[i] == '(') - (p[i] == ')');
+                        i++;
+                }
+        }
+
+        return i;
+}
+
+static int
+top_level_alternation(const char *p)
+{
+        for (size_t i = 0; p[i];) {
+                if (p[i] == '\\' && p[i + 1])
+                        i += 2;
+                else if (p[i] == '[')
+                        i += skip_bracket(p + i);
+                else if (p[i] == '(')
+                        i += skip_group(p + i);
+                else if (p[i] == '|')
+                        return 1;
+                else
+                        i++;
+        }
+
+        return 0;
+}
+
+static int
+utf8_chars(const char *s, size_t len)
+{
+        int n = 0;
+        for (size_t i = 0; i < len; i++)
+                n += ((unsigned char)s[i] & 0xc0) != 0x80;
+        return n;
+}
+
+// Keep run as a literal if the trigram index can look it up
+static void
+end_run(char *run, size_t *len, char **lits, int *n)
+{
+        if (utf8_chars(run, *len) >= 3 && *n < REGEX_MAX_LITERALS) {
+                lits[*n] = strndup(run, *len);
+                if (lits[*n])
+                        (*n)++;
+        }
+        *len = 0;
+}
+
+// Collect literal runs of three or more characters that every match of the
+// ERE p contains. Anything unsure, such as groups, classes or an optional
+// atom, just ends the current run, so the literals may be too few but are
+// never wrong.
+static int
+required_literals(const char *p, char **lits)
+{
+        size_t plen = strlen(p), len = 0;
+        char *run = malloc(plen + 1);
+        int n = 0;
+
+        if (!run)
+                return -1;
+
+        if (top_level_alternation(p)) {
+                free(run);
+                return 0;
+        }
+
+        for (size_t i = 0; p[i];) {
+                size_t start = len;
+
+                if (p[i] == '\\' && p[i + 1] && !isalnum((unsigned char)p[i + 1])) {
+                        run[len++] = p[i + 1];
+                        i += 2;
+                } else if (p[i] == '\\') {
+                        end_run(run, &len, lits, &n);
+                        i += p[i + 1] ? 2 : 1;
+                        continue;
+                } else if (p[i] == '[' || p[i] == '(') {
+                        end_run(run, &len, lits, &n);
+                        i += p[i] == '[' ? skip_bracket(p + i) : skip_group(p + i);
+                        continue;
+                } else if (p[i] == '{') {
+                        end_run(run, &len, lits, &n);
+                        i += strcspn(p + i, "}");
+                        i += p[i] != '\0';
+                        continue;
+                } else if (strchr(".^$*+?}|)", p[i])) {
+                        end_run(run, &len, lits, &n);
+                        i++;
+                        continue;
+                } else {
+                        // Take a whole UTF-8 character as one atom
+                        do {
+                                run[len++] = p[i++];
+                        } while (((unsigned char)p[i] & 0xc0) == 0x80);
+                }
+
+                if (p[i] == '*' || p[i] == '?' || p[i] == '{') {
+                        len = start;
+                        end_run(run, &len, lits, &n);
+                } else if (p[i] == '+') {
+                        end_run(run, &len, lits, &n);
+                }
+        }
+
+        end_run(run, &len, lits, &n);
+        free(run);
+        return n;
+}
+
+// Ids of the notes containing every literal, from the trigram index
+static int
+load_candidates(sqlite3 *db, char **lits, int nlits, sqlite3_int64 **ids, sqlite3_int64 *count)
+{
+        size_t qlen = 1, cap = 0;
+        for (int i = 0; i < nlits; i++)
+                qlen += 2 * strlen(lits[i]) + 8;
+
+        char *query = malloc(qlen), *q = query;
+        if (!query)
+                return SQLITE_NOMEM;
+
+        for (int i = 0; i < nlits; i++) {
+                if (i)
+                        q += sprintf(q, " AND ");
+                *q++ = '"';
+                for (const char *s = lits[i]; *s; s++) {
+                        if (*s == '"')
+                                *q++ = '"';
+                        *q++ = *s;
+                }
+                *q++ = '"';
+        }
+        *q = '\0';
+
+        sqlite3_stmt *stmt;
+        int rc = sqlite3_prepare_v2(db, "SELECT rowid FROM note_trigrams "
+                                    "WHERE note_trigrams MATCH ? ORDER BY rowid;", -1, &stmt, 0);
+
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                free(query);
+                return rc;
+        }
+
+        sqlite3_bind_text(stmt, 1, query, -1, SQLITE_STATIC);
+
+        *ids = NULL;
+        *count = 0;
+
+        while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+                if ((size_t)*count == cap) {
+                        cap = cap ? cap * 2 : 1024;
+                        sqlite3_int64 *tmp = realloc(*ids, cap * sizeof(**ids));
+                        if (!tmp) {
+                                rc = SQLITE_NOMEM;
+                                break;
+                        }
+                        *ids = tmp;
+                }
+                (*ids)[(*count)++] = sqlite3_column_int64(stmt, 0);
+        }
+
+        if (rc != SQLITE_DONE && rc != SQLITE_NOMEM)
+                fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+
+        sqlite3_finalize(stmt);
+        free(query);
+        return rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
+
+static int
+add_match(struct regex_job *job, sqlite3_int64 id)
+{
+        if (job->n == job->cap) {
+                size_t cap = job->cap ? job->cap * 2 : 256;
+                sqlite3_int64 *tmp = realloc(job->matches, cap * sizeof(*tmp));
+                if (!tmp)
+                        return SQLITE_NOMEM;
+                job->matches = tmp;
+                job->cap = cap;
+        }
+        job->matches[job->n++] = id;
+        return SQLITE_OK;
+}
+
+static int
+match_rows(struct regex_job *job, sqlite3 *db, sqlite3_stmt *stmt, regex_t *re)
+{
+        int rc;
+
+        while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+                const char *body = (const char *)sqlite3_column_text(stmt, 1);
+                if (body && regexec(re, body, 0, NULL, 0) == 0) {
+                        if (add_match(job, sqlite3_column_int64(stmt, 0)) != SQLITE_OK) {
+                                sqlite3_reset(stmt);
+                                return SQLITE_NOMEM;
+                        }
+                }
+        }
+
+        if (rc != SQLITE_DONE)
+                fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+
+        sqlite3_reset(stmt);
+        return rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
+
+static void *
+regex_worker(void *arg)
+{
+        struct regex_job *job = arg;
+        struct regex_work *work = job->work;
+        sqlite3 *db;
+        sqlite3_stmt *stmt;
+        regex_t re;
+
+        job->rc = sqlite3_open_v2(work->path, &db, SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, NULL);
+        if (job->rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot open zkc database: %s\n", sqlite3_errmsg(db));
+                sqlite3_close(db);
+                return NULL;
+        }
+
+        job->rc = register_note_text(db);
+        if (job->rc != SQLITE_OK) {
+                sqlite3_close(db);
+                return NULL;
+        }
+
+        if (regcomp(&re, work->pattern, REG_EXTENDED | REG_NOSUB | REG_NEWLINE) != 0) {
+                job->rc = SQLITE_NOMEM;
+                sqlite3_close(db);
+                return NULL;
+        }
+
+        char *sql = work->ids ? "SELECT id, note_text(body) FROM notes WHERE id = ?1;" :
+                "SELECT id, note_text(body) FROM notes WHERE id >= ?1 AND id < ?2;";
+
+        job->rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
+
+        if (job->rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                goto end;
+        }
+
+        while (job->rc == SQLITE_OK) {
+                // Claim the next chunk of candidates or of the id range
+                pthread_mutex_lock(&work->lock);
+                sqlite3_int64 lo = work->next;
+                work->next += REGEX_CHUNK;
+                pthread_mutex_unlock(&work->lock);
+
+                sqlite3_int64 end = work->ids ? work->count : work->hi;
+                if (lo >= end)
+                        break;
+                sqlite3_int64 hi = lo + REGEX_CHUNK < end ? lo + REGEX_CHUNK : end;
+
+                if (work->ids) {
+                        for (sqlite3_int64 i = lo; i < hi && job->rc == SQLITE_OK; i++) {
+                                sqlite3_bind_int64(stmt, 1, work->ids[i]);
+                                job->rc = match_rows(job, db, stmt, &re);
+                        }
+                } else {
+                        sqlite3_bind_int64(stmt, 1, lo);
+                        sqlite3_bind_int64(stmt, 2, hi);
+                        job->rc = match_rows(job, db, stmt, &re);
+                }
+        }
+
+end:
+        sqlite3_finalize(stmt);
+        regfree(&re);
+        sqlite3_close(db);
+        return NULL;
+}
+
+static int
+id_range(sqlite3 *db, sqlite3_int64 *lo, sqlite3_int64 *hi)
+{
+        sqlite3_stmt *stmt;
+        int rc = sqlite3_prepare_v2(db, "SELECT min(id), max(id) FROM notes;", -1, &stmt, 0);
+
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                return rc;
+        }
+
+        rc = sqlite3_step(stmt);
+        if (rc == SQLITE_ROW) {
+                *lo = sqlite3_column_int64(stmt, 0);
+                *hi = sqlite3_column_int64(stmt, 1) + 1;
+                rc = SQLITE_OK;
+        } else {
+                fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+        }
+
+        sqlite3_finalize(stmt);
+        return rc;
+}
+
+static int
+print_matches(sqlite3 *db, const sqlite3_int64 *ids, size_t n)
+{
+        sqlite3_stmt *stmt;
+        int rc = sqlite3_prepare_v2(db, "SELECT uuid, date, note_text(body) FROM notes WHERE id = ?;",
+                                    -1, &stmt, 0);
+
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                return rc;
+        }
+
+        for (size_t i = 0; i < n; i++) {
+                sqlite3_bind_int64(stmt, 1, ids[i]);
+
+                rc = sqlite3_step(stmt);
+                if (rc == SQLITE_ROW) {
+                        print_summary((const char *)sqlite3_column_text(stmt, 0),
+                                      (const char *)sqlite3_column_text(stmt, 1),
+                                      (const char *)sqlite3_column_text(stmt, 2));
+                } else if (rc != SQLITE_DONE) {
+                        fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+                        sqlite3_finalize(stmt);
+                        return rc;
+                }
+
+                sqlite3_reset(stmt);
+        }
+
+        sqlite3_finalize(stmt);
+        return SQLITE_OK;
+}
+
+int
+regex_search(sqlite3 *db, const char *pattern)
+{
+        regex_t re;
+        char *lits[REGEX_MAX_LITERALS];
+        struct regex_job jobs[REGEX_MAX_THREADS];
+        pthread_t threads[REGEX_MAX_THREADS];
+        struct regex_work work = {
+                .path = sqlite3_db_filename(db, "main"),
+                .pattern = pattern,
+        };
+        int nthreads = 0, rc;
+
+        // Let the pattern match characters of the user's locale, as grep does
+        setlocale(LC_CTYPE, "");
+
+        // Compile once here so a bad pattern is reported a single time
+        int err = regcomp(&re, pattern, REG_EXTENDED | REG_NOSUB | REG_NEWLINE);
+        if (err != 0) {
+                char msg[256];
+                regerror(err, &re, msg, sizeof(msg));
+                fprintf(stderr, "Invalid regex: %s\n", msg);
+                return SQLITE_ERROR;
+        }
+        regfree(&re);
+
+        int nlits = required_literals(pattern, lits);
+        if (nlits < 0)
+                return SQLITE_NOMEM;
+
+        sqlite3_int64 *candidates = NULL;
+
+        // A vault from before the trigram index has every note scanned
+        int have_trigrams;
+        rc = table_exists(db, "note_trigrams", &have_trigrams);
+        if (rc == SQLITE_OK && nlits > 0 && have_trigrams) {
+                rc = load_candidates(db, lits, nlits, &candidates, &work.count);
+                work.ids = candidates;
+        } else if (rc == SQLITE_OK) {
+                rc = id_range(db, &work.lo, &work.hi);
+                work.next = work.lo;
+        }
+
+        for (int i = 0; i < nlits; i++)
+                free(lits[i]);
+
+        if (rc != SQLITE_OK)
+                goto end;
+
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        sqlite3_int64 chunks = ((work.ids ? work.count : work.hi - work.lo) + REGEX_CHUNK - 1)
+                / REGEX_CHUNK;
+
+        nthreads = cpus < 1 ? 1 : cpus;
+        if (nthreads > REGEX_MAX_THREADS)
+                nthreads = REGEX_MAX_THREADS;
+        if (nthreads > chunks)
+                nthreads = chunks > 0 ? chunks : 1;
+
+        pthread_mutex_init(&work.lock, NULL);
+
+        int started = 1;
+        for (int t = 0; t < nthreads; t++)
+                jobs[t] = (struct regex_job){ .work = &work };
+
+        for (int t = 1; t < nthreads; t++, started++)
+                if (pthread_create(&threads[t], NULL, regex_worker, &jobs[t]) != 0)
+                        break;
+
+        // Threads that failed to start leave their chunks to the others
+        regex_worker(&jobs[0]);
+
+        for (int t = 1; t < started; t++)
+                pthread_join(threads[t], NULL);
+
+        pthread_mutex_destroy(&work.lock);
+
+        size_t total = 0;
+        for (int t = 0; t < started; t++) {
+                if (jobs[t].rc != SQLITE_OK)
+                        rc = jobs[t].rc;
+                total += jobs[t].n;
+        }
+
+        if (rc != SQLITE_OK)
+                goto end;
+
+        // Gather into the first job's array and print in note order
+        sqlite3_int64 *all = realloc(jobs[0].matches, (total ? total : 1) * sizeof(*all));
+        if (!all) {
+                rc = SQLITE_NOMEM;
+                goto end;
+        }
+        jobs[0].matches = all;
+
+        for (int t = 1, k = jobs[0].n; t < started; k += jobs[t].n, t++)
+                memcpy(all + k, jobs[t].matches, jobs[t].n * sizeof(*all));
+
+        qsort(all, total, sizeof(*all), cmp_id);
+        rc = print_matches(db, all, total);
+
+end:
+        for (int t = 0; t < nthreads; t++)
+                free(jobs[t].matches);
+        free(candidates);
+        return rc;
+}
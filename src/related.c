@@ -0,0 +1,761 @@
+#include <stdio.h>
+#include <sqlite3.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "app.h"
+#include "related.h"
+
+/*
+ * Notes are compared as TF-IDF vectors over their lower-cased words, with
+ * weight (1 + ln tf) * ln(N / df). Vectors live in note_terms, keyed by
+ * term so each term's postings are one range, and are refreshed for notes
+ * whose hash has changed since they were indexed. Vector norms depend on
+ * every df, so they are recomputed in one pass whenever any vector changed
+ * (tracked by counters.vectors against counters.norms).
+ *
+ * A query walks the postings of the note's own terms and adds each
+ * product into a dense accumulator indexed by note id, then scales the
+ * whole accumulator by the inverse norms in one flat loop.
+ */
+#define TERM_MIN 2
+#define TERM_MAX 32
+// Vaults with fewer notes than this score every shared term. In larger
+// ones, terms found in over half the notes are skipped: they weigh little
+// and have the longest postings.
+#define PRUNE_MIN_NOTES 1000
+
+struct token {
+        const char *s;
+        int len;
+};
+
+struct hit {
+        sqlite3_int64 id;
+        double score;
+};
+
+struct term_slot {
+        char *s;
+        int len;
+        sqlite3_int64 id;
+};
+
+// Open addressing map from term to id, so indexing a note does not look
+// up each of its words in the terms table
+struct term_map {
+        size_t cap, n;
+        struct term_slot *slot;
+};
+
+struct indexer {
+        struct term_map terms;
+        sqlite3_stmt *clear;
+        sqlite3_stmt *add_term;
+        sqlite3_stmt *add_posting;
+        sqlite3_stmt *set_vector;
+};
+
+static int
+is_word(unsigned char c)
+{
+        return (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c >= 0x80;
+}
+
+static int
+cmp_token(const void *a, const void *b)
+{
+        const struct token *x = a, *y = b;
+        int c = memcmp(x->s, y->s, x->len < y->len ? x->len : y->len);
+        return c ? c : x->len - y->len;
+}
+
+static double
+idf(sqlite3_int64 n, sqlite3_int64 df)
+{
+        return df > 0 ? log((double)n / df) : 0;
+}
+
+// Words of body, lower-cased into *text and sorted so repeats are adjacent
+static int
+tokenize(const char *body, char **text, struct token **tokens, int *count)
+{
+        size_t len = strlen(body);
+
+        *count = 0;
+        *text = malloc(len + 1);
+        *tokens = malloc((len / (TERM_MIN + 1) + 1) * sizeof(**tokens));
+        if (!*text || !*tokens)
+                return SQLITE_NOMEM;
+
+        for (size_t i = 0; i <= len; i++)
+                (*text)[i] = body[i] >= 'A' && body[i] <= 'Z' ? body[i] + 32 : body[i];
+
+        for (size_t i = 0; i < len;) {
+                if (!is_word((*text)[i])) {
+                        i++;
+                        continue;
+                }
+
+                size_t start = i;
+                while (i < len && is_word((*text)[i]))
+                        i++;
+
+                if (i - start >= TERM_MIN && i - start <= TERM_MAX) {
+                        (*tokens)[*count].s = *text + start;
+                        (*tokens)[*count].len = i - start;
+                        (*count)++;
+                }
+        }
+
+        qsort(*tokens, *count, sizeof(**tokens), cmp_token);
+        return SQLITE_OK;
+}
+
+static size_t
+term_hash(const char *s, int len)
+{
+        size_t h = 14695981039346656037ULL;
+        for (int i = 0; i < len; i++)
+                h = (h ^ (unsigned char)s[i]) * 1099511628211ULL;
+        return h;
+}
+
+static struct term_slot *
+term_find(struct term_map *map, const char *s, int len)
+{
+        size_t i = term_hash(s, len) & (map->cap - 1);
+
+        while (map->slot[i].s && (map->slot[i].len != len || memcmp(map->slot[i].s, s, len)))
+                i = (i + 1) & (map->cap - 1);
+
+        return &map->slot[i];
+}
+
+static int
+term_put(struct term_map *map, const char *s, int len, sqlite3_int64 id)
+{
+        if ((map->n + 1) * 2 > map->cap) {
+                struct term_map bigger = { .cap = map->cap ? map->cap * 2 : 4096 };
+                bigger.slot = calloc(bigger.cap, sizeof(*bigger.slot));
+                if (!bigger.slot)
+                        return SQLITE_NOMEM;
+
+                for (size_t i = 0; i < map->cap; i++)
+                        if (map->slot[i].s)
+                                *term_find(&bigger, map->slot[i].s, map->slot[i].len) = map->slot[i];
+
+                bigger.n = map->n;
+                free(map->slot);
+                *map = bigger;
+        }
+
+        struct term_slot *slot = term_find(map, s, len);
+        slot->s = strndup(s, len);
+        if (!slot->s)
+                return SQLITE_NOMEM;
+        slot->len = len;
+        slot->id = id;
+        map->n++;
+        return SQLITE_OK;
+}
+
+static void
+term_map_free(struct term_map *map)
+{
+        for (size_t i = 0; i < map->cap; i++)
+                free(map->slot[i].s);
+        free(map->slot);
+}
+
+static int
+step_done(sqlite3 *db, sqlite3_stmt *stmt)
+{
+        int rc = sqlite3_step(stmt);
+        sqlite3_reset(stmt);
+
+        if (rc != SQLITE_DONE) {
+                fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+                return rc;
+        }
+
+        return SQLITE_OK;
+}
+
+static int
+index_note(sqlite3 *db, struct indexer *ix, sqlite3_int64 id, const char *body, const char *hash)
+{
+        char *text;
+        struct token *tokens;
+        int count;
+
+        int rc = tokenize(body, &text, &tokens, &count);
+        if (rc != SQLITE_OK)
+                goto end;
+
+        sqlite3_bind_int64(ix->clear, 1, id);
+        rc = step_done(db, ix->clear);
+        if (rc != SQLITE_OK)
+                goto end;
+
+        for (int i = 0, j; i < count; i = j) {
+                for (j = i + 1; j < count && !cmp_token(&tokens[i], &tokens[j]); j++)
+                        ;
+
+                struct term_slot *slot = ix->terms.cap ?
+                        term_find(&ix->terms, tokens[i].s, tokens[i].len) : NULL;
+                sqlite3_int64 term_id;
+
+                if (slot && slot->s) {
+                        term_id = slot->id;
+                } else {
+                        sqlite3_bind_text(ix->add_term, 1, tokens[i].s, tokens[i].len, SQLITE_STATIC);
+                        rc = step_done(db, ix->add_term);
+                        if (rc != SQLITE_OK)
+                                goto end;
+
+                        term_id = sqlite3_last_insert_rowid(db);
+                        rc = term_put(&ix->terms, tokens[i].s, tokens[i].len, term_id);
+                        if (rc != SQLITE_OK)
+                                goto end;
+                }
+
+                sqlite3_bind_int64(ix->add_posting, 1, term_id);
+                sqlite3_bind_int64(ix->add_posting, 2, id);
+                sqlite3_bind_int(ix->add_posting, 3, j - i);
+                rc = step_done(db, ix->add_posting);
+                if (rc != SQLITE_OK)
+                        goto end;
+        }
+
+        sqlite3_bind_int64(ix->set_vector, 1, id);
+        sqlite3_bind_text(ix->set_vector, 2, hash, -1, SQLITE_STATIC);
+        rc = step_done(db, ix->set_vector);
+
+end:
+        free(text);
+        free(tokens);
+        return rc;
+}
+
+// Ids from a single column query, in *ids
+static int
+load_ids(sqlite3 *db, const char *sql, sqlite3_int64 **ids, size_t *count)
+{
+        sqlite3_stmt *stmt;
+        size_t cap = 0;
+        int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
+
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                return rc;
+        }
+
+        *ids = NULL;
+        *count = 0;
+
+        while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+                if (*count == cap) {
+                        cap = cap ? cap * 2 : 1024;
+                        sqlite3_int64 *tmp = realloc(*ids, cap * sizeof(**ids));
+                        if (!tmp) {
+                                sqlite3_finalize(stmt);
+                                return SQLITE_NOMEM;
+                        }
+                        *ids = tmp;
+                }
+                (*ids)[(*count)++] = sqlite3_column_int64(stmt, 0);
+        }
+
+        sqlite3_finalize(stmt);
+
+        if (rc != SQLITE_DONE) {
+                fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+                return rc;
+        }
+
+        return SQLITE_OK;
+}
+
+static sqlite3_int64
+max_id(sqlite3 *db, const char *table)
+{
+        char sql[64];
+        sqlite3_stmt *stmt;
+        sqlite3_int64 max = -1;
+
+        snprintf(sql, sizeof(sql), "SELECT coalesce(max(id), 0) FROM %s;", table);
+        if (sqlite3_prepare_v2(db, sql, -1, &stmt, 0) != SQLITE_OK) {
+                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                return -1;
+        }
+
+        if (sqlite3_step(stmt) == SQLITE_ROW)
+                max = sqlite3_column_int64(stmt, 0);
+        else
+                fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+
+        sqlite3_finalize(stmt);
+        return max;
+}
+
+// Document frequency and idf of every term by id, counted from the
+// postings of n indexed notes
+static int
+load_idf(sqlite3 *db, sqlite3_int64 n, sqlite3_int64 **df, double **weights, sqlite3_int64 *max_term)
+{
+        sqlite3_stmt *stmt;
+
+        *max_term = max_id(db, "terms");
+        if (*max_term < 0)
+                return SQLITE_ERROR;
+
+        *df = calloc(*max_term + 1, sizeof(**df));
+        *weights = calloc(*max_term + 1, sizeof(**weights));
+        if (!*df || !*weights)
+                return SQLITE_NOMEM;
+
+        int rc = sqlite3_prepare_v2(db, "SELECT term_id, count(*) FROM note_terms GROUP BY term_id;",
+                                    -1, &stmt, 0);
+
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                return rc;
+        }
+
+        while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+                sqlite3_int64 term = sqlite3_column_int64(stmt, 0);
+                if (term <= *max_term) {
+                        (*df)[term] = sqlite3_column_int64(stmt, 1);
+                        (*weights)[term] = idf(n, (*df)[term]);
+                }
+        }
+
+        sqlite3_finalize(stmt);
+
+        if (rc != SQLITE_DONE) {
+                fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+                return rc;
+        }
+
+        return SQLITE_OK;
+}
+
+static int
+update_norms(sqlite3 *db)
+{
+        sqlite3_int64 generation = counter_value(db, "vectors");
+        if (generation < 0) {
+                fprintf(stderr, "Missing counters table, run zkc init first\n");
+                return SQLITE_ERROR;
+        }
+
+        if (counter_value(db, "norms") == generation)
+                return SQLITE_OK;
+
+        sqlite3_int64 *ids = NULL, *df = NULL, max_term, max_note;
+        double *weights = NULL, *norms = NULL;
+        sqlite3_stmt *stmt = NULL;
+        size_t n;
+
+        int rc = load_ids(db, "SELECT note_id FROM note_vectors;", &ids, &n);
+        if (rc != SQLITE_OK)
+                goto end;
+
+        rc = load_idf(db, n, &df, &weights, &max_term);
+        if (rc != SQLITE_OK)
+                goto end;
+
+        max_note = max_id(db, "notes");
+        norms = calloc(max_note + 1, sizeof(*norms));
+        if (max_note < 0 || !norms) {
+                rc = SQLITE_NOMEM;
+                goto end;
+        }
+
+        rc = sqlite3_prepare_v2(db, "SELECT term_id, note_id, tf FROM note_terms;", -1, &stmt, 0);
+
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                goto end;
+        }
+
+        while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+                sqlite3_int64 term = sqlite3_column_int64(stmt, 0);
+                sqlite3_int64 note = sqlite3_column_int64(stmt, 1);
+                if (term > max_term || note > max_note)
+                        continue;
+                double w = (1 + log(sqlite3_column_int(stmt, 2))) * weights[term];
+                norms[note] += w * w;
+        }
+
+        if (rc != SQLITE_DONE) {
+                fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+                goto end;
+        }
+
+        sqlite3_finalize(stmt);
+        stmt = NULL;
+
+        rc = sql_exec(db, "BEGIN;");
+        if (rc != SQLITE_OK)
+                goto end;
+
+        rc = sqlite3_prepare_v2(db, "UPDATE note_vectors SET norm = ? WHERE note_id = ?;", -1, &stmt, 0);
+
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                goto rollback;
+        }
+
+        for (size_t i = 0; i < n; i++) {
+                sqlite3_bind_double(stmt, 1, ids[i] <= max_note ? sqrt(norms[ids[i]]) : 0);
+                sqlite3_bind_int64(stmt, 2, ids[i]);
+                rc = step_done(db, stmt);
+                if (rc != SQLITE_OK)
+                        goto rollback;
+        }
+
+        sqlite3_finalize(stmt);
+        stmt = NULL;
+
+        rc = sqlite3_prepare_v2(db, "UPDATE terms SET df = ? WHERE id = ?;", -1, &stmt, 0);
+
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                goto rollback;
+        }
+
+        for (sqlite3_int64 t = 1; t <= max_term; t++) {
+                if (!df[t])
+                        continue;
+                sqlite3_bind_int64(stmt, 1, df[t]);
+                sqlite3_bind_int64(stmt, 2, t);
+                rc = step_done(db, stmt);
+                if (rc != SQLITE_OK)
+                        goto rollback;
+        }
+
+        sqlite3_finalize(stmt);
+        stmt = NULL;
+
+        // Terms no note uses any more
+        rc = sql_exec(db, "DELETE FROM terms WHERE NOT EXISTS "
+                      "(SELECT 1 FROM note_terms WHERE term_id = terms.id);");
+        if (rc != SQLITE_OK)
+                goto rollback;
+
+        rc = sqlite3_prepare_v2(db, "INSERT OR REPLACE INTO counters(name, value) VALUES('norms', ?);",
+                                -1, &stmt, 0);
+
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                goto rollback;
+        }
+
+        sqlite3_bind_int64(stmt, 1, generation);
+        rc = step_done(db, stmt);
+        if (rc != SQLITE_OK)
+                goto rollback;
+
+        rc = sql_exec(db, "COMMIT;");
+        if (rc == SQLITE_OK)
+                goto end;
+
+rollback:
+        sql_exec(db, "ROLLBACK;");
+end:
+        sqlite3_finalize(stmt);
+        free(ids);
+        free(df);
+        free(weights);
+        free(norms);
+        return rc;
+}
+
+// Index every note added or edited since it was last indexed
+static int
+refresh(sqlite3 *db)
+{
+        struct indexer ix = {0};
+        sqlite3_stmt *known = NULL, *note = NULL;
+        sqlite3_int64 *ids;
+        size_t n;
+
+        struct {
+                sqlite3_stmt **stmt;
+                const char *sql;
+        } prepare[] = {
+                { &known, "SELECT id, body FROM terms;" },
+                { &note, "SELECT note_text(body), hash FROM notes WHERE id = ?;" },
+                { &ix.clear, "DELETE FROM note_terms WHERE note_id = ?;" },
+                { &ix.add_term, "INSERT INTO terms(body) VALUES(?);" },
+                { &ix.add_posting, "INSERT INTO note_terms(term_id, note_id, tf) VALUES(?, ?, ?);" },
+                { &ix.set_vector, "INSERT OR REPLACE INTO note_vectors(note_id, hash, norm) "
+                  "VALUES(?, ?, 0);" },
+        };
+
+        int rc = load_ids(db, "SELECT notes.id FROM notes "
+                          "LEFT JOIN note_vectors ON note_vectors.note_id = notes.id "
+                          "WHERE note_vectors.hash IS NOT notes.hash;", &ids, &n);
+        if (rc != SQLITE_OK)
+                return rc;
+
+        if (n == 0)
+                goto norms;
+
+        // Postings go into every term's range at once, so give the b-tree
+        // room to stay in memory while a whole vault is indexed
+        rc = sql_exec(db, "PRAGMA cache_size = -65536; BEGIN;");
+        if (rc != SQLITE_OK)
+                goto end;
+
+        for (size_t i = 0; i < sizeof(prepare) / sizeof(prepare[0]); i++) {
+                rc = sqlite3_prepare_v2(db, prepare[i].sql, -1, prepare[i].stmt, 0);
+
+                if (rc != SQLITE_OK) {
+                        fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                        goto rollback;
+                }
+        }
+
+        while ((rc = sqlite3_step(known)) == SQLITE_ROW) {
+                rc = term_put(&ix.terms, (const char *)sqlite3_column_text(known, 1),
+                              sqlite3_column_bytes(known, 1), sqlite3_column_int64(known, 0));
+                if (rc != SQLITE_OK)
+                        goto rollback;
+        }
+
+        if (rc != SQLITE_DONE) {
+                fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+                goto rollback;
+        }
+
+        for (size_t i = 0; i < n; i++) {
+                sqlite3_bind_int64(note, 1, ids[i]);
+
+                rc = sqlite3_step(note);
+                if (rc == SQLITE_ROW) {
+                        rc = index_note(db, &ix, ids[i], (const char *)sqlite3_column_text(note, 0),
+                                        (const char *)sqlite3_column_text(note, 1));
+                } else {
+                        fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+                }
+                sqlite3_reset(note);
+
+                if (rc != SQLITE_OK)
+                        goto rollback;
+        }
+
+        rc = sql_exec(db, "COMMIT;");
+        if (rc != SQLITE_OK)
+                goto rollback;
+
+norms:
+        rc = update_norms(db);
+        goto end;
+
+rollback:
+        sql_exec(db, "ROLLBACK;");
+end:
+        sqlite3_finalize(known);
+        sqlite3_finalize(note);
+        sqlite3_finalize(ix.clear);
+        sqlite3_finalize(ix.add_term);
+        term_map_free(&ix.terms);
+        sqlite3_finalize(ix.add_posting);
+        sqlite3_finalize(ix.set_vector);
+        free(ids);
+        return rc;
+}
+
+// Insert into the best list, kept sorted by descending score
+static void
+keep_top(struct hit *best, int top, int *count, sqlite3_int64 id, double score)
+{
+        if (*count == top && score <= best[top - 1].score)
+                return;
+
+        int i = *count < top ? (*count)++ : top - 1;
+        while (i > 0 && best[i - 1].score < score) {
+                best[i] = best[i - 1];
+                i--;
+        }
+        best[i].id = id;
+        best[i].score = score;
+}
+
+static int
+print_hits(sqlite3 *db, const struct hit *best, int count)
+{
+        sqlite3_stmt *stmt;
+        int rc = sqlite3_prepare_v2(db, "SELECT uuid, date, note_text(body) FROM notes WHERE id = ?;",
+                                    -1, &stmt, 0);
+
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                return rc;
+        }
+
+        for (int i = 0; i < count; i++) {
+                sqlite3_bind_int64(stmt, 1, best[i].id);
+
+                rc = sqlite3_step(stmt);
+                if (rc == SQLITE_ROW) {
+                        printf("%.3f ", best[i].score);
+                        print_summary((const char *)sqlite3_column_text(stmt, 0),
+                                      (const char *)sqlite3_column_text(stmt, 1),
+                                      (const char *)sqlite3_column_text(stmt, 2));
+                } else if (rc != SQLITE_DONE) {
+                        fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+                        sqlite3_finalize(stmt);
+                        return rc;
+                }
+
+                sqlite3_reset(stmt);
+        }
+
+        sqlite3_finalize(stmt);
+        return SQLITE_OK;
+}
+
+int
+related(sqlite3 *db, const char *uuid, int top)
+{
+        sqlite3_int64 id, max_note, *post_ids = NULL, *vectors = NULL;
+        sqlite3_stmt *terms = NULL, *postings = NULL, *norms = NULL;
+        double *acc = NULL, *inv_norm = NULL, *post_w = NULL;
+        struct hit *best = NULL;
+        size_t n, post_cap = 0;
+        int rc;
+
+        if (top <= 0) {
+                fprintf(stderr, "Number of notes must be positive\n");
+                return SQLITE_MISUSE;
+        }
+
+        rc = resolve_note_id(db, uuid, &id);
+        if (rc != SQLITE_OK)
+                return rc;
+
+        rc = refresh(db);
+        if (rc != SQLITE_OK)
+                return rc;
+
+        rc = load_ids(db, "SELECT note_id FROM note_vectors;", &vectors, &n);
+        if (rc != SQLITE_OK)
+                goto end;
+
+        max_note = max_id(db, "notes");
+        acc = calloc(max_note + 1, sizeof(*acc));
+        inv_norm = calloc(max_note + 1, sizeof(*inv_norm));
+        best = malloc(top * sizeof(*best));
+        if (max_note < 0 || !acc || !inv_norm || !best) {
+                rc = SQLITE_NOMEM;
+                goto end;
+        }
+
+        char *terms_sql = "SELECT note_terms.term_id, note_terms.tf, terms.df FROM note_terms "
+                "INNER JOIN terms ON terms.id = note_terms.term_id "
+                "WHERE note_terms.note_id = ?;";
+        char *postings_sql = "SELECT note_id, tf FROM note_terms WHERE term_id = ?;";
+        char *norms_sql = "SELECT note_id, norm FROM note_vectors WHERE norm > 0;";
+
+        if ((rc = sqlite3_prepare_v2(db, terms_sql, -1, &terms, 0)) != SQLITE_OK ||
+            (rc = sqlite3_prepare_v2(db, postings_sql, -1, &postings, 0)) != SQLITE_OK ||
+            (rc = sqlite3_prepare_v2(db, norms_sql, -1, &norms, 0)) != SQLITE_OK) {
+                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                goto end;
+        }
+
+        sqlite3_bind_int64(terms, 1, id);
+        double query_norm = 0;
+
+        while ((rc = sqlite3_step(terms)) == SQLITE_ROW) {
+                sqlite3_int64 df = sqlite3_column_int64(terms, 2);
+                double term_idf = idf(n, df);
+                double wq = (1 + log(sqlite3_column_int(terms, 1))) * term_idf;
+
+                if (n >= PRUNE_MIN_NOTES && df * 2 > (sqlite3_int64)n)
+                        continue;
+
+                // Only the terms that are scored count towards the norm
+                query_norm += wq * wq;
+
+                // Gather the postings, then add them in a tight loop
+                size_t count = 0;
+                sqlite3_bind_int64(postings, 1, sqlite3_column_int64(terms, 0));
+
+                while ((rc = sqlite3_step(postings)) == SQLITE_ROW) {
+                        if (count == post_cap) {
+                                post_cap = post_cap ? post_cap * 2 : 1024;
+                                sqlite3_int64 *i = realloc(post_ids, post_cap * sizeof(*i));
+                                double *w = i ? realloc(post_w, post_cap * sizeof(*w)) : NULL;
+                                if (i)
+                                        post_ids = i;
+                                if (w)
+                                        post_w = w;
+                                if (!i || !w) {
+                                        rc = SQLITE_NOMEM;
+                                        goto end;
+                                }
+                        }
+                        post_ids[count] = sqlite3_column_int64(postings, 0);
+                        post_w[count] = 1 + log(sqlite3_column_int(postings, 1));
+                        count++;
+                }
+
+                sqlite3_reset(postings);
+
+                if (rc != SQLITE_DONE) {
+                        fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+                        goto end;
+                }
+
+                double scale = wq * term_idf;
+                for (size_t i = 0; i < count; i++)
+                        if (post_ids[i] <= max_note)
+                                acc[post_ids[i]] += scale * post_w[i];
+        }
+
+        if (rc != SQLITE_DONE) {
+                fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+                goto end;
+        }
+
+        while ((rc = sqlite3_step(norms)) == SQLITE_ROW) {
+                sqlite3_int64 note = sqlite3_column_int64(norms, 0);
+                if (note <= max_note)
+                        inv_norm[note] = 1 / sqlite3_column_double(norms, 1);
+        }
+
+        if (rc != SQLITE_DONE) {
+                fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+                goto end;
+        }
+
+        // Cosine similarity; the note itself is not a suggestion
+        double inv_query = query_norm > 0 ? 1 / sqrt(query_norm) : 0;
+        for (sqlite3_int64 i = 0; i <= max_note; i++)
+                acc[i] *= inv_norm[i] * inv_query;
+        acc[id] = 0;
+
+        int count = 0;
+        for (sqlite3_int64 i = 0; i <= max_note; i++)
+                if (acc[i] > 0)
+                        keep_top(best, top, &count, i, acc[i]);
+
+        rc = print_hits(db, best, count);
+
+end:
+        sqlite3_finalize(terms);
+        sqlite3_finalize(postings);
+        sqlite3_finalize(norms);
+        free(vectors);
+        free(acc);
+        free(inv_norm);
+        free(post_ids);
+        free(post_w);
+        free(best);
+        return rc;
+}
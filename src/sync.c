@@ -0,0 +1,963 @@
+#include <stdio.h>
+#include <sqlite3.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#endif
+#include "app.h"
+#include "compress.h"
+#include "hash.h"
+#include "history.h"
+#include "merge3.h"
+#include "export.h"
+#include "sync.h"
+
+/*
+ * Each file synced with a note has a row in synced_files holding the
+ * note's hash and the file's hash, mtime and size as of the last sync.
+ * A file whose mtime and size are unchanged is not read. A note whose
+ * rendered file hashes the same is not written. When both the file and
+ * the note changed, the two bodies are merged against the version the
+ * last sync left, which the note's history still has.
+ *
+ * Files are never deleted because they went missing: the note is written
+ * out again. A note deleted from the database takes its file with it,
+ * unless the file was edited since, in which case the note comes back.
+ * Tags and links added to the front matter are added to the note.
+ */
+#define SYNC_BUSY_MS 5000
+#define SYNC_POLL_MS 1000
+
+struct sync {
+        sqlite3 *db;
+        const char *dir;
+        int imported, exported, removed;
+        sqlite3_stmt *by_name;
+        sqlite3_stmt *by_uuid;
+        sqlite3_stmt *set;
+};
+
+struct synced {
+        int found;
+        char name[256];
+        char uuid[40];
+        char hash[SHA256_HEX_LENGTH + 1];
+        char file_hash[SHA256_HEX_LENGTH + 1];
+        long long mtime, size;
+};
+
+struct list {
+        char **v;
+        int n, cap;
+};
+
+struct front {
+        char uuid[40];
+        struct list tags, links;
+        const char *body;
+        size_t body_len;
+};
+
+static int
+is_note_file(const char *name)
+{
+        size_t len = strlen(name);
+        return name[0] != '.' && len > 3 && !strcmp(name + len - 3, ".md");
+}
+
+static int
+file_stat(const char *path, long long *mtime, long long *size)
+{
+        struct stat st;
+        if (stat(path, &st) != 0 || !S_ISREG(st.st_mode))
+                return -1;
+
+        *mtime = (long long)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+        *size = st.st_size;
+        return 0;
+}
+
+static int
+note_path(const struct sync *s, const char *name, char *path, size_t len)
+{
+        if ((size_t)snprintf(path, len, "%s/%s", s->dir, name) >= len) {
+                fprintf(stderr, "Path too long: %s/%s\n", s->dir, name);
+                return -1;
+        }
+        return 0;
+}
+
+// Write under a temporary name and rename into place, so an editor never
+// sees half a file
+static int
+write_note_file(const char *dir, const char *name, const char *data, size_t len)
+{
+        char path[PATH_MAX], tmp[PATH_MAX];
+        if ((size_t)snprintf(path, sizeof(path), "%s/%s", dir, name) >= sizeof(path)
+            || (size_t)snprintf(tmp, sizeof(tmp), "%s/.%s.tmp", dir, name) >= sizeof(tmp)) {
+                fprintf(stderr, "Path too long: %s/%s\n", dir, name);
+                return 1;
+        }
+
+        FILE *f = fopen(tmp, "wb");
+        int ok = f && fwrite(data, 1, len, f) == len;
+
+        if (f && fclose(f) != 0)
+                ok = 0;
+
+        if (!ok || rename(tmp, path) != 0) {
+                fprintf(stderr, "Cannot write %s\n", path);
+                remove(tmp);
+                return 1;
+        }
+
+        return SQLITE_OK;
+}
+
+static int
+get_synced(struct sync *s, sqlite3_stmt *stmt, const char *key, struct synced *row)
+{
+        sqlite3_bind_text(stmt, 1, s->dir, -1, SQLITE_STATIC);
+        sqlite3_bind_text(stmt, 2, key, -1, SQLITE_STATIC);
+
+        int rc = sqlite3_step(stmt);
+        row->found = rc == SQLITE_ROW;
+        if (row->found) {
+                snprintf(row->name, sizeof(row->name), "%s", sqlite3_column_text(stmt, 0));
+                snprintf(row->uuid, sizeof(row->uuid), "%s", sqlite3_column_text(stmt, 1));
+                snprintf(row->hash, sizeof(row->hash), "%s", sqlite3_column_text(stmt, 2));
+                snprintf(row->file_hash, sizeof(row->file_hash), "%s", sqlite3_column_text(stmt, 3));
+                row->mtime = sqlite3_column_int64(stmt, 4);
+                row->size = sqlite3_column_int64(stmt, 5);
+        }
+        sqlite3_reset(stmt);
+
+        if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+                fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(s->db));
+                return rc;
+        }
+
+        return SQLITE_OK;
+}
+
+// Record that file name holds note uuid at hash as the file is now
+static int
+set_synced(struct sync *s, const char *name, const char *uuid, const char *hash,
+           const char *file_hash)
+{
+        char path[PATH_MAX];
+        long long mtime, size;
+
+        if (note_path(s, name, path, sizeof(path)) || file_stat(path, &mtime, &size)) {
+                fprintf(stderr, "Cannot stat %s/%s\n", s->dir, name);
+                return 1;
+        }
+
+        sqlite3_bind_text(s->set, 1, s->dir, -1, SQLITE_STATIC);
+        sqlite3_bind_text(s->set, 2, name, -1, SQLITE_STATIC);
+        sqlite3_bind_text(s->set, 3, uuid, -1, SQLITE_STATIC);
+        sqlite3_bind_text(s->set, 4, hash, -1, SQLITE_STATIC);
+        sqlite3_bind_text(s->set, 5, file_hash, -1, SQLITE_STATIC);
+        sqlite3_bind_int64(s->set, 6, mtime);
+        sqlite3_bind_int64(s->set, 7, size);
+
+        int rc = sqlite3_step(s->set);
+        sqlite3_reset(s->set);
+        if (rc != SQLITE_DONE) {
+                fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(s->db));
+                return rc;
+        }
+
+        return SQLITE_OK;
+}
+
+static int
+list_add(struct list *l, char *item)
+{
+        if (l->n == l->cap) {
+                int cap = l->cap ? l->cap * 2 : 8;
+                char **v = realloc(l->v, cap * sizeof(*v));
+                if (!v)
+                        return -1;
+                l->v = v;
+                l->cap = cap;
+        }
+
+        l->v[l->n++] = item;
+        return 0;
+}
+
+// Strip a list item in place, undoing the quoting export gives tags
+static char *
+list_item(char *s)
+{
+        while (*s == ' ')
+                s++;
+
+        if (*s != '"') {
+                size_t len = strlen(s);
+                while (len && (s[len - 1] == ' ' || s[len - 1] == '\r'))
+                        s[--len] = '\0';
+                return s;
+        }
+
+        char *out = ++s, *start = s;
+        for (; *s && *s != '"'; s++) {
+                if (*s == '\\' && s[1])
+                        s++;
+                *out++ = *s;
+        }
+        *out = '\0';
+        return start;
+}
+
+static int
+is_uuid(const char *s)
+{
+        size_t n = strspn(s, "0123456789abcdef-");
+        return n == 36 && (s[n] == '\0' || s[n] == ' ' || s[n] == '\r');
+}
+
+// Split text into front matter and body. Text not starting with front
+// matter holding at least one of our keys is all body. The front matter
+// is cut up in place.
+static int
+parse_front(char *text, size_t len, struct front *f)
+{
+        memset(f, 0, sizeof(*f));
+        f->body = text;
+        f->body_len = len;
+
+        if (strncmp(text, "---\n", 4))
+                return 0;
+
+        char *end = strstr(text + 3, "\n---\n");
+        size_t skip = 5;
+        if (!end && len >= 8 && !strcmp(text + len - 4, "\n---")) {
+                end = text + len - 4;
+                skip = 4;
+        }
+        if (!end)
+                return 0;
+
+        const char *body = end + skip;
+        struct list *list = NULL;
+        int keys = 0;
+
+        *end = '\0';
+        for (char *line = text + 4; line; ) {
+                char *next = strchr(line, '\n');
+                if (next)
+                        *next++ = '\0';
+
+                if (!strncmp(line, "uuid:", 5)) {
+                        char *uuid = line + 5 + strspn(line + 5, " ");
+                        if (is_uuid(uuid))
+                                snprintf(f->uuid, sizeof(f->uuid), "%.36s", uuid);
+                        list = NULL;
+                        keys++;
+                } else if (!strncmp(line, "tags:", 5)) {
+                        list = &f->tags;
+                        keys++;
+                } else if (!strncmp(line, "links:", 6)) {
+                        list = &f->links;
+                        keys++;
+                } else if (list && !strncmp(line, "  - ", 4)) {
+                        char *item = list_item(line + 4);
+                        if (*item && list_add(list, item))
+                                return -1;
+                } else {
+                        list = NULL;
+                        keys += !strncmp(line, "date:", 5);
+                }
+
+                line = next;
+        }
+
+        if (!keys) {
+                // Not ours after all: put the text back as it was
+                for (char *p = text; p < end; p++)
+                        if (!*p)
+                                *p = '\n';
+                *end = '\n';
+                free(f->tags.v);
+                free(f->links.v);
+                memset(&f->tags, 0, sizeof(f->tags));
+                memset(&f->links, 0, sizeof(f->links));
+                f->uuid[0] = '\0';
+                return 0;
+        }
+
+        f->body = body;
+        f->body_len = len - (body - text);
+        return 0;
+}
+
+static int
+step_done(sqlite3 *db, sqlite3_stmt *stmt)
+{
+        int rc = sqlite3_step(stmt);
+        sqlite3_reset(stmt);
+
+        if (rc != SQLITE_DONE) {
+                fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+                return rc;
+        }
+
+        return SQLITE_OK;
+}
+
+// Add the tags and links of the front matter the note does not have yet
+static int
+add_front(sqlite3 *db, sqlite3_int64 id, const struct front *f)
+{
+        sqlite3_stmt *tag = NULL, *note_tag = NULL, *link = NULL;
+
+        int rc = sqlite3_prepare_v2(db, "INSERT OR IGNORE INTO tags(body) VALUES(?);", -1, &tag, 0);
+        if (rc == SQLITE_OK)
+                rc = sqlite3_prepare_v2(db, "INSERT INTO note_tags(note_id, tag_id) "
+                                        "SELECT ?1, id FROM tags WHERE body = ?2 AND NOT EXISTS "
+                                        "(SELECT 1 FROM note_tags WHERE note_id = ?1 AND tag_id = tags.id);",
+                                        -1, &note_tag, 0);
+        if (rc == SQLITE_OK)
+                rc = sqlite3_prepare_v2(db, "INSERT INTO links(a_id, b_id) "
+                                        "SELECT ?1, id FROM notes WHERE uuid = ?2 AND id != ?1 AND NOT EXISTS "
+                                        "(SELECT 1 FROM links WHERE a_id = ?1 AND b_id = notes.id);",
+                                        -1, &link, 0);
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                goto end;
+        }
+
+        sqlite3_bind_int64(note_tag, 1, id);
+        sqlite3_bind_int64(link, 1, id);
+
+        for (int i = 0; i < f->tags.n && rc == SQLITE_OK; i++) {
+                sqlite3_bind_text(tag, 1, f->tags.v[i], -1, SQLITE_STATIC);
+                sqlite3_bind_text(note_tag, 2, f->tags.v[i], -1, SQLITE_STATIC);
+                rc = step_done(db, tag);
+                if (rc == SQLITE_OK)
+                        rc = step_done(db, note_tag);
+        }
+
+        for (int i = 0; i < f->links.n && rc == SQLITE_OK; i++) {
+                sqlite3_bind_text(link, 2, f->links.v[i], -1, SQLITE_STATIC);
+                rc = step_done(db, link);
+        }
+
+end:
+        sqlite3_finalize(tag);
+        sqlite3_finalize(note_tag);
+        sqlite3_finalize(link);
+        return rc;
+}
+
+static int
+insert_note(sqlite3 *db, const char *uuid, const char *body, size_t len, const char *hash,
+            sqlite3_int64 *id)
+{
+        sqlite3_stmt *stmt;
+        int rc = sqlite3_prepare_v2(db, "INSERT INTO notes(uuid, body, hash) VALUES(?, ?, ?);", -1, &stmt, 0);
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                return rc;
+        }
+
+        sqlite3_bind_text(stmt, 1, uuid, -1, SQLITE_STATIC);
+        bind_note_body(db, stmt, 2, body, len);
+        sqlite3_bind_text(stmt, 3, hash, -1, SQLITE_STATIC);
+
+        rc = step_done(db, stmt);
+        sqlite3_finalize(stmt);
+        if (rc != SQLITE_OK)
+                return rc;
+
+        *id = sqlite3_last_insert_rowid(db);
+
+        rc = sqlite3_prepare_v2(db, "INSERT INTO inbox(note_id) VALUES(?);", -1, &stmt, 0);
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                return rc;
+        }
+
+        sqlite3_bind_int64(stmt, 1, *id);
+        rc = step_done(db, stmt);
+        sqlite3_finalize(stmt);
+        return rc;
+}
+
+// Both the file and the note changed since the note had hash base: merge
+// the file's body into the note
+static int
+merge_file(struct sync *s, sqlite3_int64 id, const char *uuid, const char *base_hash,
+           const char *ours, const char *theirs, size_t theirs_len, const char *path)
+{
+        sqlite3_stmt *stmt;
+        int version = -1;
+
+        int rc = sqlite3_prepare_v2(s->db, "SELECT version FROM note_versions "
+                                    "WHERE note_id = ? AND hash = ? ORDER BY version DESC LIMIT 1;",
+                                    -1, &stmt, 0);
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(s->db));
+                return rc;
+        }
+
+        sqlite3_bind_int64(stmt, 1, id);
+        sqlite3_bind_text(stmt, 2, base_hash, -1, SQLITE_STATIC);
+        rc = sqlite3_step(stmt);
+        if (rc == SQLITE_ROW)
+                version = sqlite3_column_int(stmt, 0);
+        sqlite3_finalize(stmt);
+
+        if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+                fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(s->db));
+                return rc;
+        }
+
+        // Without the base every line is a change on both sides
+        char *base = NULL;
+        size_t base_len = 0;
+        if (version > 0) {
+                rc = read_version(s->db, id, version, &base, &base_len);
+                if (rc != SQLITE_OK)
+                        return rc;
+        }
+
+        int conflicts;
+        size_t len;
+        char *merged = merge3(base ? base : "", base_len, ours, strlen(ours), theirs, theirs_len,
+                              path, &len, &conflicts);
+        free(base);
+        if (!merged) {
+                fprintf(stderr, "Cannot merge %s: out of memory\n", path);
+                return SQLITE_NOMEM;
+        }
+
+        char hash[SHA256_HEX_LENGTH + 1];
+        rc = sha256_hex(merged, len, hash) == 0 ? SQLITE_OK : SQLITE_ERROR;
+        if (rc == SQLITE_OK)
+                rc = replace_body(s->db, id, merged, len, hash, NULL);
+        if (rc == SQLITE_OK && conflicts)
+                rc = add_conflict(s->db, id, conflicts, path);
+        free(merged);
+
+        if (rc == SQLITE_OK) {
+                if (conflicts)
+                        printf("Conflict: %s (%d hunks)\n", uuid, conflicts);
+                else
+                        printf("Merged: %s\n", uuid);
+        }
+
+        return rc;
+}
+
+// Render note uuid as its file and write it to name unless the file
+// already holds exactly that
+static int
+export_note(struct sync *s, const char *name, const char *uuid, const char *text, size_t len)
+{
+        struct note_files nf;
+        int rc = note_files_open(s->db, "notes.uuid = ?1", uuid, &nf);
+        if (rc != SQLITE_OK)
+                return rc;
+
+        rc = note_files_next(&nf);
+        if (rc != SQLITE_ROW) {
+                if (rc == SQLITE_NOMEM)
+                        fprintf(stderr, "Cannot export notes: out of memory\n");
+                note_files_close(&nf);
+                return rc == SQLITE_DONE ? SQLITE_NOTFOUND : rc;
+        }
+
+        char file_hash[SHA256_HEX_LENGTH + 1];
+        char hash[SHA256_HEX_LENGTH + 1];
+        snprintf(hash, sizeof(hash), "%s", sqlite3_column_text(nf.notes, 4));
+
+        rc = sha256_hex(nf.data, nf.len, file_hash) == 0 ? SQLITE_OK : SQLITE_ERROR;
+        if (rc == SQLITE_OK && (!text || len != nf.len || memcmp(text, nf.data, len))) {
+                rc = write_note_file(s->dir, name, nf.data, nf.len);
+                s->exported++;
+        }
+        if (rc == SQLITE_OK)
+                rc = set_synced(s, name, uuid, hash, file_hash);
+
+        note_files_close(&nf);
+        return rc;
+}
+
+// Bring file name into the database if it changed since the last sync
+static int
+sync_file(struct sync *s, const char *name)
+{
+        char path[PATH_MAX];
+        long long mtime, size;
+        struct synced row;
+
+        if (note_path(s, name, path, sizeof(path)) || file_stat(path, &mtime, &size))
+                return SQLITE_OK;
+
+        int rc = get_synced(s, s->by_name, name, &row);
+        if (rc != SQLITE_OK)
+                return rc;
+
+        if (row.found && row.mtime == mtime && row.size == size)
+                return SQLITE_OK;
+
+        FILE *fp = fopen(path, "rb");
+        size_t len;
+        char *text = fp ? read_file(fp, &len) : NULL;
+        if (fp)
+                fclose(fp);
+        if (!text) {
+                fprintf(stderr, "Cannot read %s\n", path);
+                return SQLITE_OK;
+        }
+
+        char file_hash[SHA256_HEX_LENGTH + 1];
+        char *copy = NULL;
+        sqlite3_stmt *stmt = NULL;
+        struct front f = { 0 };
+
+        rc = sha256_hex(text, len, file_hash) == 0 ? SQLITE_OK : SQLITE_ERROR;
+        if (rc != SQLITE_OK)
+                goto end;
+
+        // Touched but not changed
+        if (row.found && !strcmp(file_hash, row.file_hash)) {
+                rc = set_synced(s, name, row.uuid, row.hash, row.file_hash);
+                goto end;
+        }
+
+        copy = malloc(len + 1);
+        if (!copy || parse_front(memcpy(copy, text, len + 1), len, &f)) {
+                fprintf(stderr, "Cannot read %s: out of memory\n", path);
+                rc = SQLITE_NOMEM;
+                goto end;
+        }
+
+        // A copy of another synced file is a new note
+        if (f.uuid[0] && (!row.found || strcmp(f.uuid, row.uuid))) {
+                struct synced other;
+                char other_path[PATH_MAX];
+                long long m, z;
+
+                rc = get_synced(s, s->by_uuid, f.uuid, &other);
+                if (rc != SQLITE_OK)
+                        goto end;
+                if (other.found && !note_path(s, other.name, other_path, sizeof(other_path))
+                    && !file_stat(other_path, &m, &z))
+                        f.uuid[0] = '\0';
+        }
+
+        char uuid[40];
+        if (f.uuid[0])
+                snprintf(uuid, sizeof(uuid), "%s", f.uuid);
+        else if (row.found)
+                snprintf(uuid, sizeof(uuid), "%s", row.uuid);
+        else
+                uuid_v4_gen(uuid);
+
+        char hash[SHA256_HEX_LENGTH + 1];
+        if (sha256_hex(f.body, f.body_len, hash) != 0) {
+                rc = SQLITE_ERROR;
+                goto end;
+        }
+
+        rc = sqlite3_prepare_v2(s->db, "SELECT id, hash, note_text(body) FROM notes WHERE uuid = ?;",
+                                -1, &stmt, 0);
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(s->db));
+                goto end;
+        }
+
+        sqlite3_bind_text(stmt, 1, uuid, -1, SQLITE_STATIC);
+        rc = sqlite3_step(stmt);
+
+        sqlite3_int64 id = 0;
+        if (rc == SQLITE_DONE) {
+                rc = insert_note(s->db, uuid, f.body, f.body_len, hash, &id);
+                s->imported++;
+        } else if (rc == SQLITE_ROW) {
+                id = sqlite3_column_int64(stmt, 0);
+                const char *note_hash = (const char *)sqlite3_column_text(stmt, 1);
+                rc = SQLITE_OK;
+
+                if (!strcmp(note_hash, hash)) {
+                        // Only the front matter changed, if anything
+                } else if (!row.found || !strcmp(note_hash, row.hash)) {
+                        rc = replace_body(s->db, id, f.body, f.body_len, hash, NULL);
+                        s->imported++;
+                } else {
+                        rc = merge_file(s, id, uuid, row.hash, (const char *)sqlite3_column_text(stmt, 2),
+                                        f.body, f.body_len, path);
+                        s->imported++;
+                }
+        } else {
+                fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(s->db));
+        }
+
+        if (rc == SQLITE_OK)
+                rc = add_front(s->db, id, &f);
+
+        // The file gets its front matter, or the merged body
+        if (rc == SQLITE_OK)
+                rc = export_note(s, name, uuid, text, len);
+
+end:
+        sqlite3_finalize(stmt);
+        free(f.tags.v);
+        free(f.links.v);
+        free(copy);
+        free(text);
+        return rc;
+}
+
+static int
+sync_files(struct sync *s)
+{
+        DIR *d = opendir(s->dir);
+        if (!d) {
+                fprintf(stderr, "Cannot open directory: %s\n", s->dir);
+                return 1;
+        }
+
+        int rc = SQLITE_OK;
+        struct dirent *e;
+        while (rc == SQLITE_OK && (e = readdir(d)))
+                if (is_note_file(e->d_name))
+                        rc = sync_file(s, e->d_name);
+
+        closedir(d);
+        return rc;
+}
+
+// Remove the files of notes deleted from the database, unless they were
+// edited since the last sync
+static int
+drop_deleted(struct sync *s)
+{
+        sqlite3_stmt *stmt;
+        struct list names = { 0 };
+
+        int rc = sqlite3_prepare_v2(s->db, "SELECT name, mtime, size FROM synced_files "
+                                    "WHERE dir = ? AND uuid NOT IN (SELECT uuid FROM notes);",
+                                    -1, &stmt, 0);
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(s->db));
+                return rc;
+        }
+
+        sqlite3_bind_text(stmt, 1, s->dir, -1, SQLITE_STATIC);
+
+        while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+                const char *name = (const char *)sqlite3_column_text(stmt, 0);
+                char path[PATH_MAX];
+                long long mtime, size;
+
+                if (note_path(s, name, path, sizeof(path)))
+                        continue;
+
+                if (!file_stat(path, &mtime, &size)) {
+                        if (mtime != sqlite3_column_int64(stmt, 1) || size != sqlite3_column_int64(stmt, 2))
+                                continue;
+                        if (unlink(path) != 0) {
+                                fprintf(stderr, "Cannot remove %s\n", path);
+                                continue;
+                        }
+                        s->removed++;
+                }
+
+                char *copy = strdup(name);
+                if (!copy || list_add(&names, copy)) {
+                        free(copy);
+                        rc = SQLITE_NOMEM;
+                        break;
+                }
+        }
+
+        if (rc == SQLITE_NOMEM)
+                fprintf(stderr, "Cannot sync: out of memory\n");
+        else if (rc != SQLITE_DONE)
+                fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(s->db));
+        else
+                rc = SQLITE_OK;
+        sqlite3_finalize(stmt);
+
+        if (rc == SQLITE_OK)
+                rc = sqlite3_prepare_v2(s->db, "DELETE FROM synced_files WHERE dir = ? AND name = ?;",
+                                        -1, &stmt, 0);
+        if (rc == SQLITE_OK) {
+                sqlite3_bind_text(stmt, 1, s->dir, -1, SQLITE_STATIC);
+                for (int i = 0; i < names.n && rc == SQLITE_OK; i++) {
+                        sqlite3_bind_text(stmt, 2, names.v[i], -1, SQLITE_STATIC);
+                        rc = step_done(s->db, stmt);
+                }
+                sqlite3_finalize(stmt);
+        }
+
+        for (int i = 0; i < names.n; i++)
+                free(names.v[i]);
+        free(names.v);
+        return rc;
+}
+
+// Write out every note whose file is missing or differs from what the
+// note renders as now. A file edited since the last sync is left for
+// sync_file to import first.
+static int
+export_changed(struct sync *s)
+{
+        struct note_files nf;
+        int rc = note_files_open(s->db, NULL, NULL, &nf);
+        if (rc != SQLITE_OK)
+                return rc;
+
+        while ((rc = note_files_next(&nf)) == SQLITE_ROW) {
+                const char *uuid = (const char *)sqlite3_column_text(nf.notes, 1);
+                const char *hash = (const char *)sqlite3_column_text(nf.notes, 4);
+                char file_hash[SHA256_HEX_LENGTH + 1], name[sizeof(((struct synced *)0)->name)];
+                char path[PATH_MAX];
+                long long mtime, size;
+                struct synced row;
+
+                rc = get_synced(s, s->by_uuid, uuid, &row);
+                if (rc != SQLITE_OK)
+                        break;
+
+                if (sha256_hex(nf.data, nf.len, file_hash) != 0) {
+                        rc = SQLITE_ERROR;
+                        break;
+                }
+
+                if (row.found) {
+                        snprintf(name, sizeof(name), "%s", row.name);
+                        if (note_path(s, name, path, sizeof(path)))
+                                continue;
+                        if (!file_stat(path, &mtime, &size)
+                            && (!strcmp(file_hash, row.file_hash) || mtime != row.mtime || size != row.size))
+                                continue;
+                } else {
+                        snprintf(name, sizeof(name), "%s.md", uuid);
+                        if (note_path(s, name, path, sizeof(path)) || !file_stat(path, &mtime, &size))
+                                continue;
+                }
+
+                rc = write_note_file(s->dir, name, nf.data, nf.len);
+                if (rc == SQLITE_OK)
+                        rc = set_synced(s, name, uuid, hash, file_hash);
+                if (rc != SQLITE_OK)
+                        break;
+                s->exported++;
+        }
+
+        if (rc == SQLITE_NOMEM)
+                fprintf(stderr, "Cannot export notes: out of memory\n");
+        else if (rc == SQLITE_DONE)
+                rc = SQLITE_OK;
+
+        note_files_close(&nf);
+        return rc;
+}
+
+static int
+sync_all(struct sync *s)
+{
+        int rc = sql_exec(s->db, "BEGIN IMMEDIATE;");
+        if (rc != SQLITE_OK)
+                return rc;
+
+        rc = sync_files(s);
+        if (rc == SQLITE_OK)
+                rc = drop_deleted(s);
+        if (rc == SQLITE_OK)
+                rc = export_changed(s);
+        if (rc == SQLITE_OK)
+                rc = sql_exec(s->db, "COMMIT;");
+        if (rc != SQLITE_OK)
+                sql_exec(s->db, "ROLLBACK;");
+
+        return rc;
+}
+
+#ifdef __linux__
+static void
+report(struct sync *s)
+{
+        if (s->imported || s->exported || s->removed)
+                printf("Synced %s: %d imported, %d exported, %d removed\n", s->dir, s->imported,
+                       s->exported, s->removed);
+        fflush(stdout);
+        s->imported = s->exported = s->removed = 0;
+}
+
+// Apply each file written into the directory as it is closed or moved in,
+// and write out notes after another connection changes the database,
+// which PRAGMA data_version tells without reading anything
+static int
+watch(struct sync *s)
+{
+        sqlite3_stmt *version;
+        int rc = sqlite3_prepare_v2(s->db, "PRAGMA data_version;", -1, &version, 0);
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(s->db));
+                return rc;
+        }
+
+        int fd = inotify_init1(IN_CLOEXEC);
+        if (fd < 0 || inotify_add_watch(fd, s->dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+                fprintf(stderr, "Cannot watch %s\n", s->dir);
+                if (fd >= 0)
+                        close(fd);
+                sqlite3_finalize(version);
+                return 1;
+        }
+
+        sqlite3_int64 seen = -1;
+        int rescan = 0;
+        char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+        printf("Watching %s\n", s->dir);
+        fflush(stdout);
+
+        for (;;) {
+                struct pollfd p = { .fd = fd, .events = POLLIN };
+                int n = poll(&p, 1, SYNC_POLL_MS);
+                if (n < 0 && errno != EINTR) {
+                        fprintf(stderr, "Cannot watch %s\n", s->dir);
+                        rc = 1;
+                        break;
+                }
+
+                if (n > 0) {
+                        ssize_t len = read(fd, buf, sizeof(buf));
+                        if (len <= 0)
+                                continue;
+
+                        rc = sql_exec(s->db, "BEGIN IMMEDIATE;");
+                        for (char *e = buf; rc == SQLITE_OK && e < buf + len; ) {
+                                const struct inotify_event *ev = (const struct inotify_event *)e;
+                                if (ev->len && is_note_file(ev->name))
+                                        rc = sync_file(s, ev->name);
+                                e += sizeof(*ev) + ev->len;
+                        }
+                        if (rc == SQLITE_OK)
+                                rc = sql_exec(s->db, "COMMIT;");
+                        if (rc != SQLITE_OK) {
+                                sql_exec(s->db, "ROLLBACK;");
+                                rescan = 1;
+                        }
+                        report(s);
+                }
+
+                rc = sqlite3_step(version);
+                sqlite3_int64 now = sqlite3_column_int64(version, 0);
+                sqlite3_reset(version);
+                if (rc != SQLITE_ROW)
+                        continue;
+
+                // A batch that failed, say on a busy database, is retried
+                // as a full pass
+                if (seen >= 0 && (now != seen || rescan)) {
+                        rc = rescan ? sync_all(s) : sql_exec(s->db, "BEGIN IMMEDIATE;");
+                        if (!rescan) {
+                                if (rc == SQLITE_OK)
+                                        rc = drop_deleted(s);
+                                if (rc == SQLITE_OK)
+                                        rc = export_changed(s);
+                                if (rc == SQLITE_OK)
+                                        rc = sql_exec(s->db, "COMMIT;");
+                                if (rc != SQLITE_OK)
+                                        sql_exec(s->db, "ROLLBACK;");
+                        }
+                        rescan = rc != SQLITE_OK;
+                        report(s);
+                }
+                seen = now;
+        }
+
+        close(fd);
+        sqlite3_finalize(version);
+        return rc;
+}
+#endif
+
+int
+sync_dir(sqlite3 *db, const char *dir, int watching)
+{
+#ifndef __linux__
+        if (watching) {
+                fprintf(stderr, "Watching needs inotify, which this system does not have\n");
+                return 1;
+        }
+#endif
+
+        if (mkdir(dir, 0777) != 0 && errno != EEXIST) {
+                fprintf(stderr, "Cannot create directory: %s\n", dir);
+                return 1;
+        }
+
+        // Rows are keyed by the absolute path, so the directory can be
+        // named from anywhere
+        char real[PATH_MAX], cwd[PATH_MAX];
+        size_t n;
+        while (!strncmp(dir, "./", 2) && dir[2])
+                dir += 2;
+        if (dir[0] == '/')
+                n = snprintf(real, sizeof(real), "%s", dir);
+        else if (getcwd(cwd, sizeof(cwd)))
+                n = snprintf(real, sizeof(real), "%s/%s", cwd, dir);
+        else
+                n = sizeof(real);
+        if (n >= sizeof(real)) {
+                fprintf(stderr, "Cannot open directory: %s\n", dir);
+                return 1;
+        }
+        while (n > 1 && real[n - 1] == '/')
+                real[--n] = '\0';
+
+        struct sync s = { .db = db, .dir = real };
+        const char *columns = "SELECT name, uuid, hash, file_hash, mtime, size FROM synced_files ";
+
+        char sql[256];
+        snprintf(sql, sizeof(sql), "%sWHERE dir = ? AND name = ?;", columns);
+        int rc = sqlite3_prepare_v2(db, sql, -1, &s.by_name, 0);
+        if (rc == SQLITE_OK) {
+                snprintf(sql, sizeof(sql), "%sWHERE dir = ? AND uuid = ? ORDER BY name LIMIT 1;", columns);
+                rc = sqlite3_prepare_v2(db, sql, -1, &s.by_uuid, 0);
+        }
+        if (rc == SQLITE_OK)
+                rc = sqlite3_prepare_v2(db, "INSERT OR REPLACE INTO synced_files"
+                                        "(dir, name, uuid, hash, file_hash, mtime, size) "
+                                        "VALUES(?, ?, ?, ?, ?, ?, ?);", -1, &s.set, 0);
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                goto end;
+        }
+
+        // Edits from other processes wait for a pass rather than fail it
+        sqlite3_busy_timeout(db, SYNC_BUSY_MS);
+
+        rc = sync_all(&s);
+        printf("Synced %s: %d imported, %d exported, %d removed\n", s.dir, s.imported, s.exported,
+               s.removed);
+        s.imported = s.exported = s.removed = 0;
+
+#ifdef __linux__
+        if (rc == SQLITE_OK && watching)
+                rc = watch(&s);
+#endif
+
+end:
+        sqlite3_finalize(s.by_name);
+        sqlite3_finalize(s.by_uuid);
+        sqlite3_finalize(s.set);
+        return rc;
+}
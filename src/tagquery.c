@@ -0,0 +1,1140 @@
+#include <stdio.h>
+#include <sqlite3.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "app.h"
+#include "tagquery.h"
+
+/*
+ * Note ids are held in roaring-style bitmaps: ids are split on their high
+ * 16 bits into containers, each either a sorted array of low halves or,
+ * once it holds more than ARRAY_MAX ids, a 65536 bit set. Per-tag bitmaps
+ * are serialized to <db>-tags and memory-mapped, and are only trusted while
+ * the file's generation matches counters.tags.
+ */
+#define ARRAY_MAX 4096
+#define BITSET_WORDS 1024
+#define TAGS_MAGIC "ZKCTAGS1"
+
+struct container {
+        uint16_t key;
+        uint8_t bitset;
+        uint8_t owned;
+        uint32_t card;
+        void *data;
+};
+
+struct bitmap {
+        int n, cap;
+        struct container *c;
+};
+
+// On-disk layout: header, ntags directory entries sorted by name, names,
+// then the bitmap section. Offsets in the directory and in serialized
+// bitmaps are relative to the start of the bitmap section.
+struct tags_header {
+        char magic[8];
+        int64_t generation;
+        uint64_t ntags;
+        uint64_t names_len;
+        uint64_t universe_off;
+};
+
+struct tags_entry {
+        uint32_t name_off;
+        uint32_t name_len;
+        uint64_t bitmap_off;
+};
+
+struct disk_bitmap {
+        uint32_t n;
+        uint32_t pad;
+};
+
+struct disk_container {
+        uint16_t key;
+        uint8_t bitset;
+        uint8_t pad;
+        uint32_t card;
+        uint64_t data_off;
+};
+
+struct tag_index {
+        const char *base;
+        size_t len;
+        int mapped;
+        const struct tags_header *header;
+        const struct tags_entry *entries;
+        const char *names;
+        const char *bitmaps;
+};
+
+struct buffer {
+        char *p;
+        size_t len, cap;
+};
+
+static void
+bitmap_free(struct bitmap *b)
+{
+        for (int i = 0; i < b->n; i++)
+                if (b->c[i].owned)
+                        free(b->c[i].data);
+        free(b->c);
+        memset(b, 0, sizeof(*b));
+}
+
+static int
+bitmap_push(struct bitmap *b, struct container c)
+{
+        if (b->n == b->cap) {
+                int cap = b->cap ? b->cap * 2 : 8;
+                struct container *grown = realloc(b->c, sizeof(*grown) * cap);
+                if (!grown) {
+                        if (c.owned)
+                                free(c.data);
+                        return -1;
+                }
+                b->c = grown;
+                b->cap = cap;
+        }
+
+        b->c[b->n++] = c;
+        return 0;
+}
+
+static int
+container_contains(const struct container *c, uint16_t low)
+{
+        if (c->bitset)
+                return (((const uint64_t *)c->data)[low >> 6] >> (low & 63)) & 1;
+
+        const uint16_t *values = c->data;
+        int lo = 0, hi = (int)c->card - 1;
+        while (lo <= hi) {
+                int mid = lo + (hi - lo) / 2;
+                if (values[mid] == low)
+                        return 1;
+                if (values[mid] < low)
+                        lo = mid + 1;
+                else
+                        hi = mid - 1;
+        }
+        return 0;
+}
+
+static uint32_t
+popcount_words(const uint64_t *words)
+{
+        uint32_t card = 0;
+        for (int i = 0; i < BITSET_WORDS; i++) {
+                uint64_t w = words[i];
+                while (w) {
+                        w &= w - 1;
+                        card++;
+                }
+        }
+        return card;
+}
+
+// Take ownership of a freshly computed bit set, shrinking it to an array
+// when sparse. Empty results are dropped.
+static int
+push_words(struct bitmap *out, uint16_t key, uint64_t *words)
+{
+        uint32_t card = popcount_words(words);
+
+        if (card == 0) {
+                free(words);
+                return 0;
+        }
+
+        if (card > ARRAY_MAX)
+                return bitmap_push(out, (struct container) { key, 1, 1, card, words });
+
+        uint16_t *values = malloc(sizeof(*values) * card);
+        if (!values) {
+                free(words);
+                return -1;
+        }
+
+        uint32_t n = 0;
+        for (int i = 0; i < BITSET_WORDS; i++) {
+                uint64_t w = words[i];
+                while (w) {
+                        int bit = __builtin_ctzll(w);
+                        values[n++] = (uint16_t)(i * 64 + bit);
+                        w &= w - 1;
+                }
+        }
+
+        free(words);
+        return bitmap_push(out, (struct container) { key, 0, 1, card, values });
+}
+
+static int
+push_values(struct bitmap *out, uint16_t key, uint16_t *values, uint32_t card)
+{
+        if (card == 0) {
+                free(values);
+                return 0;
+        }
+
+        if (card <= ARRAY_MAX)
+                return bitmap_push(out, (struct container) { key, 0, 1, card, values });
+
+        uint64_t *words = calloc(BITSET_WORDS, sizeof(*words));
+        if (!words) {
+                free(values);
+                return -1;
+        }
+
+        for (uint32_t i = 0; i < card; i++)
+                words[values[i] >> 6] |= (uint64_t)1 << (values[i] & 63);
+
+        free(values);
+        return bitmap_push(out, (struct container) { key, 1, 1, card, words });
+}
+
+static uint64_t *
+to_words(const struct container *c)
+{
+        uint64_t *words = calloc(BITSET_WORDS, sizeof(*words));
+        if (!words)
+                return NULL;
+
+        if (c->bitset) {
+                memcpy(words, c->data, sizeof(*words) * BITSET_WORDS);
+        } else {
+                const uint16_t *values = c->data;
+                for (uint32_t i = 0; i < c->card; i++)
+                        words[values[i] >> 6] |= (uint64_t)1 << (values[i] & 63);
+        }
+
+        return words;
+}
+
+static int
+container_and(struct bitmap *out, const struct container *a, const struct container *b)
+{
+        if (a->bitset && b->bitset) {
+                uint64_t *words = to_words(a);
+                if (!words)
+                        return -1;
+                const uint64_t *bw = b->data;
+                for (int i = 0; i < BITSET_WORDS; i++)
+                        words[i] &= bw[i];
+                return push_words(out, a->key, words);
+        }
+
+        // Walk the array side, probing the other container
+        if (a->bitset) {
+                const struct container *tmp = a;
+                a = b;
+                b = tmp;
+        }
+
+        const uint16_t *av = a->data;
+        uint16_t *values = malloc(sizeof(*values) * (a->card ? a->card : 1));
+        if (!values)
+                return -1;
+
+        uint32_t n = 0;
+        if (!b->bitset) {
+                const uint16_t *bv = b->data;
+                uint32_t i = 0, j = 0;
+                while (i < a->card && j < b->card) {
+                        if (av[i] < bv[j]) {
+                                i++;
+                        } else if (av[i] > bv[j]) {
+                                j++;
+                        } else {
+                                values[n++] = av[i];
+                                i++;
+                                j++;
+                        }
+                }
+        } else {
+                for (uint32_t i = 0; i < a->card; i++)
+                        if (container_contains(b, av[i]))
+                                values[n++] = av[i];
+        }
+
+        return push_values(out, a->key, values, n);
+}
+
+static int
+container_or(struct bitmap *out, const struct container *a, const struct container *b)
+{
+        if (a->bitset || b->bitset) {
+                uint64_t *words = to_words(a->bitset ? a : b);
+                if (!words)
+                        return -1;
+                const struct container *other = a->bitset ? b : a;
+                if (other->bitset) {
+                        const uint64_t *ow = other->data;
+                        for (int i = 0; i < BITSET_WORDS; i++)
+                                words[i] |= ow[i];
+                } else {
+                        const uint16_t *ov = other->data;
+                        for (uint32_t i = 0; i < other->card; i++)
+                                words[ov[i] >> 6] |= (uint64_t)1 << (ov[i] & 63);
+                }
+                return push_words(out, a->key, words);
+        }
+
+        const uint16_t *av = a->data, *bv = b->data;
+        uint16_t *values = malloc(sizeof(*values) * (a->card + b->card));
+        if (!values)
+                return -1;
+
+        uint32_t i = 0, j = 0, n = 0;
+        while (i < a->card || j < b->card) {
+                if (j == b->card || (i < a->card && av[i] < bv[j])) {
+                        values[n++] = av[i++];
+                } else if (i == a->card || bv[j] < av[i]) {
+                        values[n++] = bv[j++];
+                } else {
+                        values[n++] = av[i++];
+                        j++;
+                }
+        }
+
+        return push_values(out, a->key, values, n);
+}
+
+static int
+container_andnot(struct bitmap *out, const struct container *a, const struct container *b)
+{
+        if (a->bitset) {
+                uint64_t *words = to_words(a);
+                if (!words)
+                        return -1;
+                if (b->bitset) {
+                        const uint64_t *bw = b->data;
+                        for (int i = 0; i < BITSET_WORDS; i++)
+                                words[i] &= ~bw[i];
+                } else {
+                        const uint16_t *bv = b->data;
+                        for (uint32_t i = 0; i < b->card; i++)
+                                words[bv[i] >> 6] &= ~((uint64_t)1 << (bv[i] & 63));
+                }
+                return push_words(out, a->key, words);
+        }
+
+        const uint16_t *av = a->data;
+        uint16_t *values = malloc(sizeof(*values) * (a->card ? a->card : 1));
+        if (!values)
+                return -1;
+
+        uint32_t n = 0;
+        for (uint32_t i = 0; i < a->card; i++)
+                if (!container_contains(b, av[i]))
+                        values[n++] = av[i];
+
+        return push_values(out, a->key, values, n);
+}
+
+// Non-owning copy of a container, used where the result is unchanged.
+static int
+push_view(struct bitmap *out, const struct container *c)
+{
+        struct container view = *c;
+        view.owned = 0;
+        return bitmap_push(out, view);
+}
+
+enum bitmap_op {
+        OP_AND,
+        OP_OR,
+        OP_ANDNOT,
+};
+
+// Merge the sorted container keys of a and b. Results may reference
+// containers of a or b, so inputs must outlive the output.
+static int
+bitmap_op(struct bitmap *out, const struct bitmap *a, const struct bitmap *b, enum bitmap_op op)
+{
+        int i = 0, j = 0, err = 0;
+
+        memset(out, 0, sizeof(*out));
+
+        while (!err && (i < a->n || j < b->n)) {
+                if (j == b->n || (i < a->n && a->c[i].key < b->c[j].key)) {
+                        if (op != OP_AND)
+                                err = push_view(out, &a->c[i]);
+                        i++;
+                } else if (i == a->n || b->c[j].key < a->c[i].key) {
+                        if (op == OP_OR)
+                                err = push_view(out, &b->c[j]);
+                        j++;
+                } else {
+                        if (op == OP_AND)
+                                err = container_and(out, &a->c[i], &b->c[j]);
+                        else if (op == OP_OR)
+                                err = container_or(out, &a->c[i], &b->c[j]);
+                        else
+                                err = container_andnot(out, &a->c[i], &b->c[j]);
+                        i++;
+                        j++;
+                }
+        }
+
+        if (err) {
+                bitmap_free(out);
+                return SQLITE_NOMEM;
+        }
+
+        return SQLITE_OK;
+}
+
+/*
+ * Query results own their containers but may also hold views into their
+ * operands. Every intermediate is therefore kept alive in a pool until
+ * the query finishes.
+ */
+struct pool {
+        int n, cap;
+        struct bitmap **items;
+};
+
+static struct bitmap *
+pool_add(struct pool *p)
+{
+        if (p->n == p->cap) {
+                int cap = p->cap ? p->cap * 2 : 16;
+                struct bitmap **grown = realloc(p->items, sizeof(*grown) * cap);
+                if (!grown)
+                        return NULL;
+                p->items = grown;
+                p->cap = cap;
+        }
+
+        struct bitmap *b = calloc(1, sizeof(*b));
+        if (b)
+                p->items[p->n++] = b;
+        return b;
+}
+
+static void
+pool_free(struct pool *p)
+{
+        for (int i = 0; i < p->n; i++) {
+                bitmap_free(p->items[i]);
+                free(p->items[i]);
+        }
+        free(p->items);
+}
+
+static int
+buffer_put(struct buffer *b, const void *data, size_t len)
+{
+        if (b->len + len > b->cap) {
+                size_t cap = b->cap ? b->cap : 4096;
+                while (cap < b->len + len)
+                        cap *= 2;
+                char *grown = realloc(b->p, cap);
+                if (!grown)
+                        return -1;
+                b->p = grown;
+                b->cap = cap;
+        }
+
+        memcpy(b->p + b->len, data, len);
+        b->len += len;
+        return 0;
+}
+
+static int
+buffer_align(struct buffer *b)
+{
+        static const char zero[8];
+        return buffer_put(b, zero, (8 - b->len % 8) % 8);
+}
+
+/*
+ * Serializes one bitmap from ascending ids. Containers are staged in a
+ * 65536 entry scratch array and written once their key is complete.
+ */
+struct builder {
+        struct buffer *out;
+        struct buffer headers;
+        struct buffer data;
+        uint16_t *scratch;
+        uint32_t count;
+        int32_t key;
+        int64_t last;
+};
+
+static int
+builder_flush(struct builder *bld)
+{
+        if (bld->count == 0)
+                return 0;
+
+        struct disk_container dc = {
+                .key = (uint16_t)bld->key,
+                .bitset = bld->count > ARRAY_MAX,
+                .card = bld->count,
+                .data_off = bld->data.len,
+        };
+
+        int err = buffer_put(&bld->headers, &dc, sizeof(dc));
+
+        if (dc.bitset) {
+                uint64_t words[BITSET_WORDS] = { 0 };
+                for (uint32_t i = 0; i < bld->count; i++)
+                        words[bld->scratch[i] >> 6] |= (uint64_t)1 << (bld->scratch[i] & 63);
+                err |= buffer_put(&bld->data, words, sizeof(words));
+        } else {
+                err |= buffer_put(&bld->data, bld->scratch, sizeof(uint16_t) * bld->count);
+                err |= buffer_align(&bld->data);
+        }
+
+        bld->count = 0;
+        return err;
+}
+
+static void
+builder_start(struct builder *bld)
+{
+        bld->headers.len = 0;
+        bld->data.len = 0;
+        bld->count = 0;
+        bld->key = -1;
+        bld->last = -1;
+}
+
+static int
+builder_add(struct builder *bld, int64_t id)
+{
+        // Duplicate note_tags rows and ids past 32 bits are ignored
+        if (id <= bld->last || id > UINT32_MAX)
+                return 0;
+        bld->last = id;
+
+        int32_t key = (int32_t)(id >> 16);
+        if (key != bld->key) {
+                if (builder_flush(bld))
+                        return -1;
+                bld->key = key;
+        }
+
+        bld->scratch[bld->count++] = (uint16_t)(id & 0xffff);
+        return 0;
+}
+
+// Append the staged bitmap to the output and return its offset.
+static int
+builder_finish(struct builder *bld, uint64_t *offset)
+{
+        if (builder_flush(bld))
+                return -1;
+
+        struct disk_bitmap db = { .n = bld->headers.len / sizeof(struct disk_container) };
+        *offset = bld->out->len;
+
+        // Rebase container data offsets onto the bitmap section
+        uint64_t data_start = bld->out->len + sizeof(db) + bld->headers.len;
+        struct disk_container *dc = (struct disk_container *)bld->headers.p;
+        for (uint32_t i = 0; i < db.n; i++)
+                dc[i].data_off += data_start;
+
+        if (buffer_put(bld->out, &db, sizeof(db))
+            || (bld->headers.len && buffer_put(bld->out, bld->headers.p, bld->headers.len))
+            || (bld->data.len && buffer_put(bld->out, bld->data.p, bld->data.len)))
+                return -1;
+
+        return 0;
+}
+
+static int
+build_universe(sqlite3 *db, struct builder *bld, uint64_t *offset)
+{
+        char *sql = "SELECT id FROM notes ORDER BY id;";
+        sqlite3_stmt *stmt;
+        int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
+
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                return rc;
+        }
+
+        builder_start(bld);
+
+        while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+                if (builder_add(bld, sqlite3_column_int64(stmt, 0))) {
+                        rc = SQLITE_NOMEM;
+                        break;
+                }
+        }
+
+        sqlite3_finalize(stmt);
+
+        if (rc == SQLITE_NOMEM || builder_finish(bld, offset))
+                return SQLITE_NOMEM;
+
+        if (rc != SQLITE_DONE) {
+                fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+                return rc;
+        }
+
+        return SQLITE_OK;
+}
+
+// Build the whole index file image in memory.
+static int
+build_index(sqlite3 *db, int64_t generation, struct buffer *file)
+{
+        struct buffer dir = { 0 }, names = { 0 }, bitmaps = { 0 };
+        struct builder bld = { .out = &bitmaps };
+        struct tags_header header = { .generation = generation };
+        sqlite3_stmt *stmt = NULL;
+        int rc = SQLITE_NOMEM;
+
+        memcpy(header.magic, TAGS_MAGIC, sizeof(header.magic));
+
+        bld.scratch = malloc(sizeof(*bld.scratch) * 65536);
+        if (!bld.scratch)
+                goto end;
+
+        rc = build_universe(db, &bld, &header.universe_off);
+        if (rc != SQLITE_OK)
+                goto end;
+
+        char *sql = "SELECT tags.body, note_tags.note_id FROM tags "
+                "LEFT JOIN note_tags ON note_tags.tag_id = tags.id "
+                "ORDER BY tags.body, note_tags.note_id;";
+        rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
+
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                goto end;
+        }
+
+        struct tags_entry entry = { 0 };
+        int open = 0;
+
+        while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+                const char *body = (const char *)sqlite3_column_text(stmt, 0);
+                uint32_t len = sqlite3_column_bytes(stmt, 0);
+
+                if (!open || len != entry.name_len || memcmp(names.p + entry.name_off, body, len)) {
+                        if (open && (builder_finish(&bld, &entry.bitmap_off)
+                                     || buffer_put(&dir, &entry, sizeof(entry))))
+                                break;
+
+                        entry.name_off = names.len;
+                        entry.name_len = len;
+                        header.ntags++;
+                        open = 1;
+                        builder_start(&bld);
+
+                        if (buffer_put(&names, body, len))
+                                break;
+                }
+
+                if (sqlite3_column_type(stmt, 1) != SQLITE_NULL
+                    && builder_add(&bld, sqlite3_column_int64(stmt, 1)))
+                        break;
+        }
+
+        if (rc == SQLITE_ROW) {
+                rc = SQLITE_NOMEM;
+                goto end;
+        }
+
+        if (rc != SQLITE_DONE) {
+                fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+                goto end;
+        }
+
+        rc = SQLITE_NOMEM;
+        if (open && (builder_finish(&bld, &entry.bitmap_off)
+                     || buffer_put(&dir, &entry, sizeof(entry))))
+                goto end;
+
+        header.names_len = names.len;
+
+        if (buffer_put(file, &header, sizeof(header))
+            || (dir.len && buffer_put(file, dir.p, dir.len))
+            || (names.len && buffer_put(file, names.p, names.len))
+            || buffer_align(file)
+            || buffer_put(file, bitmaps.p, bitmaps.len))
+                goto end;
+
+        rc = SQLITE_OK;
+
+end:
+        sqlite3_finalize(stmt);
+        free(bld.scratch);
+        free(bld.headers.p);
+        free(bld.data.p);
+        free(dir.p);
+        free(names.p);
+        free(bitmaps.p);
+        return rc;
+}
+
+static int
+index_open(struct tag_index *idx, const char *base, size_t len, int64_t generation)
+{
+        const struct tags_header *header = (const struct tags_header *)base;
+
+        if (len < sizeof(*header)
+            || memcmp(header->magic, TAGS_MAGIC, sizeof(header->magic))
+            || header->generation != generation
+            || header->ntags > len / sizeof(struct tags_entry)
+            || header->names_len > len)
+                return 1;
+
+        size_t names_off = sizeof(*header) + header->ntags * sizeof(struct tags_entry);
+        size_t bitmaps_off = (names_off + header->names_len + 7) & ~(size_t)7;
+
+        if (bitmaps_off > len)
+                return 1;
+
+        idx->base = base;
+        idx->len = len;
+        idx->header = header;
+        idx->entries = (const struct tags_entry *)(base + sizeof(*header));
+        idx->names = base + names_off;
+        idx->bitmaps = base + bitmaps_off;
+        return 0;
+}
+
+static void
+index_close(struct tag_index *idx)
+{
+        if (idx->mapped)
+                munmap((void *)idx->base, idx->len);
+        else
+                free((void *)idx->base);
+}
+
+static int
+index_map(const char *path, int64_t generation, struct tag_index *idx)
+{
+        int fd = open(path, O_RDONLY);
+        if (fd < 0)
+                return 1;
+
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0) {
+                close(fd);
+                return 1;
+        }
+
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+
+        if (map == MAP_FAILED)
+                return 1;
+
+        if (index_open(idx, map, st.st_size, generation)) {
+                munmap(map, st.st_size);
+                return 1;
+        }
+
+        idx->mapped = 1;
+        return 0;
+}
+
+static void
+index_write(const char *path, const struct buffer *file)
+{
+        char tmp[PATH_MAX];
+        if ((size_t)snprintf(tmp, sizeof(tmp), "%s.%ld", path, (long)getpid()) >= sizeof(tmp))
+                return;
+
+        FILE *f = fopen(tmp, "wb");
+        if (!f)
+                return;
+
+        int ok = fwrite(file->p, 1, file->len, f) == file->len;
+
+        if (fclose(f) != 0)
+                ok = 0;
+
+        if (!ok || rename(tmp, path) != 0)
+                remove(tmp);
+}
+
+static int
+index_load(sqlite3 *db, struct tag_index *idx)
+{
+        char path[PATH_MAX];
+        int64_t generation = counter_value(db, "tags");
+        int cached = generation >= 0 && !cache_path(db, "-tags", path, sizeof(path));
+
+        memset(idx, 0, sizeof(*idx));
+
+        if (cached && !index_map(path, generation, idx))
+                return SQLITE_OK;
+
+        struct buffer file = { 0 };
+        int rc = build_index(db, generation, &file);
+
+        if (rc != SQLITE_OK) {
+                if (rc == SQLITE_NOMEM)
+                        fprintf(stderr, "Out of memory building tag index\n");
+                free(file.p);
+                return rc;
+        }
+
+        if (cached)
+                index_write(path, &file);
+
+        index_open(idx, file.p, file.len, generation);
+        return SQLITE_OK;
+}
+
+// Non-owning bitmap over a serialized one.
+static int
+index_bitmap(const struct tag_index *idx, uint64_t offset, struct bitmap *out)
+{
+        const struct disk_bitmap *db = (const struct disk_bitmap *)(idx->bitmaps + offset);
+        const struct disk_container *dc = (const struct disk_container *)(db + 1);
+
+        memset(out, 0, sizeof(*out));
+
+        for (uint32_t i = 0; i < db->n; i++) {
+                struct container c = {
+                        .key = dc[i].key,
+                        .bitset = dc[i].bitset,
+                        .card = dc[i].card,
+                        .data = (void *)(idx->bitmaps + dc[i].data_off),
+                };
+                if (bitmap_push(out, c)) {
+                        bitmap_free(out);
+                        return SQLITE_NOMEM;
+                }
+        }
+
+        return SQLITE_OK;
+}
+
+static int
+name_compare(const struct tag_index *idx, uint64_t i, const char *name, size_t len)
+{
+        const struct tags_entry *e = &idx->entries[i];
+        size_t n = e->name_len < len ? e->name_len : len;
+        int c = memcmp(idx->names + e->name_off, name, n);
+        if (c)
+                return c;
+        return (e->name_len > len) - (e->name_len < len);
+}
+
+// First entry whose name is >= name.
+static uint64_t
+index_lower_bound(const struct tag_index *idx, const char *name, size_t len)
+{
+        uint64_t lo = 0, hi = idx->header->ntags;
+        while (lo < hi) {
+                uint64_t mid = lo + (hi - lo) / 2;
+                if (name_compare(idx, mid, name, len) < 0)
+                        lo = mid + 1;
+                else
+                        hi = mid;
+        }
+        return lo;
+}
+
+struct parser {
+        const char *s;
+        const struct tag_index *idx;
+        struct pool pool;
+        int error;
+};
+
+enum token {
+        TOK_END,
+        TOK_LPAREN,
+        TOK_RPAREN,
+        TOK_AND,
+        TOK_OR,
+        TOK_NOT,
+        TOK_TERM,
+};
+
+static size_t
+term_length(const char *s)
+{
+        size_t n = 0;
+        while (s[n] && s[n] != ' ' && s[n] != '\t' && s[n] != '\n'
+               && s[n] != '(' && s[n] != ')')
+                n++;
+        return n;
+}
+
+static enum token
+peek(struct parser *p, size_t *len)
+{
+        while (*p->s == ' ' || *p->s == '\t' || *p->s == '\n')
+                p->s++;
+
+        *len = 1;
+        switch (*p->s) {
+        case '\0': return TOK_END;
+        case '(': return TOK_LPAREN;
+        case ')': return TOK_RPAREN;
+        case '&': return TOK_AND;
+        case '|': return TOK_OR;
+        case '!': return TOK_NOT;
+        }
+
+        *len = term_length(p->s);
+        if (*len == 3 && !strncmp(p->s, "AND", 3))
+                return TOK_AND;
+        if (*len == 2 && !strncmp(p->s, "OR", 2))
+                return TOK_OR;
+        if (*len == 3 && !strncmp(p->s, "NOT", 3))
+                return TOK_NOT;
+        return TOK_TERM;
+}
+
+static struct bitmap *parse_or(struct parser *p);
+
+static struct bitmap *
+combine(struct parser *p, struct bitmap *a, struct bitmap *b, enum bitmap_op op)
+{
+        struct bitmap *out = pool_add(&p->pool);
+        if (!out || bitmap_op(out, a, b, op) != SQLITE_OK) {
+                p->error = SQLITE_NOMEM;
+                return NULL;
+        }
+        return out;
+}
+
+// A tag name, or the union of all tags sharing a prefix for "name*".
+static struct bitmap *
+parse_term(struct parser *p, size_t len)
+{
+        const char *name = p->s;
+        int prefix = name[len - 1] == '*';
+        p->s += len;
+
+        if (prefix)
+                len--;
+
+        struct bitmap *acc = pool_add(&p->pool);
+        if (!acc) {
+                p->error = SQLITE_NOMEM;
+                return NULL;
+        }
+
+        const struct tag_index *idx = p->idx;
+        for (uint64_t i = index_lower_bound(idx, name, len); i < idx->header->ntags; i++) {
+                const struct tags_entry *e = &idx->entries[i];
+
+                if (e->name_len < len || memcmp(idx->names + e->name_off, name, len))
+                        break;
+                if (!prefix && e->name_len != len)
+                        break;
+
+                struct bitmap *tag = pool_add(&p->pool);
+                if (!tag || index_bitmap(idx, e->bitmap_off, tag) != SQLITE_OK) {
+                        p->error = SQLITE_NOMEM;
+                        return NULL;
+                }
+
+                acc = combine(p, acc, tag, OP_OR);
+                if (!acc)
+                        return NULL;
+        }
+
+        return acc;
+}
+
+static struct bitmap *
+parse_primary(struct parser *p)
+{
+        size_t len;
+        enum token t = peek(p, &len);
+
+        if (t == TOK_TERM)
+                return parse_term(p, len);
+
+        if (t == TOK_LPAREN) {
+                p->s++;
+                struct bitmap *b = parse_or(p);
+                if (!b)
+                        return NULL;
+                if (peek(p, &len) != TOK_RPAREN) {
+                        p->error = SQLITE_ERROR;
+                        return NULL;
+                }
+                p->s++;
+                return b;
+        }
+
+        p->error = SQLITE_ERROR;
+        return NULL;
+}
+
+/*
+ * A conjunction is evaluated as the intersection of its positive factors
+ * minus the union of its negated ones, so "a NOT b" never materializes
+ * the complement of b. Only an all-negative conjunction starts from the
+ * set of all notes.
+ */
+static struct bitmap *
+parse_and(struct parser *p)
+{
+        struct bitmap *pos = NULL, *neg = NULL;
+        int operand = 1;
+        size_t len;
+
+        for (;;) {
+                enum token t = peek(p, &len);
+
+                if (t == TOK_AND && !operand) {
+                        p->s += len;
+                        operand = 1;
+                        continue;
+                }
+
+                if (t != TOK_NOT && t != TOK_TERM && t != TOK_LPAREN)
+                        break;
+                operand = 0;
+
+                int negated = 0;
+                while (t == TOK_NOT) {
+                        negated = !negated;
+                        p->s += len;
+                        t = peek(p, &len);
+                }
+
+                struct bitmap *b = parse_primary(p);
+                if (!b)
+                        return NULL;
+
+                if (negated)
+                        neg = neg ? combine(p, neg, b, OP_OR) : b;
+                else
+                        pos = pos ? combine(p, pos, b, OP_AND) : b;
+
+                if (p->error)
+                        return NULL;
+        }
+
+        if (operand) {
+                p->error = SQLITE_ERROR;
+                return NULL;
+        }
+
+        if (!pos) {
+                pos = pool_add(&p->pool);
+                if (!pos || index_bitmap(p->idx, p->idx->header->universe_off, pos) != SQLITE_OK) {
+                        p->error = SQLITE_NOMEM;
+                        return NULL;
+                }
+        }
+
+        return neg ? combine(p, pos, neg, OP_ANDNOT) : pos;
+}
+
+static struct bitmap *
+parse_or(struct parser *p)
+{
+        struct bitmap *acc = parse_and(p);
+        size_t len;
+
+        while (acc && peek(p, &len) == TOK_OR) {
+                p->s += len;
+                struct bitmap *b = parse_and(p);
+                if (!b)
+                        return NULL;
+                acc = combine(p, acc, b, OP_OR);
+        }
+
+        return acc;
+}
+
+static int
+print_note(sqlite3 *db, sqlite3_stmt *stmt, sqlite3_int64 id)
+{
+        sqlite3_bind_int64(stmt, 1, id);
+
+        int rc = sqlite3_step(stmt);
+        if (rc == SQLITE_ROW) {
+                print_summary((char *)sqlite3_column_text(stmt, 0),
+                              (char *)sqlite3_column_text(stmt, 1),
+                              (char *)sqlite3_column_text(stmt, 2));
+        } else if (rc != SQLITE_DONE) {
+                fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg(db));
+                return rc;
+        }
+
+        sqlite3_reset(stmt);
+        return SQLITE_OK;
+}
+
+static int
+print_notes(sqlite3 *db, const struct bitmap *b)
+{
+        char *sql = "SELECT uuid, date, substr(note_text(body), 1, 16) FROM notes WHERE id = ?;";
+        sqlite3_stmt *stmt;
+        int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
+
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+                return rc;
+        }
+
+        for (int i = 0; i < b->n && rc == SQLITE_OK; i++) {
+                const struct container *c = &b->c[i];
+                sqlite3_int64 high = (sqlite3_int64)c->key << 16;
+
+                if (c->bitset) {
+                        const uint64_t *words = c->data;
+                        for (int w = 0; w < BITSET_WORDS && rc == SQLITE_OK; w++) {
+                                for (uint64_t bits = words[w]; bits && rc == SQLITE_OK; bits &= bits - 1)
+                                        rc = print_note(db, stmt, high | (w * 64 + __builtin_ctzll(bits)));
+                        }
+                } else {
+                        const uint16_t *values = c->data;
+                        for (uint32_t v = 0; v < c->card && rc == SQLITE_OK; v++)
+                                rc = print_note(db, stmt, high | values[v]);
+                }
+        }
+
+        sqlite3_finalize(stmt);
+        return rc;
+}
+
+int
+tag_query(sqlite3 *db, const char *query)
+{
+        struct tag_index idx;
+        int rc = index_load(db, &idx);
+        if (rc != SQLITE_OK)
+                return rc;
+
+        struct parser p = { .s = query, .idx = &idx };
+        struct bitmap *result = parse_or(&p);
+        size_t len;
+
+        if (result && peek(&p, &len) != TOK_END)
+                p.error = SQLITE_ERROR;
+
+        if (p.error == SQLITE_NOMEM) {
+                fprintf(stderr, "Out of memory evaluating tag query\n");
+                rc = SQLITE_NOMEM;
+        } else if (p.error) {
+                fprintf(stderr, "Invalid tag query at: %s\n", *p.s ? p.s : "end of query");
+                rc = 1;
+        } else {
+                rc = print_notes(db, result);
+        }
+
+        pool_free(&p.pool);
+        index_close(&idx);
+        return rc;
+}
@@ -0,0 +1,315 @@
+#include <stdio.h>
+#include <sqlite3.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "app.h"
+#include "compress.h"
+#include "vaults.h"
+
+/*
+ * Each vault gets a read-only connection of its own, and a pool of
+ * threads runs the search in one vault after another. ATTACHing the
+ * vaults to one connection would cap them at SQLITE_LIMIT_ATTACHED and
+ * run them one statement at a time. Every vault returns its matches
+ * already in merge order, so the results are merged with a heap over
+ * the vaults rather than sorted again.
+ */
+#define VAULTS_MAX_THREADS 8
+
+struct vault_hit {
+        double score;           // -1 for notes that were never ranked
+        char uuid[40];
+        char date[32];
+        char preview[68];       // first 16 characters of the note
+};
+
+struct vault {
+        const char *path;
+        struct vault_hit *hits;
+        size_t n, cap, pos;
+        int rc;
+};
+
+struct vault_pool {
+        pthread_mutex_t lock;
+        struct vault *vaults;
+        int count, next;
+        const char *type;
+        const char *word;
+        int ranked;
+};
+
+static void
+copy_column(char *buffer, size_t len, const unsigned char *text)
+{
+        snprintf(buffer, len, "%s", text ? (const char *)text : "");
+}
+
+static int
+search_vault(struct vault *v, const struct vault_pool *pool)
+{
+        sqlite3 *db;
+        sqlite3_stmt *stmt;
+        int rc = sqlite3_open_v2(v->path, &db, SQLITE_OPEN_READONLY, 0);
+
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "%s: Cannot open zkc database: %s\n", v->path, sqlite3_errmsg(db));
+                sqlite3_close(db);
+                return rc;
+        }
+
+        rc = register_note_text(db);
+        if (rc != SQLITE_OK) {
+                sqlite3_close(db);
+                return rc;
+        }
+
+        // Same order as search --rank, with the date breaking ties so
+        // that results from different vaults interleave the same way
+        // every time
+        char query[1024];
+        snprintf(query, sizeof(query),
+                 "SELECT uuid, date, substr(note_text(body), 1, 16), "
+                 "%s FROM notes WHERE %s ORDER BY %sdate DESC;",
+                 pool->ranked ? "ifnull((SELECT score FROM note_ranks WHERE note_id = notes.id), -1)" : "0",
+                 search_where(db, pool->type), pool->ranked ? "4 DESC, " : "");
+
+        rc = sqlite3_prepare_v2(db, query, -1, &stmt, 0);
+        if (rc != SQLITE_OK) {
+                fprintf(stderr, "%s: Cannot prepare statement: %s\n", v->path, sqlite3_errmsg(db));
+                sqlite3_close(db);
+                return rc;
+        }
+
+        sqlite3_bind_text(stmt, 1, pool->word, -1, SQLITE_STATIC);
+
+        while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+                if (v->n == v->cap) {
+                        size_t cap = v->cap ? v->cap * 2 : 64;
+                        struct vault_hit *hits = realloc(v->hits, cap * sizeof(*hits));
+                        if (!hits) {
+                                rc = SQLITE_NOMEM;
+                                break;
+                        }
+                        v->hits = hits;
+                        v->cap = cap;
+                }
+
+                struct vault_hit *hit = &v->hits[v->n++];
+                copy_column(hit->uuid, sizeof(hit->uuid), sqlite3_column_text(stmt, 0));
+                copy_column(hit->date, sizeof(hit->date), sqlite3_column_text(stmt, 1));
+                copy_column(hit->preview, sizeof(hit->preview), sqlite3_column_text(stmt, 2));
+                hit->score = sqlite3_column_double(stmt, 3);
+
+                for (char *c = hit->preview; *c; c++) {
+                        if (*c == '\n')
+                                *c = ' ';
+                }
+        }
+
+        if (rc == SQLITE_DONE) {
+                rc = SQLITE_OK;
+        } else if (rc == SQLITE_NOMEM) {
+                fprintf(stderr, "%s: out of memory\n", v->path);
+        } else {
+                fprintf(stderr, "%s: execution failed: %s\n", v->path, sqlite3_errmsg(db));
+        }
+
+        sqlite3_finalize(stmt);
+        sqlite3_close(db);
+        return rc;
+}
+
+static void *
+search_worker(void *arg)
+{
+        struct vault_pool *pool = arg;
+
+        for (;;) {
+                pthread_mutex_lock(&pool->lock);
+                int i = pool->next++;
+                pthread_mutex_unlock(&pool->lock);
+
+                if (i >= pool->count)
+                        break;
+
+                pool->vaults[i].rc = search_vault(&pool->vaults[i], pool);
+        }
+
+        return NULL;
+}
+
+static int
+search_threads(int count)
+{
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+        if (cpus < 1)
+                cpus = 1;
+        if (cpus > VAULTS_MAX_THREADS)
+                cpus = VAULTS_MAX_THREADS;
+        if (cpus > count)
+                cpus = count;
+
+        return cpus;
+}
+
+// Whether the next hit of vault a goes before the next hit of vault b
+static int
+hit_before(const struct vault *vaults, int a, int b, int ranked)
+{
+        const struct vault_hit *x = &vaults[a].hits[vaults[a].pos];
+        const struct vault_hit *y = &vaults[b].hits[vaults[b].pos];
+
+        if (ranked && x->score != y->score)
+                return x->score > y->score;
+
+        int c = strcmp(x->date, y->date);
+        if (c)
+                return c > 0;
+
+        return a < b;
+}
+
+static void
+heap_down(int *heap, int n, int i, const struct vault *vaults, int ranked)
+{
+        for (;;) {
+                int first = i, l = 2 * i + 1, r = l + 1;
+
+                if (l < n && hit_before(vaults, heap[l], heap[first], ranked))
+                        first = l;
+                if (r < n && hit_before(vaults, heap[r], heap[first], ranked))
+                        first = r;
+                if (first == i)
+                        return;
+
+                int t = heap[i];
+                heap[i] = heap[first];
+                heap[first] = t;
+                i = first;
+        }
+}
+
+static void
+merge_vaults(struct vault *vaults, int count, int *heap, int ranked)
+{
+        int n = 0;
+
+        for (int i = 0; i < count; i++) {
+                if (vaults[i].n)
+                        heap[n++] = i;
+        }
+
+        for (int i = n / 2 - 1; i >= 0; i--)
+                heap_down(heap, n, i, vaults, ranked);
+
+        while (n) {
+                struct vault *v = &vaults[heap[0]];
+                struct vault_hit *hit = &v->hits[v->pos++];
+
+                printf("%s - %s - %s... - %s\n", hit->uuid, hit->date, hit->preview, v->path);
+
+                if (v->pos == v->n)
+                        heap[0] = heap[--n];
+                heap_down(heap, n, 0, vaults, ranked);
+        }
+}
+
+int
+search_vaults(int argc, char **argv)
+{
+        const char *type = "text";
+        int ranked = 0;
+
+        if (argc < 2) {
+                fprintf(stderr, "Usage: zkc search --vaults a.db,b.db [--rank] [search_type] search_word\n");
+                return 1;
+        }
+
+        char *list = argv[0];
+        argc--;
+        argv++;
+
+        if (argc >= 2 && !strcmp(argv[0], "--rank")) {
+                ranked = 1;
+                argc--;
+                argv++;
+        }
+
+        if (argc == 2) {
+                type = argv[0];
+                argc--;
+                argv++;
+        }
+
+        if (argc != 1) {
+                fprintf(stderr, "Usage: zkc search --vaults a.db,b.db [--rank] [search_type] search_word\n");
+                return 1;
+        }
+
+        if (!search_where(NULL, type)) {
+                fprintf(stderr, "Invalid search type for --vaults: %s\n", type);
+                return 1;
+        }
+
+        int count = 1;
+        for (char *c = list; *c; c++) {
+                if (*c == ',')
+                        count++;
+        }
+
+        struct vault *vaults = calloc(count, sizeof(*vaults));
+        int *heap = calloc(count, sizeof(*heap));
+        if (!vaults || !heap) {
+                free(vaults);
+                free(heap);
+                return SQLITE_NOMEM;
+        }
+
+        count = 0;
+        for (char *path = strtok(list, ","); path; path = strtok(NULL, ",")) {
+                vaults[count++].path = path;
+        }
+
+        struct vault_pool pool = {
+                .lock = PTHREAD_MUTEX_INITIALIZER,
+                .vaults = vaults,
+                .count = count,
+                .type = type,
+                .word = argv[0],
+                .ranked = ranked,
+        };
+
+        pthread_t threads[VAULTS_MAX_THREADS];
+        int nthreads = count ? search_threads(count) : 0;
+        int started = 0;
+
+        for (; started < nthreads; started++) {
+                if (pthread_create(&threads[started], NULL, search_worker, &pool) != 0)
+                        break;
+        }
+
+        // Search on this thread if no worker could be started
+        if (!started)
+                search_worker(&pool);
+
+        for (int t = 0; t < started; t++)
+                pthread_join(threads[t], NULL);
+
+        int rc = SQLITE_OK;
+        for (int i = 0; i < count; i++) {
+                if (vaults[i].rc != SQLITE_OK)
+                        rc = vaults[i].rc;
+        }
+
+        merge_vaults(vaults, count, heap, ranked);
+
+        for (int i = 0; i < count; i++)
+                free(vaults[i].hits);
+        free(vaults);
+        free(heap);
+        return rc;
+}
@@ -0,0 +1,26 @@
+#!/bin/sh
+# new and edit work on a vault named with --db or ZKC_DB, in a HOME where
+# the default vault was never opened.
+set -e
+
+zkc=$1
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+export HOME="$dir/home"
+mkdir "$HOME"
+
+printf '#!/bin/sh\necho line >> "$1"\n' > "$dir/editor"
+chmod +x "$dir/editor"
+export ZKC_EDITOR="$dir/editor"
+
+"$zkc" --db "$dir/team.db" init > /dev/null
+# new exits 1 even when it succeeds
+"$zkc" --db "$dir/team.db" new > /dev/null || true
+
+uuid=$("$zkc" --db "$dir/team.db" search line | cut -c1-36)
+test -n "$uuid"
+
+ZKC_DB="$dir/team.db" "$zkc" edit "$uuid" > /dev/null
+"$zkc" --db "$dir/team.db" view "$uuid" | grep -c line | grep -qx 2
+
+test ! -e "$HOME/.local/zkc/zkc.db"
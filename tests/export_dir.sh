@@ -0,0 +1,35 @@
+#!/bin/sh
+# export-dir --name title cuts long titles on a UTF-8 character boundary,
+# and a later export removes the files of notes that were deleted.
+set -e
+
+zkc=$1
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+export HOME="$dir"
+
+"$zkc" --db "$dir/zkc.db" init > /dev/null
+
+# 1 + 40 * 2 bytes, so the 64 byte limit falls halfway through an é
+printf 'aéééééééééééééééééééééééééééééééééééééééé\nbody\n' > "$dir/note"
+# slurp exits 1 even when it succeeds
+"$zkc" --db "$dir/zkc.db" slurp "$dir/note" > /dev/null || true
+printf 'second\n' > "$dir/note"
+"$zkc" --db "$dir/zkc.db" slurp "$dir/note" > /dev/null || true
+
+"$zkc" --db "$dir/zkc.db" export-dir --name title "$dir/out" > /dev/null
+
+python3 - "$dir/out" <<'PY'
+import os
+import sys
+
+names = sorted(n for n in os.listdir(os.fsencode(sys.argv[1])) if not n.startswith(b'.'))
+assert names == [('a' + 'é' * 31 + '.md').encode(), b'second.md'], names
+PY
+
+uuid=$("$zkc" --db "$dir/zkc.db" search second | cut -c1-36)
+"$zkc" --db "$dir/zkc.db" delete "$uuid" > /dev/null || true
+"$zkc" --db "$dir/zkc.db" export-dir --name title "$dir/out" > /dev/null
+
+test ! -e "$dir/out/second.md"
+! grep -q second.md "$dir/out/.zkc-export"
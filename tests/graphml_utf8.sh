@@ -0,0 +1,27 @@
+#!/bin/sh
+# export-graph --format graphml must stay well formed XML when a note's
+# first line is cut inside a UTF-8 character or holds control characters.
+set -e
+
+zkc=$1
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+export HOME="$dir"
+
+"$zkc" --db "$dir/zkc.db" init > /dev/null
+
+# 3 + 24 * 2 bytes, so the 40 byte label ends halfway through an ä
+printf 'xy\001ääääääääääääääääääääääää\nbody\n' > "$dir/note"
+# slurp exits 1 even when it succeeds
+"$zkc" --db "$dir/zkc.db" slurp "$dir/note" > /dev/null || true
+
+"$zkc" --db "$dir/zkc.db" export-graph --format graphml > "$dir/graph.xml"
+
+python3 - "$dir/graph.xml" <<'PY'
+import sys
+import xml.etree.ElementTree as ET
+
+ns = {'g': 'http://graphml.graphdrawing.org/xmlns'}
+summary = ET.parse(sys.argv[1]).find('.//g:data[@key="summary"]', ns).text
+assert summary == 'xy' + 'ä' * 18, repr(summary)
+PY
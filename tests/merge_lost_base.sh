@@ -0,0 +1,34 @@
+#!/bin/sh
+# A note edited in two vaults is merged with conflict markers, and listed
+# by zkc conflicts, even when the body both edits started from is no
+# longer in the history of the vault being merged into.
+set -e
+
+zkc=$1
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+export HOME="$dir"
+
+printf '#!/bin/sh\nsed -i "s/l1/$EDIT/" "$1"\n' > "$dir/editor"
+chmod +x "$dir/editor"
+export ZKC_EDITOR="$dir/editor"
+
+"$zkc" --db "$dir/a.db" init > /dev/null
+printf 'l1\nl2\n' > "$dir/note"
+# slurp exits 1 even when it succeeds
+"$zkc" --db "$dir/a.db" slurp "$dir/note" > /dev/null || true
+cp "$dir/a.db" "$dir/b.db"
+
+uuid=$("$zkc" --db "$dir/a.db" search l2 | cut -c1-36)
+EDIT=L1-A "$zkc" --db "$dir/a.db" edit "$uuid" > /dev/null
+EDIT=L1-B "$zkc" --db "$dir/b.db" edit "$uuid" > /dev/null
+
+python3 -c 'import sqlite3, sys; db = sqlite3.connect(sys.argv[1]); db.execute("DELETE FROM note_versions"); db.commit()' "$dir/a.db"
+
+"$zkc" --db "$dir/a.db" merge "$dir/b.db" > /dev/null
+
+"$zkc" --db "$dir/a.db" view "$uuid" > "$dir/merged"
+grep -q L1-A "$dir/merged"
+grep -q L1-B "$dir/merged"
+grep -q '^<<<<<<<' "$dir/merged"
+"$zkc" --db "$dir/a.db" conflicts | grep -q "$uuid"
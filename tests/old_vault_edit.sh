@@ -0,0 +1,24 @@
+#!/bin/sh
+# A vault made before note history, which has never been through zkc init
+# since, can still be edited and keeps the body it replaced.
+set -e
+
+zkc=$1
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+export HOME="$dir"
+
+printf '#!/bin/sh\necho more >> "$1"\n' > "$dir/editor"
+chmod +x "$dir/editor"
+export ZKC_EDITOR="$dir/editor"
+
+"$zkc" --db "$dir/old.db" init > /dev/null
+printf 'first\n' > "$dir/note"
+# slurp exits 1 even when it succeeds
+"$zkc" --db "$dir/old.db" slurp "$dir/note" > /dev/null || true
+
+python3 -c 'import sqlite3, sys; sqlite3.connect(sys.argv[1]).execute("DROP TABLE note_versions")' "$dir/old.db"
+
+uuid=$("$zkc" --db "$dir/old.db" search first | cut -c1-36)
+"$zkc" --db "$dir/old.db" edit "$uuid" > /dev/null
+"$zkc" --db "$dir/old.db" history "$uuid" | grep -q "$uuid@1"
@@ -0,0 +1,34 @@
+#!/bin/sh
+# Text, fuzzy and regex search of a vault made before the trigram index,
+# which has never been through zkc init since, fall back to scanning the
+# notes.
+set -e
+
+zkc=$1
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+export HOME="$dir"
+
+"$zkc" --db "$dir/old.db" init > /dev/null
+printf 'hello rusty world\n' > "$dir/note"
+# slurp exits 1 even when it succeeds
+"$zkc" --db "$dir/old.db" slurp "$dir/note" > /dev/null || true
+
+python3 - "$dir/old.db" <<'PY'
+import sqlite3
+import sys
+
+db = sqlite3.connect(sys.argv[1])
+db.executescript("""
+DROP TRIGGER notes_insert_trigrams;
+DROP TRIGGER notes_delete_trigrams;
+DROP TRIGGER notes_update_trigrams;
+DROP TABLE note_trigrams;
+""")
+db.close()
+PY
+
+"$zkc" --db "$dir/old.db" search rust | grep -q 'hello rusty'
+"$zkc" --db "$dir/old.db" search --vaults "$dir/old.db" text rust | grep -q 'hello rusty'
+"$zkc" --db "$dir/old.db" search fuzzy rusti | grep -q 'hello rusty'
+"$zkc" --db "$dir/old.db" search regex 'rust[a-z]+ wor' | grep -q 'hello rusty'
@@ -0,0 +1,20 @@
+#!/bin/sh
+# In a small vault, related still suggests notes that only share a word
+# found in most of the notes.
+set -e
+
+zkc=$1
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+export HOME="$dir"
+
+"$zkc" --db "$dir/zkc.db" init > /dev/null
+
+for text in "alpha shared" "beta shared" "gamma shared" "delta other"; do
+	printf '%s\n' "$text" > "$dir/note"
+	# slurp exits 1 even when it succeeds
+	"$zkc" --db "$dir/zkc.db" slurp "$dir/note" > /dev/null || true
+done
+
+uuid=$("$zkc" --db "$dir/zkc.db" search alpha | cut -c1-36)
+test "$("$zkc" --db "$dir/zkc.db" related "$uuid" 3 | wc -l)" -eq 2